@@ -185,6 +185,10 @@ struct _AgAccountPrivate {
     /* GTask for the ag_account_store_async operation. */
     GTask *store_task;
 
+    /* Number of changes being stored: until they are done, the cached
+     * settings might not reflect the DB contents */
+    guint pending_stores;
+
     /* The "foreign" flag means that the account has been created by another
      * instance and we got informed about it from D-Bus. In this case, all the
      * information that we get via D-Bus will be cached in the
@@ -192,6 +196,9 @@ struct _AgAccountPrivate {
     guint foreign : 1;
     guint enabled : 1;
     guint deleted : 1;
+    /* All the settings have been loaded with ag_account_preload(): the
+     * services missing from the @services table have no settings. */
+    guint all_settings_loaded : 1;
 };
 
 struct _AgAccountWatch {
@@ -546,6 +553,15 @@ _ag_account_changes_free (AgAccountChanges *changes)
 {
     if (G_LIKELY (changes))
     {
+        if (changes->account != NULL)
+        {
+            AgAccountPrivate *priv =
+                ag_account_get_instance_private (changes->account);
+
+            priv->pending_stores--;
+            g_object_remove_weak_pointer ((GObject *)changes->account,
+                                          (gpointer *)&changes->account);
+        }
         g_hash_table_unref (changes->services);
         g_slice_free (AgAccountChanges, changes);
     }
@@ -612,6 +628,11 @@ update_settings (AgAccount *account, GHashTable *services)
              */
             ss = get_service_settings (priv, sc->service, TRUE);
         }
+        else if (priv->all_settings_loaded)
+        {
+            /* The service had no settings until now */
+            ss = get_service_settings (priv, sc->service, TRUE);
+        }
         else
         {
             /* if the changed service doesn't have a AgServiceSettings entry it
@@ -828,15 +849,90 @@ _ag_account_get_service_changes (AgAccount *account, AgService *service)
     return sc->settings;
 }
 
+/* Returns whether, according to the cached settings, @key of @service is
+ * already stored with @value (or not stored at all, if @value is %NULL) */
+static gboolean
+is_stored_value (AgAccountPrivate *priv, AgService *service,
+                 const gchar *key, GVariant *value)
+{
+    AgServiceSettings *ss;
+    GVariant *stored;
+
+    /* The cache does not know about the changes being stored, and a new
+     * or deleted account must be written anyway */
+    if (priv->pending_stores > 0) return FALSE;
+    if (priv->changes != NULL &&
+        (priv->changes->created || priv->changes->deleted))
+        return FALSE;
+
+    if (service == NULL && value != NULL)
+    {
+        /* These are stored in the Accounts table */
+        if (strcmp (key, "name") == 0 &&
+            g_variant_is_of_type (value, G_VARIANT_TYPE_STRING))
+            return g_strcmp0 (priv->display_name,
+                              g_variant_get_string (value, NULL)) == 0;
+        if (strcmp (key, "enabled") == 0 &&
+            g_variant_is_of_type (value, G_VARIANT_TYPE_BOOLEAN))
+            return priv->enabled == g_variant_get_boolean (value);
+    }
+
+    ss = get_service_settings (priv, service, FALSE);
+    if (ss == NULL)
+    {
+        /* Unless all the settings are loaded, we just don't know */
+        return value == NULL && priv->all_settings_loaded;
+    }
+
+    stored = g_hash_table_lookup (ss->settings, key);
+    if (value == NULL) return stored == NULL;
+    return stored != NULL && g_variant_equal (stored, value);
+}
+
+static void
+drop_service_change (AgAccountPrivate *priv, AgService *service,
+                     const gchar *key)
+{
+    AgServiceChanges *sc;
+    const gchar *service_name;
+
+    if (priv->changes == NULL) return;
+
+    service_name = service ? service->name : SERVICE_GLOBAL;
+    sc = g_hash_table_lookup (priv->changes->services, service_name);
+    if (sc == NULL) return;
+
+    g_hash_table_remove (sc->settings, key);
+    if (g_hash_table_size (sc->settings) > 0 || sc->signatures != NULL)
+        return;
+
+    g_hash_table_remove (priv->changes->services, service_name);
+    /* Nothing left to store */
+    if (g_hash_table_size (priv->changes->services) == 0)
+        g_clear_pointer (&priv->changes, _ag_account_changes_free);
+}
+
 static void
 change_service_value (AgAccountPrivate *priv, AgService *service,
                       const gchar *key, GVariant *value)
 {
     AgServiceChanges *sc;
+
+    if (value != NULL)
+        g_variant_ref_sink (value);
+
+    if (is_stored_value (priv, service, key, value))
+    {
+        /* Writing the same value again would only cost a transaction and
+         * a D-Bus signal */
+        drop_service_change (priv, service, key);
+        if (value != NULL)
+            g_variant_unref (value);
+        return;
+    }
+
     sc = account_service_changes_get (priv, service, FALSE);
-    g_hash_table_insert (sc->settings,
-                         g_strdup (key),
-                         value ? g_variant_ref_sink (value) : NULL);
+    g_hash_table_insert (sc->settings, g_strdup (key), value);
 }
 
 static inline void
@@ -868,14 +964,13 @@ static gboolean
 ag_account_load (AgAccount *account, GError **error)
 {
     AgAccountPrivate *priv = ag_account_get_instance_private (account);
-    gchar sql[128];
     gint rows;
 
-    g_snprintf (sql, sizeof (sql),
-                "SELECT name, provider, enabled "
-                "FROM Accounts WHERE id = %u", account->id);
-    rows = _ag_manager_exec_query (priv->manager,
-                                   (AgQueryCallback)got_account, priv, sql);
+    rows = _ag_manager_exec_prepared (priv->manager,
+                                      (AgQueryCallback)got_account, priv,
+                                      "SELECT name, provider, enabled "
+                                      "FROM Accounts WHERE id = ?",
+                                      "u", account->id);
     /* if the query succeeded but we didn't get a row, we must set the
      * NOT_FOUND error */
     if (rows != 1)
@@ -1227,12 +1322,23 @@ _ag_account_changes_from_dbus (AgManager *manager, GVariant *v_services,
     return changes;
 }
 
+/* The account keeps track of the stolen changes until they are freed, so
+ * that the values being stored are not mistaken for no-op changes */
 AgAccountChanges *
 _ag_account_steal_changes (AgAccount *account)
 {
     AgAccountPrivate *priv = ag_account_get_instance_private (account);
+    AgAccountChanges *changes;
 
-    return g_steal_pointer (&priv->changes);
+    changes = g_steal_pointer (&priv->changes);
+    if (changes != NULL)
+    {
+        changes->account = account;
+        g_object_add_weak_pointer ((GObject *)account,
+                                   (gpointer *)&changes->account);
+        priv->pending_stores++;
+    }
+    return changes;
 }
 
 static void
@@ -1335,16 +1441,12 @@ _ag_account_changes_have_enabled (AgAccountChanges *changes)
 }
 
 static void
-ag_account_store_signature (AgAccount *account, AgServiceChanges *sc, GString *sql)
+ag_account_store_signature (AgServiceChanges *sc, gint service_id,
+                            AgDbScript *script)
 {
-    AgAccountId account_id;
     GHashTableIter i_signatures;
-    gint service_id;
     gpointer ht_key, ht_value;
 
-    account_id = account->id;
-    service_id = (sc->service != NULL) ? sc->service->id : 0;
-
     g_hash_table_iter_init (&i_signatures, sc->signatures);
     while (g_hash_table_iter_next (&i_signatures, &ht_key, &ht_value))
     {
@@ -1353,24 +1455,27 @@ ag_account_store_signature (AgAccount *account, AgServiceChanges *sc, GString *s
 
         if (sgn)
         {
-            _ag_string_append_printf
-                (sql,
+            _ag_db_script_add
+                (script,
                  "INSERT OR REPLACE INTO Signatures"
                  "(account, service, key, signature, token)"
-                 "VALUES (%d, %d, %Q, %Q, %Q);",
-                 account_id, service_id, key, sgn->signature, sgn->token);
+                 "VALUES (?, ?, ?, ?, ?);",
+                 "aisss", service_id, key, sgn->signature, sgn->token);
         }
     }
 }
 
-gchar *
-_ag_account_get_store_sql (AgAccount *account, GError **error)
+/* Returns the statements storing the changes of @account, or %NULL if there
+ * are none; the script refers to the keys and values of the changes, which
+ * must outlive it. */
+AgDbScript *
+_ag_account_get_store_script (AgAccount *account, GError **error)
 {
     AgAccountPrivate *priv = ag_account_get_instance_private (account);
     AgAccountChanges *changes;
-    GString *sql;
-    gchar account_id_buffer[16];
-    const gchar *account_id_str;
+    AgDbScript *script;
+    GHashTableIter i_services;
+    gpointer ht_key, ht_value;
 
     if (G_UNLIKELY (priv->deleted))
     {
@@ -1384,137 +1489,94 @@ _ag_account_get_store_sql (AgAccount *account, GError **error)
 
     if (G_UNLIKELY (!changes))
     {
-        /* Nothing to do: return no SQL, and no error */
+        /* Nothing to do: return no script, and no error */
         return NULL;
     }
 
-    sql = g_string_sized_new (512);
+    script = _ag_db_script_new (account->id,
+                                _ag_manager_has_binary_values (priv->manager));
     if (changes->deleted)
     {
         if (account->id != 0)
         {
-            _ag_string_append_printf
-                (sql, "DELETE FROM Accounts WHERE id = %d;", account->id);
-            _ag_string_append_printf
-                (sql, "DELETE FROM Settings WHERE account = %d;", account->id);
+            _ag_db_script_add (script,
+                               "DELETE FROM Accounts WHERE id = ?;", "a");
+            _ag_db_script_add (script,
+                               "DELETE FROM Settings WHERE account = ?;", "a");
         }
-        account_id_str = NULL; /* make the compiler happy */
+        return script;
     }
-    else if (account->id == 0)
+
+    if (account->id == 0)
     {
         gboolean enabled;
         const gchar *display_name;
 
         ag_account_changes_get_enabled (changes, &enabled);
         ag_account_changes_get_display_name (changes, &display_name);
-        _ag_string_append_printf
-            (sql,
+        _ag_db_script_add
+            (script,
              "INSERT INTO Accounts (name, provider, enabled) "
-             "VALUES (%Q, %Q, %d);",
-             display_name,
-             priv->provider_name,
-             enabled);
-
-        g_string_append (sql, "SELECT set_last_rowid_as_account_id();");
-        account_id_str = "account_id()";
+             "VALUES (?, ?, ?);",
+             "ssi", display_name, priv->provider_name, enabled);
+        _ag_db_script_take_inserted_id (script);
     }
     else
     {
-        gboolean enabled, enabled_changed, display_name_changed;
+        gboolean enabled;
         const gchar *display_name;
 
-        g_snprintf (account_id_buffer, sizeof (account_id_buffer),
-                    "%u", account->id);
-        account_id_str = account_id_buffer;
-
-        enabled_changed = ag_account_changes_get_enabled (changes, &enabled);
-        display_name_changed =
-            ag_account_changes_get_display_name (changes, &display_name);
-
-        if (display_name_changed || enabled_changed)
-        {
-            gboolean comma = FALSE;
-            g_string_append (sql, "UPDATE Accounts SET ");
-            if (display_name_changed)
-            {
-                _ag_string_append_printf
-                    (sql, "name = %Q", display_name);
-                comma = TRUE;
-            }
-
-            if (enabled_changed)
-            {
-                _ag_string_append_printf
-                    (sql, "%cenabled = %d",
-                     comma ? ',' : ' ', enabled);
-            }
+        if (ag_account_changes_get_display_name (changes, &display_name))
+            _ag_db_script_add (script,
+                               "UPDATE Accounts SET name = ? WHERE id = ?;",
+                               "sa", display_name);
 
-            _ag_string_append_printf (sql, " WHERE id = %d;", account->id);
-        }
+        if (ag_account_changes_get_enabled (changes, &enabled))
+            _ag_db_script_add (script,
+                               "UPDATE Accounts SET enabled = ? WHERE id = ?;",
+                               "ia", enabled);
     }
 
-    if (!changes->deleted)
+    g_hash_table_iter_init (&i_services, changes->services);
+    while (g_hash_table_iter_next (&i_services, &ht_key, &ht_value))
     {
-        GHashTableIter i_services;
-        gpointer ht_key, ht_value;
+        AgServiceChanges *sc = ht_value;
+        GHashTableIter i_settings;
+        gint service_id;
 
-        g_hash_table_iter_init (&i_services, changes->services);
-        while (g_hash_table_iter_next (&i_services, &ht_key, &ht_value))
+        service_id = _ag_manager_get_service_id (priv->manager, sc->service);
+
+        g_hash_table_iter_init (&i_settings, sc->settings);
+        while (g_hash_table_iter_next (&i_settings, &ht_key, &ht_value))
         {
-            AgServiceChanges *sc = ht_value;
-            GHashTableIter i_settings;
-            const gchar *service_id_str;
-            gchar service_id_buffer[16];
+            const gchar *key = ht_key;
+            GVariant *value = ht_value;
 
-            if (sc->service)
+            if (value)
             {
-                g_snprintf (service_id_buffer, sizeof (service_id_buffer),
-                            "%d", sc->service->id);
-                service_id_str = service_id_buffer;
+                _ag_db_script_add
+                    (script,
+                     "INSERT OR REPLACE INTO Settings (account, service,"
+                                                      "key, type, value) "
+                     "VALUES (?, ?, ?, ?, ?);",
+                     "aissv", service_id, key,
+                     g_variant_get_type_string (value), value);
             }
-            else
-                service_id_str = "0";
-
-            g_hash_table_iter_init (&i_settings, sc->settings);
-            while (g_hash_table_iter_next (&i_settings, &ht_key, &ht_value))
+            else if (account->id != 0)
             {
-                const gchar *key = ht_key;
-                GVariant *value = ht_value;
-
-                if (value)
-                {
-                    const GVariantType *type_str;
-                    gchar *value_str;
-
-                    value_str = _ag_value_to_db (value, FALSE);
-                    type_str = g_variant_get_type (value);
-                    _ag_string_append_printf
-                        (sql,
-                         "INSERT OR REPLACE INTO Settings (account, service,"
-                                                          "key, type, value) "
-                         "VALUES (%s, %s, %Q, %Q, %Q);",
-                         account_id_str, service_id_str, key,
-                         (const gchar *)type_str, value_str);
-                    g_free (value_str);
-                }
-                else if (account->id != 0)
-                {
-                    _ag_string_append_printf
-                        (sql,
-                         "DELETE FROM Settings WHERE "
-                         "account = %d AND "
-                         "service = %Q AND "
-                         "key = %Q;",
-                         account->id, service_id_str, key);
-                }
+                _ag_db_script_add
+                    (script,
+                     "DELETE FROM Settings WHERE "
+                     "account = ? AND service = ? AND key = ?;",
+                     "ais", service_id, key);
             }
-
-            if (sc->signatures)
-                ag_account_store_signature (account, sc, sql);
         }
+
+        if (sc->signatures)
+            ag_account_store_signature (sc, service_id, script);
     }
 
-    return g_string_free (sql, FALSE);
+    return script;
 }
 
 /**
@@ -1557,30 +1619,15 @@ GList *
 ag_account_list_services (AgAccount *account)
 {
     AgAccountPrivate *priv = ag_account_get_instance_private (account);
-    GList *all_services, *list;
-    GList *services = NULL;
 
     g_return_val_if_fail (AG_IS_ACCOUNT (account), NULL);
 
     if (!priv->provider_name)
         return NULL;
 
-    all_services = ag_manager_list_services (priv->manager);
-    for (list = all_services; list != NULL; list = list->next)
-    {
-        AgService *service = list->data;
-
-        const gchar *provider = ag_service_get_provider (service);
-        if (provider &&
-            strcmp (provider, priv->provider_name) == 0)
-        {
-            services = g_list_prepend (services, service);
-        }
-        else
-            ag_service_unref (service);
-    }
-    g_list_free (all_services);
-    return services;
+    return _ag_manager_list_services_by_provider
+        (priv->manager, priv->provider_name,
+         ag_manager_get_service_type (priv->manager));
 }
 
 /**
@@ -1600,8 +1647,6 @@ ag_account_list_services_by_type (AgAccount *account,
                                   const gchar *service_type)
 {
     AgAccountPrivate *priv = ag_account_get_instance_private (account);
-    GList *all_services, *list;
-    GList *services = NULL;
 
     g_return_val_if_fail (AG_IS_ACCOUNT (account), NULL);
     g_return_val_if_fail (service_type != NULL, NULL);
@@ -1609,21 +1654,9 @@ ag_account_list_services_by_type (AgAccount *account,
     if (!priv->provider_name)
         return NULL;
 
-    all_services = ag_manager_list_services_by_type (priv->manager, service_type);
-    for (list = all_services; list != NULL; list = list->next)
-    {
-        AgService *service = list->data;
-        const gchar *provider = ag_service_get_provider (service);
-        if (provider &&
-            strcmp (provider, priv->provider_name) == 0)
-        {
-            services = g_list_prepend (services, service);
-        }
-        else
-            ag_service_unref (service);
-    }
-    g_list_free (all_services);
-    return services;
+    return _ag_manager_list_services_by_provider (priv->manager,
+                                                  priv->provider_name,
+                                                  service_type);
 }
 
 static gboolean
@@ -1731,7 +1764,6 @@ ag_account_list_enabled_services (AgAccount *account)
     GList *iter;
     GList *services = NULL;
     const gchar *service_type;
-    char sql[512];
 
     g_return_val_if_fail (AG_IS_ACCOUNT (account), NULL);
 
@@ -1741,27 +1773,57 @@ ag_account_list_enabled_services (AgAccount *account)
     if (priv->foreign)
         return list_enabled_services_from_memory (priv, service_type);
 
-    if (service_type != NULL)
-        sqlite3_snprintf (sizeof (sql), sql,
-                          "SELECT DISTINCT Services.name FROM Services "
-                          "JOIN Settings ON Settings.service = Services.id "
-                          "WHERE Settings.key='enabled' "
-                          "AND Settings.value='true' "
-                          "AND Settings.account='%d' "
-                          "AND Services.type = '%s';",
-                           account->id,
-                           service_type);
+    if (_ag_manager_has_account_services (priv->manager))
+    {
+        if (service_type != NULL)
+            _ag_manager_exec_prepared (priv->manager,
+                                       (AgQueryCallback)add_name_to_list,
+                                       &list,
+                                       "SELECT Services.name "
+                                       "FROM AccountServices "
+                                       "JOIN Services "
+                                       "ON AccountServices.service = "
+                                       "Services.id "
+                                       "WHERE AccountServices.account = ? "
+                                       "AND AccountServices.enabled = 1 "
+                                       "AND Services.type = ?;",
+                                       "us", account->id, service_type);
+        else
+            _ag_manager_exec_prepared (priv->manager,
+                                       (AgQueryCallback)add_name_to_list,
+                                       &list,
+                                       "SELECT Services.name "
+                                       "FROM AccountServices "
+                                       "JOIN Services "
+                                       "ON AccountServices.service = "
+                                       "Services.id "
+                                       "WHERE AccountServices.account = ? "
+                                       "AND AccountServices.enabled = 1;",
+                                       "u", account->id);
+    }
+    else if (service_type != NULL)
+        _ag_manager_exec_prepared (priv->manager,
+                                   (AgQueryCallback)add_name_to_list, &list,
+                                   "SELECT DISTINCT Services.name "
+                                   "FROM Services "
+                                   "JOIN Settings "
+                                   "ON Settings.service = Services.id "
+                                   "WHERE Settings.key='enabled' "
+                                   "AND Settings.value IN ('true', X'01') "
+                                   "AND Settings.account = ? "
+                                   "AND Services.type = ?;",
+                                   "us", account->id, service_type);
     else
-        sqlite3_snprintf (sizeof (sql), sql,
-                          "SELECT DISTINCT Services.name FROM Services "
-                          "JOIN Settings ON Settings.service = Services.id "
-                          "WHERE Settings.key='enabled' "
-                          "AND Settings.value='true' "
-                          "AND Settings.account='%d';",
-                           account->id);
-
-    _ag_manager_exec_query (priv->manager, (AgQueryCallback)add_name_to_list,
-                            &list, sql);
+        _ag_manager_exec_prepared (priv->manager,
+                                   (AgQueryCallback)add_name_to_list, &list,
+                                   "SELECT DISTINCT Services.name "
+                                   "FROM Services "
+                                   "JOIN Settings "
+                                   "ON Settings.service = Services.id "
+                                   "WHERE Settings.key='enabled' "
+                                   "AND Settings.value IN ('true', X'01') "
+                                   "AND Settings.account = ?;",
+                                   "u", account->id);
 
     for (iter = list; iter != NULL; iter = iter->next)
     {
@@ -1875,7 +1937,7 @@ ag_account_select_service (AgAccount *account, AgService *service)
 
     priv->service = service;
 
-    if (account->id != 0 &&
+    if (account->id != 0 && !priv->all_settings_loaded &&
         !get_service_settings (priv, service, FALSE))
     {
         /* the settings for this service are not yet loaded: do it now */
@@ -1887,19 +1949,171 @@ ag_account_select_service (AgAccount *account, AgService *service)
     if (load_settings)
     {
         guint service_id;
-        gchar sql[128];
 
         service_id = _ag_manager_get_service_id (priv->manager, service);
-        g_snprintf (sql, sizeof (sql),
-                    "SELECT key, type, value FROM Settings "
-                    "WHERE account = %u AND service = %u",
-                    account->id, service_id);
-        _ag_manager_exec_query (priv->manager,
-                                (AgQueryCallback)got_account_setting,
-                                ss->settings, sql);
+        _ag_manager_exec_prepared (priv->manager,
+                                   (AgQueryCallback)got_account_setting,
+                                   ss->settings,
+                                   "SELECT key, type, value FROM Settings "
+                                   "WHERE account = ? AND service = ?",
+                                   "uu", account->id, service_id);
     }
 }
 
+/* Creates the object of an account whose row has already been read by the
+ * manager; none of its settings are loaded yet. */
+AgAccount *
+_ag_account_new_loaded (AgManager *manager, AgAccountId id,
+                        const gchar *display_name, const gchar *provider_name,
+                        gboolean enabled)
+{
+    AgAccount *account;
+    AgAccountPrivate *priv;
+
+    /* Without an ID, the account is not loaded from the DB */
+    account = g_initable_new (AG_TYPE_ACCOUNT, NULL, NULL,
+                              "manager", manager,
+                              NULL);
+    g_return_val_if_fail (AG_IS_ACCOUNT (account), NULL);
+
+    priv = ag_account_get_instance_private (account);
+    account->id = id;
+    priv->display_name = g_strdup (display_name);
+    priv->provider_name = g_strdup (provider_name);
+    priv->enabled = enabled;
+    /* The empty global settings have been created by the selection of the
+     * global service */
+    g_hash_table_remove (priv->services, SERVICE_GLOBAL);
+
+    return account;
+}
+
+void
+_ag_account_preload_init (AgAccountPreload *preload, AgAccount *account)
+{
+    preload->account = g_object_ref (account);
+    preload->service_id = -1;
+    preload->settings = NULL;
+}
+
+/* Adds the setting of a row with the columns: service, Services.name,
+ * Services.type, key, type, value, starting from @first_column. The
+ * settings of the services which were already loaded are skipped. */
+gboolean
+_ag_account_preload_row (AgAccountPreload *preload, sqlite3_stmt *stmt,
+                         gint first_column)
+{
+    AgAccountPrivate *priv = ag_account_get_instance_private (preload->account);
+    gint col = first_column;
+    gint service_id;
+    gchar *key;
+    GVariant *value;
+
+    service_id = sqlite3_column_int (stmt, col);
+    if (service_id != preload->service_id)
+    {
+        AgService *service = NULL;
+
+        preload->service_id = service_id;
+        preload->settings = NULL;
+
+        if (service_id != 0)
+        {
+            const gchar *service_name, *service_type;
+
+            service_name = (const gchar *)sqlite3_column_text (stmt, col + 1);
+            service_type = (const gchar *)sqlite3_column_text (stmt, col + 2);
+            if (G_UNLIKELY (service_name == NULL)) return FALSE;
+
+            /* The manager doesn't need to query the DB for this */
+            service = _ag_manager_get_service_lazy (priv->manager,
+                                                    service_name,
+                                                    service_type,
+                                                    service_id);
+        }
+
+        if (!get_service_settings (priv, service, FALSE))
+            preload->settings = get_service_settings (priv, service,
+                                                      TRUE)->settings;
+
+        if (service != NULL)
+            ag_service_unref (service);
+    }
+
+    if (preload->settings == NULL) return FALSE;
+
+    key = g_strdup ((gchar *)sqlite3_column_text (stmt, col + 3));
+    g_return_val_if_fail (key != NULL, FALSE);
+
+    value = _ag_value_from_db (stmt, col + 4, col + 5);
+
+    g_hash_table_insert (preload->settings, key, value);
+    return TRUE;
+}
+
+/* Called when all the rows of the account have been read; if they were
+ * read for all the services, the services which didn't appear have no
+ * settings. Releases @preload. */
+void
+_ag_account_preload_done (AgAccountPreload *preload, gboolean all_services)
+{
+    AgAccountPrivate *priv = ag_account_get_instance_private (preload->account);
+
+    /* The global settings are there, even if they are empty */
+    get_service_settings (priv, NULL, TRUE);
+    if (all_services)
+        priv->all_settings_loaded = TRUE;
+
+    g_clear_object (&preload->account);
+}
+
+static gboolean
+preload_setting (sqlite3_stmt *stmt, AgAccountPreload *preload)
+{
+    return _ag_account_preload_row (preload, stmt, 0);
+}
+
+/**
+ * ag_account_preload:
+ * @account: the #AgAccount.
+ *
+ * Loads the settings of all the services of @account, with a single query;
+ * otherwise, the settings of each service are loaded the first time that the
+ * service is selected with ag_account_select_service(). This is worth doing
+ * before going through all the services of @account.
+ *
+ * Since: 1.27
+ */
+void
+ag_account_preload (AgAccount *account)
+{
+    AgAccountPrivate *priv = ag_account_get_instance_private (account);
+    AgAccountPreload preload;
+    gint rows;
+
+    g_return_if_fail (AG_IS_ACCOUNT (account));
+
+    if (account->id == 0 || priv->all_settings_loaded) return;
+
+    _ag_account_preload_init (&preload, account);
+    /* The rows come in the order of the idx_setting index, grouped by
+     * service */
+    rows = _ag_manager_exec_prepared (priv->manager,
+                                      (AgQueryCallback)preload_setting,
+                                      &preload,
+                                      "SELECT Settings.service, Services.name, "
+                                      "Services.type, key, Settings.type, value "
+                                      "FROM Settings "
+                                      "LEFT JOIN Services "
+                                      "ON Services.id = Settings.service "
+                                      "WHERE account = ? "
+                                      "ORDER BY Settings.service",
+                                      "u", account->id);
+    /* On errors, the services which are missing will be loaded when
+     * selected */
+    _ag_account_preload_done (&preload, rows >= 0);
+}
+
 /**
  * ag_account_get_selected_service:
  * @account: the #AgAccount.
@@ -2136,6 +2350,9 @@ ag_account_get_variant (AgAccount *account, const gchar *key,
  * If @value has a floating reference, the @account will take ownership
  * of it.
  * If @value is %NULL, then the setting is unset.
+ * Setting a key to the value it is stored with is not recorded as a change:
+ * if nothing else changed, ag_account_store_async() will not write to the
+ * account database.
  *
  * Since: 1.4
  */
@@ -2486,6 +2703,11 @@ ag_account_store (AgAccount *account, AgAccountStoreCb callback,
  * Commit the changed account settings to the account database, and invoke
  * @callback when the operation has been completed.
  *
+ * The transaction is executed in a separate thread; @callback is invoked in
+ * the thread-default main context of the caller. If @cancellable is cancelled
+ * before the transaction has started, the operation fails with
+ * %G_IO_ERROR_CANCELLED.
+ *
  * Since: 1.4
  */
 void
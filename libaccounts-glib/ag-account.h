@@ -92,6 +92,7 @@ void ag_account_set_display_name (AgAccount *account,
 /* Account configuration */
 void ag_account_select_service (AgAccount *account, AgService *service);
 AgService *ag_account_get_selected_service (AgAccount *account);
+void ag_account_preload (AgAccount *account);
 
 gboolean ag_account_get_enabled (AgAccount *account);
 void ag_account_set_enabled (AgAccount *account, gboolean enabled);
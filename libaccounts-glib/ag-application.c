@@ -58,6 +58,7 @@
  */
 
 #include "ag-application.h"
+#include "ag-catalog.h"
 #include "ag-internals.h"
 #include "ag-service.h"
 #include "ag-util.h"
@@ -326,35 +327,24 @@ read_application_file (xmlTextReaderPtr reader, AgApplication *application)
 }
 
 static gboolean
-_ag_application_load_from_file (AgApplication *application)
+_ag_application_load_from_path (AgApplication *application,
+                                const gchar *filepath)
 {
     xmlTextReaderPtr reader;
-    gchar *filepath;
     gboolean ret = FALSE;
     GError *error = NULL;
     gchar *file_data;
     gsize file_data_len;
 
-    g_return_val_if_fail (application->name != NULL, FALSE);
-
-    DEBUG_REFS ("Loading application %s", application->name);
-    filepath = _ag_find_libaccounts_file (application->name,
-                                          ".application",
-                                          "AG_APPLICATIONS",
-                                          APPLICATION_FILES_DIR);
-    if (G_UNLIKELY (!filepath)) return FALSE;
-
     g_file_get_contents (filepath, &file_data, &file_data_len, &error);
     if (G_UNLIKELY (error))
     {
         g_warning ("Error reading %s: %s", filepath, error->message);
         g_error_free (error);
-        g_free (filepath);
         return FALSE;
     }
 
     reader = xmlReaderForMemory (file_data, file_data_len, filepath, NULL, 0);
-    g_free (filepath);
     if (G_UNLIKELY (reader == NULL))
         goto err_reader;
 
@@ -366,6 +356,102 @@ err_reader:
     return ret;
 }
 
+static GHashTable *
+items_from_catalog (GVariant *entry, const gchar *key)
+{
+    GHashTable *hash_table;
+    GVariantIter *iter;
+    AgApplicationItem *item;
+    gchar *item_id, *description;
+
+    if (!g_variant_lookup (entry, key, "a{sms}", &iter))
+        return NULL;
+
+    hash_table =
+        g_hash_table_new_full (g_str_hash, g_str_equal,
+                               g_free,
+                               (GDestroyNotify)_ag_application_item_free);
+    while (g_variant_iter_next (iter, "{sms}", &item_id, &description))
+    {
+        item = g_slice_new0 (AgApplicationItem);
+        item->description = description;
+        g_hash_table_insert (hash_table, item_id, item);
+    }
+    g_variant_iter_free (iter);
+
+    return hash_table;
+}
+
+static void
+items_to_catalog (GVariantDict *dict, const gchar *key,
+                  GHashTable *hash_table)
+{
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    AgApplicationItem *item;
+    const gchar *item_id;
+
+    if (hash_table == NULL) return;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sms}"));
+    g_hash_table_iter_init (&iter, hash_table);
+    while (g_hash_table_iter_next (&iter, (gpointer)&item_id,
+                                   (gpointer)&item))
+        g_variant_builder_add (&builder, "{sms}", item_id, item->description);
+    g_variant_dict_insert_value (dict, key, g_variant_builder_end (&builder));
+}
+
+static gboolean
+_ag_application_load_from_catalog (AgApplication *application,
+                                   GVariant *entry)
+{
+    if (!_ag_catalog_entry_is_valid (entry))
+        return FALSE;
+
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_DESKTOP_ENTRY,
+                                  &application->desktop_entry);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_DESCRIPTION,
+                                  &application->description);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_I18N_DOMAIN,
+                                  &application->i18n_domain);
+    application->services =
+        items_from_catalog (entry, AG_CATALOG_KEY_SERVICES);
+    application->service_types =
+        items_from_catalog (entry, AG_CATALOG_KEY_SERVICE_TYPES);
+    return TRUE;
+}
+
+static gboolean
+_ag_application_load_from_file (AgApplication *application)
+{
+    GVariant *entry;
+    gchar *filepath;
+    gboolean ret;
+
+    g_return_val_if_fail (application->name != NULL, FALSE);
+
+    DEBUG_REFS ("Loading application %s", application->name);
+    filepath = _ag_find_libaccounts_file (application->name,
+                                          ".application",
+                                          "AG_APPLICATIONS",
+                                          APPLICATION_FILES_DIR,
+                                          &entry);
+    if (G_UNLIKELY (!filepath)) return FALSE;
+
+    if (entry != NULL)
+    {
+        ret = _ag_application_load_from_catalog (application, entry);
+        g_variant_unref (entry);
+    }
+    else
+    {
+        ret = _ag_application_load_from_path (application, filepath);
+    }
+
+    g_free (filepath);
+    return ret;
+}
+
 static gint compare_service_name (gconstpointer a, gconstpointer b)
 {
     AgService *service = (AgService *)a;
@@ -391,6 +477,40 @@ _ag_application_new_from_file (const gchar *application_name)
     return application;
 }
 
+GVariant *
+_ag_application_compile_catalog_entry (const gchar *application_name,
+                                       const gchar *filepath)
+{
+    GVariantDict dict;
+    AgApplication *application;
+
+    application = g_slice_new0 (AgApplication);
+    application->ref_count = 1;
+    application->name = g_strdup (application_name);
+
+    if (!_ag_application_load_from_path (application, filepath))
+    {
+        ag_application_unref (application);
+        return NULL;
+    }
+
+    g_variant_dict_init (&dict, NULL);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_NAME,
+                                 application->name);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_DESKTOP_ENTRY,
+                                 application->desktop_entry);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_DESCRIPTION,
+                                 application->description);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_I18N_DOMAIN,
+                                 application->i18n_domain);
+    items_to_catalog (&dict, AG_CATALOG_KEY_SERVICES, application->services);
+    items_to_catalog (&dict, AG_CATALOG_KEY_SERVICE_TYPES,
+                      application->service_types);
+    ag_application_unref (application);
+
+    return g_variant_dict_end (&dict);
+}
+
 GList *
 _ag_application_list_supported_services (AgApplication *self, AgManager *manager)
 {
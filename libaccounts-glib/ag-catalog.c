@@ -0,0 +1,732 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This file is part of libaccounts-glib
+ *
+ * Copyright (C) 2012-2016 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * The compiled catalog is a serialized GVariant of type (ua{sa{sv}}), stored
+ * in the directory holding the data files it describes:
+ *
+ * - the first member is the format version;
+ * - the second member maps file names (including the suffix) to the
+ *   pre-parsed contents of each file; the array is sorted by file name, so
+ *   that entries can be found with a binary search directly on the mapped
+ *   file. Files which could not be parsed are recorded with an empty
+ *   dictionary.
+ *
+ * The catalog is considered up to date as long as its modification time is
+ * the same as the one of its directory: the compiler sets it so right after
+ * writing the file, and adding, removing or renaming any file in the
+ * directory changes the directory time.
+ *
+ * Directories without an up-to-date catalog are indexed by listing their
+ * contents; either way, the index of each directory is kept for the whole
+ * life of the process and refreshed when the directory changes, so that
+ * looking up a data file doesn't need to access the file system.
+ */
+
+#include "ag-catalog.h"
+
+#include "ag-debug.h"
+#include "ag-internals.h"
+#include "ag-util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <gio/gio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define AG_CATALOG_VERSION 1
+#define AG_CATALOG_FORMAT "(ua{sa{sv}})"
+#define AG_CATALOG_ENTRIES_FORMAT "a{sa{sv}}"
+
+/* How often the modification time of a monitored directory is checked, in
+ * case the events of its monitor are not delivered */
+#define MONITORED_DIR_CHECK_INTERVAL G_USEC_PER_SEC
+
+typedef struct {
+    /* Used to detect changes which the monitor did not report (yet) */
+    struct timespec dir_mtime;
+    /* When the modification time was last checked */
+    gint64 check_time;
+    gboolean exists;
+    GFileMonitor *monitor;
+    /* Set when the monitor reports a change */
+    gboolean stale;
+    /* The catalog entries, or NULL if the directory doesn't have an
+     * up-to-date catalog */
+    GVariant *entries;
+    /* If the catalog is not available, the set of the file names in the
+     * directory */
+    GHashTable *file_names;
+} AgDataDir;
+
+static const struct {
+    const gchar *suffix;
+    AgCatalogCompileFunc compile;
+} compilers[] = {
+    { ".application", _ag_application_compile_catalog_entry },
+    { ".provider", _ag_provider_compile_catalog_entry },
+    { ".service", _ag_service_compile_catalog_entry },
+    { ".service-type", _ag_service_type_compile_catalog_entry },
+};
+
+/* Maps directory paths to AgDataDir structures: this is the index used to
+ * find the data files without hitting the file system. Entries are never
+ * removed, so that the monitors can refer to them. */
+static GHashTable *data_dirs = NULL;
+G_LOCK_DEFINE_STATIC (data_dirs);
+
+/* Incremented whenever the contents of an indexed directory change */
+static volatile gint generation = 0;
+
+static void
+clear_contents (AgDataDir *data_dir)
+{
+    g_clear_pointer (&data_dir->entries, g_variant_unref);
+    g_clear_pointer (&data_dir->file_names, g_hash_table_unref);
+}
+
+static inline gboolean
+same_mtime (const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static GVariant *
+open_catalog (const gchar *dirname, const struct stat *dir_stat)
+{
+    struct stat catalog_stat;
+    GMappedFile *mapped_file;
+    GVariant *catalog, *entries;
+    GBytes *bytes;
+    GError *error = NULL;
+    gchar *filepath;
+    guint32 version;
+
+    filepath = g_build_filename (dirname, AG_CATALOG_FILE_NAME, NULL);
+    if (stat (filepath, &catalog_stat) != 0)
+    {
+        g_free (filepath);
+        return NULL;
+    }
+
+    if (!same_mtime (&catalog_stat.st_mtim, &dir_stat->st_mtim))
+    {
+        DEBUG_INFO ("Catalog %s is out of date", filepath);
+        g_free (filepath);
+        return NULL;
+    }
+
+    mapped_file = g_mapped_file_new (filepath, FALSE, &error);
+    if (G_UNLIKELY (mapped_file == NULL))
+    {
+        g_warning ("Error reading %s: %s", filepath, error->message);
+        g_error_free (error);
+        g_free (filepath);
+        return NULL;
+    }
+
+    bytes = g_mapped_file_get_bytes (mapped_file);
+    g_mapped_file_unref (mapped_file);
+    catalog = g_variant_new_from_bytes (G_VARIANT_TYPE (AG_CATALOG_FORMAT),
+                                        bytes, FALSE);
+    g_bytes_unref (bytes);
+    g_variant_ref_sink (catalog);
+
+    g_variant_get (catalog, "(u@" AG_CATALOG_ENTRIES_FORMAT ")",
+                   &version, &entries);
+    g_variant_unref (catalog);
+
+    if (G_UNLIKELY (version != AG_CATALOG_VERSION))
+    {
+        DEBUG_INFO ("Ignoring catalog %s (version %u)", filepath, version);
+        g_clear_pointer (&entries, g_variant_unref);
+    }
+    else
+    {
+        DEBUG_INFO ("Loaded catalog %s", filepath);
+    }
+
+    g_free (filepath);
+    return entries;
+}
+
+static void
+on_dir_changed (GFileMonitor *monitor,
+                GFile *file, GFile *other_file,
+                GFileMonitorEvent event_type,
+                AgDataDir *data_dir)
+{
+    G_LOCK (data_dirs);
+    data_dir->stale = TRUE;
+    G_UNLOCK (data_dirs);
+    g_atomic_int_inc (&generation);
+}
+
+static GHashTable *
+read_file_names (const gchar *dirname)
+{
+    GHashTable *file_names;
+    const gchar *file_name;
+    GDir *dir;
+
+    dir = g_dir_open (dirname, 0, NULL);
+    if (dir == NULL) return NULL;
+
+    file_names = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                        g_free, NULL);
+    while ((file_name = g_dir_read_name (dir)) != NULL)
+    {
+        if (strcmp (file_name, AG_CATALOG_FILE_NAME) == 0)
+            continue;
+        g_hash_table_add (file_names, g_strdup (file_name));
+    }
+    g_dir_close (dir);
+
+    return file_names;
+}
+
+static AgDataDir *
+create_data_dir (const gchar *dirname)
+{
+    AgDataDir *data_dir;
+    GError *error = NULL;
+    GFile *file;
+
+    data_dir = g_slice_new0 (AgDataDir);
+    data_dir->stale = TRUE;
+
+    /* The monitor works for directories which don't exist yet, too */
+    file = g_file_new_for_path (dirname);
+    data_dir->monitor = g_file_monitor_directory (file, G_FILE_MONITOR_NONE,
+                                                  NULL, &error);
+    g_object_unref (file);
+    if (G_LIKELY (data_dir->monitor != NULL))
+    {
+        g_signal_connect (data_dir->monitor, "changed",
+                          G_CALLBACK (on_dir_changed), data_dir);
+    }
+    else
+    {
+        DEBUG_INFO ("Cannot monitor %s: %s", dirname, error->message);
+        g_error_free (error);
+    }
+
+    return data_dir;
+}
+
+/*
+ * Returns the up-to-date index of @dirname; must be called with the
+ * data_dirs lock held.
+ *
+ * Directories are read once, and then only when they change. The
+ * modification time of the directories which cannot be monitored is checked
+ * on every call; for the others, at most once every
+ * MONITORED_DIR_CHECK_INTERVAL, since the events of the monitor are
+ * delivered through the thread-default main context of the thread which
+ * first looked the directory up, which might never be run.
+ */
+static AgDataDir *
+get_data_dir_locked (const gchar *dirname)
+{
+    AgDataDir *data_dir;
+    struct stat dir_stat;
+    gboolean exists;
+    gint64 now;
+
+    if (G_UNLIKELY (data_dirs == NULL))
+        data_dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, NULL);
+
+    data_dir = g_hash_table_lookup (data_dirs, dirname);
+    if (data_dir == NULL)
+    {
+        data_dir = create_data_dir (dirname);
+        g_hash_table_insert (data_dirs, g_strdup (dirname), data_dir);
+    }
+
+    now = g_get_monotonic_time ();
+    if (data_dir->monitor != NULL && !data_dir->stale &&
+        now - data_dir->check_time < MONITORED_DIR_CHECK_INTERVAL)
+        return data_dir;
+
+    data_dir->check_time = now;
+    exists = (stat (dirname, &dir_stat) == 0);
+    if (!data_dir->stale &&
+        exists == data_dir->exists &&
+        (!exists || same_mtime (&data_dir->dir_mtime, &dir_stat.st_mtim)))
+        return data_dir;
+
+    /* Changes reported by the monitor have already been counted */
+    if (!data_dir->stale)
+        g_atomic_int_inc (&generation);
+
+    /* Clear the flag before reading, so that changes happening while we are
+     * reading the directory are not lost */
+    data_dir->stale = FALSE;
+    data_dir->exists = exists;
+    clear_contents (data_dir);
+    if (!exists) return data_dir;
+
+    data_dir->dir_mtime = dir_stat.st_mtim;
+    data_dir->entries = open_catalog (dirname, &dir_stat);
+    if (data_dir->entries == NULL)
+        data_dir->file_names = read_file_names (dirname);
+
+    return data_dir;
+}
+
+static GVariant *
+find_entry (GVariant *entries, const gchar *file_name)
+{
+    gsize low, high;
+
+    /* the entries are sorted by file name */
+    low = 0;
+    high = g_variant_n_children (entries);
+    while (low < high)
+    {
+        gsize middle = low + (high - low) / 2;
+        GVariant *child, *entry = NULL;
+        const gchar *key;
+        gint cmp;
+
+        child = g_variant_get_child_value (entries, middle);
+        g_variant_get_child (child, 0, "&s", &key);
+        cmp = strcmp (file_name, key);
+        if (cmp == 0)
+            entry = g_variant_get_child_value (child, 1);
+        g_variant_unref (child);
+
+        if (cmp == 0)
+            return entry;
+        else if (cmp < 0)
+            high = middle;
+        else
+            low = middle + 1;
+    }
+
+    return NULL;
+}
+
+/**
+ * _ag_catalog_lookup:
+ * @dirname: the data directory.
+ * @file_name: name of the data file, including the suffix.
+ * @entry: (out) (allow-none): location for the catalog entry.
+ *
+ * Look up @file_name in the index of @dirname, without accessing the file
+ * system unless the directory changed. If @dirname has an up-to-date
+ * compiled catalog, @entry is set to a new reference to the a{sv} entry
+ * describing the file; otherwise it's set to %NULL.
+ *
+ * Returns: whether @file_name exists in @dirname.
+ */
+gboolean
+_ag_catalog_lookup (const gchar *dirname, const gchar *file_name,
+                    GVariant **entry)
+{
+    AgDataDir *data_dir;
+    GVariant *found = NULL;
+    gboolean exists;
+
+    G_LOCK (data_dirs);
+    data_dir = get_data_dir_locked (dirname);
+    if (data_dir->entries != NULL)
+    {
+        found = find_entry (data_dir->entries, file_name);
+        exists = (found != NULL);
+    }
+    else
+    {
+        exists = data_dir->file_names != NULL &&
+            g_hash_table_contains (data_dir->file_names, file_name);
+    }
+    G_UNLOCK (data_dirs);
+
+    if (entry)
+        *entry = found;
+    else if (found)
+        g_variant_unref (found);
+    return exists;
+}
+
+/**
+ * _ag_catalog_list_files:
+ * @dirname: the data directory.
+ *
+ * Returns: (transfer full): the names of the files in @dirname, taken from
+ * the directory index.
+ */
+gchar **
+_ag_catalog_list_files (const gchar *dirname)
+{
+    AgDataDir *data_dir;
+    gchar **file_names;
+    gsize i = 0;
+
+    G_LOCK (data_dirs);
+    data_dir = get_data_dir_locked (dirname);
+    if (data_dir->entries != NULL)
+    {
+        GVariantIter iter;
+        const gchar *file_name;
+
+        file_names = g_new (gchar *,
+                            g_variant_n_children (data_dir->entries) + 1);
+        g_variant_iter_init (&iter, data_dir->entries);
+        while (g_variant_iter_next (&iter, "{&s@a{sv}}", &file_name, NULL))
+            file_names[i++] = g_strdup (file_name);
+    }
+    else if (data_dir->file_names != NULL)
+    {
+        GHashTableIter iter;
+        const gchar *file_name;
+
+        file_names = g_new (gchar *,
+                            g_hash_table_size (data_dir->file_names) + 1);
+        g_hash_table_iter_init (&iter, data_dir->file_names);
+        while (g_hash_table_iter_next (&iter, (gpointer)&file_name, NULL))
+            file_names[i++] = g_strdup (file_name);
+    }
+    else
+    {
+        file_names = g_new (gchar *, 1);
+    }
+    file_names[i] = NULL;
+    G_UNLOCK (data_dirs);
+
+    return file_names;
+}
+
+/**
+ * _ag_catalog_get_generation:
+ *
+ * Get a counter which is incremented whenever any of the indexed data
+ * directories changes, so that data derived from the directory contents can
+ * be checked for staleness without reading the directories again; only their
+ * modification time is checked, when due.
+ *
+ * Returns: the generation of the directory index.
+ */
+guint
+_ag_catalog_get_generation (void)
+{
+    GHashTableIter iter;
+    const gchar *dirname;
+
+    G_LOCK (data_dirs);
+    if (data_dirs != NULL)
+    {
+        g_hash_table_iter_init (&iter, data_dirs);
+        while (g_hash_table_iter_next (&iter, (gpointer)&dirname, NULL))
+            get_data_dir_locked (dirname);
+    }
+    G_UNLOCK (data_dirs);
+
+    return (guint)g_atomic_int_get (&generation);
+}
+
+/**
+ * _ag_catalog_invalidate:
+ * @dirname: the data directory.
+ *
+ * Force the index of @dirname to be reloaded on its next access. This is
+ * for callers which learn about a change before the index's own monitor
+ * delivers it.
+ */
+void
+_ag_catalog_invalidate (const gchar *dirname)
+{
+    AgDataDir *data_dir;
+
+    G_LOCK (data_dirs);
+    data_dir = data_dirs != NULL ?
+        g_hash_table_lookup (data_dirs, dirname) : NULL;
+    if (data_dir != NULL && !data_dir->stale)
+    {
+        data_dir->stale = TRUE;
+        g_atomic_int_inc (&generation);
+    }
+    G_UNLOCK (data_dirs);
+}
+
+static gint
+compare_file_names (gconstpointer a, gconstpointer b)
+{
+    return strcmp (*(const gchar **)a, *(const gchar **)b);
+}
+
+static AgCatalogCompileFunc
+get_compile_func (const gchar *file_name, gsize *suffix_length)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (compilers); i++)
+    {
+        if (g_str_has_suffix (file_name, compilers[i].suffix))
+        {
+            *suffix_length = strlen (compilers[i].suffix);
+            return compilers[i].compile;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * _ag_catalog_compile:
+ * @dirname: the data directory.
+ * @error: return location for error, or %NULL.
+ *
+ * Parse all the data files found in @dirname, and write the compiled catalog
+ * in the same directory.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise.
+ */
+gboolean
+_ag_catalog_compile (const gchar *dirname, GError **error)
+{
+    GVariantBuilder builder;
+    GPtrArray *file_names;
+    GVariant *catalog;
+    const gchar *file_name;
+    struct timespec times[2];
+    struct stat dir_stat;
+    gchar *filepath;
+    gboolean ok;
+    GDir *dir;
+    guint i;
+
+    g_return_val_if_fail (dirname != NULL, FALSE);
+
+    dir = g_dir_open (dirname, 0, error);
+    if (dir == NULL) return FALSE;
+
+    file_names = g_ptr_array_new_with_free_func (g_free);
+    while ((file_name = g_dir_read_name (dir)) != NULL)
+    {
+        gsize suffix_length;
+
+        if (file_name[0] == '.')
+            continue;
+
+        if (get_compile_func (file_name, &suffix_length) != NULL)
+            g_ptr_array_add (file_names, g_strdup (file_name));
+    }
+    g_dir_close (dir);
+
+    g_ptr_array_sort (file_names, compare_file_names);
+
+    g_variant_builder_init (&builder,
+                            G_VARIANT_TYPE (AG_CATALOG_ENTRIES_FORMAT));
+    for (i = 0; i < file_names->len; i++)
+    {
+        AgCatalogCompileFunc compile;
+        gsize suffix_length;
+        gchar *name;
+        GVariant *entry;
+
+        file_name = g_ptr_array_index (file_names, i);
+        compile = get_compile_func (file_name, &suffix_length);
+        name = g_strndup (file_name, strlen (file_name) - suffix_length);
+        filepath = g_build_filename (dirname, file_name, NULL);
+
+        entry = compile (name, filepath);
+        if (G_UNLIKELY (entry == NULL))
+        {
+            /* Record it anyway, so that the catalog keeps hiding any file
+             * with the same name in lower priority directories */
+            g_warning ("Invalid data file %s", filepath);
+            entry = g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0);
+        }
+        g_variant_builder_add (&builder, "{s@a{sv}}", file_name, entry);
+
+        g_free (filepath);
+        g_free (name);
+    }
+    g_ptr_array_free (file_names, TRUE);
+
+    catalog = g_variant_new ("(u" AG_CATALOG_ENTRIES_FORMAT ")",
+                             AG_CATALOG_VERSION, &builder);
+    g_variant_ref_sink (catalog);
+
+    filepath = g_build_filename (dirname, AG_CATALOG_FILE_NAME, NULL);
+    ok = g_file_set_contents (filepath, g_variant_get_data (catalog),
+                              g_variant_get_size (catalog), error);
+    g_variant_unref (catalog);
+    if (!ok) goto finish;
+
+    /* Writing the catalog changed the directory time: mark the catalog as up
+     * to date with it */
+    if (stat (dirname, &dir_stat) != 0)
+        goto error_errno;
+
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1] = dir_stat.st_mtim;
+    if (utimensat (AT_FDCWD, filepath, times, 0) != 0)
+        goto error_errno;
+
+    DEBUG_INFO ("Compiled catalog %s", filepath);
+    _ag_catalog_invalidate (dirname);
+    goto finish;
+
+error_errno:
+    {
+        int errsv = errno;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                     "Cannot update %s: %s", filepath, g_strerror (errsv));
+        ok = FALSE;
+    }
+finish:
+    g_free (filepath);
+    return ok;
+}
+
+gboolean
+_ag_catalog_entry_is_valid (GVariant *entry)
+{
+    /* invalid files are stored as empty dictionaries */
+    return g_variant_n_children (entry) > 0;
+}
+
+void
+_ag_catalog_entry_dup_string (GVariant *entry, const gchar *key,
+                              gchar **dest)
+{
+    /* fields which are already set are kept: callers might be holding
+     * pointers to them */
+    if (*dest == NULL)
+        g_variant_lookup (entry, key, "s", dest);
+}
+
+/* The returned bytes point into the catalog, and are NUL-terminated */
+GBytes *
+_ag_catalog_entry_get_contents (GVariant *entry)
+{
+    GVariant *contents;
+    GBytes *bytes, *ret;
+    const gchar *data;
+    gsize n_bytes;
+
+    contents = g_variant_lookup_value (entry, AG_CATALOG_KEY_CONTENTS,
+                                       G_VARIANT_TYPE_BYTESTRING);
+    if (G_UNLIKELY (contents == NULL)) return NULL;
+
+    /* the stored contents include the terminating NUL */
+    data = g_variant_get_fixed_array (contents, &n_bytes, sizeof (gchar));
+    if (G_UNLIKELY (n_bytes == 0 || data[n_bytes - 1] != '\0'))
+    {
+        g_variant_unref (contents);
+        return NULL;
+    }
+
+    bytes = g_variant_get_data_as_bytes (contents);
+    ret = g_bytes_new_from_bytes (bytes, 0, n_bytes - 1);
+    g_bytes_unref (bytes);
+    g_variant_unref (contents);
+    return ret;
+}
+
+GHashTable *
+_ag_catalog_entry_get_settings (GVariant *entry)
+{
+    GHashTable *settings;
+    GVariant *variant;
+
+    variant = g_variant_lookup_value (entry, AG_CATALOG_KEY_SETTINGS,
+                                      G_VARIANT_TYPE_VARDICT);
+    if (variant == NULL)
+        return NULL;
+
+    settings = _ag_settings_from_variant (variant);
+    g_variant_unref (variant);
+
+    return settings;
+}
+
+GHashTable *
+_ag_catalog_entry_get_tags (GVariant *entry)
+{
+    GHashTable *tags;
+    GVariantIter *iter;
+    const gchar *tag;
+
+    if (!g_variant_lookup (entry, AG_CATALOG_KEY_TAGS, "as", &iter))
+        return NULL;
+
+    /* Like in _ag_xml_parse_element_list(), tags are interned */
+    tags = g_hash_table_new (g_str_hash, g_str_equal);
+    while (g_variant_iter_next (iter, "&s", &tag))
+        g_hash_table_insert (tags, (gpointer)g_intern_string (tag), NULL);
+    g_variant_iter_free (iter);
+
+    return tags;
+}
+
+void
+_ag_catalog_dict_add_string (GVariantDict *dict, const gchar *key,
+                             const gchar *value)
+{
+    if (value != NULL)
+        g_variant_dict_insert (dict, key, "s", value);
+}
+
+void
+_ag_catalog_dict_add_contents (GVariantDict *dict,
+                               const gchar *contents, gsize len)
+{
+    if (contents == NULL) return;
+
+    /* store the terminating NUL too */
+    g_variant_dict_insert_value (dict, AG_CATALOG_KEY_CONTENTS,
+        g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, contents, len + 1,
+                                   sizeof (gchar)));
+}
+
+void
+_ag_catalog_dict_add_settings (GVariantDict *dict, GHashTable *settings)
+{
+    if (settings == NULL) return;
+
+    g_variant_dict_insert_value (dict, AG_CATALOG_KEY_SETTINGS,
+                                 _ag_settings_to_variant (settings));
+}
+
+void
+_ag_catalog_dict_add_tags (GVariantDict *dict, GHashTable *tags)
+{
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    const gchar *tag;
+
+    if (tags == NULL) return;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_STRING_ARRAY);
+    g_hash_table_iter_init (&iter, tags);
+    while (g_hash_table_iter_next (&iter, (gpointer)&tag, NULL))
+        g_variant_builder_add (&builder, "s", tag);
+    g_variant_dict_insert_value (dict, AG_CATALOG_KEY_TAGS,
+                                 g_variant_builder_end (&builder));
+}
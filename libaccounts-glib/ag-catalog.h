@@ -0,0 +1,107 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This file is part of libaccounts-glib
+ *
+ * Copyright (C) 2012-2016 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef _AG_CATALOG_H_
+#define _AG_CATALOG_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Name of the compiled catalog, stored in the same directory as the data
+ * files it describes. */
+#define AG_CATALOG_FILE_NAME "catalog.compiled"
+
+/* Catalog entries are a{sv} dictionaries; these are their keys. */
+#define AG_CATALOG_KEY_NAME "name"
+#define AG_CATALOG_KEY_CONTENTS "contents"
+#define AG_CATALOG_KEY_DISPLAY_NAME "display-name"
+#define AG_CATALOG_KEY_DESCRIPTION "description"
+#define AG_CATALOG_KEY_ICON "icon"
+#define AG_CATALOG_KEY_I18N_DOMAIN "i18n-domain"
+#define AG_CATALOG_KEY_TYPE "type"
+#define AG_CATALOG_KEY_PROVIDER "provider"
+#define AG_CATALOG_KEY_TYPE_DATA_OFFSET "type-data-offset"
+#define AG_CATALOG_KEY_DOMAINS "domains"
+#define AG_CATALOG_KEY_PLUGIN "plugin"
+#define AG_CATALOG_KEY_SINGLE_ACCOUNT "single-account"
+#define AG_CATALOG_KEY_SETTINGS "settings"
+#define AG_CATALOG_KEY_TAGS "tags"
+#define AG_CATALOG_KEY_DESKTOP_ENTRY "desktop-entry"
+#define AG_CATALOG_KEY_SERVICES "services"
+#define AG_CATALOG_KEY_SERVICE_TYPES "service-types"
+
+typedef GVariant *(*AgCatalogCompileFunc) (const gchar *name,
+                                           const gchar *filepath);
+
+G_GNUC_INTERNAL
+gboolean _ag_catalog_lookup (const gchar *dirname, const gchar *file_name,
+                             GVariant **entry);
+
+G_GNUC_INTERNAL
+gchar **_ag_catalog_list_files (const gchar *dirname);
+
+G_GNUC_INTERNAL
+guint _ag_catalog_get_generation (void);
+
+G_GNUC_INTERNAL
+void _ag_catalog_invalidate (const gchar *dirname);
+
+G_GNUC_INTERNAL
+gboolean _ag_catalog_compile (const gchar *dirname, GError **error);
+
+G_GNUC_INTERNAL
+gboolean _ag_catalog_entry_is_valid (GVariant *entry);
+
+G_GNUC_INTERNAL
+void _ag_catalog_entry_dup_string (GVariant *entry, const gchar *key,
+                                   gchar **dest);
+
+G_GNUC_INTERNAL
+GBytes *_ag_catalog_entry_get_contents (GVariant *entry);
+
+G_GNUC_INTERNAL
+GHashTable *_ag_catalog_entry_get_settings (GVariant *entry);
+
+G_GNUC_INTERNAL
+GHashTable *_ag_catalog_entry_get_tags (GVariant *entry);
+
+G_GNUC_INTERNAL
+void _ag_catalog_dict_add_string (GVariantDict *dict, const gchar *key,
+                                  const gchar *value);
+
+G_GNUC_INTERNAL
+void _ag_catalog_dict_add_contents (GVariantDict *dict,
+                                    const gchar *contents, gsize len);
+
+G_GNUC_INTERNAL
+void _ag_catalog_dict_add_settings (GVariantDict *dict,
+                                    GHashTable *settings);
+
+G_GNUC_INTERNAL
+void _ag_catalog_dict_add_tags (GVariantDict *dict, GHashTable *tags);
+
+G_END_DECLS
+
+#endif /* _AG_CATALOG_H_ */
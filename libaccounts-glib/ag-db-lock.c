@@ -0,0 +1,259 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This file is part of libaccounts-glib
+ *
+ * Copyright (C) 2012-2016 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * Waiting for a locked DB without polling.
+ *
+ * SQLite locks the DB with POSIX advisory locks on some bytes of the DB file
+ * (or, in WAL mode, of the shared memory file); a writer holds them from the
+ * beginning to the end of its transaction. A helper thread waits for them to
+ * be released by asking for a conflicting open file description lock, which
+ * blocks until the writer is done, be it in another process or in this one;
+ * the lock is then dropped right away, and the waiters are woken up.
+ *
+ * POSIX locks have a nasty property: closing any file descriptor on a file
+ * releases all the locks that the process holds on it, including those of
+ * SQLite. For this reason the objects here are never freed, and their file
+ * descriptors are never closed: when the file is replaced, a connection
+ * opened earlier might still be holding locks on the old one.
+ *
+ * If open file description locks are not available, or if the DB is busy
+ * while the lock is free (for instance, because of a checkpoint), waiters
+ * are woken up after a short delay instead.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "ag-db-lock.h"
+
+#include "ag-debug.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* The locks held by SQLite writers (see os_unix.c and wal.c in the SQLite
+ * sources): in WAL mode, the write, checkpoint and recovery locks in the
+ * shared memory file; otherwise, the pending, reserved and shared bytes of
+ * the DB file. */
+#define WAL_LOCK_OFFSET 120
+#define WAL_LOCK_SIZE 3
+#define PENDING_BYTE 0x40000000
+#define PENDING_LOCK_SIZE (2 + 510)
+
+#define RETRY_DELAY_MS 20
+
+struct _AgDbLock {
+    gchar *filename;
+    off_t offset;
+    off_t size;
+    /* Only used by the watcher thread */
+    int fd;
+    /* The descriptors of the files which have been replaced */
+    GArray *old_fds;
+
+    GMutex mutex;
+    GCond cond;
+    /* Incremented every time the watcher thread wakes up the waiters */
+    guint64 releases;
+    gboolean watching;
+};
+
+G_LOCK_DEFINE_STATIC (locks);
+static GHashTable *locks = NULL;
+
+static gboolean
+open_lock_file (AgDbLock *lock)
+{
+    struct stat st_path, st_fd;
+
+    if (lock->fd >= 0)
+    {
+        if (stat (lock->filename, &st_path) != 0) return FALSE;
+        if (fstat (lock->fd, &st_fd) == 0 &&
+            st_fd.st_dev == st_path.st_dev && st_fd.st_ino == st_path.st_ino)
+            return TRUE;
+
+        /* The file has been replaced; keep the old descriptor open */
+        g_array_append_val (lock->old_fds, lock->fd);
+        lock->fd = -1;
+    }
+
+    lock->fd = open (lock->filename, O_RDONLY | O_CLOEXEC);
+    return lock->fd >= 0;
+}
+
+/* Returns TRUE if the lock was held, and it has been released */
+static gboolean
+wait_for_release (AgDbLock *lock)
+{
+#ifdef F_OFD_SETLKW
+    struct flock fl;
+    int ret;
+
+    if (!open_lock_file (lock)) return FALSE;
+
+    memset (&fl, 0, sizeof (fl));
+    fl.l_type = F_RDLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = lock->offset;
+    fl.l_len = lock->size;
+
+    ret = fcntl (lock->fd, F_OFD_SETLK, &fl);
+    if (ret == 0)
+    {
+        /* Nobody is writing */
+        fl.l_type = F_UNLCK;
+        fcntl (lock->fd, F_OFD_SETLK, &fl);
+        return FALSE;
+    }
+    if (errno != EAGAIN && errno != EACCES) return FALSE;
+
+    DEBUG_LOCKS ("Waiting for the DB lock to be released");
+    do
+        ret = fcntl (lock->fd, F_OFD_SETLKW, &fl);
+    while (ret != 0 && errno == EINTR);
+    if (ret != 0) return FALSE;
+
+    fl.l_type = F_UNLCK;
+    fcntl (lock->fd, F_OFD_SETLK, &fl);
+    DEBUG_LOCKS ("DB lock released");
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+static gpointer
+watch_lock (AgDbLock *lock)
+{
+    if (!wait_for_release (lock))
+        g_usleep (RETRY_DELAY_MS * 1000);
+
+    g_mutex_lock (&lock->mutex);
+    lock->releases++;
+    lock->watching = FALSE;
+    g_cond_broadcast (&lock->cond);
+    g_mutex_unlock (&lock->mutex);
+
+    return NULL;
+}
+
+/* Must be called with the mutex held */
+static void
+start_watching (AgDbLock *lock)
+{
+    if (lock->watching) return;
+
+    lock->watching = TRUE;
+    g_thread_unref (g_thread_new ("ag-db-lock", (GThreadFunc)watch_lock,
+                                  lock));
+}
+
+/* Returns the lock object for the DB file @db_filename; it's never freed. */
+AgDbLock *
+_ag_db_lock_get (const gchar *db_filename, gboolean wal)
+{
+    AgDbLock *lock;
+
+    g_return_val_if_fail (db_filename != NULL, NULL);
+
+    G_LOCK (locks);
+    if (G_UNLIKELY (locks == NULL))
+        locks = g_hash_table_new (g_str_hash, g_str_equal);
+
+    lock = g_hash_table_lookup (locks, db_filename);
+    if (lock == NULL)
+    {
+        lock = g_slice_new0 (AgDbLock);
+        if (wal)
+        {
+            lock->filename = g_strconcat (db_filename, "-shm", NULL);
+            lock->offset = WAL_LOCK_OFFSET;
+            lock->size = WAL_LOCK_SIZE;
+        }
+        else
+        {
+            lock->filename = g_strdup (db_filename);
+            lock->offset = PENDING_BYTE;
+            lock->size = PENDING_LOCK_SIZE;
+        }
+        lock->fd = -1;
+        lock->old_fds = g_array_new (FALSE, FALSE, sizeof (int));
+        g_mutex_init (&lock->mutex);
+        g_cond_init (&lock->cond);
+        g_hash_table_insert (locks, g_strdup (db_filename), lock);
+    }
+    G_UNLOCK (locks);
+
+    return lock;
+}
+
+static void
+on_cancelled (G_GNUC_UNUSED GCancellable *cancellable, AgDbLock *lock)
+{
+    g_mutex_lock (&lock->mutex);
+    g_cond_broadcast (&lock->cond);
+    g_mutex_unlock (&lock->mutex);
+}
+
+/* Blocks until the DB lock is released, until @end_time (in monotonic
+ * time) is reached or until @cancellable is cancelled. Returns %FALSE in the
+ * latter cases. */
+gboolean
+_ag_db_lock_wait (AgDbLock *lock, gint64 end_time, GCancellable *cancellable)
+{
+    guint64 releases;
+    gboolean released = TRUE;
+    gulong handler_id = 0;
+
+    g_return_val_if_fail (lock != NULL, FALSE);
+
+    if (cancellable != NULL)
+        handler_id = g_cancellable_connect (cancellable,
+                                            G_CALLBACK (on_cancelled),
+                                            lock, NULL);
+
+    g_mutex_lock (&lock->mutex);
+    releases = lock->releases;
+    start_watching (lock);
+    while (lock->releases == releases)
+    {
+        if (g_cancellable_is_cancelled (cancellable) ||
+            !g_cond_wait_until (&lock->cond, &lock->mutex, end_time))
+        {
+            released = (lock->releases != releases);
+            break;
+        }
+    }
+    g_mutex_unlock (&lock->mutex);
+
+    if (handler_id != 0)
+        g_cancellable_disconnect (cancellable, handler_id);
+
+    return released;
+}
@@ -0,0 +1,43 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This file is part of libaccounts-glib
+ *
+ * Copyright (C) 2012-2016 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef _AG_DB_LOCK_H_
+#define _AG_DB_LOCK_H_
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _AgDbLock AgDbLock;
+
+G_GNUC_INTERNAL
+AgDbLock *_ag_db_lock_get (const gchar *db_filename, gboolean wal);
+
+G_GNUC_INTERNAL
+gboolean _ag_db_lock_wait (AgDbLock *lock, gint64 end_time,
+                           GCancellable *cancellable);
+
+G_END_DECLS
+
+#endif /* _AG_DB_LOCK_H_ */
@@ -0,0 +1,863 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This file is part of libaccounts-glib
+ *
+ * Copyright (C) 2012-2016 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+
+/*
+ * The writer thread.
+ *
+ * Storing an account means running a transaction and waiting for it to be
+ * flushed to the disk, which can take a long time. To keep this away from
+ * the main loop, the transactions are executed in order by a dedicated
+ * thread, on its own DB connection; the results of the asynchronous requests
+ * are delivered to the main context which was the thread-default one when
+ * they were made.
+ *
+ * Committing a transaction means waiting for the data to be flushed; when
+ * several requests are queued, because they were made while a commit was in
+ * progress or within a short time of each other, they are executed in a
+ * single transaction, each in its own savepoint so that its failure does not
+ * affect the others.
+ *
+ * The requests are made of scripts, lists of statements with their
+ * parameters: the writer keeps each statement prepared, so that storing an
+ * account only costs binding the parameters and stepping the statements.
+ */
+
+#include "ag-db-writer.h"
+
+#include "ag-debug.h"
+#include "ag-errors.h"
+#include <string.h>
+
+/* Maximum number of requests executed in the same transaction */
+#define MAX_BATCH_SIZE 256
+/* How long to wait for more asynchronous requests, before starting a
+ * transaction */
+#define GROUP_COMMIT_WINDOW_US 2000
+/* Maximum number of parameters of a statement */
+#define MAX_PARAMS 5
+
+typedef struct {
+    /* 'a' for the account ID of the script, otherwise as in
+     * _ag_db_script_add() */
+    gchar type;
+    union {
+        gint i;
+        const gchar *s;
+        GVariant *v;
+    } u;
+} DbParam;
+
+typedef struct {
+    /* %NULL to take the ID of the last inserted row as account ID */
+    const gchar *sql;
+    guint n_params;
+    DbParam params[MAX_PARAMS];
+} DbStatement;
+
+struct _AgDbScript {
+    sqlite3_int64 account_id;
+    gboolean binary_values;
+    GArray *statements;
+};
+
+struct _AgDbWriter {
+    sqlite3 *db;
+    AgDbLock *lock;
+    sqlite3_stmt *begin_stmt;
+    sqlite3_stmt *commit_stmt;
+    sqlite3_stmt *rollback_stmt;
+    sqlite3_stmt *savepoint_stmt;
+    sqlite3_stmt *release_stmt;
+    sqlite3_stmt *rollback_to_stmt;
+    /* The statements of the scripts, indexed by their SQL */
+    GHashTable *statements;
+
+    GAsyncQueue *queue;
+    GThread *thread;
+
+    /* Used to signal the completion of the blocking requests */
+    GMutex mutex;
+    GCond cond;
+
+    /* Only used by the writer thread */
+    GPtrArray *batch;
+    /* Cancelled when any request of the batch is cancelled */
+    GCancellable *wakeup;
+};
+
+typedef struct _WriteRequest {
+    /* Executed atomically, one after the other */
+    AgDbScript **scripts;
+    guint n_scripts;
+    GCancellable *cancellable;
+    gint64 end_time;
+
+    /* Only set for asynchronous requests */
+    GMainContext *context;
+    AgDbWriterCallback callback;
+    gpointer user_data;
+
+    gulong cancelled_id;
+
+    /* The account IDs of each script, once executed */
+    sqlite3_int64 *account_ids;
+    GError *error;
+    gboolean done;
+} WriteRequest;
+
+/* Pushed to the queue to terminate the thread */
+static WriteRequest quit_request;
+
+/* Creates an empty script for the account @account_id, which can be 0 if
+ * the script creates the account; the settings values are stored as blobs if
+ * @binary_values is %TRUE, as text otherwise. */
+AgDbScript *
+_ag_db_script_new (sqlite3_int64 account_id, gboolean binary_values)
+{
+    AgDbScript *script;
+
+    script = g_slice_new (AgDbScript);
+    script->account_id = account_id;
+    script->binary_values = binary_values;
+    script->statements = g_array_new (FALSE, FALSE, sizeof (DbStatement));
+    return script;
+}
+
+void
+_ag_db_script_free (AgDbScript *script)
+{
+    g_array_unref (script->statements);
+    g_slice_free (AgDbScript, script);
+}
+
+/* Appends the statement @sql to @script; @param_types describes the
+ * parameters which follow: 'a' stands for the account ID of the script and
+ * takes no argument, 'i' for a #gint, 's' for a string (which can be %NULL)
+ * and 'v' for a #GVariant, stored as a settings value. Neither @sql nor the
+ * arguments are copied: they must stay valid until the script is freed. */
+void
+_ag_db_script_add (AgDbScript *script, const gchar *sql,
+                   const gchar *param_types, ...)
+{
+    DbStatement statement;
+    va_list ap;
+    guint i;
+
+    statement.sql = sql;
+    statement.n_params = strlen (param_types);
+    g_return_if_fail (statement.n_params <= MAX_PARAMS);
+
+    va_start (ap, param_types);
+    for (i = 0; i < statement.n_params; i++)
+    {
+        DbParam *param = &statement.params[i];
+
+        param->type = param_types[i];
+        switch (param->type)
+        {
+        case 'a':
+            break;
+        case 'i':
+            param->u.i = va_arg (ap, gint);
+            break;
+        case 's':
+            param->u.s = va_arg (ap, const gchar *);
+            break;
+        case 'v':
+            param->u.v = va_arg (ap, GVariant *);
+            break;
+        default:
+            g_warn_if_reached ();
+        }
+    }
+    va_end (ap);
+
+    g_array_append_val (script->statements, statement);
+}
+
+/* Makes the ID of the row inserted by the previous statement of @script
+ * the account ID for the rest of the script */
+void
+_ag_db_script_take_inserted_id (AgDbScript *script)
+{
+    DbStatement statement = { NULL, 0, };
+
+    g_array_append_val (script->statements, statement);
+}
+
+static void
+write_request_free (WriteRequest *request)
+{
+    guint i;
+
+    for (i = 0; i < request->n_scripts; i++)
+        _ag_db_script_free (request->scripts[i]);
+    g_free (request->scripts);
+    g_free (request->account_ids);
+    g_clear_object (&request->cancellable);
+    if (request->context != NULL)
+        g_main_context_unref (request->context);
+    if (request->error != NULL)
+        g_error_free (request->error);
+    g_slice_free (WriteRequest, request);
+}
+
+static gboolean
+batch_is_cancelled (AgDbWriter *writer)
+{
+    guint i;
+
+    for (i = 0; i < writer->batch->len; i++)
+    {
+        WriteRequest *request = g_ptr_array_index (writer->batch, i);
+        if (g_cancellable_is_cancelled (request->cancellable)) return TRUE;
+    }
+    return FALSE;
+}
+
+/* Waits for the DB lock to be released. Before the transaction starts,
+ * the wait ends when the earliest deadline of the requests expires, or one
+ * of them is cancelled, so that they can be dropped from the batch; after
+ * that, the requests are bound to the transaction, which waits for the
+ * latest deadline. */
+static int
+busy_handler (gpointer user_data, G_GNUC_UNUSED int count)
+{
+    AgDbWriter *writer = user_data;
+    gint64 end_time, min_end_time = G_MAXINT64, max_end_time = 0;
+    gboolean started;
+    guint i;
+
+    if (writer->batch->len == 0) return 0;
+
+    for (i = 0; i < writer->batch->len; i++)
+    {
+        WriteRequest *request = g_ptr_array_index (writer->batch, i);
+        min_end_time = MIN (min_end_time, request->end_time);
+        max_end_time = MAX (max_end_time, request->end_time);
+    }
+
+    started = !sqlite3_get_autocommit (writer->db);
+    end_time = started ? max_end_time : min_end_time;
+    if (g_get_monotonic_time () >= end_time) return 0;
+
+    if (!started && batch_is_cancelled (writer)) return 0;
+
+    DEBUG_LOCKS ("Database locked, waiting...");
+    _ag_db_lock_wait (writer->lock, end_time,
+                      started ? NULL : writer->wakeup);
+    return 1;
+}
+
+static GError *
+error_from_db (AgDbWriter *writer, int db_error)
+{
+    AgAccountsError code = (db_error == SQLITE_READONLY) ?
+        AG_ACCOUNTS_ERROR_READONLY : AG_ACCOUNTS_ERROR_DB;
+    return g_error_new (AG_ACCOUNTS_ERROR, code,
+                        "Got error: %s (%d)",
+                        sqlite3_errmsg (writer->db), db_error);
+}
+
+static void
+rollback (AgDbWriter *writer)
+{
+    int ret;
+
+    ret = sqlite3_step (writer->rollback_stmt);
+    if (G_UNLIKELY (ret != SQLITE_DONE))
+        g_warning ("Rollback failed");
+    sqlite3_reset (writer->rollback_stmt);
+    DEBUG_LOCKS ("Accounts DB is now unlocked");
+}
+
+static gboolean
+step_simple (AgDbWriter *writer, sqlite3_stmt *stmt)
+{
+    int ret;
+
+    ret = sqlite3_step (stmt);
+    sqlite3_reset (stmt);
+    if (G_UNLIKELY (ret != SQLITE_DONE))
+    {
+        g_warning ("%s: %s", G_STRFUNC, sqlite3_errmsg (writer->db));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+on_request_cancelled (G_GNUC_UNUSED GCancellable *cancellable,
+                      AgDbWriter *writer)
+{
+    g_cancellable_cancel (writer->wakeup);
+}
+
+/* Fails the requests of the batch which have been cancelled, or whose
+ * deadline has expired (with the @db_error which the transaction could not
+ * be started with), and removes them from it; returns %TRUE if any request
+ * was removed. */
+static gboolean
+drop_expired_requests (AgDbWriter *writer, int db_error)
+{
+    gint64 now = g_get_monotonic_time ();
+    gboolean dropped = FALSE;
+    guint i = 0;
+
+    while (i < writer->batch->len)
+    {
+        WriteRequest *request = g_ptr_array_index (writer->batch, i);
+
+        if (!g_cancellable_set_error_if_cancelled (request->cancellable,
+                                                   &request->error) &&
+            request->end_time > now)
+        {
+            i++;
+            continue;
+        }
+
+        if (request->error == NULL)
+            request->error = error_from_db (writer, db_error);
+        g_ptr_array_remove_index (writer->batch, i);
+        dropped = TRUE;
+    }
+
+    return dropped;
+}
+
+static void
+fail_batch (AgDbWriter *writer, GError *error)
+{
+    guint i;
+
+    for (i = 0; i < writer->batch->len; i++)
+    {
+        WriteRequest *request = g_ptr_array_index (writer->batch, i);
+
+        g_clear_error (&request->error);
+        request->error = g_error_copy (error);
+    }
+    g_ptr_array_set_size (writer->batch, 0);
+    g_error_free (error);
+}
+
+static sqlite3_stmt *
+get_statement (AgDbWriter *writer, const gchar *sql, int *ret)
+{
+    sqlite3_stmt *stmt;
+
+    stmt = g_hash_table_lookup (writer->statements, sql);
+    if (stmt != NULL) return stmt;
+
+    *ret = sqlite3_prepare_v2 (writer->db, sql, -1, &stmt, NULL);
+    if (G_UNLIKELY (*ret != SQLITE_OK)) return NULL;
+
+    g_hash_table_insert (writer->statements, g_strdup (sql), stmt);
+    return stmt;
+}
+
+static int
+bind_value (sqlite3_stmt *stmt, int index, GVariant *value, gboolean binary)
+{
+    GVariant *normal;
+    gsize size;
+    int ret;
+
+    if (!binary)
+        return sqlite3_bind_text (stmt, index,
+                                  g_variant_print (value, FALSE), -1, g_free);
+
+    normal = g_variant_get_normal_form (value);
+    size = g_variant_get_size (normal);
+    /* The data of an empty value can be NULL, which would be bound as NULL */
+    ret = size > 0 ?
+        sqlite3_bind_blob (stmt, index, g_variant_get_data (normal), size,
+                           SQLITE_TRANSIENT) :
+        sqlite3_bind_zeroblob (stmt, index, 0);
+    g_variant_unref (normal);
+    return ret;
+}
+
+static int
+execute_statement (AgDbWriter *writer, const DbStatement *statement,
+                   AgDbScript *script)
+{
+    sqlite3_stmt *stmt;
+    guint i;
+    int ret = SQLITE_OK;
+
+    stmt = get_statement (writer, statement->sql, &ret);
+    if (G_UNLIKELY (stmt == NULL)) return ret;
+
+    for (i = 0; i < statement->n_params && ret == SQLITE_OK; i++)
+    {
+        const DbParam *param = &statement->params[i];
+
+        switch (param->type)
+        {
+        case 'a':
+            ret = sqlite3_bind_int64 (stmt, i + 1, script->account_id);
+            break;
+        case 'i':
+            ret = sqlite3_bind_int (stmt, i + 1, param->u.i);
+            break;
+        case 's':
+            ret = sqlite3_bind_text (stmt, i + 1, param->u.s, -1,
+                                     SQLITE_STATIC);
+            break;
+        case 'v':
+            ret = bind_value (stmt, i + 1, param->u.v,
+                              script->binary_values);
+            break;
+        }
+    }
+
+    DEBUG_QUERIES ("called: %s", statement->sql);
+    if (G_LIKELY (ret == SQLITE_OK))
+    {
+        while ((ret = sqlite3_step (stmt)) == SQLITE_ROW);
+        if (ret == SQLITE_DONE) ret = SQLITE_OK;
+    }
+
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+    return ret;
+}
+
+static int
+execute_script (AgDbWriter *writer, AgDbScript *script)
+{
+    guint i;
+    int ret = SQLITE_OK;
+
+    for (i = 0; i < script->statements->len && ret == SQLITE_OK; i++)
+    {
+        const DbStatement *statement =
+            &g_array_index (script->statements, DbStatement, i);
+
+        if (statement->sql == NULL)
+            script->account_id = sqlite3_last_insert_rowid (writer->db);
+        else
+            ret = execute_statement (writer, statement, script);
+    }
+    return ret;
+}
+
+static void
+execute_request (AgDbWriter *writer, WriteRequest *request)
+{
+    guint i;
+    int ret = SQLITE_OK;
+
+    if (!step_simple (writer, writer->savepoint_stmt))
+    {
+        request->error = error_from_db (writer, SQLITE_ERROR);
+        return;
+    }
+
+    for (i = 0; i < request->n_scripts && ret == SQLITE_OK; i++)
+    {
+        ret = execute_script (writer, request->scripts[i]);
+        request->account_ids[i] = request->scripts[i]->account_id;
+    }
+
+    if (G_UNLIKELY (ret != SQLITE_OK))
+    {
+        request->error = error_from_db (writer, ret);
+        /* Some errors roll back the whole transaction */
+        if (sqlite3_get_autocommit (writer->db)) return;
+        step_simple (writer, writer->rollback_to_stmt);
+    }
+    step_simple (writer, writer->release_stmt);
+}
+
+/* Executes all the requests of the batch in one transaction; the requests
+ * which are cancelled, or whose deadline expires, before the transaction
+ * starts are failed, without affecting the others. */
+static void
+execute_batch (AgDbWriter *writer, GPtrArray *requests)
+{
+    guint i;
+    int ret;
+
+    for (i = 0; i < requests->len; i++)
+    {
+        WriteRequest *request = g_ptr_array_index (requests, i);
+
+        /* Once the transaction has started, it cannot be cancelled anymore */
+        if (g_cancellable_set_error_if_cancelled (request->cancellable,
+                                                  &request->error))
+            continue;
+
+        if (request->cancellable != NULL)
+            request->cancelled_id =
+                g_cancellable_connect (request->cancellable,
+                                       G_CALLBACK (on_request_cancelled),
+                                       writer, NULL);
+        g_ptr_array_add (writer->batch, request);
+    }
+
+    while (writer->batch->len > 0)
+    {
+        ret = sqlite3_step (writer->begin_stmt);
+        sqlite3_reset (writer->begin_stmt);
+        if (ret == SQLITE_DONE) break;
+
+        /* Retry without the requests which were cancelled, or which could
+         * not wait any longer */
+        if (drop_expired_requests (writer, ret))
+        {
+            g_cancellable_reset (writer->wakeup);
+            continue;
+        }
+
+        fail_batch (writer, error_from_db (writer, ret));
+    }
+
+    /* From now on, cancelling the requests has no effect */
+    for (i = 0; i < requests->len; i++)
+    {
+        WriteRequest *request = g_ptr_array_index (requests, i);
+
+        if (request->cancelled_id != 0)
+        {
+            g_cancellable_disconnect (request->cancellable,
+                                      request->cancelled_id);
+            request->cancelled_id = 0;
+        }
+    }
+    g_cancellable_reset (writer->wakeup);
+
+    if (writer->batch->len == 0) return;
+
+    DEBUG_LOCKS ("Accounts DB is now locked");
+    for (i = 0; i < writer->batch->len; i++)
+    {
+        WriteRequest *request = g_ptr_array_index (writer->batch, i);
+
+        execute_request (writer, request);
+        if (G_UNLIKELY (sqlite3_get_autocommit (writer->db)))
+        {
+            /* The transaction has been rolled back */
+            DEBUG_LOCKS ("Accounts DB is now unlocked");
+            fail_batch (writer, request->error != NULL ?
+                        g_error_copy (request->error) :
+                        error_from_db (writer, SQLITE_ABORT));
+            return;
+        }
+    }
+
+    ret = sqlite3_step (writer->commit_stmt);
+    sqlite3_reset (writer->commit_stmt);
+    if (G_UNLIKELY (ret != SQLITE_DONE))
+    {
+        GError *error;
+
+        error = g_error_new_literal (AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
+                                     sqlite3_errmsg (writer->db));
+        if (!sqlite3_get_autocommit (writer->db))
+            rollback (writer);
+        fail_batch (writer, error);
+        return;
+    }
+
+    DEBUG_LOCKS ("Accounts DB is now unlocked (%u requests committed)",
+                 writer->batch->len);
+    g_ptr_array_set_size (writer->batch, 0);
+}
+
+static gboolean
+deliver_result (WriteRequest *request)
+{
+    GError *error = request->error;
+
+    request->error = NULL;
+    request->callback (request->account_ids, error, request->user_data);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+complete_request (AgDbWriter *writer, WriteRequest *request)
+{
+    if (request->context != NULL)
+    {
+        GSource *source;
+
+        source = g_idle_source_new ();
+        g_source_set_priority (source, G_PRIORITY_DEFAULT);
+        g_source_set_callback (source, (GSourceFunc)deliver_result,
+                               request,
+                               (GDestroyNotify)write_request_free);
+        g_source_attach (source, request->context);
+        g_source_unref (source);
+    }
+    else
+    {
+        g_mutex_lock (&writer->mutex);
+        request->done = TRUE;
+        g_cond_broadcast (&writer->cond);
+        g_mutex_unlock (&writer->mutex);
+    }
+}
+
+/* Collects the requests to be executed in the next transaction, starting
+ * with @first; returns %FALSE if the thread must terminate. */
+static gboolean
+collect_requests (AgDbWriter *writer, WriteRequest *first,
+                  GPtrArray *requests)
+{
+    WriteRequest *request;
+    gboolean blocking;
+    gint64 end_time;
+
+    g_ptr_array_add (requests, first);
+    blocking = (first->context == NULL);
+
+    /* The requests queued while the last transaction was running */
+    while (requests->len < MAX_BATCH_SIZE &&
+           (request = g_async_queue_try_pop (writer->queue)) != NULL)
+    {
+        if (request == &quit_request) return FALSE;
+        g_ptr_array_add (requests, request);
+        if (request->context == NULL) blocking = TRUE;
+    }
+
+    /* Someone is waiting for a blocking request: don't delay it */
+    if (blocking) return TRUE;
+
+    end_time = g_get_monotonic_time () + GROUP_COMMIT_WINDOW_US;
+    while (requests->len < MAX_BATCH_SIZE)
+    {
+        gint64 now = g_get_monotonic_time ();
+
+        if (now >= end_time) break;
+        request = g_async_queue_timeout_pop (writer->queue, end_time - now);
+        if (request == NULL) break;
+        if (request == &quit_request) return FALSE;
+        g_ptr_array_add (requests, request);
+        if (request->context == NULL) break;
+    }
+
+    return TRUE;
+}
+
+static gpointer
+writer_thread (AgDbWriter *writer)
+{
+    GPtrArray *requests;
+    WriteRequest *request;
+    gboolean running = TRUE;
+    guint i;
+
+    requests = g_ptr_array_new ();
+    while (running)
+    {
+        request = g_async_queue_pop (writer->queue);
+        if (request == &quit_request) break;
+
+        running = collect_requests (writer, request, requests);
+        execute_batch (writer, requests);
+
+        for (i = 0; i < requests->len; i++)
+            complete_request (writer, g_ptr_array_index (requests, i));
+        g_ptr_array_set_size (requests, 0);
+    }
+    g_ptr_array_unref (requests);
+
+    return NULL;
+}
+
+static void
+finalize_statements (AgDbWriter *writer)
+{
+    /* sqlite3_finalize() accepts NULL */
+    sqlite3_finalize (writer->begin_stmt);
+    sqlite3_finalize (writer->commit_stmt);
+    sqlite3_finalize (writer->rollback_stmt);
+    sqlite3_finalize (writer->savepoint_stmt);
+    sqlite3_finalize (writer->release_stmt);
+    sqlite3_finalize (writer->rollback_to_stmt);
+}
+
+/* Takes ownership of @db, which must not be used by other threads. Returns
+ * %NULL on failure. */
+AgDbWriter *
+_ag_db_writer_new (sqlite3 *db, AgDbLock *lock)
+{
+    AgDbWriter *writer;
+    int ret;
+
+    g_return_val_if_fail (db != NULL, NULL);
+    g_return_val_if_fail (lock != NULL, NULL);
+
+    writer = g_slice_new0 (AgDbWriter);
+    writer->db = db;
+    writer->lock = lock;
+
+    ret = sqlite3_prepare_v2 (db, "BEGIN EXCLUSIVE;", -1,
+                              &writer->begin_stmt, NULL);
+    if (ret == SQLITE_OK)
+        ret = sqlite3_prepare_v2 (db, "COMMIT;", -1,
+                                  &writer->commit_stmt, NULL);
+    if (ret == SQLITE_OK)
+        ret = sqlite3_prepare_v2 (db, "ROLLBACK;", -1,
+                                  &writer->rollback_stmt, NULL);
+    if (ret == SQLITE_OK)
+        ret = sqlite3_prepare_v2 (db, "SAVEPOINT request;", -1,
+                                  &writer->savepoint_stmt, NULL);
+    if (ret == SQLITE_OK)
+        ret = sqlite3_prepare_v2 (db, "RELEASE request;", -1,
+                                  &writer->release_stmt, NULL);
+    if (ret == SQLITE_OK)
+        ret = sqlite3_prepare_v2 (db, "ROLLBACK TO request;", -1,
+                                  &writer->rollback_to_stmt, NULL);
+    if (G_UNLIKELY (ret != SQLITE_OK))
+    {
+        g_warning ("%s: couldn't prepare statements (%s)",
+                   G_STRFUNC, sqlite3_errmsg (db));
+        finalize_statements (writer);
+        sqlite3_close (db);
+        g_slice_free (AgDbWriter, writer);
+        return NULL;
+    }
+
+    sqlite3_busy_handler (db, busy_handler, writer);
+    writer->statements =
+        g_hash_table_new_full (g_str_hash, g_str_equal,
+                               g_free, (GDestroyNotify)sqlite3_finalize);
+
+    g_mutex_init (&writer->mutex);
+    g_cond_init (&writer->cond);
+    writer->batch = g_ptr_array_new ();
+    writer->wakeup = g_cancellable_new ();
+    writer->queue = g_async_queue_new ();
+    writer->thread = g_thread_new ("ag-db-writer",
+                                   (GThreadFunc)writer_thread, writer);
+
+    return writer;
+}
+
+/* Waits for the queued requests to be executed, and frees @writer */
+void
+_ag_db_writer_free (AgDbWriter *writer)
+{
+    g_return_if_fail (writer != NULL);
+
+    g_async_queue_push (writer->queue, &quit_request);
+    g_thread_join (writer->thread);
+    g_async_queue_unref (writer->queue);
+
+    finalize_statements (writer);
+    g_hash_table_unref (writer->statements);
+    sqlite3_close (writer->db);
+    g_ptr_array_unref (writer->batch);
+    g_object_unref (writer->wakeup);
+
+    g_mutex_clear (&writer->mutex);
+    g_cond_clear (&writer->cond);
+    g_slice_free (AgDbWriter, writer);
+}
+
+static WriteRequest *
+write_request_new (AgDbScript **scripts, guint n_scripts)
+{
+    WriteRequest *request;
+
+    request = g_slice_new0 (WriteRequest);
+    request->scripts = g_new (AgDbScript *, n_scripts);
+    memcpy (request->scripts, scripts, n_scripts * sizeof (AgDbScript *));
+    request->n_scripts = n_scripts;
+    request->account_ids = g_new0 (sqlite3_int64, n_scripts);
+    return request;
+}
+
+/* Queues the execution of the @n_scripts @scripts in a transaction, taking
+ * ownership of them; either all of them succeed, or none. @callback will be
+ * invoked in the thread-default main context with the account IDs of each
+ * script, including those of the accounts it created. If @cancellable is
+ * cancelled before the transaction starts, the operation fails with
+ * %G_IO_ERROR_CANCELLED. */
+void
+_ag_db_writer_exec_async (AgDbWriter *writer, AgDbScript **scripts,
+                          guint n_scripts, GCancellable *cancellable,
+                          AgDbWriterCallback callback, gpointer user_data)
+{
+    WriteRequest *request;
+
+    g_return_if_fail (writer != NULL);
+    g_return_if_fail (scripts != NULL || n_scripts == 0);
+    g_return_if_fail (callback != NULL);
+
+    request = write_request_new (scripts, n_scripts);
+    if (cancellable != NULL)
+        request->cancellable = g_object_ref (cancellable);
+    request->end_time = G_MAXINT64;
+    request->context = g_main_context_ref_thread_default ();
+    request->callback = callback;
+    request->user_data = user_data;
+
+    g_async_queue_push (writer->queue, request);
+}
+
+/* Like _ag_db_writer_exec_async(), but blocks until the requests queued
+ * before have been executed, and @scripts too; if the DB is locked, waits
+ * for it until @end_time (in monotonic time). @account_ids, if not %NULL,
+ * must have room for an ID per script. */
+gboolean
+_ag_db_writer_exec (AgDbWriter *writer, AgDbScript **scripts,
+                    guint n_scripts, gint64 end_time,
+                    sqlite3_int64 *account_ids, GError **error)
+{
+    WriteRequest *request;
+    gboolean ok;
+
+    g_return_val_if_fail (writer != NULL, FALSE);
+    g_return_val_if_fail (scripts != NULL || n_scripts == 0, FALSE);
+
+    request = write_request_new (scripts, n_scripts);
+    request->end_time = end_time;
+
+    g_async_queue_push (writer->queue, request);
+
+    g_mutex_lock (&writer->mutex);
+    while (!request->done)
+        g_cond_wait (&writer->cond, &writer->mutex);
+    g_mutex_unlock (&writer->mutex);
+
+    ok = (request->error == NULL);
+    if (ok)
+    {
+        if (account_ids != NULL && request->n_scripts > 0)
+            memcpy (account_ids, request->account_ids,
+                    request->n_scripts * sizeof (sqlite3_int64));
+    }
+    else
+    {
+        g_propagate_error (error, g_steal_pointer (&request->error));
+    }
+    write_request_free (request);
+
+    return ok;
+}
@@ -0,0 +1,78 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This file is part of libaccounts-glib
+ *
+ * Copyright (C) 2012-2016 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+
+#ifndef _AG_DB_WRITER_H_
+#define _AG_DB_WRITER_H_
+
+#include "ag-db-lock.h"
+
+#include <gio/gio.h>
+#include <sqlite3.h>
+
+G_BEGIN_DECLS
+
+typedef struct _AgDbWriter AgDbWriter;
+typedef struct _AgDbScript AgDbScript;
+
+/* @account_ids holds an element per script; @error is owned by the
+ * callee */
+typedef void (*AgDbWriterCallback) (const sqlite3_int64 *account_ids,
+                                    GError *error, gpointer user_data);
+
+G_GNUC_INTERNAL
+AgDbScript *_ag_db_script_new (sqlite3_int64 account_id,
+                               gboolean binary_values);
+
+G_GNUC_INTERNAL
+void _ag_db_script_free (AgDbScript *script);
+
+G_GNUC_INTERNAL
+void _ag_db_script_add (AgDbScript *script, const gchar *sql,
+                        const gchar *param_types, ...);
+
+G_GNUC_INTERNAL
+void _ag_db_script_take_inserted_id (AgDbScript *script);
+
+G_GNUC_INTERNAL
+AgDbWriter *_ag_db_writer_new (sqlite3 *db, AgDbLock *lock);
+
+G_GNUC_INTERNAL
+void _ag_db_writer_free (AgDbWriter *writer);
+
+G_GNUC_INTERNAL
+void _ag_db_writer_exec_async (AgDbWriter *writer, AgDbScript **scripts,
+                               guint n_scripts,
+                               GCancellable *cancellable,
+                               AgDbWriterCallback callback,
+                               gpointer user_data);
+
+G_GNUC_INTERNAL
+gboolean _ag_db_writer_exec (AgDbWriter *writer, AgDbScript **scripts,
+                             guint n_scripts, gint64 end_time,
+                             sqlite3_int64 *account_ids, GError **error);
+
+G_END_DECLS
+
+#endif /* _AG_DB_WRITER_H_ */
@@ -31,6 +31,7 @@
 
 #include "ag-account.h"
 #include "ag-auth-data.h"
+#include "ag-db-writer.h"
 #include "ag-debug.h"
 #include "ag-manager.h"
 #include <sqlite3.h>
@@ -58,6 +59,10 @@ struct _AgAccountChanges {
     /* The keys of the table are service names, and the values are
      * AgServiceChanges structures */
     GHashTable *services;
+
+    /* The account the changes have been taken from, while they are being
+     * stored; see _ag_account_steal_changes() */
+    AgAccount *account;
 };
 
 G_GNUC_INTERNAL
@@ -78,7 +83,8 @@ AgAccountChanges *_ag_account_changes_from_dbus (AgManager *manager,
                                                  gboolean deleted);
 
 G_GNUC_INTERNAL
-gchar *_ag_account_get_store_sql (AgAccount *account, GError **error);
+AgDbScript *_ag_account_get_store_script (AgAccount *account,
+                                          GError **error);
 
 G_GNUC_INTERNAL
 AgAccountChanges *_ag_account_steal_changes (AgAccount *account);
@@ -87,8 +93,30 @@ G_GNUC_INTERNAL
 GHashTable *_ag_account_get_service_changes (AgAccount *account,
                                              AgService *service);
 
+/* The state of a scan of the Settings rows of an account, ordered by
+ * service; see _ag_account_preload_row() */
+typedef struct {
+    AgAccount *account;
+    gint service_id;
+    GHashTable *settings;
+} AgAccountPreload;
+
+G_GNUC_INTERNAL
+AgAccount *_ag_account_new_loaded (AgManager *manager, AgAccountId id,
+                                   const gchar *display_name,
+                                   const gchar *provider_name,
+                                   gboolean enabled);
+G_GNUC_INTERNAL
+void _ag_account_preload_init (AgAccountPreload *preload, AgAccount *account);
+G_GNUC_INTERNAL
+gboolean _ag_account_preload_row (AgAccountPreload *preload,
+                                  sqlite3_stmt *stmt, gint first_column);
+G_GNUC_INTERNAL
+void _ag_account_preload_done (AgAccountPreload *preload,
+                               gboolean all_services);
+
 G_GNUC_INTERNAL
-void _ag_manager_exec_transaction (AgManager *manager, const gchar *sql,
+void _ag_manager_exec_transaction (AgManager *manager, AgDbScript *script,
                                    AgAccountChanges *changes,
                                    AgAccount *account,
                                    GTask *task);
@@ -97,7 +125,7 @@ typedef gboolean (*AgQueryCallback) (sqlite3_stmt *stmt, gpointer user_data);
 
 G_GNUC_INTERNAL
 void _ag_manager_exec_transaction_blocking (AgManager *manager,
-                                            const gchar *sql,
+                                            AgDbScript *script,
                                             AgAccountChanges *changes,
                                             AgAccount *account,
                                             GError **error);
@@ -106,9 +134,12 @@ gint _ag_manager_exec_query (AgManager *manager,
                              AgQueryCallback callback, gpointer user_data,
                              const gchar *sql);
 G_GNUC_INTERNAL
-void _ag_manager_take_error (AgManager *manager, GError *error);
+gint _ag_manager_exec_prepared (AgManager *manager,
+                                AgQueryCallback callback, gpointer user_data,
+                                const gchar *sql, const gchar *param_types,
+                                ...);
 G_GNUC_INTERNAL
-const GError *_ag_manager_get_last_error (AgManager *manager);
+void _ag_manager_take_error (AgManager *manager, GError *error);
 
 G_GNUC_INTERNAL
 AgService *_ag_manager_get_service_lazy (AgManager *manager,
@@ -117,6 +148,10 @@ AgService *_ag_manager_get_service_lazy (AgManager *manager,
                                          const gint service_id);
 G_GNUC_INTERNAL
 guint _ag_manager_get_service_id (AgManager *manager, AgService *service);
+G_GNUC_INTERNAL
+gboolean _ag_manager_has_binary_values (AgManager *manager);
+G_GNUC_INTERNAL
+gboolean _ag_manager_has_account_services (AgManager *manager);
 
 G_GNUC_INTERNAL
 void _ag_manager_store_async (AgManager *manager, AgAccount *account,
@@ -135,16 +170,29 @@ struct _AgService {
     gchar *provider;
     gchar *icon_name;
     gchar *i18n_domain;
-    gchar *file_data;
+    GBytes *file_contents;
+    /* The offset of <type_data> in file_contents */
+    gsize file_type_data_offset;
     gsize type_data_offset;
     gint id;
+    gboolean loaded;
     GHashTable *default_settings;
+    /* Default settings as stored in the DB, and the file mtime they match */
+    GVariant *stored_defaults;
+    gint64 stored_defaults_mtime;
     GHashTable *tags;
+    /* The AgManager which loaded the service, if any */
+    GWeakRef manager;
 };
 
 G_GNUC_INTERNAL
 AgService *_ag_service_new_from_file (const gchar *service_name);
 G_GNUC_INTERNAL
+AgService *_ag_service_new_from_header (const gchar *service_name);
+G_GNUC_INTERNAL
+GVariant *_ag_service_compile_catalog_entry (const gchar *service_name,
+                                             const gchar *filepath);
+G_GNUC_INTERNAL
 AgService *_ag_service_new_from_memory (const gchar *service_name,
                                         const gchar *service_type,
                                         const gint service_id);
@@ -169,14 +217,19 @@ struct _AgProvider {
     gchar *description;
     gchar *domains;
     gchar *plugin_name;
-    gchar *file_data;
+    GBytes *file_contents;
     gboolean single_account;
     GHashTable *default_settings;
     GHashTable *tags;
+    /* The compiled domains regex, created on first use */
+    struct _AgDomainMatcher *domain_matcher;
 };
 
 G_GNUC_INTERNAL
 AgProvider *_ag_provider_new_from_file (const gchar *provider_name);
+G_GNUC_INTERNAL
+GVariant *_ag_provider_compile_catalog_entry (const gchar *provider_name,
+                                              const gchar *filepath);
 
 G_GNUC_INTERNAL
 GHashTable *_ag_provider_load_default_settings (AgProvider *provider);
@@ -198,6 +251,20 @@ gboolean _ag_account_changes_have_enabled (AgAccountChanges *changes);
 G_GNUC_INTERNAL
 GList *_ag_manager_list_all (AgManager *manager);
 
+G_GNUC_INTERNAL
+GList *_ag_manager_list_services_by_provider (AgManager *manager,
+                                              const gchar *provider_name,
+                                              const gchar *service_type);
+
+G_GNUC_INTERNAL
+AgServiceType *_ag_manager_get_service_type (AgManager *manager,
+                                             const gchar *service_type_name);
+
+G_GNUC_INTERNAL
+void _ag_manager_store_service_defaults (AgManager *manager,
+                                         AgService *service,
+                                         gint64 mtime);
+
 G_GNUC_INTERNAL
 void _ag_account_changes_free (AgAccountChanges *change);
 
@@ -210,6 +277,11 @@ void _ag_account_settings_iter_init (AgAccount *account,
 /* Service type functions */
 G_GNUC_INTERNAL
 AgServiceType *_ag_service_type_new_from_file (const gchar *service_type_name);
+G_GNUC_INTERNAL
+GHashTable *_ag_service_type_get_tags_table (AgServiceType *service_type);
+G_GNUC_INTERNAL
+GVariant *_ag_service_type_compile_catalog_entry (const gchar *service_type_name,
+                                                  const gchar *filepath);
 
 /* AgAuthData functions */
 G_GNUC_INTERNAL
@@ -218,6 +290,9 @@ AgAuthData *_ag_auth_data_new (AgAccount *account, AgService *service);
 /* Application functions */
 G_GNUC_INTERNAL
 AgApplication *_ag_application_new_from_file (const gchar *application_name);
+G_GNUC_INTERNAL
+GVariant *_ag_application_compile_catalog_entry (const gchar *application_name,
+                                                 const gchar *filepath);
 
 G_GNUC_INTERNAL
 GList *_ag_application_list_supported_services (AgApplication *self,
@@ -42,19 +42,31 @@
  * corresponding functions, such as ag_manager_list_free() for the #GList of
  * #AgAccountId returned from ag_manager_list(), or ag_service_list_free() for
  * the #GList of #AgService returned from ag_manager_list_services().
+ *
+ * The queries on the accounts DB run on a small pool of read-only
+ * connections, so ag_manager_list(), ag_manager_list_by_service_type(),
+ * ag_manager_get_account(), ag_manager_load_account() and
+ * ag_manager_get_service() can be called from several threads at once. The
+ * #AgAccount objects themselves are not thread-safe: each of them must be
+ * used by one thread at a time.
  */
 
 #include "ag-manager.h"
 
 #include "ag-account-service.h"
 #include "ag-application.h"
+#include "ag-catalog.h"
+#include "ag-db-lock.h"
+#include "ag-db-writer.h"
 #include "ag-errors.h"
 #include "ag-internals.h"
+#include "ag-provider.h"
 #include "ag-service.h"
+#include "ag-service-type.h"
 #include "ag-util.h"
 #include <errno.h>
 #include <fcntl.h>
-#include <sched.h>
+#include <libxml/parser.h>
 #include <sqlite3.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -65,10 +77,23 @@
 #define DATABASE_DIR "libaccounts-glib"
 #endif
 
+/* How long the blocking stores wait for the DB to be unlocked */
+#define BLOCKING_STORE_TIMEOUT (30 * G_TIME_SPAN_SECOND)
+
+/* How many read-only connections can be open at the same time */
+#define MAX_READERS 4
+
+/* When loading many accounts, the IDs closer than this to each other are
+ * read with one range scan; farther IDs start a new range, so that the rows
+ * of the accounts in between are not scanned */
+#define MAX_ACCOUNT_ID_GAP 16
+
 #ifdef DISABLE_WAL
 #define JOURNAL_MODE "TRUNCATE"
+#define USE_WAL FALSE
 #else
 #define JOURNAL_MODE "WAL"
+#define USE_WAL TRUE
 #endif
 
 enum
@@ -79,6 +104,7 @@ enum
     PROP_DB_TIMEOUT,
     PROP_ABORT_ON_DB_TIMEOUT,
     PROP_USE_DBUS,
+    PROP_PARALLEL_LOADING,
     N_PROPERTIES
 };
 
@@ -90,31 +116,91 @@ enum
     ACCOUNT_DELETED,
     ACCOUNT_ENABLED,
     ACCOUNT_UPDATED,
+    SERVICE_ADDED,
+    SERVICE_REMOVED,
+    PROVIDER_CHANGED,
     LAST_SIGNAL
 };
 
 static guint signals[LAST_SIGNAL] = { 0 };
 
-struct _AgManagerPrivate {
+/* The installed services and applications, indexed by the properties used
+ * to query them. Built on first use; then, if the manager is watching the
+ * data directories, it's updated one file at a time, otherwise it's built
+ * again whenever the data directories change. */
+typedef struct {
+    guint generation;
+    /* All the installed services */
+    GPtrArray *services;
+    /* Service name -> AgService */
+    GHashTable *services_by_name;
+    /* Service type -> GPtrArray of AgService */
+    GHashTable *services_by_type;
+    /* Provider name -> GPtrArray of AgService */
+    GHashTable *services_by_provider;
+    /* The applications and their index are built only when needed */
+    GPtrArray *applications;
+    /* Service name -> GPtrArray of the AgApplication supporting it */
+    GHashTable *applications_by_service;
+} AgManagerCatalog;
+
+/* A connection to the accounts DB, used by one thread at a time */
+typedef struct {
+    AgManagerPrivate *priv;
     sqlite3 *db;
+    /* Prepared statements of _ag_manager_exec_prepared(), by SQL text */
+    GHashTable *statements;
+    /* When the current SQLite operation found the DB locked */
+    gint64 busy_since;
+    /* The thread running queries on the connection, and how many of them
+     * are nested into each other */
+    GThread *owner;
+    guint depth;
+} DbConnection;
 
-    sqlite3_stmt *begin_stmt;
-    sqlite3_stmt *commit_stmt;
-    sqlite3_stmt *rollback_stmt;
-
+struct _AgManagerPrivate {
+    sqlite3 *db;
+    /* The connection on @db, used to initialize the DB and to write to the
+     * Services table; protected by @main_lock */
+    DbConnection main_conn;
+    GRecMutex main_lock;
+
+    /* The read-only connections on which the queries are run; the threads
+     * wait on @readers_cond for one of them to be available */
+    GPtrArray *readers;
+    GMutex readers_lock;
+    GCond readers_cond;
+
+    /* Executes the store transactions; created when first needed */
+    AgDbWriter *writer;
+
+    /* The IDs of the rows of the Services table, by service name: read when
+     * the DB is opened, then refreshed with the rows added after the one
+     * with ID @last_service_id */
+    GHashTable *service_ids;
     sqlite3_int64 last_service_id;
-    sqlite3_int64 last_account_id;
+
+    /* Whether the Services table matches the installed services, as of the
+     * catalog generation @services_synced_generation; protected by
+     * @services_sync_lock, which is held while the table is updated */
+    gboolean services_synced;
+    guint services_synced_generation;
+    GMutex services_sync_lock;
 
     GDBusConnection *dbus_conn;
 
     /* Cache for AgService */
     GHashTable *services;
 
-    /* Weak references to loaded accounts */
+    /* GWeakRef to the loaded accounts, by account ID */
     GHashTable *accounts;
 
-    /* list of StoreCbData awaiting for exclusive locks */
-    GList *locks;
+    /* Protects @services, @service_ids, @accounts and @last_error, which
+     * are also used by the threads running queries */
+    GMutex cache_lock;
+
+    /* Used to wait for other connections to release the DB */
+    AgDbLock *db_lock;
 
     /* list of EmittedSignalData for the signals emitted by this instance */
     GList *emitted_signals;
@@ -132,10 +218,46 @@ struct _AgManagerPrivate {
 
     guint db_timeout;
 
+    /* Index of the installed data files */
+    AgManagerCatalog *catalog;
+
+    /* The installed services as last notified with the service-added and
+     * service-removed signals, by name; NULL until the catalog is built
+     * while watching the data directories */
+    GHashTable *notified_services;
+
+    /* GFileMonitors on the data directories; NULL if not watching them */
+    GPtrArray *dir_monitors;
+
+    /* Protects @catalog, @notified_services and @dir_monitors; held by
+     * the users of the catalog for as long as they read it. Taken before
+     * @cache_lock. */
+    GRecMutex catalog_lock;
+
+    /* Loaded service types, by name; dropped when the data files change */
+    GHashTable *service_types;
+    guint service_types_generation;
+    GMutex service_types_lock;
+
+    /* The installed providers, an array which is replaced, never modified,
+     * when the data files change; protected by @providers_lock */
+    GPtrArray *providers;
+    guint providers_generation;
+    GMutex providers_lock;
+
     guint abort_on_db_timeout : 1;
     guint use_dbus : 1;
+    guint parallel_loading : 1;
     guint is_disposed : 1;
     guint is_readonly : 1;
+    /* The Services table can store the default settings */
+    guint has_service_defaults : 1;
+    /* The settings are stored as serialized GVariant data */
+    guint has_binary_values : 1;
+    /* The AccountServices table is available */
+    guint has_account_services : 1;
+    /* The Services table tells which services are installed */
+    guint has_installed_services : 1;
 
     gchar *service_type;
 };
@@ -143,9 +265,7 @@ struct _AgManagerPrivate {
 typedef struct {
     AgManager *manager;
     AgAccount *account;
-    gchar *sql;
     AgAccountChanges *changes;
-    guint id;
     GTask *task;
 } StoreCbData;
 
@@ -168,11 +288,41 @@ G_DEFINE_TYPE_WITH_CODE (AgManager, ag_manager, G_TYPE_OBJECT,
                                             ag_manager_initable_iface_init)
                          G_ADD_PRIVATE (AgManager));
 
-static void store_cb_data_free (StoreCbData *sd);
-static void account_weak_notify (gpointer userdata, GObject *dead_account);
+static AgAccount *lookup_account (AgManager *manager,
+                                  AgAccountId account_id);
+static AgAccount *cache_account (AgManager *manager, AgAccount *account);
+static gint exec_write (AgManager *manager, const gchar *sql,
+                        const gchar *param_types, ...);
+static AgService *get_service_header (AgManager *manager,
+                                      const gchar *service_name);
+static AgService *lookup_service (AgManager *manager,
+                                  const gchar *service_name);
+static AgService *adopt_service (AgManager *manager, AgService *service);
+
+typedef gpointer (*AgDataFileLookupFunc) (AgManager *self,
+                                          const gchar *base_name);
+typedef gpointer (*AgDataFileParseFunc) (const gchar *base_name);
+typedef gpointer (*AgDataFileAdoptFunc) (AgManager *self, gpointer item);
+
+/* Describes how to load one kind of data files */
+typedef struct {
+    const gchar *suffix;
+    const gchar *env_var;
+    const gchar *subdir;
+    /* Optional: returns the item if the manager already has it */
+    AgDataFileLookupFunc lookup;
+    /* Loads the item from its file; must be thread-safe */
+    AgDataFileParseFunc parse;
+    /* Optional: registers a newly loaded item with the manager */
+    AgDataFileAdoptFunc adopt;
+} AgDataFileKind;
 
-typedef gpointer (*AgDataFileLoadFunc) (AgManager *self,
-                                        const gchar *base_name);
+typedef struct {
+    const gchar *base_name;
+    AgDataFileParseFunc parse;
+    gpointer item;
+    guint index;
+} ParseJob;
 
 static void
 on_dbus_store_done (GObject *object, GAsyncResult *res,
@@ -310,118 +460,155 @@ ag_manager_store_dbus_sync (AgManager *manager, AgAccount *account,
     return TRUE;
 }
 
-static void
-add_data_files_from_dir (AgManager *manager, const gchar *dirname,
-                         GHashTable *loaded_files, const gchar *suffix,
-                         AgDataFileLoadFunc load_file_func)
+static gint
+compare_names (gconstpointer a, gconstpointer b)
 {
-    const gchar *filename;
-    gchar *base_name;
-    gint suffix_length;
-    gpointer loaded_file;
-    GDir *dir;
-
-    g_return_if_fail (dirname != NULL);
+    return strcmp (*(const gchar **)a, *(const gchar **)b);
+}
 
-    dir = g_dir_open (dirname, 0, NULL);
-    if (!dir) return;
+/* Returns the sorted names of the data files of the given kind */
+static GPtrArray *
+list_data_file_names (const AgDataFileKind *kind)
+{
+    GHashTable *seen;
+    GPtrArray *names;
+    gchar **dirs, **dirname;
+    gsize suffix_len;
 
-    suffix_length = strlen (suffix);
+    names = g_ptr_array_new_with_free_func (g_free);
+    seen = g_hash_table_new (g_str_hash, g_str_equal);
+    suffix_len = strlen (kind->suffix);
 
-    while ((filename = g_dir_read_name (dir)) != NULL)
+    dirs = _ag_get_data_dirs (kind->env_var, kind->subdir);
+    for (dirname = dirs; *dirname != NULL; dirname++)
     {
-        if (filename[0] == '.')
-            continue;
+        gchar **filenames, **filename;
 
-        if (!g_str_has_suffix (filename, suffix))
-            continue;
+        filenames = _ag_catalog_list_files (*dirname);
+        for (filename = filenames; *filename != NULL; filename++)
+        {
+            gchar *base_name;
 
-        base_name = g_strndup (filename, (strlen (filename) - suffix_length));
+            if ((*filename)[0] == '.' ||
+                !g_str_has_suffix (*filename, kind->suffix))
+                continue;
 
-        /* if there is already a service with the same name in the list, then
-         * we skip this one (we process directories in descending order of
-         * priority) */
-        if (g_hash_table_lookup (loaded_files, base_name) != NULL)
-        {
-            g_free (base_name);
-            continue;
-        }
+            base_name = g_strndup (*filename,
+                                   strlen (*filename) - suffix_len);
 
-        loaded_file = load_file_func (manager, base_name);
-        if (G_UNLIKELY (!loaded_file))
-        {
-            g_free (base_name);
-            continue;
+            /* if there is already a file with the same name in the list,
+             * then we skip this one (we process directories in descending
+             * order of priority) */
+            if (g_hash_table_contains (seen, base_name))
+            {
+                g_free (base_name);
+                continue;
+            }
+
+            g_hash_table_add (seen, base_name);
+            g_ptr_array_add (names, base_name);
         }
+        g_strfreev (filenames);
+    }
+    g_strfreev (dirs);
+    g_hash_table_unref (seen);
+
+    g_ptr_array_sort (names, compare_names);
+    return names;
+}
+
+static void
+run_parse_job (ParseJob *job, gpointer user_data)
+{
+    job->item = job->parse (job->base_name);
+}
+
+static void
+parse_data_files (AgManager *manager, GArray *jobs)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    GThreadPool *pool = NULL;
+    guint i;
+
+    if (priv->parallel_loading && jobs->len > 1)
+    {
+        /* Make sure that libxml2 is initialized before it's used by more
+         * threads at once */
+        xmlInitParser ();
+        pool = g_thread_pool_new ((GFunc)run_parse_job, NULL,
+                                  MIN (g_get_num_processors (), jobs->len),
+                                  FALSE, NULL);
+    }
 
-        g_hash_table_insert (loaded_files, base_name, loaded_file);
+    if (pool == NULL)
+    {
+        for (i = 0; i < jobs->len; i++)
+            run_parse_job (&g_array_index (jobs, ParseJob, i), NULL);
+        return;
     }
 
-    g_dir_close (dir);
+    DEBUG_INFO ("Parsing %u files in parallel", jobs->len);
+    for (i = 0; i < jobs->len; i++)
+        g_thread_pool_push (pool, &g_array_index (jobs, ParseJob, i), NULL);
+
+    /* Wait for all the jobs to be done */
+    g_thread_pool_free (pool, FALSE, TRUE);
 }
 
 static GList *
-list_data_files (AgManager *manager,
-                 const gchar *suffix,
-                 const gchar *env_var,
-                 const gchar *subdir,
-                 AgDataFileLoadFunc load_file_func)
-{
-    GHashTable *loaded_files;
-    GList *file_list;
-    const gchar * const *dirs;
-    const gchar *env_dirname, *datadir;
-    gchar *dirname, *desktop_override = NULL;
-
-    loaded_files = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                          g_free, NULL);
-
-    env_dirname = g_getenv (env_var);
-    if (env_dirname)
-    {
-        add_data_files_from_dir (manager, env_dirname, loaded_files, suffix,
-                                 load_file_func);
-        /* If the environment variable is set, don't look in other places */
-        goto finish;
-    }
+list_data_files (AgManager *manager, const AgDataFileKind *kind)
+{
+    GPtrArray *names;
+    GArray *jobs;
+    GList *file_list = NULL;
+    gpointer *items;
+    guint i;
 
-    datadir = g_get_user_data_dir ();
-    if (G_LIKELY (datadir))
+    names = list_data_file_names (kind);
+    items = g_new0 (gpointer, names->len);
+
+    /* Only the files of the items which are not already known are parsed;
+     * the lookup and the merging of the parsed items happen on this thread,
+     * in the order of the names, so that the result doesn't depend on the
+     * order in which the parsing jobs complete. */
+    jobs = g_array_new (FALSE, TRUE, sizeof (ParseJob));
+    for (i = 0; i < names->len; i++)
     {
-        dirname = g_build_filename (datadir, subdir, NULL);
-        add_data_files_from_dir (manager, dirname, loaded_files, suffix,
-                                 load_file_func);
-        g_free (dirname);
+        const gchar *base_name = g_ptr_array_index (names, i);
+        ParseJob job;
+
+        if (kind->lookup != NULL)
+            items[i] = kind->lookup (manager, base_name);
+        if (items[i] != NULL) continue;
+
+        job.base_name = base_name;
+        job.parse = kind->parse;
+        job.item = NULL;
+        job.index = i;
+        g_array_append_val (jobs, job);
     }
 
-    /* Check what desktop is this running on */
-    env_dirname = g_getenv ("XDG_CURRENT_DESKTOP");
-    if (env_dirname)
-        desktop_override = g_ascii_strdown (env_dirname, -1);
+    parse_data_files (manager, jobs);
 
-    dirs = g_get_system_data_dirs ();
-    for (datadir = *dirs; datadir != NULL; dirs++, datadir = *dirs)
+    for (i = 0; i < jobs->len; i++)
     {
-        /* Check first if desktop override files exist and if yes, load them first */
-        if (desktop_override)
-        {
-            dirname = g_build_filename (datadir, subdir, desktop_override, NULL);
-            add_data_files_from_dir (manager, dirname, loaded_files, suffix,
-                                     load_file_func);
-            g_free (dirname);
-        }
+        ParseJob *job = &g_array_index (jobs, ParseJob, i);
 
-        dirname = g_build_filename (datadir, subdir, NULL);
-        add_data_files_from_dir (manager, dirname, loaded_files, suffix,
-                                 load_file_func);
-        g_free (dirname);
+        if (G_UNLIKELY (job->item == NULL)) continue;
+
+        items[job->index] = kind->adopt != NULL ?
+            kind->adopt (manager, job->item) : job->item;
     }
+    g_array_free (jobs, TRUE);
 
-finish:
-    file_list = g_hash_table_get_values (loaded_files);
-    g_hash_table_unref (loaded_files);
-    g_free (desktop_override);
+    for (i = names->len; i > 0; i--)
+    {
+        if (items[i - 1] != NULL)
+            file_list = g_list_prepend (file_list, items[i - 1]);
+    }
 
+    g_free (items);
+    g_ptr_array_free (names, TRUE);
     return file_list;
 }
 
@@ -443,36 +630,524 @@ ag_manager_get_application (AgManager *self, const gchar *application_name)
     return _ag_application_new_from_file (application_name);
 }
 
+static const AgDataFileKind application_files = {
+    ".application", "AG_APPLICATIONS", APPLICATION_FILES_DIR,
+    NULL, (AgDataFileParseFunc)_ag_application_new_from_file, NULL
+};
+
+static const AgDataFileKind provider_files = {
+    ".provider", "AG_PROVIDERS", PROVIDER_FILES_DIR,
+    NULL, (AgDataFileParseFunc)_ag_provider_new_from_file, NULL
+};
+
+/* When enumerating the services, only the data needed to identify and filter
+ * them is loaded */
+static const AgDataFileKind service_files = {
+    ".service", "AG_SERVICES", SERVICE_FILES_DIR,
+    (AgDataFileLookupFunc)lookup_service,
+    (AgDataFileParseFunc)_ag_service_new_from_header,
+    (AgDataFileAdoptFunc)adopt_service
+};
+
+static const AgDataFileKind service_type_files = {
+    ".service-type", "AG_SERVICE_TYPES", SERVICE_TYPE_FILES_DIR,
+    NULL, (AgDataFileParseFunc)_ag_service_type_new_from_file, NULL
+};
+
 static inline GList *
 _ag_applications_list (AgManager *self)
 {
-    return list_data_files (self, ".application",
-                            "AG_APPLICATIONS", APPLICATION_FILES_DIR,
-                            (AgDataFileLoadFunc)ag_manager_get_application);
+    return list_data_files (self, &application_files);
 }
 
 static inline GList *
 _ag_providers_list (AgManager *self)
 {
-    return list_data_files (self, ".provider",
-                            "AG_PROVIDERS", PROVIDER_FILES_DIR,
-                            (AgDataFileLoadFunc)ag_manager_get_provider);
+    return list_data_files (self, &provider_files);
 }
 
 static inline GList *
 _ag_services_list (AgManager *self)
 {
-    return list_data_files (self, ".service",
-                            "AG_SERVICES", SERVICE_FILES_DIR,
-                            (AgDataFileLoadFunc)ag_manager_get_service);
+    return list_data_files (self, &service_files);
 }
 
 static inline GList *
 _ag_service_types_list (AgManager *self)
 {
-    return list_data_files (self, ".service-type",
-                           "AG_SERVICE_TYPES", SERVICE_TYPE_FILES_DIR,
-                           (AgDataFileLoadFunc)ag_manager_load_service_type);
+    return list_data_files (self, &service_type_files);
+}
+
+static void
+ag_manager_catalog_free (AgManagerCatalog *catalog)
+{
+    g_hash_table_unref (catalog->services_by_name);
+    g_hash_table_unref (catalog->services_by_type);
+    g_hash_table_unref (catalog->services_by_provider);
+    g_ptr_array_unref (catalog->services);
+    if (catalog->applications_by_service)
+        g_hash_table_unref (catalog->applications_by_service);
+    if (catalog->applications)
+        g_ptr_array_unref (catalog->applications);
+    g_slice_free (AgManagerCatalog, catalog);
+}
+
+static inline GHashTable *
+catalog_index_new (void)
+{
+    return g_hash_table_new_full (g_str_hash, g_str_equal,
+                                  g_free, (GDestroyNotify)g_ptr_array_unref);
+}
+
+static void
+catalog_index_add (GHashTable *index, const gchar *key, gpointer item)
+{
+    GPtrArray *items;
+
+    if (key == NULL) return;
+
+    items = g_hash_table_lookup (index, key);
+    if (items == NULL)
+    {
+        items = g_ptr_array_new ();
+        g_hash_table_insert (index, g_strdup (key), items);
+    }
+    g_ptr_array_add (items, item);
+}
+
+static GList *
+catalog_index_lookup (GHashTable *index, const gchar *key,
+                      GBoxedCopyFunc ref_func)
+{
+    GPtrArray *items;
+    GList *list = NULL;
+    guint i;
+
+    items = g_hash_table_lookup (index, key);
+    if (items == NULL) return NULL;
+
+    for (i = items->len; i > 0; i--)
+        list = g_list_prepend (list, ref_func (g_ptr_array_index (items,
+                                                                  i - 1)));
+    return list;
+}
+
+static void
+catalog_index_remove (GHashTable *index, const gchar *key, gpointer item)
+{
+    GPtrArray *items;
+
+    if (key == NULL) return;
+
+    items = g_hash_table_lookup (index, key);
+    if (items == NULL) return;
+
+    g_ptr_array_remove (items, item);
+    if (items->len == 0)
+        g_hash_table_remove (index, key);
+}
+
+/* Takes ownership of @service */
+static void
+catalog_add_service (AgManagerCatalog *catalog, AgService *service)
+{
+    g_ptr_array_add (catalog->services, service);
+    g_hash_table_insert (catalog->services_by_name, service->name, service);
+    catalog_index_add (catalog->services_by_type,
+                       ag_service_get_service_type (service), service);
+    catalog_index_add (catalog->services_by_provider,
+                       ag_service_get_provider (service), service);
+}
+
+/* Drops the catalog's reference to @service */
+static void
+catalog_remove_service (AgManagerCatalog *catalog, AgService *service)
+{
+    g_hash_table_remove (catalog->services_by_name, service->name);
+    catalog_index_remove (catalog->services_by_type,
+                          ag_service_get_service_type (service), service);
+    catalog_index_remove (catalog->services_by_provider,
+                          ag_service_get_provider (service), service);
+    g_ptr_array_remove (catalog->services, service);
+}
+
+static void
+catalog_clear_applications (AgManagerCatalog *catalog)
+{
+    g_clear_pointer (&catalog->applications_by_service, g_hash_table_unref);
+    g_clear_pointer (&catalog->applications, g_ptr_array_unref);
+}
+
+static gchar *
+get_changed_data_file (GFile *file, GFileMonitorEvent event_type,
+                       const gchar *suffix)
+{
+    gchar *basename, *dirname, *path, *name = NULL;
+
+    /* Wait for the file to be completely written */
+    if (event_type != G_FILE_MONITOR_EVENT_CREATED &&
+        event_type != G_FILE_MONITOR_EVENT_DELETED &&
+        event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT)
+        return NULL;
+
+    basename = g_file_get_basename (file);
+    if (basename[0] != '.' && g_str_has_suffix (basename, suffix))
+    {
+        name = g_strndup (basename, strlen (basename) - strlen (suffix));
+
+        /* The directory index might not have been told yet */
+        path = g_file_get_path (file);
+        dirname = g_path_get_dirname (path);
+        _ag_catalog_invalidate (dirname);
+        g_free (dirname);
+        g_free (path);
+    }
+    g_free (basename);
+
+    return name;
+}
+
+static void
+update_service (AgManager *manager, const gchar *service_name)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    AgManagerCatalog *catalog;
+    AgService *old_service = NULL, *service = NULL;
+    gchar *filepath;
+
+    g_mutex_lock (&priv->cache_lock);
+    g_hash_table_remove (priv->services, service_name);
+    g_mutex_unlock (&priv->cache_lock);
+
+    /* Load only this service; a file in another directory might be hiding
+     * the changed one, or be uncovered by it */
+    filepath = _ag_find_libaccounts_file (service_name, ".service",
+                                          "AG_SERVICES", SERVICE_FILES_DIR,
+                                          NULL);
+    if (filepath != NULL)
+    {
+        service = get_service_header (manager, service_name);
+        g_free (filepath);
+    }
+
+    g_rec_mutex_lock (&priv->catalog_lock);
+    if (priv->notified_services == NULL)
+    {
+        /* Nobody has listed the services yet */
+        g_rec_mutex_unlock (&priv->catalog_lock);
+        if (service != NULL)
+            ag_service_unref (service);
+        return;
+    }
+
+    /* The catalog might have been rebuilt in the meantime, with or without
+     * the changed service */
+    catalog = priv->catalog;
+    if (catalog != NULL)
+    {
+        AgService *cataloged;
+
+        cataloged = g_hash_table_lookup (catalog->services_by_name,
+                                         service_name);
+        if (cataloged != NULL)
+            catalog_remove_service (catalog, cataloged);
+        if (service != NULL)
+            catalog_add_service (catalog, ag_service_ref (service));
+        if (cataloged != NULL || service != NULL)
+            catalog_clear_applications (catalog);
+    }
+
+    old_service = g_hash_table_lookup (priv->notified_services, service_name);
+    if (old_service != NULL)
+        ag_service_ref (old_service);
+    if (service != NULL)
+        g_hash_table_replace (priv->notified_services, service->name,
+                              ag_service_ref (service));
+    else
+        g_hash_table_remove (priv->notified_services, service_name);
+    g_rec_mutex_unlock (&priv->catalog_lock);
+
+    if (service != NULL && old_service == NULL)
+    {
+        DEBUG_INFO ("Service %s added", service_name);
+        g_signal_emit (manager, signals[SERVICE_ADDED], 0, service);
+    }
+    else if (service == NULL && old_service != NULL)
+    {
+        DEBUG_INFO ("Service %s removed", service_name);
+        g_signal_emit (manager, signals[SERVICE_REMOVED], 0, old_service);
+    }
+
+    if (service != NULL)
+        ag_service_unref (service);
+    if (old_service != NULL)
+        ag_service_unref (old_service);
+}
+
+static void
+on_services_dir_changed (GFileMonitor *monitor,
+                         GFile *file, GFile *other_file,
+                         GFileMonitorEvent event_type,
+                         AgManager *manager)
+{
+    gchar *service_name;
+
+    service_name = get_changed_data_file (file, event_type, ".service");
+    if (service_name == NULL) return;
+
+    update_service (manager, service_name);
+    g_free (service_name);
+}
+
+static void
+on_providers_dir_changed (GFileMonitor *monitor,
+                          GFile *file, GFile *other_file,
+                          GFileMonitorEvent event_type,
+                          AgManager *manager)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    gchar *provider_name;
+
+    provider_name = get_changed_data_file (file, event_type, ".provider");
+    if (provider_name == NULL) return;
+
+    /* The providers are reloaded on their next use */
+    g_mutex_lock (&priv->providers_lock);
+    g_clear_pointer (&priv->providers, g_ptr_array_unref);
+    g_mutex_unlock (&priv->providers_lock);
+
+    DEBUG_INFO ("Provider %s changed", provider_name);
+    g_signal_emit (manager, signals[PROVIDER_CHANGED], 0, provider_name);
+    g_free (provider_name);
+}
+
+static void
+on_applications_dir_changed (GFileMonitor *monitor,
+                             GFile *file, GFile *other_file,
+                             GFileMonitorEvent event_type,
+                             AgManager *manager)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    gchar *application_name;
+
+    application_name = get_changed_data_file (file, event_type,
+                                              ".application");
+    if (application_name == NULL) return;
+
+    /* The applications are reloaded on their next use */
+    g_rec_mutex_lock (&priv->catalog_lock);
+    if (priv->catalog != NULL)
+        catalog_clear_applications (priv->catalog);
+    g_rec_mutex_unlock (&priv->catalog_lock);
+    g_free (application_name);
+}
+
+/* Must be called with the catalog lock held */
+static void
+stop_watching_data_dirs (AgManager *manager)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    guint i;
+
+    if (priv->dir_monitors == NULL) return;
+
+    for (i = 0; i < priv->dir_monitors->len; i++)
+    {
+        GFileMonitor *monitor = g_ptr_array_index (priv->dir_monitors, i);
+
+        g_signal_handlers_disconnect_by_data (monitor, manager);
+        g_file_monitor_cancel (monitor);
+    }
+    g_clear_pointer (&priv->dir_monitors, g_ptr_array_unref);
+}
+
+static void
+watch_data_dirs (AgManager *manager)
+{
+    static const struct {
+        const gchar *env_var;
+        const gchar *subdir;
+        GCallback callback;
+    } kinds[] = {
+        { "AG_SERVICES", SERVICE_FILES_DIR,
+            G_CALLBACK (on_services_dir_changed) },
+        { "AG_PROVIDERS", PROVIDER_FILES_DIR,
+            G_CALLBACK (on_providers_dir_changed) },
+        { "AG_APPLICATIONS", APPLICATION_FILES_DIR,
+            G_CALLBACK (on_applications_dir_changed) },
+    };
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    GError *error = NULL;
+    guint i;
+
+    g_rec_mutex_lock (&priv->catalog_lock);
+    if (priv->dir_monitors != NULL)
+    {
+        g_rec_mutex_unlock (&priv->catalog_lock);
+        return;
+    }
+
+    priv->dir_monitors = g_ptr_array_new_with_free_func (g_object_unref);
+    for (i = 0; i < G_N_ELEMENTS (kinds); i++)
+    {
+        gchar **dirs, **dirname;
+
+        dirs = _ag_get_data_dirs (kinds[i].env_var, kinds[i].subdir);
+        for (dirname = dirs; *dirname != NULL; dirname++)
+        {
+            GFileMonitor *monitor;
+            GFile *file;
+
+            file = g_file_new_for_path (*dirname);
+            monitor = g_file_monitor_directory (file, G_FILE_MONITOR_NONE,
+                                                NULL, &error);
+            g_object_unref (file);
+            if (G_UNLIKELY (monitor == NULL))
+            {
+                DEBUG_INFO ("Cannot monitor %s: %s", *dirname,
+                            error->message);
+                g_clear_error (&error);
+                g_strfreev (dirs);
+                /* Fall back to checking the directory index */
+                stop_watching_data_dirs (manager);
+                g_rec_mutex_unlock (&priv->catalog_lock);
+                return;
+            }
+
+            g_signal_connect (monitor, "changed", kinds[i].callback,
+                              manager);
+            g_ptr_array_add (priv->dir_monitors, monitor);
+        }
+        g_strfreev (dirs);
+    }
+    g_rec_mutex_unlock (&priv->catalog_lock);
+}
+
+/* Must be called with the catalog lock held; the catalog can only be used
+ * until the lock is released. */
+static AgManagerCatalog *
+get_catalog (AgManager *manager)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    AgManagerCatalog *catalog;
+    GList *services, *list;
+    guint generation, i;
+
+    /* The file monitors might not have reported all the changes yet */
+    generation = _ag_catalog_get_generation ();
+    if (priv->catalog != NULL && priv->catalog->generation == generation)
+        return priv->catalog;
+
+    DEBUG_INFO ("Building catalog, generation %u", generation);
+    g_clear_pointer (&priv->catalog, ag_manager_catalog_free);
+
+    catalog = g_slice_new0 (AgManagerCatalog);
+    catalog->generation = generation;
+    catalog->services_by_name = g_hash_table_new (g_str_hash, g_str_equal);
+    catalog->services_by_type = catalog_index_new ();
+    catalog->services_by_provider = catalog_index_new ();
+
+    /* Start watching before listing, not to miss any change */
+    watch_data_dirs (manager);
+
+    services = _ag_services_list (manager);
+    catalog->services =
+        g_ptr_array_new_full (g_list_length (services),
+                              (GDestroyNotify)ag_service_unref);
+    for (list = services; list != NULL; list = list->next)
+        catalog_add_service (catalog, list->data);
+    g_list_free (services);
+
+    /* From now on, the changes of the files are notified */
+    if (priv->notified_services == NULL && priv->dir_monitors != NULL)
+    {
+        priv->notified_services =
+            g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                   (GDestroyNotify)ag_service_unref);
+        for (i = 0; i < catalog->services->len; i++)
+        {
+            AgService *service = g_ptr_array_index (catalog->services, i);
+            g_hash_table_insert (priv->notified_services, service->name,
+                                 ag_service_ref (service));
+        }
+    }
+
+    priv->catalog = catalog;
+    return catalog;
+}
+
+/* Like get_catalog(), with the applications index built too */
+static AgManagerCatalog *
+get_catalog_with_applications (AgManager *manager)
+{
+    AgManagerCatalog *catalog;
+    GList *applications, *list;
+    guint i;
+
+    catalog = get_catalog (manager);
+    if (catalog->applications != NULL)
+        return catalog;
+
+    catalog->applications_by_service = catalog_index_new ();
+
+    applications = _ag_applications_list (manager);
+    catalog->applications =
+        g_ptr_array_new_full (g_list_length (applications),
+                              (GDestroyNotify)ag_application_unref);
+    for (list = applications; list != NULL; list = list->next)
+    {
+        AgApplication *application = list->data;
+
+        g_ptr_array_add (catalog->applications, application);
+        for (i = 0; i < catalog->services->len; i++)
+        {
+            AgService *service = g_ptr_array_index (catalog->services, i);
+
+            if (ag_application_supports_service (application, service))
+                catalog_index_add (catalog->applications_by_service,
+                                   service->name, application);
+        }
+    }
+    g_list_free (applications);
+
+    return catalog;
+}
+
+/* Lists the services of @provider_name; if @service_type is not %NULL, only
+ * the services of that type are listed. */
+GList *
+_ag_manager_list_services_by_provider (AgManager *manager,
+                                       const gchar *provider_name,
+                                       const gchar *service_type)
+{
+    AgManagerPrivate *priv;
+    AgManagerCatalog *catalog;
+    GPtrArray *services;
+    GList *list = NULL;
+    guint i;
+
+    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
+    g_return_val_if_fail (provider_name != NULL, NULL);
+    priv = ag_manager_get_instance_private (manager);
+
+    g_rec_mutex_lock (&priv->catalog_lock);
+    catalog = get_catalog (manager);
+    services = g_hash_table_lookup (catalog->services_by_provider,
+                                    provider_name);
+    for (i = services != NULL ? services->len : 0; i > 0; i--)
+    {
+        AgService *service = g_ptr_array_index (services, i - 1);
+
+        if (service_type != NULL &&
+            g_strcmp0 (ag_service_get_service_type (service),
+                       service_type) != 0)
+            continue;
+
+        list = g_list_prepend (list, ag_service_ref (service));
+    }
+    g_rec_mutex_unlock (&priv->catalog_lock);
+
+    return list;
 }
 
 static GList *
@@ -480,20 +1155,30 @@ get_account_services_from_accounts (AgManager *manager,
                                     GList *account_ids,
                                     gboolean enabled_only)
 {
-    GList *ret = NULL, *account_list;
+    GList *ret = NULL, *accounts, *account_list;
+    GArray *ids;
 
+    ids = g_array_new (FALSE, FALSE, sizeof (AgAccountId));
     for (account_list = account_ids;
          account_list != NULL;
          account_list = account_list->next)
     {
-        AgAccount *account;
-        GList *service_ids, *service_elem;
+        AgAccountId id = GPOINTER_TO_UINT (account_list->data);
+        g_array_append_val (ids, id);
+    }
 
-        account = ag_manager_get_account (manager,
-                                          (AgAccountId)
-                                          GPOINTER_TO_UINT(account_list->data));
-        if (G_UNLIKELY (account == NULL))
-            continue;
+    /* The AgAccountService objects need the settings of all the services */
+    accounts = ag_manager_load_accounts (manager,
+                                         (AgAccountId *)ids->data, ids->len,
+                                         AG_ACCOUNT_LOAD_SETTINGS, NULL);
+    g_array_free (ids, TRUE);
+
+    for (account_list = accounts;
+         account_list != NULL;
+         account_list = account_list->next)
+    {
+        AgAccount *account = account_list->data;
+        GList *service_ids, *service_elem;
 
         service_ids = enabled_only ?
             ag_account_list_enabled_services (account) :
@@ -513,20 +1198,20 @@ get_account_services_from_accounts (AgManager *manager,
         }
 
         ag_service_list_free (service_ids);
-        g_object_unref (account);
     }
 
+    g_list_free_full (accounts, g_object_unref);
     return ret;
 }
 
 static void
-set_error_from_db (AgManager *manager)
+set_error_from_db (AgManager *manager, sqlite3 *db)
 {
     AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
     AgAccountsError code;
     GError *error;
 
-    switch (sqlite3_errcode (priv->db))
+    switch (sqlite3_errcode (db))
     {
     case SQLITE_DONE:
     case SQLITE_OK:
@@ -543,8 +1228,8 @@ set_error_from_db (AgManager *manager)
     }
 
     error = g_error_new (AG_ACCOUNTS_ERROR, code, "SQLite error %d: %s",
-                         sqlite3_errcode (priv->db),
-                         sqlite3_errmsg (priv->db));
+                         sqlite3_errcode (db),
+                         sqlite3_errmsg (db));
     _ag_manager_take_error (manager, error);
 }
 
@@ -687,7 +1372,7 @@ dbus_filter_callback (G_GNUC_UNUSED GDBusConnection *dbus_conn,
     AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
     const gchar *provider_name = NULL;
     AgAccountId account_id = 0;
-    AgAccount *account;
+    AgAccount *account = NULL, *new_account;
     AgAccountChanges *changes;
     struct timespec ts;
     gboolean deleted, created;
@@ -763,8 +1448,7 @@ dbus_filter_callback (G_GNUC_UNUSED GDBusConnection *dbus_conn,
                                              created, deleted);
 
     /* check if the account is loaded */
-    account = g_hash_table_lookup (priv->accounts,
-                                   GUINT_TO_POINTER (account_id));
+    account = lookup_account (manager, account_id);
 
     if (!account && !created && !deleted)
         must_instantiate = FALSE;
@@ -778,18 +1462,18 @@ dbus_filter_callback (G_GNUC_UNUSED GDBusConnection *dbus_conn,
          * created or deleted from another instance.
          * We must emit the signals, and cache the newly created account for a
          * while, because the application is likely to inspect it */
-        account = g_initable_new (AG_TYPE_ACCOUNT, NULL, NULL,
-                                  "manager", manager,
-                                  "provider", provider_name,
-                                  "id", account_id,
-                                  "foreign", created,
-                                  NULL);
-        g_return_if_fail (AG_IS_ACCOUNT (account));
-
-        g_object_weak_ref (G_OBJECT (account), account_weak_notify, manager);
-        g_hash_table_insert (priv->accounts, GUINT_TO_POINTER (account_id),
-                             account);
-        g_timeout_add_seconds (2, timed_unref_account, account);
+        new_account = g_initable_new (AG_TYPE_ACCOUNT, NULL, NULL,
+                                      "manager", manager,
+                                      "provider", provider_name,
+                                      "id", account_id,
+                                      "foreign", created,
+                                      NULL);
+        g_return_if_fail (AG_IS_ACCOUNT (new_account));
+
+        account = cache_account (manager, new_account);
+        g_object_unref (new_account);
+        g_timeout_add_seconds (2, timed_unref_account,
+                               g_object_ref (account));
     }
 
     if (changes)
@@ -809,6 +1493,7 @@ dbus_filter_callback (G_GNUC_UNUSED GDBusConnection *dbus_conn,
                              deleted);
 
 skip_processing:
+    g_clear_object (&account);
     g_variant_unref (v_services);
 }
 
@@ -875,7 +1560,6 @@ signal_account_changes (AgManager *manager, AgAccount *account,
     /* emit the signal on all service-types */
     signal_account_changes_on_service_types(manager, changes, msg);
 
-    g_dbus_connection_flush_sync (priv->dbus_conn, NULL, NULL);
     DEBUG_INFO ("Emitted signal, time: %lu-%lu", eds.ts.tv_sec, eds.ts.tv_nsec);
 
     eds.must_process = FALSE;
@@ -886,7 +1570,17 @@ signal_account_changes (AgManager *manager, AgAccount *account,
     g_variant_unref (msg);
 }
 
-static gboolean
+/* Sends the D-Bus signals emitted by signal_account_changes() */
+static void
+flush_account_changes (AgManager *manager)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+
+    if (G_LIKELY (priv->use_dbus))
+        g_dbus_connection_flush_sync (priv->dbus_conn, NULL, NULL);
+}
+
+static gboolean
 got_service (sqlite3_stmt *stmt, AgService **p_service)
 {
     AgService *service;
@@ -899,44 +1593,125 @@ got_service (sqlite3_stmt *stmt, AgService **p_service)
     service->provider = g_strdup ((gchar *)sqlite3_column_text (stmt, 2));
     service->type = g_strdup ((gchar *)sqlite3_column_text (stmt, 3));
 
+    /* The default settings, if the DB has them */
+    if (sqlite3_column_count (stmt) > 5 &&
+        sqlite3_column_type (stmt, 4) == SQLITE_BLOB)
+    {
+        GBytes *bytes;
+
+        bytes = g_bytes_new (sqlite3_column_blob (stmt, 4),
+                             sqlite3_column_bytes (stmt, 4));
+        service->stored_defaults =
+            g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE_VARDICT,
+                                                          bytes, FALSE));
+        service->stored_defaults_mtime = sqlite3_column_int64 (stmt, 5);
+        g_bytes_unref (bytes);
+    }
+
     *p_service = service;
     return TRUE;
 }
 
-static gboolean
-got_service_id (sqlite3_stmt *stmt, AgService *service)
+static void
+remember_service_id (AgManagerPrivate *priv, const gchar *service_name,
+                     gint service_id)
 {
-    g_assert (service != NULL);
+    g_mutex_lock (&priv->cache_lock);
+    g_hash_table_insert (priv->service_ids, g_strdup (service_name),
+                         GINT_TO_POINTER (service_id));
+    g_mutex_unlock (&priv->cache_lock);
+}
 
-    service->id = sqlite3_column_int (stmt, 0);
+static gboolean
+got_service_id (sqlite3_stmt *stmt, AgManagerPrivate *priv)
+{
+    sqlite3_int64 service_id;
+
+    service_id = sqlite3_column_int64 (stmt, 0);
+    g_mutex_lock (&priv->cache_lock);
+    g_hash_table_insert (priv->service_ids,
+                         g_strdup ((gchar *)sqlite3_column_text (stmt, 1)),
+                         GINT_TO_POINTER ((gint)service_id));
+    /* The IDs are never reused, so the rows added later have higher IDs */
+    if (service_id > priv->last_service_id)
+        priv->last_service_id = service_id;
+    g_mutex_unlock (&priv->cache_lock);
     return TRUE;
 }
 
+/* Reads the IDs of the services added to the DB since the last time */
+static void
+refresh_service_ids (AgManager *manager)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    sqlite3_int64 last_service_id;
+
+    g_mutex_lock (&priv->cache_lock);
+    last_service_id = priv->last_service_id;
+    g_mutex_unlock (&priv->cache_lock);
+
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)got_service_id, priv,
+                               "SELECT id, name FROM Services WHERE id > ?",
+                               "x", last_service_id);
+}
+
+/* Returns the ID of @service_name in the DB, or 0 if it is not known; if
+ * @refresh is %TRUE, the services added to the DB by other processes are
+ * looked up too */
+static gint
+lookup_service_id (AgManager *manager, const gchar *service_name,
+                   gboolean refresh)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    gint service_id;
+
+    g_mutex_lock (&priv->cache_lock);
+    service_id = GPOINTER_TO_INT (g_hash_table_lookup (priv->service_ids,
+                                                       service_name));
+    g_mutex_unlock (&priv->cache_lock);
+    if (service_id != 0 || !refresh) return service_id;
+
+    refresh_service_ids (manager);
+
+    g_mutex_lock (&priv->cache_lock);
+    service_id = GPOINTER_TO_INT (g_hash_table_lookup (priv->service_ids,
+                                                       service_name));
+    g_mutex_unlock (&priv->cache_lock);
+    return service_id;
+}
+
 static gboolean
 add_service_to_db (AgManager *manager, AgService *service)
 {
-    gchar *sql;
-
-    /* Add the service to the DB */
-    sql = sqlite3_mprintf ("INSERT INTO Services "
-                           "(name, display, provider, type) "
-                           "VALUES (%Q, %Q, %Q, %Q);",
-                           service->name,
-                           service->display_name,
-                           service->provider,
-                           service->type);
-    _ag_manager_exec_query (manager, NULL, NULL, sql);
-    sqlite3_free (sql);
-
-    /* The insert statement above might fail in the unlikely case
-     * that in the meantime the same service was inserted by some other
-     * process; so, instead of calling sqlite3_last_insert_rowid(), we
-     * just get the ID with another query. */
-    sql = sqlite3_mprintf ("SELECT id FROM Services WHERE name = %Q",
-                           service->name);
-    _ag_manager_exec_query (manager, (AgQueryCallback)got_service_id,
-                            service, sql);
-    sqlite3_free (sql);
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    gint rows;
+
+    /* Add the service to the DB; the main connection is locked, so that
+     * nothing else can run on it before we read the ID */
+    g_rec_mutex_lock (&priv->main_lock);
+    rows = exec_write (manager,
+                       "INSERT OR IGNORE INTO Services "
+                       "(name, display, provider, type) "
+                       "VALUES (?, ?, ?, ?);",
+                       "ssss",
+                       service->name,
+                       service->display_name,
+                       service->provider,
+                       service->type);
+    if (rows >= 0 && sqlite3_changes (priv->db) == 1)
+        service->id = sqlite3_last_insert_rowid (priv->db);
+    g_rec_mutex_unlock (&priv->main_lock);
+
+    if (service->id != 0)
+    {
+        remember_service_id (priv, service->name, service->id);
+    }
+    else
+    {
+        /* In the unlikely case that in the meantime the same service was
+         * inserted by some other process, the row was left untouched */
+        service->id = lookup_service_id (manager, service->name, TRUE);
+    }
 
     return service->id != 0;
 }
@@ -952,91 +1727,94 @@ add_id_to_list (sqlite3_stmt *stmt, GList **plist)
 }
 
 static void
-account_weak_notify (gpointer userdata, GObject *dead_account)
+account_ref_free (GWeakRef *ref)
 {
-    AgManagerPrivate *priv = ag_manager_get_instance_private (AG_MANAGER (userdata));
-    GHashTableIter iter;
-    GObject *account;
+    g_weak_ref_clear (ref);
+    g_slice_free (GWeakRef, ref);
+}
 
-    DEBUG_REFS ("called for %p", dead_account);
-    g_hash_table_iter_init (&iter, priv->accounts);
-    while (g_hash_table_iter_next (&iter, NULL, (gpointer)&account))
+/* Returns a new reference to the loaded account with ID @account_id, or
+ * %NULL; a GWeakRef is used, because another thread might be dropping the
+ * last reference to the account. */
+static AgAccount *
+lookup_account (AgManager *manager, AgAccountId account_id)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    AgAccount *account = NULL;
+    GWeakRef *ref;
+
+    g_mutex_lock (&priv->cache_lock);
+    ref = g_hash_table_lookup (priv->accounts, GUINT_TO_POINTER (account_id));
+    if (ref != NULL)
     {
-        if (account == dead_account)
+        account = g_weak_ref_get (ref);
+        /* Drop the entries of the accounts which have been finalized */
+        if (account == NULL)
         {
-            g_hash_table_iter_steal (&iter);
-            break;
+            DEBUG_REFS ("account %u was finalized", account_id);
+            g_hash_table_remove (priv->accounts,
+                                 GUINT_TO_POINTER (account_id));
         }
     }
+    g_mutex_unlock (&priv->cache_lock);
+
+    return account;
 }
 
-static void
-account_weak_unref (GObject *account)
+/* Adds @account to the loaded accounts, unless another thread loaded the
+ * same account in the meantime; returns a new reference to the account
+ * which is in the cache. */
+static AgAccount *
+cache_account (AgManager *manager, AgAccount *account)
 {
-    g_object_weak_unref (account, account_weak_notify,
-                         ag_account_get_manager (AG_ACCOUNT (account)));
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    AgAccount *cached = NULL;
+    GWeakRef *ref;
+
+    g_mutex_lock (&priv->cache_lock);
+    ref = g_hash_table_lookup (priv->accounts, GUINT_TO_POINTER (account->id));
+    if (ref != NULL)
+        cached = g_weak_ref_get (ref);
+
+    if (cached == NULL)
+    {
+        ref = g_slice_new (GWeakRef);
+        g_weak_ref_init (ref, account);
+        g_hash_table_insert (priv->accounts, GUINT_TO_POINTER (account->id),
+                             ref);
+        cached = g_object_ref (account);
+    }
+    g_mutex_unlock (&priv->cache_lock);
+
+    return cached;
 }
 
 /*
- * exec_transaction:
+ * complete_transaction:
  *
- * Executes a transaction, assuming that the exclusive lock has been obtained.
+ * Updates the account and notifies the changes, after the transaction which
+ * stored them has been committed. The D-Bus signals must then be sent with
+ * flush_account_changes().
  */
 static void
-exec_transaction (AgManager *manager, AgAccount *account,
-                  const gchar *sql, AgAccountChanges *changes,
-                  GError **error)
+complete_transaction (AgManager *manager, AgAccount *account,
+                      AgAccountChanges *changes, sqlite3_int64 account_id)
 {
     AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
-    gchar *err_msg = NULL;
-    int ret;
     gboolean updated, enabled;
 
-    DEBUG_LOCKS ("Accounts DB is now locked");
-    DEBUG_QUERIES ("called: %s", sql);
     g_return_if_fail (AG_IS_MANAGER (manager));
     g_return_if_fail (AG_IS_ACCOUNT (account));
-    g_return_if_fail (sql != NULL);
-    g_return_if_fail (priv->db != NULL);
-
-    ret = sqlite3_exec (priv->db, sql, NULL, NULL, &err_msg);
-    if (G_UNLIKELY (ret != SQLITE_OK))
-    {
-        *error = g_error_new (AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB, "%s",
-                              err_msg);
-        if (err_msg)
-            sqlite3_free (err_msg);
-
-        ret = sqlite3_step (priv->rollback_stmt);
-        if (G_UNLIKELY (ret != SQLITE_OK))
-            g_warning ("Rollback failed");
-        sqlite3_reset (priv->rollback_stmt);
-        DEBUG_LOCKS ("Accounts DB is now unlocked");
-        return;
-    }
-
-    ret = sqlite3_step (priv->commit_stmt);
-    if (G_UNLIKELY (ret != SQLITE_DONE))
-    {
-        *error = g_error_new_literal (AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
-                                      sqlite3_errmsg (priv->db));
-        sqlite3_reset (priv->commit_stmt);
-        return;
-    }
-    sqlite3_reset (priv->commit_stmt);
-
-    DEBUG_LOCKS ("Accounts DB is now unlocked");
 
     /* everything went well; if this was a new account, we must update the
      * local data structure */
     if (account->id == 0)
     {
-        account->id = priv->last_account_id;
+        account->id = account_id;
 
-        /* insert the account into our cache */
-        g_object_weak_ref (G_OBJECT (account), account_weak_notify, manager);
-        g_hash_table_insert (priv->accounts, GUINT_TO_POINTER (account->id),
-                             account);
+        /* insert the account into our cache; being new, no other thread
+         * can have loaded it */
+        g_object_unref (cache_account (manager, account));
     }
 
     if (G_LIKELY (priv->use_dbus))
@@ -1060,51 +1838,14 @@ exec_transaction (AgManager *manager, AgAccount *account,
 static void
 store_cb_data_free (StoreCbData *sd)
 {
-    if (sd->id)
-        g_source_remove (sd->id);
-    g_free (sd->sql);
     g_slice_free (StoreCbData, sd);
 }
 
-static gboolean
-exec_transaction_idle (StoreCbData *sd)
+static void
+on_transaction_done (const sqlite3_int64 *account_ids, GError *error,
+                     StoreCbData *sd)
 {
-    AgManager *manager = sd->manager;
-    AgAccount *account = sd->account;
-    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);;
-    GError *error = NULL;
-    int ret;
-
-    g_return_val_if_fail (AG_IS_MANAGER (manager), FALSE);
-
-    g_object_ref (manager);
-    g_object_ref (account);
-
-    /* If the operation was cancelled, abort it. */
-    if (g_task_return_error_if_cancelled (sd->task))
-    {
-        goto finish;
-    }
-
-    g_return_val_if_fail (priv->begin_stmt != NULL, FALSE);
-    ret = sqlite3_step (priv->begin_stmt);
-    if (ret == SQLITE_BUSY)
-    {
-        sched_yield ();
-        g_object_unref (account);
-        g_object_unref (manager);
-        return TRUE; /* call this callback again */
-    }
-
-    if (ret == SQLITE_DONE)
-    {
-        exec_transaction (manager, account, sd->sql, sd->changes, &error);
-    }
-    else
-    {
-        error = g_error_new_literal (AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
-                                     "Generic error");
-    }
+    AgManagerPrivate *priv = ag_manager_get_instance_private (sd->manager);
 
     if (error != NULL)
     {
@@ -1112,113 +1853,254 @@ exec_transaction_idle (StoreCbData *sd)
     }
     else
     {
+        if (G_LIKELY (!priv->is_disposed))
+        {
+            /* No script is run if there was nothing to store */
+            complete_transaction (sd->manager, sd->account, sd->changes,
+                                  account_ids != NULL ?
+                                  account_ids[0] : sd->account->id);
+            flush_account_changes (sd->manager);
+        }
         g_task_return_boolean (sd->task, TRUE);
     }
 
-finish:
-    _ag_account_store_completed (account, sd->changes);
-
-    priv->locks = g_list_remove (priv->locks, sd);
-    sd->id = 0;
+    _ag_account_store_completed (sd->account, sd->changes);
     store_cb_data_free (sd);
-    g_object_unref (account);
-    g_object_unref (manager);
-    return FALSE;
 }
 
-static int
-prepare_transaction_statements (AgManagerPrivate *priv)
+static void
+setup_db_options (sqlite3 *db)
 {
+    gchar *error;
     int ret;
 
-    if (G_UNLIKELY (!priv->begin_stmt))
+    error = NULL;
+    ret = sqlite3_exec (db, "PRAGMA synchronous = 1", NULL, NULL, &error);
+    if (ret != SQLITE_OK)
     {
-        ret = sqlite3_prepare_v2 (priv->db, "BEGIN EXCLUSIVE;", -1,
-                                  &priv->begin_stmt, NULL);
-        if (ret != SQLITE_OK) return ret;
+        g_warning ("%s: couldn't set synchronous mode (%s)",
+                   G_STRFUNC, error);
+        sqlite3_free (error);
     }
-    else
-        sqlite3_reset (priv->begin_stmt);
 
-    if (G_UNLIKELY (!priv->commit_stmt))
+    error = NULL;
+    ret = sqlite3_exec (db, "PRAGMA journal_mode = " JOURNAL_MODE, NULL, NULL,
+                        &error);
+    if (ret != SQLITE_OK)
     {
-        ret = sqlite3_prepare_v2 (priv->db, "COMMIT;", -1,
-                                  &priv->commit_stmt, NULL);
-        if (ret != SQLITE_OK) return ret;
+        g_warning ("%s: couldn't set journal mode to " JOURNAL_MODE " (%s)",
+                   G_STRFUNC, error);
+        sqlite3_free (error);
     }
-    else
-        sqlite3_reset (priv->commit_stmt);
+}
+
+/* Returns the writer, opening its DB connection if needed */
+static AgDbWriter *
+get_writer (AgManager *manager, GError **error)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    sqlite3 *db = NULL;
+    int ret;
+
+    if (G_LIKELY (g_atomic_pointer_get (&priv->writer) != NULL))
+        return priv->writer;
 
-    if (G_UNLIKELY (!priv->rollback_stmt))
+    /* Queries can store data too, from any thread */
+    g_rec_mutex_lock (&priv->main_lock);
+    if (priv->writer != NULL) goto finish;
+
+    ret = sqlite3_open_v2 (sqlite3_db_filename (priv->db, "main"), &db,
+                           SQLITE_OPEN_READWRITE, NULL);
+    if (G_UNLIKELY (ret != SQLITE_OK))
     {
-        ret = sqlite3_prepare_v2 (priv->db, "ROLLBACK;", -1,
-                                  &priv->rollback_stmt, NULL);
-        if (ret != SQLITE_OK) return ret;
+        g_set_error (error, AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
+                     "Error opening accounts DB: %s",
+                     db != NULL ? sqlite3_errmsg (db) : "out of memory");
+        sqlite3_close (db);
+        goto finish;
     }
-    else
-        sqlite3_reset (priv->rollback_stmt);
 
-    return SQLITE_OK;
+    setup_db_options (db);
+    g_atomic_pointer_set (&priv->writer, _ag_db_writer_new (db, priv->db_lock));
+    if (G_UNLIKELY (priv->writer == NULL))
+        g_set_error_literal (error, AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
+                             "Couldn't set up the accounts DB for writing");
+
+finish:
+    g_rec_mutex_unlock (&priv->main_lock);
+    return priv->writer;
 }
 
-static void
-set_last_rowid_as_account_id (sqlite3_context *ctx,
-                              G_GNUC_UNUSED int argc,
-                              G_GNUC_UNUSED sqlite3_value **argv)
+/* Instead of polling, wait for the DB lock to be released, for at most
+ * db_timeout milliseconds */
+static int
+busy_handler (gpointer user_data, int count)
 {
-    AgManagerPrivate *priv;
+    DbConnection *conn = user_data;
+    AgManagerPrivate *priv = conn->priv;
+    gint64 end_time;
+
+    if (count == 0)
+        conn->busy_since = g_get_monotonic_time ();
+
+    end_time = conn->busy_since + priv->db_timeout * G_TIME_SPAN_MILLISECOND;
+    if (g_get_monotonic_time () >= end_time) return 0;
 
-    priv = sqlite3_user_data (ctx);
-    priv->last_account_id = sqlite3_last_insert_rowid (priv->db);
-    sqlite3_result_null (ctx);
+    DEBUG_LOCKS ("Database locked, waiting...");
+    _ag_db_lock_wait (priv->db_lock, end_time, NULL);
+    return 1;
 }
 
 static void
-get_account_id (sqlite3_context *ctx,
-                G_GNUC_UNUSED int argc,
-                G_GNUC_UNUSED sqlite3_value **argv)
+db_connection_init (DbConnection *conn, AgManagerPrivate *priv, sqlite3 *db)
 {
-    AgManagerPrivate *priv;
-
-    priv = sqlite3_user_data (ctx);
-    sqlite3_result_int64 (ctx, priv->last_account_id);
+    conn->priv = priv;
+    conn->db = db;
+    conn->statements =
+        g_hash_table_new_full (g_str_hash, g_str_equal,
+                               g_free, (GDestroyNotify)sqlite3_finalize);
+    sqlite3_busy_handler (db, busy_handler, conn);
 }
 
+/* Finalizes the statements; the DB connection is not closed */
 static void
-create_functions (AgManagerPrivate *priv)
+db_connection_clear (DbConnection *conn)
 {
-    sqlite3_create_function (priv->db, "set_last_rowid_as_account_id", 0,
-                             SQLITE_ANY, priv,
-                             set_last_rowid_as_account_id, NULL, NULL);
-    sqlite3_create_function (priv->db, "account_id", 0,
-                             SQLITE_ANY, priv,
-                             get_account_id, NULL, NULL);
+    g_clear_pointer (&conn->statements, g_hash_table_unref);
 }
 
 static void
-setup_db_options (sqlite3 *db)
+db_connection_free (DbConnection *conn)
 {
-    gchar *error;
+    db_connection_clear (conn);
+    if (sqlite3_close (conn->db) != SQLITE_OK)
+        g_warning ("Failed to close database: %s", sqlite3_errmsg (conn->db));
+    g_slice_free (DbConnection, conn);
+}
+
+/* Opens a read-only connection to the DB; in WAL mode, it can read while
+ * the other connections are reading or writing. */
+static DbConnection *
+open_reader (AgManager *manager)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    DbConnection *conn;
+    sqlite3 *db = NULL;
     int ret;
 
-    error = NULL;
-    ret = sqlite3_exec (db, "PRAGMA synchronous = 1", NULL, NULL, &error);
-    if (ret != SQLITE_OK)
+    ret = sqlite3_open_v2 (sqlite3_db_filename (priv->db, "main"), &db,
+                           SQLITE_OPEN_READONLY, NULL);
+    if (G_UNLIKELY (ret != SQLITE_OK))
     {
-        g_warning ("%s: couldn't set synchronous mode (%s)",
-                   G_STRFUNC, error);
-        sqlite3_free (error);
+        g_warning ("Error opening accounts DB for reading: %s",
+                   db != NULL ? sqlite3_errmsg (db) : "out of memory");
+        sqlite3_close (db);
+        return NULL;
+    }
+
+    DEBUG_INFO ("Opened reader %u", priv->readers->len + 1);
+    conn = g_slice_new0 (DbConnection);
+    db_connection_init (conn, priv, db);
+    return conn;
+}
+
+/* Returns the connection on which the calling thread can run a query, which
+ * must be released with release_connection(). If the thread is already
+ * running a query (that is, we are called from its callback), its
+ * connection is returned again. */
+static DbConnection *
+acquire_connection (AgManager *manager)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    DbConnection *conn, *free_conn;
+    GThread *self = g_thread_self ();
+    guint i;
+
+    /* Without WAL, readers would block the writes: just use one connection */
+    if (!USE_WAL) goto use_main_conn;
+
+    g_mutex_lock (&priv->readers_lock);
+    for (;;)
+    {
+        conn = free_conn = NULL;
+        for (i = 0; i < priv->readers->len; i++)
+        {
+            DbConnection *reader = g_ptr_array_index (priv->readers, i);
+
+            if (reader->owner == self)
+            {
+                conn = reader;
+                break;
+            }
+            if (reader->owner == NULL && free_conn == NULL)
+                free_conn = reader;
+        }
+
+        if (conn == NULL)
+            conn = free_conn;
+        if (conn == NULL && priv->readers->len < MAX_READERS)
+        {
+            conn = open_reader (manager);
+            if (conn != NULL)
+                g_ptr_array_add (priv->readers, conn);
+        }
+        if (conn != NULL) break;
+
+        if (priv->readers->len == 0)
+        {
+            g_mutex_unlock (&priv->readers_lock);
+            goto use_main_conn;
+        }
+        g_cond_wait (&priv->readers_cond, &priv->readers_lock);
+    }
+
+    conn->owner = self;
+    conn->depth++;
+    g_mutex_unlock (&priv->readers_lock);
+    return conn;
+
+use_main_conn:
+    g_rec_mutex_lock (&priv->main_lock);
+    return &priv->main_conn;
+}
+
+static void
+release_connection (AgManager *manager, DbConnection *conn)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+
+    if (conn == &priv->main_conn)
+    {
+        g_rec_mutex_unlock (&priv->main_lock);
+        return;
+    }
+
+    g_mutex_lock (&priv->readers_lock);
+    if (--conn->depth == 0)
+    {
+        conn->owner = NULL;
+        g_cond_signal (&priv->readers_cond);
     }
+    g_mutex_unlock (&priv->readers_lock);
+}
+
+static gboolean
+exec_db_script (sqlite3 *db, const gchar *sql)
+{
+    gchar *error;
+    int ret;
 
+    /* If the DB is locked, the busy handler waits for it */
     error = NULL;
-    ret = sqlite3_exec (db, "PRAGMA journal_mode = " JOURNAL_MODE, NULL, NULL,
-                        &error);
+    ret = sqlite3_exec (db, sql, NULL, NULL, &error);
     if (ret != SQLITE_OK)
     {
-        g_warning ("%s: couldn't set journal mode to " JOURNAL_MODE " (%s)",
-                   G_STRFUNC, error);
+        g_warning ("Error initializing DB: %s", error);
         sqlite3_free (error);
+        return FALSE;
     }
+
+    return TRUE;
 }
 
 static gint
@@ -1238,14 +2120,98 @@ get_db_version (sqlite3 *db)
     return version;
 }
 
+/* The steps to create the DB and to upgrade it to the latest version. Each
+ * step is run in its own transaction, so it's safe against other processes
+ * opening the DB at the same time. Steps which are not mandatory only enable
+ * some optimizations, and the DB can be used even if they fail; since each
+ * step relies on the previous ones, the upgrade stops at the first
+ * failure. */
+typedef gboolean (*DbMigrationFunc) (sqlite3 *db, gint version);
+
+typedef struct {
+    /* The version of the DB after this step */
+    gint version;
+    gboolean mandatory;
+    /* Either a SQL script, or a function */
+    const gchar *sql;
+    DbMigrationFunc func;
+} DbMigration;
+
+#define MIGRATION_PROGRESS_ROWS 1000
+
+static void
+report_migration_progress (gint version, guint done, guint total)
+{
+    DEBUG_INFO ("Upgrading DB to version %d: %u of %u done",
+                version, done, total);
+}
+
+/* Converts the settings values from the GVariant text format to their
+ * serialized data, which can be read back without parsing */
 static gboolean
-create_db (sqlite3 *db)
+convert_settings_to_binary (sqlite3 *db, gint version)
 {
-    const gchar *sql;
-    gchar *error;
+    sqlite3_stmt *stmt;
+    GArray *rowids;
+    GPtrArray *values;
+    guint i;
     int ret;
 
-    sql = ""
+    ret = sqlite3_prepare_v2 (db, "SELECT rowid, type, value FROM Settings "
+                              "WHERE typeof(value) = 'text';",
+                              -1, &stmt, NULL);
+    if (ret != SQLITE_OK) return FALSE;
+
+    /* Read all the values first: the table must not be modified while the
+     * SELECT statement is running */
+    rowids = g_array_new (FALSE, FALSE, sizeof (sqlite3_int64));
+    values = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+    while ((ret = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+        sqlite3_int64 rowid = sqlite3_column_int64 (stmt, 0);
+        GVariant *value = _ag_value_from_db (stmt, 1, 2);
+
+        /* values which cannot be parsed are left as they are */
+        if (G_UNLIKELY (value == NULL)) continue;
+
+        g_array_append_val (rowids, rowid);
+        g_ptr_array_add (values, g_variant_take_ref (value));
+    }
+    sqlite3_finalize (stmt);
+    stmt = NULL;
+
+    if (ret == SQLITE_DONE)
+        ret = sqlite3_prepare_v2 (db, "UPDATE Settings SET value = ? "
+                                  "WHERE rowid = ?;", -1, &stmt, NULL);
+    for (i = 0; i < values->len && ret == SQLITE_OK; i++)
+    {
+        GVariant *value = g_variant_get_normal_form (values->pdata[i]);
+
+        if (i % MIGRATION_PROGRESS_ROWS == 0)
+            report_migration_progress (version, i, values->len);
+
+        sqlite3_bind_blob (stmt, 1, g_variant_get_data (value),
+                           g_variant_get_size (value), SQLITE_TRANSIENT);
+        sqlite3_bind_int64 (stmt, 2, g_array_index (rowids, sqlite3_int64, i));
+        ret = sqlite3_step (stmt);
+        if (ret == SQLITE_DONE)
+            ret = sqlite3_reset (stmt);
+        g_variant_unref (value);
+    }
+    if (ret != SQLITE_OK)
+        g_warning ("Error converting settings: %s", sqlite3_errmsg (db));
+    else if (values->len > 0)
+        report_migration_progress (version, values->len, values->len);
+    sqlite3_finalize (stmt);
+
+    g_array_free (rowids, TRUE);
+    g_ptr_array_free (values, TRUE);
+    return ret == SQLITE_OK;
+}
+
+static const DbMigration db_migrations[] = {
+    /* Version 1: the initial schema */
+    { 1, TRUE,
         "CREATE TABLE IF NOT EXISTS Accounts ("
             "id INTEGER PRIMARY KEY AUTOINCREMENT,"
             "name TEXT,"
@@ -1282,38 +2248,130 @@ create_db (sqlite3 *db)
             "signature TEXT NOT NULL,"
             "token TEXT NOT NULL);"
         "CREATE UNIQUE INDEX IF NOT EXISTS idx_signatures ON Signatures "
-           "(account, service, key);"
+           "(account, service, key);",
+      NULL },
+    /* Version 2: serialized default settings of the services, and mtime of
+     * the file they come from */
+    { 2, FALSE,
+        "ALTER TABLE Services ADD COLUMN defaults BLOB;"
+        "ALTER TABLE Services ADD COLUMN mtime INTEGER;",
+      NULL },
+    /* Version 3: settings values stored as serialized GVariant data */
+    { 3, FALSE, NULL, convert_settings_to_binary },
+    /* Version 4: the "enabled" settings of the account services (the
+     * global one is in the Accounts table), kept in sync by triggers, so
+     * that the enabled accounts and services can be listed from indexes */
+    { 4, FALSE,
+        "CREATE TABLE IF NOT EXISTS AccountServices ("
+            "account INTEGER NOT NULL,"
+            "service INTEGER NOT NULL,"
+            "enabled INTEGER NOT NULL,"
+            "PRIMARY KEY (account, service)) WITHOUT ROWID;"
+        "CREATE INDEX IF NOT EXISTS idx_enabled_services ON AccountServices "
+            "(service, enabled, account);"
+        "CREATE INDEX IF NOT EXISTS idx_service_type ON Services(type);"
+
+        "CREATE TRIGGER IF NOT EXISTS tg_insert_enabled "
+            "AFTER INSERT ON Settings FOR EACH ROW "
+            "WHEN NEW.key = 'enabled' AND NEW.service != 0 BEGIN "
+                "INSERT OR REPLACE INTO AccountServices "
+                "VALUES (NEW.account, NEW.service, "
+                        "NEW.value IN ('true', X'01')); "
+            "END;"
+        "CREATE TRIGGER IF NOT EXISTS tg_update_enabled "
+            "AFTER UPDATE OF value ON Settings FOR EACH ROW "
+            "WHEN NEW.key = 'enabled' AND NEW.service != 0 BEGIN "
+                "INSERT OR REPLACE INTO AccountServices "
+                "VALUES (NEW.account, NEW.service, "
+                        "NEW.value IN ('true', X'01')); "
+            "END;"
+        "CREATE TRIGGER IF NOT EXISTS tg_delete_enabled "
+            "AFTER DELETE ON Settings FOR EACH ROW "
+            "WHEN OLD.key = 'enabled' BEGIN "
+                "DELETE FROM AccountServices "
+                "WHERE account = OLD.account AND service = OLD.service; "
+            "END;"
 
-        "PRAGMA user_version = 1;";
+        "INSERT OR REPLACE INTO AccountServices "
+            "SELECT account, service, value IN ('true', X'01') "
+            "FROM Settings WHERE key = 'enabled' AND service != 0;",
+      NULL },
+    /* Version 5: whether the services of the Services table are
+     * installed (the rows are kept, since the settings refer to their IDs),
+     * and indexes to list the accounts by the type of their services, going
+     * from the type to the providers of the installed services, and from
+     * those to the accounts; the new index on the Services type replaces the
+     * old one */
+    { 5, FALSE,
+        "ALTER TABLE Services ADD COLUMN installed INTEGER NOT NULL "
+            "DEFAULT 1;"
+        "CREATE INDEX IF NOT EXISTS idx_service_type_provider ON Services"
+            "(type, installed, provider);"
+        "DROP INDEX IF EXISTS idx_service_type;"
+        "CREATE INDEX IF NOT EXISTS idx_account_provider ON Accounts"
+            "(provider);",
+      NULL },
+};
 
-    error = NULL;
-    ret = sqlite3_exec (db, sql, NULL, NULL, &error);
-    if (ret == SQLITE_BUSY)
+static gboolean
+run_db_migration (sqlite3 *db, const DbMigration *migration)
+{
+    gchar version_sql[64];
+    gboolean ok;
+
+    if (!exec_db_script (db, "BEGIN EXCLUSIVE;"))
+        return get_db_version (db) >= migration->version;
+
+    /* Another process might have upgraded the DB while we were waiting for
+     * the lock */
+    if (get_db_version (db) >= migration->version)
     {
-        guint t;
-        for (t = 5; t < MAX_SQLITE_BUSY_LOOP_TIME_MS; t *= 2)
-        {
-            DEBUG_LOCKS ("Database locked, retrying...");
-            sched_yield ();
-            g_assert(error != NULL);
-            sqlite3_free (error);
-            ret = sqlite3_exec (db, sql, NULL, NULL, &error);
-            if (ret != SQLITE_BUSY) break;
-            usleep(t * 1000);
-        }
+        exec_db_script (db, "COMMIT;");
+        return TRUE;
     }
 
-    if (ret != SQLITE_OK)
+    DEBUG_INFO ("Upgrading DB to version %d", migration->version);
+
+    ok = migration->sql != NULL ?
+        exec_db_script (db, migration->sql) :
+        migration->func (db, migration->version);
+
+    g_snprintf (version_sql, sizeof (version_sql),
+                "PRAGMA user_version = %d;", migration->version);
+    if (ok && exec_db_script (db, version_sql) &&
+        exec_db_script (db, "COMMIT;"))
     {
-        g_warning ("Error initializing DB: %s", error);
-        sqlite3_free (error);
-        return FALSE;
+        DEBUG_INFO ("DB upgraded to version %d", migration->version);
+        return TRUE;
     }
 
-    return TRUE;
+    sqlite3_exec (db, "ROLLBACK;", NULL, NULL, NULL);
+    return get_db_version (db) >= migration->version;
 }
 
-static inline gboolean
+/* Brings the DB to the latest version; returns the version of the DB, or 0
+ * if it cannot be used. */
+static gint
+migrate_db (sqlite3 *db, gint version, gboolean is_readonly)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (db_migrations); i++)
+    {
+        const DbMigration *migration = &db_migrations[i];
+
+        if (migration->version <= version) continue;
+
+        if (is_readonly || !run_db_migration (db, migration))
+            return migration->mandatory ? 0 : version;
+
+        version = migration->version;
+    }
+
+    return version;
+}
+
+static inline gboolean
 file_is_read_only (const gchar *filename)
 {
     int fd;
@@ -1376,7 +2434,6 @@ open_db (AgManager *manager)
         priv->is_readonly = FALSE;
     }
     ret = sqlite3_open_v2 (filename, &priv->db, flags, NULL);
-    g_free (filename);
 
     if (ret != SQLITE_OK)
     {
@@ -1387,26 +2444,36 @@ open_db (AgManager *manager)
             sqlite3_close (priv->db);
             priv->db = NULL;
         }
+        g_free (filename);
         return FALSE;
     }
 
-    /* TODO: busy handler */
+    priv->db_lock = _ag_db_lock_get (filename, USE_WAL);
+    g_free (filename);
+    db_connection_init (&priv->main_conn, priv, priv->db);
 
     version = get_db_version(priv->db);
     DEBUG_INFO ("DB version: %d", version);
-    if (version < 1)
-        ok = create_db(priv->db);
-    /* insert here code to upgrade the DB from older versions... */
+    version = migrate_db (priv->db, version, priv->is_readonly);
+    ok = (version > 0);
+    priv->has_service_defaults = (version >= 2);
+    priv->has_binary_values = (version >= 3);
+    priv->has_account_services = (version >= 4);
+    priv->has_installed_services = (version >= 5);
 
     if (G_UNLIKELY (!ok))
     {
+        db_connection_clear (&priv->main_conn);
         sqlite3_close (priv->db);
         priv->db = NULL;
         return FALSE;
     }
 
     setup_db_options (priv->db);
-    create_functions (priv);
+
+    /* Read the IDs of all the services at once, so that resolving them
+     * later doesn't need a query each */
+    refresh_service_ids (manager);
 
     return TRUE;
 }
@@ -1505,9 +2572,25 @@ ag_manager_init (AgManager *manager)
     priv->services =
         g_hash_table_new_full (g_str_hash, g_str_equal,
                                NULL, (GDestroyNotify)ag_service_unref);
+    priv->service_ids =
+        g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    priv->service_types =
+        g_hash_table_new_full (g_str_hash, g_str_equal,
+                               g_free, (GDestroyNotify)ag_service_type_unref);
+    priv->service_types_generation = _ag_catalog_get_generation ();
     priv->accounts =
         g_hash_table_new_full (NULL, NULL,
-                               NULL, (GDestroyNotify)account_weak_unref);
+                               NULL, (GDestroyNotify)account_ref_free);
+    g_mutex_init (&priv->cache_lock);
+    g_mutex_init (&priv->services_sync_lock);
+    g_rec_mutex_init (&priv->catalog_lock);
+    g_mutex_init (&priv->service_types_lock);
+    g_mutex_init (&priv->providers_lock);
+    g_rec_mutex_init (&priv->main_lock);
+    priv->readers =
+        g_ptr_array_new_with_free_func ((GDestroyNotify)db_connection_free);
+    g_mutex_init (&priv->readers_lock);
+    g_cond_init (&priv->readers_cond);
 
     priv->db_timeout = MAX_SQLITE_BUSY_LOOP_TIME_MS; /* 5 seconds */
     priv->use_dbus = TRUE;
@@ -1536,6 +2619,9 @@ ag_manager_get_property (GObject *object, guint property_id,
     case PROP_USE_DBUS:
         g_value_set_boolean (value, priv->use_dbus);
         break;
+    case PROP_PARALLEL_LOADING:
+        g_value_set_boolean (value, priv->parallel_loading);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -1564,6 +2650,9 @@ ag_manager_set_property (GObject *object, guint property_id,
     case PROP_USE_DBUS:
         priv->use_dbus = g_value_get_boolean (value);
         break;
+    case PROP_PARALLEL_LOADING:
+        priv->parallel_loading = g_value_get_boolean (value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -1580,8 +2669,6 @@ ag_manager_dispose (GObject *object)
 
     DEBUG_REFS ("Disposing manager %p", object);
 
-    g_list_free_full (g_steal_pointer (&priv->locks), (GDestroyNotify)store_cb_data_free);
-
     if (priv->dbus_conn)
     {
         while (priv->subscription_ids)
@@ -1596,6 +2683,20 @@ ag_manager_dispose (GObject *object)
         g_clear_object (&priv->dbus_conn);
     }
 
+    g_rec_mutex_lock (&priv->catalog_lock);
+    stop_watching_data_dirs (AG_MANAGER (object));
+    g_clear_pointer (&priv->catalog, ag_manager_catalog_free);
+    g_clear_pointer (&priv->notified_services, g_hash_table_unref);
+    g_rec_mutex_unlock (&priv->catalog_lock);
+
+    g_mutex_lock (&priv->service_types_lock);
+    g_clear_pointer (&priv->service_types, g_hash_table_unref);
+    g_mutex_unlock (&priv->service_types_lock);
+
+    g_mutex_lock (&priv->providers_lock);
+    g_clear_pointer (&priv->providers, g_ptr_array_unref);
+    g_mutex_unlock (&priv->providers_lock);
+
     g_clear_pointer (&priv->services, g_hash_table_unref);
     g_clear_pointer (&priv->accounts, g_hash_table_unref);
 
@@ -1623,9 +2724,9 @@ ag_manager_finalize (GObject *object)
                                                       priv->processed_signals);
     }
 
-    g_clear_pointer (&priv->begin_stmt, sqlite3_finalize);
-    g_clear_pointer (&priv->commit_stmt, sqlite3_finalize);
-    g_clear_pointer (&priv->rollback_stmt, sqlite3_finalize);
+    g_clear_pointer (&priv->writer, _ag_db_writer_free);
+    g_clear_pointer (&priv->readers, g_ptr_array_unref);
+    db_connection_clear (&priv->main_conn);
 
     if (priv->db)
     {
@@ -1636,8 +2737,18 @@ ag_manager_finalize (GObject *object)
     }
 
     g_clear_pointer (&priv->service_type, g_free);
+    g_clear_pointer (&priv->service_ids, g_hash_table_unref);
     g_clear_pointer (&priv->last_error, g_error_free);
 
+    g_mutex_clear (&priv->cache_lock);
+    g_mutex_clear (&priv->services_sync_lock);
+    g_rec_mutex_clear (&priv->catalog_lock);
+    g_mutex_clear (&priv->service_types_lock);
+    g_mutex_clear (&priv->providers_lock);
+    g_rec_mutex_clear (&priv->main_lock);
+    g_mutex_clear (&priv->readers_lock);
+    g_cond_clear (&priv->readers_cond);
+
     G_OBJECT_CLASS (ag_manager_parent_class)->finalize (object);
 }
 
@@ -1679,9 +2790,9 @@ ag_manager_account_deleted (AgManager *manager, AgAccountId id)
 
     g_return_if_fail (AG_IS_MANAGER (manager));
 
-    /* The weak reference is removed automatically when the account is removed
-     * from the hash table */
+    g_mutex_lock (&priv->cache_lock);
     g_hash_table_remove (priv->accounts, GUINT_TO_POINTER (id));
+    g_mutex_unlock (&priv->cache_lock);
 }
 
 static void
@@ -1743,6 +2854,23 @@ ag_manager_class_init (AgManagerClass *klass)
                               G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE |
                               G_PARAM_CONSTRUCT_ONLY);
 
+    /**
+     * AgManager:parallel-loading:
+     *
+     * Whether to parse the data files on multiple threads when enumerating
+     * them. This speeds up the first listing of the installed services,
+     * providers and applications on multi-core systems when their files
+     * haven't been compiled into a catalog; the results are the same as
+     * with sequential loading.
+     *
+     * Since: 1.27
+     */
+    properties[PROP_PARALLEL_LOADING] =
+        g_param_spec_boolean ("parallel-loading", NULL, NULL,
+                              FALSE,
+                              G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE |
+                              G_PARAM_CONSTRUCT_ONLY);
+
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        properties);
@@ -1825,6 +2953,64 @@ ag_manager_class_init (AgManagerClass *klass)
          G_TYPE_NONE,
          1, G_TYPE_UINT);
 
+    /**
+     * AgManager::service-added:
+     * @manager: the #AgManager.
+     * @service: the #AgService which has been installed.
+     *
+     * Emitted when a new service file has been installed. The data
+     * directories are watched once the manager has listed the installed
+     * services or providers.
+     *
+     * Since: 1.27
+     */
+    signals[SERVICE_ADDED] = g_signal_new ("service-added",
+        G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST,
+        0,
+        NULL, NULL,
+        g_cclosure_marshal_VOID__BOXED,
+        G_TYPE_NONE,
+        1, AG_TYPE_SERVICE);
+
+    /**
+     * AgManager::service-removed:
+     * @manager: the #AgManager.
+     * @service: the #AgService which has been uninstalled.
+     *
+     * Emitted when a service file has been removed.
+     *
+     * Since: 1.27
+     */
+    signals[SERVICE_REMOVED] = g_signal_new ("service-removed",
+        G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST,
+        0,
+        NULL, NULL,
+        g_cclosure_marshal_VOID__BOXED,
+        G_TYPE_NONE,
+        1, AG_TYPE_SERVICE);
+
+    /**
+     * AgManager::provider-changed:
+     * @manager: the #AgManager.
+     * @provider_name: the name of the provider.
+     *
+     * Emitted when the file of the provider @provider_name has been
+     * installed, modified or removed; use ag_manager_get_provider() to get
+     * its current state.
+     *
+     * Since: 1.27
+     */
+    signals[PROVIDER_CHANGED] = g_signal_new ("provider-changed",
+        G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST,
+        0,
+        NULL, NULL,
+        g_cclosure_marshal_VOID__STRING,
+        G_TYPE_NONE,
+        1, G_TYPE_STRING);
+
     _ag_debug_init();
 }
 
@@ -1846,12 +3032,10 @@ GList *
 _ag_manager_list_all (AgManager *manager)
 {
     GList *list = NULL;
-    const gchar *sql;
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
-    sql = "SELECT id FROM Accounts;";
-    _ag_manager_exec_query (manager, (AgQueryCallback)add_id_to_list,
-                            &list, sql);
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)add_id_to_list,
+                               &list, "SELECT id FROM Accounts;", "");
     return list;
 }
 
@@ -1862,19 +3046,11 @@ _ag_manager_take_error (AgManager *manager, GError *error)
 
     g_return_if_fail (AG_IS_MANAGER (manager));
 
+    g_mutex_lock (&priv->cache_lock);
     if (priv->last_error)
         g_error_free (priv->last_error);
     priv->last_error = error;
-}
-
-const GError *
-_ag_manager_get_last_error (AgManager *manager)
-{
-    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
-
-    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
-
-    return priv->last_error;
+    g_mutex_unlock (&priv->cache_lock);
 }
 
 /**
@@ -1902,6 +3078,161 @@ ag_manager_list (AgManager *manager)
     return _ag_manager_list_all (manager);
 }
 
+static gboolean
+got_service_row (sqlite3_stmt *stmt, GHashTable *rows)
+{
+    AgService *service;
+
+    service = _ag_service_new ();
+    service->name = g_strdup ((gchar *)sqlite3_column_text (stmt, 0));
+    service->display_name = g_strdup ((gchar *)sqlite3_column_text (stmt, 1));
+    service->provider = g_strdup ((gchar *)sqlite3_column_text (stmt, 2));
+    service->type = g_strdup ((gchar *)sqlite3_column_text (stmt, 3));
+    g_hash_table_replace (rows, service->name, service);
+    return TRUE;
+}
+
+static gboolean
+same_service_header (AgService *a, AgService *b)
+{
+    return g_strcmp0 (a->display_name, b->display_name) == 0 &&
+        g_strcmp0 (a->provider, b->provider) == 0 &&
+        g_strcmp0 (a->type, b->type) == 0;
+}
+
+/* Makes the Services table match the installed service files, so that the
+ * queries on it are correct also for the services which were never loaded:
+ * the missing and changed rows are written, and those of the uninstalled
+ * services marked as such, in one transaction run by the writer. The rows
+ * are never deleted, since the settings refer to their IDs. This is done
+ * again only when the data directories change. */
+static void
+sync_services_table (AgManager *manager)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    GHashTable *rows;
+    GPtrArray *names, *services;
+    GHashTableIter iter;
+    AgDbScript *script = NULL;
+    AgDbWriter *writer;
+    AgService *row;
+    GError *error = NULL;
+    guint generation, i;
+
+    if (priv->is_readonly || !priv->has_installed_services) return;
+
+    g_mutex_lock (&priv->services_sync_lock);
+    generation = _ag_catalog_get_generation ();
+    if (priv->services_synced &&
+        priv->services_synced_generation == generation)
+    {
+        g_mutex_unlock (&priv->services_sync_lock);
+        return;
+    }
+
+    DEBUG_INFO ("Updating the Services table, generation %u", generation);
+    rows = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                  (GDestroyNotify)ag_service_unref);
+    /* The services which are written, and the strings bound to the script */
+    services = g_ptr_array_new_with_free_func (
+        (GDestroyNotify)ag_service_unref);
+    if (_ag_manager_exec_prepared (manager, (AgQueryCallback)got_service_row,
+                                   rows,
+                                   "SELECT name, display, provider, type "
+                                   "FROM Services WHERE installed", "") < 0)
+        goto finish;
+
+    names = list_data_file_names (&service_files);
+    for (i = 0; i < names->len; i++)
+    {
+        const gchar *service_name = g_ptr_array_index (names, i);
+        AgService *service;
+
+        service = _ag_service_new_from_header (service_name);
+        if (G_UNLIKELY (service == NULL)) continue;
+
+        row = g_hash_table_lookup (rows, service_name);
+        if (row != NULL && same_service_header (row, service))
+        {
+            ag_service_unref (service);
+            g_hash_table_remove (rows, service_name);
+            continue;
+        }
+
+        /* The row might be missing, or be marked as not installed */
+        if (script == NULL)
+            script = _ag_db_script_new (0, priv->has_binary_values);
+        _ag_db_script_add (script,
+                           "INSERT OR IGNORE INTO Services "
+                           "(name, display, provider, type) "
+                           "VALUES (?, ?, ?, ?);",
+                           "ssss", service->name, service->display_name,
+                           service->provider, service->type);
+        _ag_db_script_add (script,
+                           "UPDATE Services SET "
+                           "display = ?, provider = ?, type = ?, "
+                           "installed = 1 "
+                           "WHERE name = ?;",
+                           "ssss", service->display_name,
+                           service->provider, service->type,
+                           service->name);
+        g_ptr_array_add (services, service);
+        g_hash_table_remove (rows, service_name);
+    }
+    g_ptr_array_unref (names);
+
+    /* The rows left are those of the services which are not installed */
+    g_hash_table_iter_init (&iter, rows);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer)&row))
+    {
+        if (script == NULL)
+            script = _ag_db_script_new (0, priv->has_binary_values);
+        _ag_db_script_add (script,
+                           "UPDATE Services SET installed = 0 "
+                           "WHERE name = ?;",
+                           "s", row->name);
+    }
+
+    if (script != NULL)
+    {
+        gint64 end_time;
+
+        writer = get_writer (manager, &error);
+        end_time = g_get_monotonic_time () + BLOCKING_STORE_TIMEOUT;
+        if (writer == NULL)
+            _ag_db_script_free (script);
+        else
+            _ag_db_writer_exec (writer, &script, 1, end_time, NULL, &error);
+        if (G_UNLIKELY (error != NULL))
+        {
+            g_warning ("Couldn't update the services in the DB: %s",
+                       error->message);
+            g_error_free (error);
+            goto finish;
+        }
+
+        /* Drop what was loaded from the old rows */
+        g_mutex_lock (&priv->cache_lock);
+        for (i = 0; i < services->len; i++)
+        {
+            AgService *service = g_ptr_array_index (services, i);
+            g_hash_table_remove (priv->services, service->name);
+        }
+        g_mutex_unlock (&priv->cache_lock);
+
+        /* Read the IDs of the inserted rows */
+        refresh_service_ids (manager);
+    }
+
+    priv->services_synced = TRUE;
+    priv->services_synced_generation = generation;
+
+finish:
+    g_ptr_array_unref (services);
+    g_hash_table_unref (rows);
+    g_mutex_unlock (&priv->services_sync_lock);
+}
+
 /**
  * ag_manager_list_by_service_type:
  * @manager: the #AgManager.
@@ -1917,16 +3248,21 @@ GList *
 ag_manager_list_by_service_type (AgManager *manager,
                                  const gchar *service_type)
 {
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
     GList *list = NULL;
-    char sql[512];
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
-    sqlite3_snprintf (sizeof (sql), sql,
-                      "SELECT id FROM Accounts WHERE provider IN ("
-                      "SELECT provider FROM Services WHERE type = %Q);",
-                      service_type);
-    _ag_manager_exec_query (manager, (AgQueryCallback)add_id_to_list,
-                            &list, sql);
+
+    sync_services_table (manager);
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)add_id_to_list,
+                               &list,
+                               priv->has_installed_services ?
+                               "SELECT id FROM Accounts WHERE provider IN ("
+                               "SELECT provider FROM Services "
+                               "WHERE type = ? AND installed = 1);" :
+                               "SELECT id FROM Accounts WHERE provider IN ("
+                               "SELECT provider FROM Services WHERE type = ?);",
+                               "s", service_type);
     return list;
 }
 
@@ -1944,17 +3280,16 @@ GList *
 ag_manager_list_enabled (AgManager *manager)
 {
     GList *list = NULL;
-    char sql[512];
     AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
 
     if (priv->service_type == NULL)
     {
-        sqlite3_snprintf (sizeof (sql), sql,
-                          "SELECT id FROM Accounts WHERE enabled=1;");
-        _ag_manager_exec_query (manager, (AgQueryCallback)add_id_to_list,
-                                &list, sql);
+        _ag_manager_exec_prepared (manager, (AgQueryCallback)add_id_to_list,
+                                   &list,
+                                   "SELECT id FROM Accounts WHERE enabled=1;",
+                                   "");
     }
     else
     {
@@ -1978,20 +3313,37 @@ GList *
 ag_manager_list_enabled_by_service_type (AgManager *manager,
                                          const gchar *service_type)
 {
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
     GList *list = NULL;
-    char sql[512];
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
     g_return_val_if_fail (service_type != NULL, NULL);
-    sqlite3_snprintf (sizeof (sql), sql,
-                      "SELECT Settings.account FROM Settings "
-                      "INNER JOIN Services ON Settings.service = Services.id "
-                      "WHERE Settings.key='enabled' AND Settings.value='true' "
-                      "AND Services.type = %Q AND Settings.account IN "
-                      "(SELECT id FROM Accounts WHERE enabled=1);",
-                      service_type);
-    _ag_manager_exec_query (manager, (AgQueryCallback)add_id_to_list,
-                            &list, sql);
+    if (priv->has_account_services)
+    {
+        _ag_manager_exec_prepared (manager, (AgQueryCallback)add_id_to_list,
+                                   &list,
+                                   "SELECT AccountServices.account "
+                                   "FROM Services "
+                                   "INNER JOIN AccountServices "
+                                   "ON AccountServices.service = Services.id "
+                                   "WHERE Services.type = ? "
+                                   "AND AccountServices.enabled = 1 "
+                                   "AND AccountServices.account IN "
+                                   "(SELECT id FROM Accounts WHERE enabled=1);",
+                                   "s", service_type);
+        return list;
+    }
+
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)add_id_to_list,
+                               &list,
+                               "SELECT Settings.account FROM Settings "
+                               "INNER JOIN Services "
+                               "ON Settings.service = Services.id "
+                               "WHERE Settings.key='enabled' "
+                               "AND Settings.value IN ('true', X'01') "
+                               "AND Services.type = ? AND Settings.account IN "
+                               "(SELECT id FROM Accounts WHERE enabled=1);",
+                               "s", service_type);
     return list;
 }
 
@@ -2113,163 +3465,565 @@ AgAccount *
 ag_manager_load_account (AgManager *manager, AgAccountId account_id,
                          GError **error)
 {
-    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
-    AgAccount *account;
-
-    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
-    g_return_val_if_fail (account_id != 0, NULL);
-
-    account = g_hash_table_lookup (priv->accounts,
-                                   GUINT_TO_POINTER (account_id));
-    if (account)
-        return g_object_ref (account);
-
-    /* the account is not loaded; do it now */
-    account = g_initable_new (AG_TYPE_ACCOUNT, NULL, error,
-                              "manager", manager,
-                              "id", account_id,
-                              NULL);
-    if (G_LIKELY (account))
-    {
-        g_object_weak_ref (G_OBJECT (account), account_weak_notify, manager);
-        g_hash_table_insert (priv->accounts, GUINT_TO_POINTER (account_id),
-                             account);
-    }
-
-    return account;
+    return ag_manager_load_account_full (manager, account_id,
+                                         AG_ACCOUNT_LOAD_NONE, error);
 }
 
 /**
- * ag_manager_create_account:
+ * ag_manager_load_account_full:
  * @manager: the #AgManager.
- * @provider_name: name of the provider of the account.
+ * @account_id: the #AgAccountId of the account.
+ * @flags: the #AgAccountLoadFlags.
+ * @error: pointer to a #GError, or %NULL.
  *
- * Create a new account. The account is not stored in the database until
- * ag_account_store() has successfully returned; the @id field in the
- * #AgAccount structure is also not meant to be valid until the account has
- * been stored.
+ * Like ag_manager_load_account(), but with @flags telling what else should be
+ * loaded together with the account.
  *
- * Returns: (transfer full): a new #AgAccount, or %NULL.
+ * Returns: (transfer full): an #AgAccount, on which the client must call
+ * g_object_unref() when it is no longer required, or %NULL if an error occurs.
+ *
+ * Since: 1.27
  */
 AgAccount *
-ag_manager_create_account (AgManager *manager, const gchar *provider_name)
+ag_manager_load_account_full (AgManager *manager, AgAccountId account_id,
+                              AgAccountLoadFlags flags, GError **error)
 {
-    AgAccount *account;
+    AgAccount *account, *new_account;
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
+    g_return_val_if_fail (account_id != 0, NULL);
+
+    account = lookup_account (manager, account_id);
+    if (!account)
+    {
+        /* the account is not loaded; do it now */
+        new_account = g_initable_new (AG_TYPE_ACCOUNT, NULL, error,
+                                      "manager", manager,
+                                      "id", account_id,
+                                      NULL);
+        if (G_UNLIKELY (!new_account)) return NULL;
+
+        /* another thread might have loaded it in the meantime */
+        account = cache_account (manager, new_account);
+        g_object_unref (new_account);
+    }
+
+    if (flags & AG_ACCOUNT_LOAD_SETTINGS)
+        ag_account_preload (account);
 
-    account = g_initable_new (AG_TYPE_ACCOUNT, NULL, NULL,
-                              "manager", manager,
-                              "provider", provider_name,
-                              NULL);
     return account;
 }
 
-/* This is called when creating AgService objects from inside the DBus
- * handler: we don't want to access the Db from there */
-AgService *
-_ag_manager_get_service_lazy (AgManager *manager, const gchar *service_name,
-                              const gchar *service_type, const gint service_id)
+typedef struct {
+    /* Account ID -> AgAccountPreload of the accounts whose settings are
+     * being loaded; the value is NULL if the account has not been found
+     * in the DB yet */
+    GHashTable *loading;
+    AgManager *manager;
+} LoadAccountsData;
+
+static void
+account_preload_free (AgAccountPreload *preload)
 {
-    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
-    AgService *service;
+    if (preload == NULL) return;
+    g_clear_object (&preload->account);
+    g_slice_free (AgAccountPreload, preload);
+}
 
-    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
-    g_return_val_if_fail (service_name != NULL, NULL);
+static void
+add_account_preload (LoadAccountsData *data, AgAccount *account)
+{
+    AgAccountPreload *preload = g_slice_new (AgAccountPreload);
 
-    service = g_hash_table_lookup (priv->services, service_name);
-    if (service)
-    {
-        if (service->id == 0)
-            service->id = service_id;
-        return ag_service_ref (service);
-    }
+    _ag_account_preload_init (preload, account);
+    g_hash_table_insert (data->loading, GUINT_TO_POINTER (account->id),
+                         preload);
+}
+
+static gboolean
+got_account_row (sqlite3_stmt *stmt, LoadAccountsData *data)
+{
+    AgAccountId account_id;
+    AgAccount *account;
+    gpointer preload;
+
+    account_id = sqlite3_column_int (stmt, 0);
+    /* The IDs in the scanned range might not have been requested, or be
+     * already loaded */
+    if (!g_hash_table_lookup_extended (data->loading,
+                                       GUINT_TO_POINTER (account_id),
+                                       NULL, &preload) ||
+        preload != NULL)
+        return FALSE;
 
-    service = _ag_service_new_from_memory (service_name, service_type, service_id);
+    account = _ag_account_new_loaded (data->manager, account_id,
+                                      (const gchar *)
+                                      sqlite3_column_text (stmt, 1),
+                                      (const gchar *)
+                                      sqlite3_column_text (stmt, 2),
+                                      sqlite3_column_int (stmt, 3));
+    if (G_UNLIKELY (account == NULL)) return FALSE;
 
-    g_hash_table_insert (priv->services, service->name, service);
-    return ag_service_ref (service);
+    add_account_preload (data, account);
+    g_object_unref (account);
+    return TRUE;
 }
 
-/**
- * ag_manager_get_service:
- * @manager: the #AgManager.
- * @service_name: the name of the service.
- *
- * Loads the service identified by @service_name.
- *
- * Returns: an #AgService, which must be free'd with ag_service_unref() when no
- * longer required.
- */
-AgService *
-ag_manager_get_service (AgManager *manager, const gchar *service_name)
+static gboolean
+got_accounts_setting (sqlite3_stmt *stmt, LoadAccountsData *data)
 {
-    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
-    AgService *service;
-    gchar *sql;
+    AgAccountPreload *preload;
+    AgAccountId account_id;
 
-    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
-    g_return_val_if_fail (service_name != NULL, NULL);
+    account_id = sqlite3_column_int (stmt, 0);
+    preload = g_hash_table_lookup (data->loading,
+                                   GUINT_TO_POINTER (account_id));
+    if (preload == NULL) return FALSE;
 
-    service = g_hash_table_lookup (priv->services, service_name);
-    if (service)
-        return ag_service_ref (service);
+    return _ag_account_preload_row (preload, stmt, 1);
+}
 
-    /* First, check if the service is in the DB */
-    sql = sqlite3_mprintf ("SELECT id, display, provider, type "
-                           "FROM Services WHERE name = %Q", service_name);
-    _ag_manager_exec_query (manager, (AgQueryCallback)got_service,
-                            &service, sql);
-    sqlite3_free (sql);
+static gint
+compare_account_ids (gconstpointer a, gconstpointer b)
+{
+    AgAccountId id_a = *(const AgAccountId *)a;
+    AgAccountId id_b = *(const AgAccountId *)b;
 
-    if (service)
-    {
-        /* the basic server data have been loaded from the DB; the service name
-         * is still missing, though */
-        service->name = g_strdup (service_name);
-    }
-    else
-    {
-        /* The service is not in the DB: it must be loaded */
-        service = _ag_service_new_from_file (service_name);
+    return (id_a > id_b) - (id_a < id_b);
+}
 
-        if (service && !add_service_to_db (manager, service))
-        {
-            g_warning ("Error in adding service %s to DB!", service_name);
-            ag_service_unref (service);
-            service = NULL;
-        }
-    }
+/* Returns the sorted account IDs in @data; if @missing_only is set, only
+ * those which have not been found yet */
+static GArray *
+get_sorted_ids (LoadAccountsData *data, gboolean missing_only)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GArray *ids;
 
-    if (G_UNLIKELY (!service)) return NULL;
+    ids = g_array_sized_new (FALSE, FALSE, sizeof (AgAccountId),
+                             g_hash_table_size (data->loading));
+    g_hash_table_iter_init (&iter, data->loading);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        AgAccountId id = GPOINTER_TO_UINT (key);
 
-    g_hash_table_insert (priv->services, service->name, service);
-    return ag_service_ref (service);
+        if (missing_only && value != NULL) continue;
+        g_array_append_val (ids, id);
+    }
+    g_array_sort (ids, compare_account_ids);
+    return ids;
 }
 
-guint
-_ag_manager_get_service_id (AgManager *manager, AgService *service)
+/* Runs @sql, which takes the first and last ID of a range as parameters, on
+ * the ranges covering the sorted @ids; returns %FALSE on error */
+static gboolean
+exec_on_id_ranges (AgManager *manager, GArray *ids,
+                   AgQueryCallback callback, LoadAccountsData *data,
+                   const gchar *sql)
 {
-    g_return_val_if_fail (AG_IS_MANAGER (manager), 0);
+    guint start, end;
 
-    if (service == NULL) return 0; /* global service */
-
-    if (service->id == 0)
+    for (start = 0; start < ids->len; start = end)
     {
-        gchar *sql;
-        gint rows;
-
-        /* We got this service name from another process; load the id from the
-         * DB - it must already exist */
-        sql = sqlite3_mprintf ("SELECT id FROM Services WHERE name = %Q",
-                               service->name);
-        rows = _ag_manager_exec_query (manager, (AgQueryCallback)got_service_id,
-                                       service, sql);
-        sqlite3_free (sql);
-        if (G_UNLIKELY (rows != 1))
+        AgAccountId first_id = g_array_index (ids, AgAccountId, start);
+        AgAccountId last_id = first_id;
+
+        for (end = start + 1; end < ids->len; end++)
         {
-            g_warning ("%s: got %d rows when asking for service %s",
-                       G_STRFUNC, rows, service->name);
+            AgAccountId id = g_array_index (ids, AgAccountId, end);
+
+            if (id - last_id > MAX_ACCOUNT_ID_GAP) break;
+            last_id = id;
+        }
+
+        if (_ag_manager_exec_prepared (manager, callback, data, sql,
+                                       "uu", first_id, last_id) < 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * ag_manager_load_accounts:
+ * @manager: the #AgManager.
+ * @ids: (array length=n_ids): the IDs of the accounts to load.
+ * @n_ids: the number of elements in @ids.
+ * @flags: the #AgAccountLoadFlags.
+ * @error: pointer to a #GError, or %NULL.
+ *
+ * Instantiates the objects representing the accounts identified by @ids, like
+ * ag_manager_load_account_full() does for one account. The accounts which are
+ * not already loaded are read from the DB together: the accounts and their
+ * settings are scanned by ranges of close IDs.
+ *
+ * The IDs of accounts which don't exist are skipped.
+ *
+ * Returns: (transfer full) (element-type AgAccount): a #GList of the
+ * #AgAccount objects, in the order of @ids, or %NULL if an error occurs. Must
+ * be free'd with g_list_free_full() and g_object_unref().
+ *
+ * Since: 1.27
+ */
+GList *
+ag_manager_load_accounts (AgManager *manager, const AgAccountId *ids,
+                          guint n_ids, AgAccountLoadFlags flags,
+                          GError **error)
+{
+    LoadAccountsData data;
+    GHashTable *found;
+    GArray *sorted_ids;
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *list = NULL;
+    gboolean all_services = (flags & AG_ACCOUNT_LOAD_SETTINGS) != 0;
+    gboolean ok = TRUE;
+    gint i;
+
+    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
+    g_return_val_if_fail (ids != NULL || n_ids == 0, NULL);
+
+    data.manager = manager;
+    data.loading = g_hash_table_new_full (NULL, NULL, NULL,
+                                          (GDestroyNotify)account_preload_free);
+    /* Account ID -> AgAccount; each ID is looked up only once, so that
+     * repeated IDs always resolve to the same object */
+    found = g_hash_table_new_full (NULL, NULL, NULL, g_object_unref);
+
+    for (i = 0; i < (gint)n_ids; i++)
+    {
+        gpointer id = GUINT_TO_POINTER (ids[i]);
+        AgAccount *account;
+
+        if (ids[i] == 0 || g_hash_table_contains (found, id) ||
+            g_hash_table_contains (data.loading, id))
+            continue;
+
+        account = lookup_account (manager, ids[i]);
+        if (account == NULL)
+        {
+            g_hash_table_insert (data.loading, id, NULL);
+            continue;
+        }
+
+        g_hash_table_insert (found, id, account);
+        if (all_services)
+            add_account_preload (&data, account);
+    }
+
+    /* Read the accounts which are not loaded yet */
+    sorted_ids = get_sorted_ids (&data, TRUE);
+    ok = exec_on_id_ranges (manager, sorted_ids,
+                            (AgQueryCallback)got_account_row, &data,
+                            "SELECT id, name, provider, enabled "
+                            "FROM Accounts "
+                            "WHERE id BETWEEN ? AND ?");
+    g_array_unref (sorted_ids);
+
+    /* Then, their settings: the rows are read in the order of the
+     * idx_setting index */
+    sorted_ids = get_sorted_ids (&data, FALSE);
+    ok = ok &&
+        exec_on_id_ranges (manager, sorted_ids,
+                           (AgQueryCallback)got_accounts_setting, &data,
+                           all_services ?
+                           "SELECT account, Settings.service, "
+                           "Services.name, Services.type, key, "
+                           "Settings.type, value "
+                           "FROM Settings "
+                           "LEFT JOIN Services "
+                           "ON Services.id = Settings.service "
+                           "WHERE account BETWEEN ? AND ? "
+                           "ORDER BY account, Settings.service" :
+                           "SELECT account, service, NULL, NULL, "
+                           "key, type, value "
+                           "FROM Settings "
+                           "WHERE account BETWEEN ? AND ? "
+                           "AND service = 0 "
+                           "ORDER BY account");
+    g_array_unref (sorted_ids);
+
+    if (G_UNLIKELY (!ok))
+    {
+        g_set_error_literal (error, AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
+                             "Couldn't load the accounts from the DB");
+        goto finish;
+    }
+
+    /* Add the new accounts to the cache */
+    g_hash_table_iter_init (&iter, data.loading);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        AgAccountPreload *preload = value;
+        AgAccount *account;
+
+        if (preload == NULL) continue;
+
+        account = g_object_ref (preload->account);
+        _ag_account_preload_done (preload, all_services);
+        /* another thread might have loaded it in the meantime */
+        preload->account = cache_account (manager, account);
+        g_object_unref (account);
+        g_hash_table_replace (found, key, g_object_ref (preload->account));
+    }
+
+    for (i = (gint)n_ids - 1; i >= 0; i--)
+    {
+        AgAccount *account;
+
+        account = g_hash_table_lookup (found, GUINT_TO_POINTER (ids[i]));
+        if (account != NULL)
+            list = g_list_prepend (list, g_object_ref (account));
+    }
+
+finish:
+    g_hash_table_unref (found);
+    g_hash_table_unref (data.loading);
+    return list;
+}
+
+/**
+ * ag_manager_create_account:
+ * @manager: the #AgManager.
+ * @provider_name: name of the provider of the account.
+ *
+ * Create a new account. The account is not stored in the database until
+ * ag_account_store() has successfully returned; the @id field in the
+ * #AgAccount structure is also not meant to be valid until the account has
+ * been stored.
+ *
+ * Returns: (transfer full): a new #AgAccount, or %NULL.
+ */
+AgAccount *
+ag_manager_create_account (AgManager *manager, const gchar *provider_name)
+{
+    AgAccount *account;
+
+    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
+
+    account = g_initable_new (AG_TYPE_ACCOUNT, NULL, NULL,
+                              "manager", manager,
+                              "provider", provider_name,
+                              NULL);
+    return account;
+}
+
+/* Stores the default settings of @service in the DB, so that they can be
+ * read without parsing the service file; @mtime is the modification time of
+ * the file they come from. */
+void
+_ag_manager_store_service_defaults (AgManager *manager, AgService *service,
+                                    gint64 mtime)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    GVariant *defaults;
+    GBytes *data;
+
+    if (!priv->has_service_defaults || priv->is_readonly ||
+        priv->db == NULL || service->id == 0)
+        return;
+
+    defaults =
+        g_variant_ref_sink (_ag_settings_to_variant (service->default_settings));
+    data = g_variant_get_data_as_bytes (defaults);
+
+    exec_write (manager,
+                "UPDATE Services SET defaults = ?, mtime = ? WHERE id = ?;",
+                "bxi", data, mtime, service->id);
+    g_bytes_unref (data);
+    g_variant_unref (defaults);
+}
+
+/* Adds @service to the cache of the manager, unless another thread cached
+ * the same service in the meantime; takes ownership of @service, and returns
+ * a new reference to the cached service */
+static AgService *
+cache_service (AgManager *manager, AgService *service)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    AgService *cached;
+
+    g_mutex_lock (&priv->cache_lock);
+    cached = g_hash_table_lookup (priv->services, service->name);
+    if (G_UNLIKELY (cached != NULL))
+    {
+        ag_service_unref (service);
+        service = cached;
+    }
+    else
+    {
+        /* Let the service find the manager's service types */
+        g_weak_ref_set (&service->manager, manager);
+        g_hash_table_insert (priv->services, service->name, service);
+    }
+    ag_service_ref (service);
+    g_mutex_unlock (&priv->cache_lock);
+
+    return service;
+}
+
+/* This is called when creating AgService objects from inside the DBus
+ * handler: we don't want to access the Db from there */
+AgService *
+_ag_manager_get_service_lazy (AgManager *manager, const gchar *service_name,
+                              const gchar *service_type, const gint service_id)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    AgService *service;
+    gint id;
+
+    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
+    g_return_val_if_fail (service_name != NULL, NULL);
+
+    g_mutex_lock (&priv->cache_lock);
+    service = g_hash_table_lookup (priv->services, service_name);
+    if (service)
+    {
+        if (service->id == 0)
+            service->id = service_id;
+        ag_service_ref (service);
+    }
+    g_mutex_unlock (&priv->cache_lock);
+    if (service) return service;
+
+    /* The ID might be known even if the service was never loaded */
+    if (service_id != 0)
+        remember_service_id (priv, service_name, service_id);
+    id = service_id != 0 ?
+        service_id : lookup_service_id (manager, service_name, FALSE);
+
+    service = _ag_service_new_from_memory (service_name, service_type, id);
+
+    return cache_service (manager, service);
+}
+
+/* Returns the service if it's cached or in the DB */
+static AgService *
+lookup_service (AgManager *manager, const gchar *service_name)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    AgService *service;
+
+    g_mutex_lock (&priv->cache_lock);
+    service = g_hash_table_lookup (priv->services, service_name);
+    if (service)
+        ag_service_ref (service);
+    g_mutex_unlock (&priv->cache_lock);
+    if (service) return service;
+
+    /* First, check if the service is in the DB */
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)got_service,
+                               &service,
+                               priv->has_service_defaults ?
+                               "SELECT id, display, provider, type, "
+                               "defaults, mtime "
+                               "FROM Services WHERE name = ?" :
+                               "SELECT id, display, provider, type "
+                               "FROM Services WHERE name = ?",
+                               "s", service_name);
+
+    if (G_UNLIKELY (!service)) return NULL;
+
+    /* the basic server data have been loaded from the DB; the service name
+     * is still missing, though */
+    service->name = g_strdup (service_name);
+    return cache_service (manager, service);
+}
+
+/* Adds a service loaded from its file to the DB and to the cache; takes
+ * ownership of @service */
+static AgService *
+adopt_service (AgManager *manager, AgService *service)
+{
+    if (!add_service_to_db (manager, service))
+    {
+        g_warning ("Error in adding service %s to DB!", service->name);
+        ag_service_unref (service);
+        return NULL;
+    }
+
+    return cache_service (manager, service);
+}
+
+static AgService *
+get_service (AgManager *manager, const gchar *service_name,
+             gboolean header_only)
+{
+    AgService *service;
+
+    service = lookup_service (manager, service_name);
+    if (service) return service;
+
+    /* The service is not in the DB: it must be loaded */
+    service = header_only ?
+        _ag_service_new_from_header (service_name) :
+        _ag_service_new_from_file (service_name);
+    if (G_UNLIKELY (!service)) return NULL;
+
+    return adopt_service (manager, service);
+}
+
+/* Used when enumerating the services: only the data needed to identify and
+ * filter the services is loaded. */
+static AgService *
+get_service_header (AgManager *manager, const gchar *service_name)
+{
+    return get_service (manager, service_name, TRUE);
+}
+
+/**
+ * ag_manager_get_service:
+ * @manager: the #AgManager.
+ * @service_name: the name of the service.
+ *
+ * Loads the service identified by @service_name.
+ *
+ * Returns: an #AgService, which must be free'd with ag_service_unref() when no
+ * longer required.
+ */
+AgService *
+ag_manager_get_service (AgManager *manager, const gchar *service_name)
+{
+    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
+    g_return_val_if_fail (service_name != NULL, NULL);
+
+    return get_service (manager, service_name, FALSE);
+}
+
+gboolean
+_ag_manager_has_binary_values (AgManager *manager)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+
+    g_return_val_if_fail (AG_IS_MANAGER (manager), FALSE);
+    return priv->has_binary_values;
+}
+
+gboolean
+_ag_manager_has_account_services (AgManager *manager)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+
+    g_return_val_if_fail (AG_IS_MANAGER (manager), FALSE);
+    return priv->has_account_services;
+}
+
+guint
+_ag_manager_get_service_id (AgManager *manager, AgService *service)
+{
+    g_return_val_if_fail (AG_IS_MANAGER (manager), 0);
+
+    if (service == NULL) return 0; /* global service */
+
+    if (service->id == 0)
+    {
+        /* We got this service name from another process; it must already
+         * exist in the DB, but we might not have read it yet */
+        service->id = lookup_service_id (manager, service->name, TRUE);
+        if (G_UNLIKELY (service->id == 0))
+        {
+            g_warning ("%s: service %s not found in the DB",
+                       G_STRFUNC, service->name);
         }
     }
 
@@ -2291,13 +4045,22 @@ GList *
 ag_manager_list_services (AgManager *manager)
 {
     AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    AgManagerCatalog *catalog;
+    GList *list = NULL;
+    guint i;
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
 
     if (priv->service_type)
         return ag_manager_list_services_by_type (manager, priv->service_type);
 
-    return _ag_services_list (manager);
+    g_rec_mutex_lock (&priv->catalog_lock);
+    catalog = get_catalog (manager);
+    for (i = catalog->services->len; i > 0; i--)
+        list = g_list_prepend (list,
+            ag_service_ref (g_ptr_array_index (catalog->services, i - 1)));
+    g_rec_mutex_unlock (&priv->catalog_lock);
+    return list;
 }
 
 /**
@@ -2314,306 +4077,737 @@ ag_manager_list_services (AgManager *manager)
 GList *
 ag_manager_list_services_by_type (AgManager *manager, const gchar *service_type)
 {
-    GList *all_services, *list;
-    GList *services = NULL;
+    AgManagerPrivate *priv;
+    AgManagerCatalog *catalog;
+    GList *list;
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
     g_return_val_if_fail (service_type != NULL, NULL);
+    priv = ag_manager_get_instance_private (manager);
 
-    /* if we kept the DB Service table always up-to-date with all known
-     * services, then we could just run a query over it. But while we are not,
-     * it's simpler to implement the function by reusing the output from
-     * _ag_services_list(manager). */
-    all_services = _ag_services_list (manager);
-    for (list = all_services; list != NULL; list = list->next)
+    g_rec_mutex_lock (&priv->catalog_lock);
+    catalog = get_catalog (manager);
+    list = catalog_index_lookup (catalog->services_by_type, service_type,
+                                 (GBoxedCopyFunc)ag_service_ref);
+    g_rec_mutex_unlock (&priv->catalog_lock);
+    return list;
+}
+
+/* Takes ownership of @script, which can be %NULL if there is nothing to
+ * store */
+void
+_ag_manager_exec_transaction (AgManager *manager, AgDbScript *script,
+                              AgAccountChanges *changes, AgAccount *account,
+                              GTask *task)
+{
+    AgDbWriter *writer;
+    StoreCbData *sd;
+    GError *error = NULL;
+
+    writer = get_writer (manager, &error);
+    if (G_UNLIKELY (writer == NULL))
     {
-        AgService *service = list->data;
-        const gchar *serviceType = ag_service_get_service_type (service);
-        if (serviceType && strcmp (serviceType, service_type) == 0)
-        {
-            services = g_list_prepend (services, service);
-        }
-        else
-            ag_service_unref (service);
+        if (script != NULL)
+            _ag_db_script_free (script);
+        g_task_return_error (task, error);
+        _ag_account_store_completed (account, changes);
+        return;
+    }
+
+    /* The transaction runs in the writer thread, not to block the main loop
+     * while the DB is locked or the data is being flushed */
+    sd = g_slice_new0 (StoreCbData);
+    sd->manager = manager;
+    sd->account = account;
+    sd->changes = changes;
+    sd->task = task;
+    _ag_db_writer_exec_async (writer, &script, script != NULL ? 1 : 0,
+                              g_task_get_cancellable (task),
+                              (AgDbWriterCallback)on_transaction_done, sd);
+}
+
+/* Takes ownership of @script, which can be %NULL if there is nothing to
+ * store */
+void
+_ag_manager_exec_transaction_blocking (AgManager *manager, AgDbScript *script,
+                                       AgAccountChanges *changes,
+                                       AgAccount *account,
+                                       GError **error)
+{
+    AgDbWriter *writer;
+    sqlite3_int64 account_id = account->id;
+    gint64 end_time;
+
+    writer = get_writer (manager, error);
+    if (G_UNLIKELY (writer == NULL))
+    {
+        if (script != NULL)
+            _ag_db_script_free (script);
+        return;
+    }
+
+    end_time = g_get_monotonic_time () + BLOCKING_STORE_TIMEOUT;
+    if (!_ag_db_writer_exec (writer, &script, script != NULL ? 1 : 0,
+                             end_time, &account_id, error))
+        return;
+
+    complete_transaction (manager, account, changes, account_id);
+    flush_account_changes (manager);
+}
+
+static void
+ag_manager_store_local_async (AgManager *manager, AgAccount *account,
+                              GTask *task)
+{
+    AgAccountChanges *changes;
+    GError *error = NULL;
+    AgDbScript *script;
+
+    script = _ag_account_get_store_script (account, &error);
+    if (G_UNLIKELY (error))
+    {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
     }
-    g_list_free (all_services);
 
-    return services;
+    changes = _ag_account_steal_changes (account);
+
+    _ag_manager_exec_transaction (manager, script, changes, account, task);
 }
 
-static GError *
-sqlite_error_to_gerror (int db_error, sqlite3 *db)
+static gboolean
+ag_manager_store_local_sync (AgManager *manager, AgAccount *account,
+                             GError **error)
 {
-    AgAccountsError code = (db_error == SQLITE_READONLY) ?
-        AG_ACCOUNTS_ERROR_READONLY : AG_ACCOUNTS_ERROR_DB;
-    return g_error_new (AG_ACCOUNTS_ERROR, code,
-                        "Got error: %s (%d)",
-                        sqlite3_errmsg (db), db_error);
+    AgAccountChanges *changes;
+    GError *error_int = NULL;
+    AgDbScript *script;
+
+    script = _ag_account_get_store_script (account, &error_int);
+    if (G_UNLIKELY (error_int))
+    {
+        g_warning ("%s: %s", G_STRFUNC, error_int->message);
+        g_propagate_error (error, error_int);
+        return FALSE;
+    }
+
+    changes = _ag_account_steal_changes (account);
+
+    _ag_manager_exec_transaction_blocking (manager, script,
+                                           changes, account,
+                                           &error_int);
+    _ag_account_changes_free (changes);
+
+    if (G_UNLIKELY (error_int))
+    {
+        g_warning ("%s: %s", G_STRFUNC, error_int->message);
+        g_propagate_error (error, error_int);
+        return FALSE;
+    }
+
+    return TRUE;
 }
 
 void
-_ag_manager_exec_transaction (AgManager *manager, const gchar *sql,
-                              AgAccountChanges *changes, AgAccount *account,
-                              GTask *task)
+_ag_manager_store_async (AgManager *manager, AgAccount *account,
+                         GTask *task)
 {
     AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
-    GError *error = NULL;
-    int ret;
 
-    ret = prepare_transaction_statements (priv);
-    if (G_UNLIKELY (ret != SQLITE_OK))
+    if (priv->is_readonly)
     {
-        error = sqlite_error_to_gerror (ret, priv->db);
-        goto finish;
+        ag_manager_store_dbus_async (manager, account, task);
     }
+    else
+    {
+        ag_manager_store_local_async (manager, account, task);
+    }
+}
+
+gboolean
+_ag_manager_store_sync (AgManager *manager, AgAccount *account,
+                        GError **error)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
 
-    ret = sqlite3_step (priv->begin_stmt);
-    if (ret == SQLITE_BUSY)
+    if (priv->is_readonly)
+    {
+        return ag_manager_store_dbus_sync (manager, account, error);
+    }
+    else
     {
-        StoreCbData *sd;
+        return ag_manager_store_local_sync (manager, account, error);
+    }
+}
 
-        sd = g_slice_new (StoreCbData);
-        sd->manager = manager;
-        sd->account = account;
-        sd->changes = changes;
-        sd->task = task;
-        sd->sql = g_strdup (sql);
-        sd->id = g_idle_add ((GSourceFunc)exec_transaction_idle, sd);
-        priv->locks = g_list_prepend (priv->locks, sd);
-        return;
+/* The accounts stored by ag_manager_store_accounts_async() */
+typedef struct {
+    AgManager *manager;
+    GPtrArray *accounts;
+    GPtrArray *changes;
+    /* The scripts storing each account, owned by the writer once the
+     * store has started */
+    GPtrArray *scripts;
+} BulkStoreData;
+
+static void
+bulk_store_data_free (BulkStoreData *data)
+{
+    g_ptr_array_unref (data->accounts);
+    g_ptr_array_unref (data->changes);
+    g_ptr_array_unref (data->scripts);
+    g_slice_free (BulkStoreData, data);
+}
+
+/* Takes the changes of those @accounts which have any; returns %NULL on
+ * error, in which case no account is modified. */
+static BulkStoreData *
+bulk_store_data_new (AgManager *manager, GList *accounts, GError **error)
+{
+    BulkStoreData *data;
+    GHashTable *seen;
+    GList *list;
+    guint i;
+
+    data = g_slice_new0 (BulkStoreData);
+    data->manager = manager;
+    data->accounts = g_ptr_array_new_with_free_func (g_object_unref);
+    data->changes =
+        g_ptr_array_new_with_free_func ((GDestroyNotify)
+                                        _ag_account_changes_free);
+    data->scripts = g_ptr_array_new ();
+
+    seen = g_hash_table_new (NULL, NULL);
+    for (list = accounts; list != NULL; list = list->next)
+    {
+        AgAccount *account = list->data;
+        GError *error_int = NULL;
+        AgDbScript *script;
+
+        if (!g_hash_table_add (seen, account)) continue;
+
+        script = _ag_account_get_store_script (account, &error_int);
+        if (G_UNLIKELY (error_int != NULL))
+        {
+            g_propagate_error (error, error_int);
+            g_hash_table_unref (seen);
+            g_ptr_array_foreach (data->scripts, (GFunc)_ag_db_script_free,
+                                 NULL);
+            bulk_store_data_free (data);
+            return NULL;
+        }
+
+        /* Nothing to store */
+        if (script == NULL) continue;
+
+        g_ptr_array_add (data->accounts, g_object_ref (account));
+        g_ptr_array_add (data->scripts, script);
     }
+    g_hash_table_unref (seen);
 
-    if (ret != SQLITE_DONE)
+    /* All the scripts could be built: take the changes */
+    for (i = 0; i < data->accounts->len; i++)
     {
-        error = sqlite_error_to_gerror (ret, priv->db);
-        goto finish;
+        AgAccount *account = g_ptr_array_index (data->accounts, i);
+        g_ptr_array_add (data->changes, _ag_account_steal_changes (account));
     }
 
-    exec_transaction (manager, account, sql, changes, &error);
+    return data;
+}
+
+static void
+complete_bulk_store (BulkStoreData *data, const sqlite3_int64 *account_ids)
+{
+    guint i;
+
+    for (i = 0; i < data->accounts->len; i++)
+        complete_transaction (data->manager,
+                              g_ptr_array_index (data->accounts, i),
+                              g_ptr_array_index (data->changes, i),
+                              account_ids[i]);
+
+    /* Send all the D-Bus signals at once */
+    flush_account_changes (data->manager);
+}
+
+static void
+on_accounts_stored (const sqlite3_int64 *account_ids, GError *error,
+                    GTask *task)
+{
+    BulkStoreData *data = g_task_get_task_data (task);
+    AgManagerPrivate *priv = ag_manager_get_instance_private (data->manager);
 
-finish:
     if (error != NULL)
     {
         g_task_return_error (task, error);
     }
     else
     {
-        g_task_return_boolean (task, TRUE);
+        if (G_LIKELY (!priv->is_disposed))
+            complete_bulk_store (data, account_ids);
+        g_task_return_boolean (task, TRUE);
+    }
+    g_object_unref (task);
+}
+
+static void store_next_account (GTask *task);
+
+static void
+on_account_stored (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+    GTask *task = user_data;
+    GError *error = NULL;
+
+    if (!ag_account_store_finish (AG_ACCOUNT (object), res, &error))
+    {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+
+    store_next_account (task);
+}
+
+/* With a read-only DB, the accounts are stored one after the other by the
+ * D-Bus service */
+static void
+store_next_account (GTask *task)
+{
+    GQueue *queue = g_task_get_task_data (task);
+    AgAccount *account;
+
+    account = g_queue_pop_head (queue);
+    if (account == NULL)
+    {
+        g_task_return_boolean (task, TRUE);
+        g_object_unref (task);
+        return;
+    }
+
+    ag_account_store_async (account, g_task_get_cancellable (task),
+                            on_account_stored, task);
+    g_object_unref (account);
+}
+
+static void
+free_account_queue (GQueue *queue)
+{
+    g_queue_free_full (queue, g_object_unref);
+}
+
+static gboolean
+accounts_belong_to_manager (GList *accounts, AgManager *manager)
+{
+    GList *list;
+
+    for (list = accounts; list != NULL; list = list->next)
+    {
+        if (!AG_IS_ACCOUNT (list->data) ||
+            ag_account_get_manager (list->data) != manager)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * ag_manager_store_accounts_async:
+ * @manager: the #AgManager.
+ * @accounts: (element-type AgAccount): a list of #AgAccount objects created
+ * by @manager; accounts belonging to another #AgManager are not accepted.
+ * @cancellable: (allow-none): optional #GCancellable object, %NULL to ignore.
+ * @callback: (scope async): function to be called when the accounts have
+ * been stored.
+ * @user_data: pointer to user data, to be passed to @callback.
+ *
+ * Commits the changed settings of all the @accounts to the account database,
+ * in a single transaction: either all the changes are stored, or none of
+ * them. This is much faster than calling ag_account_store_async() on each
+ * account, and the other processes are notified of all the changes at once.
+ * The accounts without changes are ignored.
+ *
+ * If the account database is read-only, the accounts are stored one after
+ * the other through the accounts D-Bus service, and the operation is not
+ * atomic.
+ *
+ * Since: 1.27
+ */
+void
+ag_manager_store_accounts_async (AgManager *manager, GList *accounts,
+                                 GCancellable *cancellable,
+                                 GAsyncReadyCallback callback,
+                                 gpointer user_data)
+{
+    AgManagerPrivate *priv;
+    BulkStoreData *data = NULL;
+    AgDbWriter *writer;
+    GError *error = NULL;
+    GTask *task;
+
+    g_return_if_fail (AG_IS_MANAGER (manager));
+    g_return_if_fail (accounts_belong_to_manager (accounts, manager));
+    priv = ag_manager_get_instance_private (manager);
+
+    task = g_task_new (manager, cancellable, callback, user_data);
+    g_task_set_source_tag (task, ag_manager_store_accounts_async);
+
+    if (priv->is_readonly)
+    {
+        GQueue *queue = g_queue_new ();
+        GList *list;
+
+        for (list = accounts; list != NULL; list = list->next)
+            g_queue_push_tail (queue, g_object_ref (list->data));
+        g_task_set_task_data (task, queue, (GDestroyNotify)free_account_queue);
+        store_next_account (task);
+        return;
+    }
+
+    writer = get_writer (manager, &error);
+    if (G_LIKELY (writer != NULL))
+        data = bulk_store_data_new (manager, accounts, &error);
+    if (G_UNLIKELY (error != NULL))
+    {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+
+    if (data->accounts->len == 0)
+    {
+        bulk_store_data_free (data);
+        g_task_return_boolean (task, TRUE);
+        g_object_unref (task);
+        return;
+    }
+
+    g_task_set_task_data (task, data, (GDestroyNotify)bulk_store_data_free);
+    _ag_db_writer_exec_async (writer, (AgDbScript **)data->scripts->pdata,
+                              data->scripts->len, cancellable,
+                              (AgDbWriterCallback)on_accounts_stored, task);
+}
+
+/**
+ * ag_manager_store_accounts_finish:
+ * @manager: the #AgManager.
+ * @res: A #GAsyncResult obtained from the #GAsyncReadyCallback passed to
+ * ag_manager_store_accounts_async().
+ * @error: return location for error, or %NULL.
+ *
+ * Finishes the store operation started by ag_manager_store_accounts_async().
+ *
+ * Returns: %TRUE on success, %FALSE otherwise.
+ *
+ * Since: 1.27
+ */
+gboolean
+ag_manager_store_accounts_finish (AgManager *manager, GAsyncResult *res,
+                                  GError **error)
+{
+    g_return_val_if_fail (AG_IS_MANAGER (manager), FALSE);
+    g_return_val_if_fail (g_task_is_valid (res, manager), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+/**
+ * ag_manager_store_accounts_blocking:
+ * @manager: the #AgManager.
+ * @accounts: (element-type AgAccount): a list of #AgAccount objects created
+ * by @manager.
+ * @error: return location for error, or %NULL.
+ *
+ * Commits the changed settings of all the @accounts to the account database;
+ * this is the blocking version of ag_manager_store_accounts_async().
+ *
+ * Returns: %TRUE on success, %FALSE otherwise.
+ *
+ * Since: 1.27
+ */
+gboolean
+ag_manager_store_accounts_blocking (AgManager *manager, GList *accounts,
+                                    GError **error)
+{
+    AgManagerPrivate *priv;
+    BulkStoreData *data;
+    AgDbWriter *writer;
+    sqlite3_int64 *account_ids;
+    gint64 end_time;
+    gboolean ok;
+
+    g_return_val_if_fail (AG_IS_MANAGER (manager), FALSE);
+    g_return_val_if_fail (accounts_belong_to_manager (accounts, manager),
+                          FALSE);
+    priv = ag_manager_get_instance_private (manager);
+
+    if (priv->is_readonly)
+    {
+        GList *list;
+
+        for (list = accounts; list != NULL; list = list->next)
+            if (!ag_account_store_blocking (list->data, error))
+                return FALSE;
+        return TRUE;
     }
 
-    _ag_account_store_completed (account, changes);
+    writer = get_writer (manager, error);
+    if (G_UNLIKELY (writer == NULL)) return FALSE;
+
+    data = bulk_store_data_new (manager, accounts, error);
+    if (G_UNLIKELY (data == NULL)) return FALSE;
+
+    account_ids = g_new0 (sqlite3_int64, data->accounts->len);
+    end_time = g_get_monotonic_time () + BLOCKING_STORE_TIMEOUT;
+    ok = data->accounts->len == 0 ||
+        _ag_db_writer_exec (writer, (AgDbScript **)data->scripts->pdata,
+                            data->scripts->len, end_time, account_ids, error);
+    if (ok)
+        complete_bulk_store (data, account_ids);
+
+    g_free (account_ids);
+    bulk_store_data_free (data);
+    return ok;
 }
 
-void
-_ag_manager_exec_transaction_blocking (AgManager *manager, const gchar *sql,
-                                       AgAccountChanges *changes,
-                                       AgAccount *account,
-                                       GError **error)
+/* Runs @stmt until completion, calling @callback on each row; the statement
+ * is not finalized. Returns the number of rows processed, or -1 if an error
+ * occurred. */
+static gint
+step_statement (AgManager *manager, sqlite3_stmt *stmt,
+                AgQueryCallback callback, gpointer user_data)
 {
-    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
-    gint sleep_ms = 200;
+    sqlite3 *db = sqlite3_db_handle (stmt);
     int ret;
+    gint rows = 0;
 
-    ret = prepare_transaction_statements (priv);
-    if (G_UNLIKELY (ret != SQLITE_OK))
+    do
     {
-        *error = sqlite_error_to_gerror (ret, priv->db);
-        return;
-    }
+        ret = sqlite3_step (stmt);
 
-    ret = sqlite3_step (priv->begin_stmt);
-    while (ret == SQLITE_BUSY)
-    {
-        /* TODO: instead of this loop, use a semaphore or some other non
-         * polling mechanism */
-        if (sleep_ms > 30000)
+        switch (ret)
         {
-            DEBUG_LOCKS ("Database locked for more than 30 seconds; "
-                         "giving up!");
-            break;
-        }
-        DEBUG_LOCKS ("Database locked, sleeping for %ums", sleep_ms);
-        g_usleep (sleep_ms * 1000);
-        sleep_ms *= 2;
-        ret = sqlite3_step (priv->begin_stmt);
-    }
+            case SQLITE_DONE:
+                break;
 
-    if (ret != SQLITE_DONE)
-    {
-        *error = sqlite_error_to_gerror (ret, priv->db);
-        return;
-    }
+            case SQLITE_ROW:
+                if (callback == NULL || callback (stmt, user_data))
+                {
+                    rows++;
+                }
+                break;
+
+            /* If the DB is locked, the busy handler already waited for
+             * db_timeout milliseconds */
+            default:
+                set_error_from_db (manager, db);
+                g_warning ("%s: runtime error while executing \"%s\": %s",
+                           G_STRFUNC, sqlite3_sql (stmt), sqlite3_errmsg (db));
+                return -1;
+        }
+    } while (ret != SQLITE_DONE);
 
-    exec_transaction (manager, account, sql, changes, error);
+    return rows;
 }
 
-static void
-ag_manager_store_local_async (AgManager *manager, AgAccount *account,
-                              GTask *task)
+gint
+_ag_manager_exec_query (AgManager *manager,
+                        AgQueryCallback callback, gpointer user_data,
+                        const gchar *sql)
 {
-    AgAccountChanges *changes;
-    GError *error = NULL;
-    gchar *sql;
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    DbConnection *conn;
+    int ret;
+    sqlite3_stmt *stmt;
+    gint rows = -1;
 
-    sql = _ag_account_get_store_sql (account, &error);
-    if (G_UNLIKELY (error))
+    g_return_val_if_fail (AG_IS_MANAGER (manager), 0);
+    g_return_val_if_fail (priv->db != NULL, 0);
+
+    conn = acquire_connection (manager);
+    ret = sqlite3_prepare_v2 (conn->db, sql, -1, &stmt, NULL);
+    if (ret == SQLITE_OK)
     {
-        g_task_return_error (task, error);
-        g_object_unref (task);
-        return;
-    }
+        DEBUG_QUERIES ("about to run:\n%s", sql);
 
-    changes = _ag_account_steal_changes (account);
+        rows = step_statement (manager, stmt, callback, user_data);
+        sqlite3_finalize (stmt);
+    }
+    else
+    {
+        g_warning ("%s: can't compile SQL statement \"%s\": %s", G_STRFUNC, sql,
+                   sqlite3_errmsg (conn->db));
+    }
+    release_connection (manager, conn);
 
-    _ag_manager_exec_transaction (manager, sql, changes, account, task);
-    g_free (sql);
+    return rows;
 }
 
 static gboolean
-ag_manager_store_local_sync (AgManager *manager, AgAccount *account,
-                             GError **error)
+bind_parameters (sqlite3_stmt *stmt, const gchar *param_types, va_list args)
 {
-    AgAccountChanges *changes;
-    GError *error_int = NULL;
-    gchar *sql;
+    const gchar *type;
+    GBytes *bytes;
+    int ret = SQLITE_OK;
+    int i;
 
-    sql = _ag_account_get_store_sql (account, &error_int);
-    if (G_UNLIKELY (error_int))
+    for (type = param_types, i = 1; *type != '\0' && ret == SQLITE_OK;
+         type++, i++)
     {
-        g_warning ("%s: %s", G_STRFUNC, error_int->message);
-        g_propagate_error (error, error_int);
-        return FALSE;
+        switch (*type)
+        {
+        case 'i':
+            ret = sqlite3_bind_int (stmt, i, va_arg (args, gint));
+            break;
+        case 'u':
+            ret = sqlite3_bind_int64 (stmt, i, va_arg (args, guint));
+            break;
+        case 'x':
+            ret = sqlite3_bind_int64 (stmt, i, va_arg (args, gint64));
+            break;
+        case 's':
+            /* NULL strings are bound as NULL */
+            ret = sqlite3_bind_text (stmt, i, va_arg (args, const gchar *),
+                                     -1, SQLITE_STATIC);
+            break;
+        case 'b':
+            bytes = va_arg (args, GBytes *);
+            ret = sqlite3_bind_blob (stmt, i,
+                                     g_bytes_get_data (bytes, NULL),
+                                     g_bytes_get_size (bytes),
+                                     SQLITE_STATIC);
+            break;
+        default:
+            g_return_val_if_reached (FALSE);
+        }
     }
 
-    changes = _ag_account_steal_changes (account);
+    return ret == SQLITE_OK;
+}
 
-    _ag_manager_exec_transaction_blocking (manager, sql,
-                                           changes, account,
-                                           &error_int);
-    g_free (sql);
-    _ag_account_changes_free (changes);
+static gint
+exec_prepared_valist (AgManager *manager, DbConnection *conn,
+                      AgQueryCallback callback, gpointer user_data,
+                      const gchar *sql, const gchar *param_types,
+                      va_list args)
+{
+    sqlite3_stmt *stmt, *own_stmt = NULL;
+    gboolean ok;
+    gint rows;
+    int ret;
 
-    if (G_UNLIKELY (error_int))
+    stmt = g_hash_table_lookup (conn->statements, sql);
+    if (stmt == NULL || sqlite3_stmt_busy (stmt))
     {
-        g_warning ("%s: %s", G_STRFUNC, error_int->message);
-        g_propagate_error (error, error_int);
-        return FALSE;
-    }
+        ret = sqlite3_prepare_v2 (conn->db, sql, -1, &own_stmt, NULL);
+        if (ret != SQLITE_OK)
+        {
+            g_warning ("%s: can't compile SQL statement \"%s\": %s",
+                       G_STRFUNC, sql, sqlite3_errmsg (conn->db));
+            return -1;
+        }
 
-    return TRUE;
-}
+        /* A busy statement is being run by a caller of ours: use a new one
+         * just for this time */
+        if (stmt == NULL)
+        {
+            g_hash_table_insert (conn->statements, g_strdup (sql), own_stmt);
+            own_stmt = NULL;
+            stmt = g_hash_table_lookup (conn->statements, sql);
+        }
+        else
+        {
+            stmt = own_stmt;
+        }
+    }
 
-void
-_ag_manager_store_async (AgManager *manager, AgAccount *account,
-                         GTask *task)
-{
-    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    ok = bind_parameters (stmt, param_types, args);
 
-    if (priv->is_readonly)
+    if (G_LIKELY (ok))
     {
-        ag_manager_store_dbus_async (manager, account, task);
+        DEBUG_QUERIES ("about to run:\n%s", sql);
+        rows = step_statement (manager, stmt, callback, user_data);
     }
     else
     {
-        ag_manager_store_local_async (manager, account, task);
+        g_warning ("%s: can't bind parameters of \"%s\": %s",
+                   G_STRFUNC, sql, sqlite3_errmsg (conn->db));
+        rows = -1;
     }
-}
-
-gboolean
-_ag_manager_store_sync (AgManager *manager, AgAccount *account,
-                        GError **error)
-{
-    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
 
-    if (priv->is_readonly)
+    if (own_stmt != NULL)
     {
-        return ag_manager_store_dbus_sync (manager, account, error);
+        sqlite3_finalize (own_stmt);
     }
     else
     {
-        return ag_manager_store_local_sync (manager, account, error);
+        sqlite3_reset (stmt);
+        sqlite3_clear_bindings (stmt);
     }
-}
 
-static guint
-timespec_diff_ms(struct timespec *ts1, struct timespec *ts0)
-{
-    return (ts1->tv_sec - ts0->tv_sec) * 1000 +
-        (ts1->tv_nsec - ts0->tv_nsec) / 1000000;
+    return rows;
 }
 
-/* Executes an SQL statement, and optionally calls
- * the callback for every row of the result.
- * Returns the number of rows fetched.
+/**
+ * _ag_manager_exec_prepared:
+ * @manager: the #AgManager.
+ * @callback: (allow-none): function called on each row of the result.
+ * @user_data: data for @callback.
+ * @sql: a single SQL statement, with "?" parameters.
+ * @param_types: the types of the parameters: "i" for #gint, "u" for #guint,
+ * "x" for #gint64, "s" for strings and "b" for #GBytes blobs.
+ * @...: the values of the parameters.
+ *
+ * Like _ag_manager_exec_query(), but the statement is prepared only the first
+ * time, and then reused; the parameters are bound to it instead of being
+ * formatted into the SQL text. @sql should therefore be a constant template.
+ *
+ * The query runs on one of the read-only connections, so this can be called
+ * from any thread; @sql must not modify the DB.
+ *
+ * Returns: the number of rows processed, or -1 if an error occurred.
  */
 gint
-_ag_manager_exec_query (AgManager *manager,
-                        AgQueryCallback callback, gpointer user_data,
-                        const gchar *sql)
+_ag_manager_exec_prepared (AgManager *manager,
+                           AgQueryCallback callback, gpointer user_data,
+                           const gchar *sql, const gchar *param_types, ...)
 {
     AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
-    sqlite3 *db;
-    int ret;
-    sqlite3_stmt *stmt;
-    struct timespec ts0, ts1;
-    gint rows = 0;
+    DbConnection *conn;
+    va_list args;
+    gint rows;
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), 0);
-    db = priv->db;
-
-    g_return_val_if_fail (db != NULL, 0);
-
-    ret = sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL);
-    if (ret != SQLITE_OK)
-    {
-        g_warning ("%s: can't compile SQL statement \"%s\": %s", G_STRFUNC, sql,
-                   sqlite3_errmsg (db));
-        return 0;
-    }
+    g_return_val_if_fail (priv->db != NULL, 0);
 
-    DEBUG_QUERIES ("about to run:\n%s", sql);
+    conn = acquire_connection (manager);
+    va_start (args, param_types);
+    rows = exec_prepared_valist (manager, conn, callback, user_data,
+                                 sql, param_types, args);
+    va_end (args);
+    release_connection (manager, conn);
 
-    /* get the current time, to abort the operation in case the DB is locked
-     * for longer than db_timeout. */
-    clock_gettime(CLOCK_MONOTONIC, &ts0);
-
-    do
-    {
-        ret = sqlite3_step (stmt);
-
-        switch (ret)
-        {
-            case SQLITE_DONE:
-                break;
-
-            case SQLITE_ROW:
-                if (callback == NULL || callback (stmt, user_data))
-                {
-                    rows++;
-                }
-                break;
+    return rows;
+}
 
-            case SQLITE_BUSY:
-                clock_gettime(CLOCK_MONOTONIC, &ts1);
-                if (timespec_diff_ms(&ts1, &ts0) < priv->db_timeout)
-                {
-                    /* If timeout was specified and table is locked,
-                     * wait instead of executing default runtime
-                     * error action. Otherwise, fall through to it. */
-                    sched_yield ();
-                    break;
-                }
+/* Like _ag_manager_exec_prepared(), but for the statements which write to
+ * the DB outside of the store transactions: they run on the main connection,
+ * one thread at a time. */
+static gint
+exec_write (AgManager *manager, const gchar *sql, const gchar *param_types,
+            ...)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    va_list args;
+    gint rows;
 
-            default:
-                set_error_from_db (manager);
-                g_warning ("%s: runtime error while executing \"%s\": %s",
-                           G_STRFUNC, sql, sqlite3_errmsg (db));
-                sqlite3_finalize (stmt);
-                return rows;
-        }
-    } while (ret != SQLITE_DONE);
+    g_return_val_if_fail (priv->db != NULL, 0);
 
-    sqlite3_finalize (stmt);
+    g_rec_mutex_lock (&priv->main_lock);
+    va_start (args, param_types);
+    rows = exec_prepared_valist (manager, &priv->main_conn, NULL, NULL,
+                                 sql, param_types, args);
+    va_end (args);
+    g_rec_mutex_unlock (&priv->main_lock);
 
     return rows;
 }
@@ -2639,6 +4833,47 @@ ag_manager_get_provider (AgManager *manager, const gchar *provider_name)
     return _ag_provider_new_from_file (provider_name);
 }
 
+/* Returns a new reference to the array of the installed providers, which is
+ * never modified */
+static GPtrArray *
+get_providers (AgManager *manager)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    GList *providers, *list;
+    GPtrArray *array = NULL;
+    guint generation;
+
+    generation = _ag_catalog_get_generation ();
+    g_mutex_lock (&priv->providers_lock);
+    if (priv->providers != NULL && priv->providers_generation == generation)
+        array = g_ptr_array_ref (priv->providers);
+    g_mutex_unlock (&priv->providers_lock);
+    if (array != NULL) return array;
+
+    /* Start watching before listing, not to miss any change */
+    watch_data_dirs (manager);
+
+    providers = _ag_providers_list (manager);
+    array = g_ptr_array_new_full (g_list_length (providers),
+                                  (GDestroyNotify)ag_provider_unref);
+    for (list = providers; list != NULL; list = list->next)
+        g_ptr_array_add (array, list->data);
+    g_list_free (providers);
+
+    /* Unless the manager has been disposed meanwhile */
+    g_mutex_lock (&priv->providers_lock);
+    if (G_LIKELY (!priv->is_disposed))
+    {
+        if (priv->providers != NULL)
+            g_ptr_array_unref (priv->providers);
+        priv->providers = g_ptr_array_ref (array);
+        priv->providers_generation = generation;
+    }
+    g_mutex_unlock (&priv->providers_lock);
+
+    return array;
+}
+
 /**
  * ag_manager_list_providers:
  * @manager: the #AgManager.
@@ -2651,9 +4886,57 @@ ag_manager_get_provider (AgManager *manager, const gchar *provider_name)
 GList *
 ag_manager_list_providers (AgManager *manager)
 {
+    GPtrArray *providers;
+    GList *list = NULL;
+    guint i;
+
+    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
+
+    providers = get_providers (manager);
+    for (i = providers->len; i > 0; i--)
+        list = g_list_prepend (list,
+                               ag_provider_ref (g_ptr_array_index (providers,
+                                                                   i - 1)));
+    g_ptr_array_unref (providers);
+    return list;
+}
+
+/**
+ * ag_manager_find_providers_for_domain:
+ * @manager: the #AgManager.
+ * @domain: a domain name.
+ *
+ * Finds the installed providers which support @domain, according to
+ * ag_provider_match_domain(). The providers are loaded and their domain
+ * regular expressions compiled only once, so this is much faster than
+ * matching each of the providers returned by ag_manager_list_providers().
+ *
+ * Returns: (transfer full) (element-type AgProvider): a list of #AgProvider,
+ * which must be then free'd with ag_provider_list_free().
+ *
+ * Since: 1.27
+ */
+GList *
+ag_manager_find_providers_for_domain (AgManager *manager,
+                                      const gchar *domain)
+{
+    GPtrArray *providers;
+    GList *list = NULL;
+    guint i;
+
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
+    g_return_val_if_fail (domain != NULL, NULL);
 
-    return _ag_providers_list (manager);
+    providers = get_providers (manager);
+    for (i = providers->len; i > 0; i--)
+    {
+        AgProvider *provider = g_ptr_array_index (providers, i - 1);
+
+        if (ag_provider_match_domain (provider, domain))
+            list = g_list_prepend (list, ag_provider_ref (provider));
+    }
+    g_ptr_array_unref (providers);
+    return list;
 }
 
 /**
@@ -2774,6 +5057,50 @@ ag_manager_get_abort_on_db_timeout (AgManager *manager)
     return priv->abort_on_db_timeout;
 }
 
+/* Gets the service type @service_type_name from the manager cache, loading it
+ * if needed. Returns a new reference. */
+AgServiceType *
+_ag_manager_get_service_type (AgManager *manager,
+                              const gchar *service_type_name)
+{
+    AgManagerPrivate *priv = ag_manager_get_instance_private (manager);
+    AgServiceType *service_type;
+    guint generation;
+
+    g_return_val_if_fail (service_type_name != NULL, NULL);
+
+    generation = _ag_catalog_get_generation ();
+    g_mutex_lock (&priv->service_types_lock);
+
+    /* Already disposed */
+    if (G_UNLIKELY (priv->service_types == NULL))
+    {
+        g_mutex_unlock (&priv->service_types_lock);
+        return _ag_service_type_new_from_file (service_type_name);
+    }
+
+    if (priv->service_types_generation != generation)
+    {
+        g_hash_table_remove_all (priv->service_types);
+        priv->service_types_generation = generation;
+    }
+
+    service_type = g_hash_table_lookup (priv->service_types,
+                                        service_type_name);
+    if (service_type == NULL)
+    {
+        service_type = _ag_service_type_new_from_file (service_type_name);
+        if (service_type != NULL)
+            g_hash_table_insert (priv->service_types,
+                                 g_strdup (service_type_name), service_type);
+    }
+    if (service_type != NULL)
+        ag_service_type_ref (service_type);
+    g_mutex_unlock (&priv->service_types_lock);
+
+    return service_type;
+}
+
 /**
  * ag_manager_list_service_types:
  * @manager: the #AgManager.
@@ -2796,7 +5123,8 @@ ag_manager_list_service_types (AgManager *manager)
  * @manager: the #AgManager.
  * @service_type: the name of the service type.
  *
- * Instantiate the service type with the name @service_type.
+ * Instantiate the service type with the name @service_type. Service types
+ * are cached by the manager, and shared with its #AgService objects.
  *
  * Returns: (transfer full): an #AgServiceType, which must be free'd with
  * ag_service_type_unref() when no longer required.
@@ -2806,11 +5134,7 @@ ag_manager_load_service_type (AgManager *manager, const gchar *service_type)
 {
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
 
-    /* Given the small size of the service type file, and the unlikely need to
-     * load them more than once, we don't cache them in the manager. But this
-     * might change in the future.
-     */
-    return _ag_service_type_new_from_file (service_type);
+    return _ag_manager_get_service_type (manager, service_type);
 }
 
 /**
@@ -2828,26 +5152,38 @@ GList *
 ag_manager_list_applications_by_service (AgManager *manager,
                                          AgService *service)
 {
+    AgManagerPrivate *priv;
+    AgManagerCatalog *catalog;
     GList *applications = NULL;
-    GList *all_applications, *list;
+    guint i;
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
     g_return_val_if_fail (service != NULL, NULL);
+    priv = ag_manager_get_instance_private (manager);
 
-    all_applications = _ag_applications_list (manager);
-    for (list = all_applications; list != NULL; list = list->next)
+    g_rec_mutex_lock (&priv->catalog_lock);
+    catalog = get_catalog_with_applications (manager);
+    if (g_hash_table_lookup (catalog->services_by_name, service->name) != NULL)
     {
-        AgApplication *application = list->data;
+        applications =
+            catalog_index_lookup (catalog->applications_by_service,
+                                  service->name,
+                                  (GBoxedCopyFunc)ag_application_ref);
+        g_rec_mutex_unlock (&priv->catalog_lock);
+        return applications;
+    }
+
+    /* The service is not installed: it's not in the index */
+    for (i = catalog->applications->len; i > 0; i--)
+    {
+        AgApplication *application =
+            g_ptr_array_index (catalog->applications, i - 1);
+
         if (ag_application_supports_service (application, service))
-        {
-            applications = g_list_prepend (applications, application);
-        }
-        else
-        {
-            ag_application_unref (application);
-        }
+            applications = g_list_prepend (applications,
+                                           ag_application_ref (application));
     }
-    g_list_free (all_applications);
+    g_rec_mutex_unlock (&priv->catalog_lock);
 
     return applications;
 }
@@ -2870,3 +5206,61 @@ ag_manager_list_services_by_application (AgManager *manager,
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
     return _ag_application_list_supported_services (application, manager);
 }
+
+/**
+ * ag_manager_compile_catalog:
+ * @manager: the #AgManager.
+ * @directory: (allow-none): a directory holding application, provider,
+ * service or service type files, or %NULL.
+ * @error: return location for error, or %NULL.
+ *
+ * Parses all the data files found in @directory and writes a compiled
+ * catalog of them into the same directory. When a directory has an up to date
+ * catalog, #AgManager reads the data from it instead of parsing the XML
+ * files.
+ * The catalog is ignored as soon as files are added to, removed from or
+ * renamed in @directory; files which are modified in place are not detected,
+ * so the catalog must be compiled again after installing or modifying any data
+ * file.
+ * If @directory is %NULL, all the existing directories of the data files
+ * search path are compiled.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise.
+ *
+ * Since: 1.27
+ */
+gboolean
+ag_manager_compile_catalog (AgManager *manager, const gchar *directory,
+                            GError **error)
+{
+    static const struct {
+        const gchar *env_var;
+        const gchar *subdir;
+    } data_dirs[] = {
+        { "AG_APPLICATIONS", APPLICATION_FILES_DIR },
+        { "AG_PROVIDERS", PROVIDER_FILES_DIR },
+        { "AG_SERVICES", SERVICE_FILES_DIR },
+        { "AG_SERVICE_TYPES", SERVICE_TYPE_FILES_DIR },
+    };
+    gchar **dirs, **dirname;
+    gboolean ok = TRUE;
+    guint i;
+
+    g_return_val_if_fail (AG_IS_MANAGER (manager), FALSE);
+
+    if (directory != NULL)
+        return _ag_catalog_compile (directory, error);
+
+    for (i = 0; ok && i < G_N_ELEMENTS (data_dirs); i++)
+    {
+        dirs = _ag_get_data_dirs (data_dirs[i].env_var, data_dirs[i].subdir);
+        for (dirname = dirs; ok && *dirname != NULL; dirname++)
+        {
+            if (!g_file_test (*dirname, G_FILE_TEST_IS_DIR)) continue;
+            ok = _ag_catalog_compile (*dirname, error);
+        }
+        g_strfreev (dirs);
+    }
+
+    return ok;
+}
@@ -32,6 +32,7 @@
 #warning "Only <libaccounts-glib.h> should be included directly."
 #endif
 
+#include <gio/gio.h>
 #include <glib-object.h>
 #include <libaccounts-glib/ag-types.h>
 
@@ -72,6 +73,22 @@ struct _AgManager
     AgManagerPrivate *priv;
 };
 
+/**
+ * AgAccountLoadFlags:
+ * @AG_ACCOUNT_LOAD_NONE: only the account itself is loaded; the settings of
+ * each service are loaded when the service is first selected.
+ * @AG_ACCOUNT_LOAD_SETTINGS: the settings of all the services are loaded
+ * too, as with ag_account_preload().
+ *
+ * Flags for the functions loading accounts.
+ *
+ * Since: 1.27
+ */
+typedef enum {
+    AG_ACCOUNT_LOAD_NONE = 0,
+    AG_ACCOUNT_LOAD_SETTINGS = 1 << 0,
+} AgAccountLoadFlags;
+
 GType ag_manager_get_type (void) G_GNUC_CONST;
 
 AgManager *ag_manager_new (void);
@@ -91,6 +108,15 @@ AgAccount *ag_manager_get_account (AgManager *manager,
 AgAccount *ag_manager_load_account (AgManager *manager,
                                     AgAccountId account_id,
                                     GError **error);
+AgAccount *ag_manager_load_account_full (AgManager *manager,
+                                         AgAccountId account_id,
+                                         AgAccountLoadFlags flags,
+                                         GError **error);
+GList *ag_manager_load_accounts (AgManager *manager,
+                                 const AgAccountId *ids,
+                                 guint n_ids,
+                                 AgAccountLoadFlags flags,
+                                 GError **error);
 AgAccount *ag_manager_create_account (AgManager *manager,
                                       const gchar *provider_name);
 
@@ -109,6 +135,8 @@ const gchar *ag_manager_get_service_type (AgManager *manager);
 AgProvider *ag_manager_get_provider (AgManager *manager,
                                      const gchar *provider_name);
 GList *ag_manager_list_providers (AgManager *manager);
+GList *ag_manager_find_providers_for_domain (AgManager *manager,
+                                             const gchar *domain);
 
 void ag_manager_set_db_timeout (AgManager *manager, guint timeout_ms);
 guint ag_manager_get_db_timeout (AgManager *manager);
@@ -124,6 +152,21 @@ AgApplication *ag_manager_get_application (AgManager *self,
 GList *ag_manager_list_applications_by_service (AgManager *manager,
                                                 AgService *service);
 
+gboolean ag_manager_compile_catalog (AgManager *manager,
+                                     const gchar *directory,
+                                     GError **error);
+
+void ag_manager_store_accounts_async (AgManager *manager, GList *accounts,
+                                      GCancellable *cancellable,
+                                      GAsyncReadyCallback callback,
+                                      gpointer user_data);
+gboolean ag_manager_store_accounts_finish (AgManager *manager,
+                                           GAsyncResult *res,
+                                           GError **error);
+gboolean ag_manager_store_accounts_blocking (AgManager *manager,
+                                             GList *accounts,
+                                             GError **error);
+
 G_END_DECLS
 
 #endif /* _AG_MANAGER_H_ */
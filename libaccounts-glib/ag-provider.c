@@ -43,15 +43,235 @@
 
 #include "ag-provider.h"
 
+#include "ag-catalog.h"
 #include "ag-internals.h"
 #include "ag-util.h"
 #include <libxml/xmlreader.h>
 #include <string.h>
 
+/* The domains regex, compiled; the literals are used to discard most of the
+ * non matching domains without running the regex */
+typedef struct _AgDomainMatcher {
+    GRegex *regex;
+    /* If TRUE, a matching domain ends with one of @suffixes or contains one of
+     * @substrings */
+    gboolean use_literals;
+    gchar **suffixes;
+    gchar **substrings;
+} AgDomainMatcher;
+
 G_DEFINE_BOXED_TYPE (AgProvider, ag_provider,
                      (GBoxedCopyFunc)ag_provider_ref,
                      (GBoxedFreeFunc)ag_provider_unref);
 
+/* Returns the last character of the POSIX class (such as "[:alpha:]") at
+ * @p, or sets @ok to %FALSE if it's not a valid one */
+static const gchar *
+skip_posix_class (const gchar *p, gboolean *ok)
+{
+    const gchar *start, *name;
+
+    start = (p[2] == '^') ? p + 3 : p + 2;
+    name = start;
+    while (g_ascii_isalpha (*name)) name++;
+    if (name == start || name[0] != ':' || name[1] != ']')
+    {
+        *ok = FALSE;
+        return p;
+    }
+    return name + 1;
+}
+
+/* Collects the literal text which each top-level alternative of @pattern
+ * ends with, into @suffixes if the alternative is anchored at the end of the
+ * string, into @substrings otherwise. Returns %FALSE if some alternative
+ * doesn't end with a literal, or the pattern is too complex to tell. */
+static gboolean
+get_pattern_literals (const gchar *pattern,
+                      GPtrArray *suffixes, GPtrArray *substrings)
+{
+    GString *literal;
+    gboolean anchored = FALSE;
+    gboolean ok = TRUE;
+    gint depth = 0;
+    const gchar *p;
+
+    /* inline options and assertions */
+    if (strstr (pattern, "(?") != NULL) return FALSE;
+
+    literal = g_string_new (NULL);
+    for (p = pattern; ok; p++)
+    {
+        if (*p == '\0' || (*p == '|' && depth == 0))
+        {
+            if (literal->len == 0)
+            {
+                ok = FALSE;
+                break;
+            }
+            g_ptr_array_add (anchored ? suffixes : substrings,
+                             g_strndup (literal->str, literal->len));
+            g_string_truncate (literal, 0);
+            anchored = FALSE;
+            if (*p == '\0') break;
+            continue;
+        }
+
+        /* whatever follows a "$" must be the end of the alternative */
+        if (anchored)
+        {
+            ok = FALSE;
+            break;
+        }
+
+        switch (*p)
+        {
+        case '\\':
+            p++;
+            if (*p == '\0')
+                ok = FALSE;
+            else if (strchr ("bBdDsSwW", *p) != NULL)
+                /* character classes and word boundaries */
+                g_string_truncate (literal, 0);
+            else if (g_ascii_isalnum (*p))
+                /* character codes, back-references, properties...: the
+                 * text following them is not literal */
+                ok = FALSE;
+            else if (depth == 0)
+                g_string_append_c (literal, *p);
+            break;
+        case '[':
+            /* skip the character class; "]" is literal if it comes first */
+            p++;
+            if (*p == '^') p++;
+            if (*p == ']') p++;
+            while (*p != ']' && *p != '\0' && ok)
+            {
+                if (*p == '\\' && p[1] != '\0')
+                    p++;
+                else if (*p == '[' && p[1] == ':')
+                    p = skip_posix_class (p, &ok);
+                else if (*p == '[' && (p[1] == '=' || p[1] == '.'))
+                    /* collating elements: not supported */
+                    ok = FALSE;
+                p++;
+            }
+            if (*p == '\0') ok = FALSE;
+            g_string_truncate (literal, 0);
+            break;
+        case '(':
+            depth++;
+            g_string_truncate (literal, 0);
+            break;
+        case ')':
+            depth--;
+            g_string_truncate (literal, 0);
+            break;
+        case '$':
+            if (depth == 0)
+                anchored = TRUE;
+            else
+                g_string_truncate (literal, 0);
+            break;
+        case '.': case '^': case '|':
+        case '*': case '+': case '?': case '{': case '}':
+            /* quantifiers make the previous characters optional */
+            g_string_truncate (literal, 0);
+            break;
+        default:
+            if (depth == 0)
+                g_string_append_c (literal, *p);
+            else
+                g_string_truncate (literal, 0);
+        }
+    }
+
+    g_string_free (literal, TRUE);
+    return ok && depth == 0;
+}
+
+static void
+domain_matcher_free (AgDomainMatcher *matcher)
+{
+    g_clear_pointer (&matcher->regex, g_regex_unref);
+    g_strfreev (matcher->suffixes);
+    g_strfreev (matcher->substrings);
+    g_slice_free (AgDomainMatcher, matcher);
+}
+
+static AgDomainMatcher *
+domain_matcher_new (const gchar *pattern)
+{
+    AgDomainMatcher *matcher;
+    GPtrArray *suffixes, *substrings;
+    GError *error = NULL;
+
+    matcher = g_slice_new0 (AgDomainMatcher);
+    matcher->regex = g_regex_new (pattern, G_REGEX_OPTIMIZE, 0, &error);
+    if (G_UNLIKELY (error != NULL))
+    {
+        g_warning ("Invalid domains regex \"%s\": %s",
+                   pattern, error->message);
+        g_error_free (error);
+        return matcher;
+    }
+
+    suffixes = g_ptr_array_new ();
+    substrings = g_ptr_array_new ();
+    matcher->use_literals =
+        get_pattern_literals (pattern, suffixes, substrings);
+    g_ptr_array_add (suffixes, NULL);
+    g_ptr_array_add (substrings, NULL);
+    matcher->suffixes = (gchar **)g_ptr_array_free (suffixes, FALSE);
+    matcher->substrings = (gchar **)g_ptr_array_free (substrings, FALSE);
+
+    return matcher;
+}
+
+static gboolean
+domain_matcher_match (AgDomainMatcher *matcher, const gchar *domain)
+{
+    gboolean found;
+    gchar **literal;
+
+    if (G_UNLIKELY (matcher->regex == NULL))
+        return FALSE;
+
+    /* "$" also matches before a final newline: don't bother with that */
+    if (matcher->use_literals && strchr (domain, '\n') == NULL)
+    {
+        found = FALSE;
+        for (literal = matcher->suffixes; *literal != NULL && !found;
+             literal++)
+            found = g_str_has_suffix (domain, *literal);
+        for (literal = matcher->substrings; *literal != NULL && !found;
+             literal++)
+            found = (strstr (domain, *literal) != NULL);
+        if (!found) return FALSE;
+    }
+
+    return g_regex_match (matcher->regex, domain, 0, NULL);
+}
+
+static AgDomainMatcher *
+get_domain_matcher (AgProvider *provider)
+{
+    AgDomainMatcher *matcher;
+
+    matcher = g_atomic_pointer_get (&provider->domain_matcher);
+    if (matcher != NULL) return matcher;
+
+    /* Providers can be shared among threads */
+    matcher = domain_matcher_new (provider->domains);
+    if (!g_atomic_pointer_compare_and_exchange (&provider->domain_matcher,
+                                                NULL, matcher))
+    {
+        domain_matcher_free (matcher);
+        matcher = g_atomic_pointer_get (&provider->domain_matcher);
+    }
+    return matcher;
+}
+
 static gboolean
 parse_template (xmlTextReaderPtr reader, AgProvider *provider)
 {
@@ -193,13 +413,78 @@ _ag_provider_new (void)
 }
 
 static gboolean
-_ag_provider_load_from_file (AgProvider *provider)
+parse_provider_contents (AgProvider *provider, GBytes *contents)
 {
     xmlTextReaderPtr reader;
+    const gchar *data;
+    gsize len;
+    gboolean ret;
+
+    data = g_bytes_get_data (contents, &len);
+
+    /* TODO: cache the xmlReader */
+    reader = xmlReaderForMemory (data, len, NULL, NULL, 0);
+    if (G_UNLIKELY (reader == NULL))
+        return FALSE;
+
+    ret = read_provider_file (reader, provider);
+
+    xmlFreeTextReader (reader);
+    return ret;
+}
+
+static gboolean
+_ag_provider_load_from_path (AgProvider *provider, const gchar *filepath)
+{
+    GBytes *contents;
+    gboolean ret;
+
+    /* The contents are not kept: they are loaded again if
+     * ag_provider_get_file_contents() is called */
+    contents = _ag_map_file (filepath);
+    if (G_UNLIKELY (contents == NULL))
+        return FALSE;
+
+    ret = parse_provider_contents (provider, contents);
+    g_bytes_unref (contents);
+    return ret;
+}
+
+static gboolean
+_ag_provider_load_from_catalog (AgProvider *provider, GVariant *entry)
+{
+    if (!_ag_catalog_entry_is_valid (entry))
+        return FALSE;
+
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_DISPLAY_NAME,
+                                  &provider->display_name);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_DESCRIPTION,
+                                  &provider->description);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_I18N_DOMAIN,
+                                  &provider->i18n_domain);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_ICON,
+                                  &provider->icon_name);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_DOMAINS,
+                                  &provider->domains);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_PLUGIN,
+                                  &provider->plugin_name);
+    g_variant_lookup (entry, AG_CATALOG_KEY_SINGLE_ACCOUNT, "b",
+                      &provider->single_account);
+
+    if (!provider->default_settings)
+        provider->default_settings = _ag_catalog_entry_get_settings (entry);
+    if (!provider->tags)
+        provider->tags = _ag_catalog_entry_get_tags (entry);
+
+    return TRUE;
+}
+
+static gboolean
+_ag_provider_load_from_file (AgProvider *provider)
+{
+    GVariant *entry;
     gchar *filepath;
     gboolean ret;
-    GError *error = NULL;
-    gsize len;
 
     g_return_val_if_fail (provider->name != NULL, FALSE);
 
@@ -207,31 +492,69 @@ _ag_provider_load_from_file (AgProvider *provider)
     filepath = _ag_find_libaccounts_file (provider->name,
                                           ".provider",
                                           "AG_PROVIDERS",
-                                          PROVIDER_FILES_DIR);
+                                          PROVIDER_FILES_DIR,
+                                          &entry);
     if (G_UNLIKELY (!filepath)) return FALSE;
 
-    g_file_get_contents (filepath, &provider->file_data,
-                         &len, &error);
-    if (G_UNLIKELY (error))
+    if (entry != NULL)
     {
-        g_warning ("Error reading %s: %s", filepath, error->message);
-        g_error_free (error);
-        g_free (filepath);
-        return FALSE;
+        ret = _ag_provider_load_from_catalog (provider, entry);
+        g_variant_unref (entry);
+    }
+    else
+    {
+        ret = _ag_provider_load_from_path (provider, filepath);
     }
 
     g_free (filepath);
+    return ret;
+}
 
-    /* TODO: cache the xmlReader */
-    reader = xmlReaderForMemory (provider->file_data, len,
-                                 NULL, NULL, 0);
-    if (G_UNLIKELY (reader == NULL))
-        return FALSE;
+GVariant *
+_ag_provider_compile_catalog_entry (const gchar *provider_name,
+                                    const gchar *filepath)
+{
+    GVariantDict dict;
+    AgProvider *provider;
+    GBytes *contents;
 
-    ret = read_provider_file (reader, provider);
+    contents = _ag_map_file (filepath);
+    if (G_UNLIKELY (contents == NULL))
+        return NULL;
 
-    xmlFreeTextReader (reader);
-    return ret;
+    provider = _ag_provider_new ();
+    provider->name = g_strdup (provider_name);
+    if (!parse_provider_contents (provider, contents))
+    {
+        ag_provider_unref (provider);
+        g_bytes_unref (contents);
+        return NULL;
+    }
+
+    g_variant_dict_init (&dict, NULL);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_NAME, provider->name);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_DISPLAY_NAME,
+                                 provider->display_name);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_DESCRIPTION,
+                                 provider->description);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_I18N_DOMAIN,
+                                 provider->i18n_domain);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_ICON,
+                                 provider->icon_name);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_DOMAINS,
+                                 provider->domains);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_PLUGIN,
+                                 provider->plugin_name);
+    g_variant_dict_insert (&dict, AG_CATALOG_KEY_SINGLE_ACCOUNT, "b",
+                           provider->single_account);
+    _ag_catalog_dict_add_settings (&dict, provider->default_settings);
+    _ag_catalog_dict_add_tags (&dict, provider->tags);
+    _ag_catalog_dict_add_contents (&dict, g_bytes_get_data (contents, NULL),
+                                   g_bytes_get_size (contents));
+    g_bytes_unref (contents);
+    ag_provider_unref (provider);
+
+    return g_variant_dict_end (&dict);
 }
 
 AgProvider *
@@ -255,19 +578,8 @@ _ag_provider_load_default_settings (AgProvider *provider)
 {
     g_return_val_if_fail (provider != NULL, NULL);
 
-    if (!provider->default_settings)
-    {
-        /* This can happen if the provider was created by the AccountManager by
-         * loading the record from the DB.
-         * Now we must reload the provider from its XML file.
-         */
-        if (!_ag_provider_load_from_file (provider))
-        {
-            g_warning ("Loading provider %s file failed", provider->name);
-            return NULL;
-        }
-    }
-
+    /* Providers are always fully loaded when created: if they have no default
+     * settings, there's no point in reading the file again */
     return provider->default_settings;
 }
 
@@ -386,7 +698,8 @@ ag_provider_get_domains_regex (AgProvider *provider)
  * @domain: a domain name.
  *
  * Check whether @domain is supported by this provider, by matching it with the
- * regex returned by ag_provider_get_domains_regex().
+ * regex returned by ag_provider_get_domains_regex(). The regex is compiled
+ * only once for each #AgProvider.
  * If the provider does not define a regular expression to match the supported
  * domains, this function will return %FALSE.
  *
@@ -403,7 +716,7 @@ ag_provider_match_domain (AgProvider *provider, const gchar *domain)
     if (provider->domains == NULL)
         return FALSE;
 
-    return g_regex_match_simple (provider->domains, domain, 0, 0);
+    return domain_matcher_match (get_domain_matcher (provider), domain);
 }
 
 /**
@@ -484,20 +797,35 @@ void
 ag_provider_get_file_contents (AgProvider *provider,
                               const gchar **contents)
 {
+    GBytes *file_contents;
+
     g_return_if_fail (provider != NULL);
     g_return_if_fail (contents != NULL);
 
-    if (provider->file_data == NULL)
+    /* The contents are only loaded when requested, and are shared with the
+     * compiled catalog or the page cache */
+    file_contents = g_atomic_pointer_get (&provider->file_contents);
+    if (file_contents == NULL)
     {
-        /* This can happen if the provider was created by the AccountManager by
-         * loading the record from the DB.
-         * Now we must reload the provider from its XML file.
-         */
-        if (!_ag_provider_load_from_file (provider))
+        file_contents =
+            _ag_get_libaccounts_file_contents (provider->name, ".provider",
+                                               "AG_PROVIDERS",
+                                               PROVIDER_FILES_DIR);
+        if (G_UNLIKELY (file_contents == NULL))
+        {
             g_warning ("Loading provider %s file failed", provider->name);
+        }
+        else if (!g_atomic_pointer_compare_and_exchange
+                 (&provider->file_contents, NULL, file_contents))
+        {
+            /* another thread has loaded them in the meantime */
+            g_bytes_unref (file_contents);
+            file_contents = g_atomic_pointer_get (&provider->file_contents);
+        }
     }
 
-    *contents = provider->file_data;
+    *contents = file_contents != NULL ?
+        g_bytes_get_data (file_contents, NULL) : NULL;
 }
 
 /**
@@ -543,9 +871,10 @@ ag_provider_unref (AgProvider *provider)
         g_clear_pointer (&provider->display_name, g_free);
         g_clear_pointer (&provider->domains, g_free);
         g_clear_pointer (&provider->plugin_name, g_free);
-        g_clear_pointer (&provider->file_data, g_free);
+        g_clear_pointer (&provider->file_contents, g_bytes_unref);
         g_clear_pointer (&provider->default_settings, g_hash_table_unref);
         g_clear_pointer (&provider->tags, g_hash_table_unref);
+        g_clear_pointer (&provider->domain_matcher, domain_matcher_free);
         g_slice_free (AgProvider, provider);
     }
 }
@@ -44,6 +44,7 @@
 
 #include "ag-service-type.h"
 
+#include "ag-catalog.h"
 #include "ag-internals.h"
 #include "ag-util.h"
 #include <libxml/xmlreader.h>
@@ -57,8 +58,7 @@ struct _AgServiceType {
     gchar *display_name;
     gchar *description;
     gchar *icon_name;
-    gchar *file_data;
-    gsize file_data_len;
+    GBytes *file_contents;
     GHashTable *tags;
 };
 
@@ -164,12 +164,71 @@ _ag_service_type_new (void)
 }
 
 static gboolean
-_ag_service_type_load_from_file (AgServiceType *service_type)
+parse_service_type_contents (AgServiceType *service_type, GBytes *contents,
+                             const gchar *filepath)
 {
     xmlTextReaderPtr reader;
+    const gchar *data;
+    gsize len;
+    gboolean ret;
+
+    data = g_bytes_get_data (contents, &len);
+
+    /* TODO: cache the xmlReader */
+    reader = xmlReaderForMemory (data, len, filepath, NULL, 0);
+    if (G_UNLIKELY (reader == NULL))
+        return FALSE;
+
+    ret = read_service_type_file (reader, service_type);
+
+    xmlFreeTextReader (reader);
+    return ret;
+}
+
+static gboolean
+_ag_service_type_load_from_path (AgServiceType *service_type,
+                                 const gchar *filepath)
+{
+    GBytes *contents;
+    gboolean ret;
+
+    /* The contents are not kept: they are loaded again if
+     * ag_service_type_get_file_contents() is called */
+    contents = _ag_map_file (filepath);
+    if (G_UNLIKELY (contents == NULL))
+        return FALSE;
+
+    ret = parse_service_type_contents (service_type, contents, filepath);
+    g_bytes_unref (contents);
+    return ret;
+}
+
+static gboolean
+_ag_service_type_load_from_catalog (AgServiceType *service_type,
+                                    GVariant *entry)
+{
+    if (!_ag_catalog_entry_is_valid (entry))
+        return FALSE;
+
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_DISPLAY_NAME,
+                                  &service_type->display_name);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_DESCRIPTION,
+                                  &service_type->description);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_ICON,
+                                  &service_type->icon_name);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_I18N_DOMAIN,
+                                  &service_type->i18n_domain);
+    service_type->tags = _ag_catalog_entry_get_tags (entry);
+
+    return TRUE;
+}
+
+static gboolean
+_ag_service_type_load_from_file (AgServiceType *service_type)
+{
+    GVariant *entry;
     gchar *filepath;
     gboolean ret;
-    GError *error = NULL;
 
     g_return_val_if_fail (service_type->name != NULL, FALSE);
 
@@ -177,31 +236,63 @@ _ag_service_type_load_from_file (AgServiceType *service_type)
     filepath = _ag_find_libaccounts_file (service_type->name,
                                           ".service-type",
                                           "AG_SERVICE_TYPES",
-                                          SERVICE_TYPE_FILES_DIR);
+                                          SERVICE_TYPE_FILES_DIR,
+                                          &entry);
     if (G_UNLIKELY (!filepath)) return FALSE;
 
-    g_file_get_contents (filepath, &service_type->file_data,
-                         &service_type->file_data_len, &error);
-    if (G_UNLIKELY (error))
+    if (entry != NULL)
     {
-        g_warning ("Error reading %s: %s", filepath, error->message);
-        g_error_free (error);
-        g_free (filepath);
-        return FALSE;
+        ret = _ag_service_type_load_from_catalog (service_type, entry);
+        g_variant_unref (entry);
+    }
+    else
+    {
+        ret = _ag_service_type_load_from_path (service_type, filepath);
     }
 
-    /* TODO: cache the xmlReader */
-    reader = xmlReaderForMemory (service_type->file_data,
-                                 service_type->file_data_len,
-                                 filepath, NULL, 0);
     g_free (filepath);
-    if (G_UNLIKELY (reader == NULL))
-        return FALSE;
+    return ret;
+}
 
-    ret = read_service_type_file (reader, service_type);
+GVariant *
+_ag_service_type_compile_catalog_entry (const gchar *service_type_name,
+                                        const gchar *filepath)
+{
+    GVariantDict dict;
+    AgServiceType *service_type;
+    GBytes *contents;
 
-    xmlFreeTextReader (reader);
-    return ret;
+    contents = _ag_map_file (filepath);
+    if (G_UNLIKELY (contents == NULL))
+        return NULL;
+
+    service_type = _ag_service_type_new ();
+    service_type->name = g_strdup (service_type_name);
+    if (!parse_service_type_contents (service_type, contents, filepath))
+    {
+        ag_service_type_unref (service_type);
+        g_bytes_unref (contents);
+        return NULL;
+    }
+
+    g_variant_dict_init (&dict, NULL);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_NAME,
+                                 service_type->name);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_DISPLAY_NAME,
+                                 service_type->display_name);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_DESCRIPTION,
+                                 service_type->description);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_ICON,
+                                 service_type->icon_name);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_I18N_DOMAIN,
+                                 service_type->i18n_domain);
+    _ag_catalog_dict_add_tags (&dict, service_type->tags);
+    _ag_catalog_dict_add_contents (&dict, g_bytes_get_data (contents, NULL),
+                                   g_bytes_get_size (contents));
+    g_bytes_unref (contents);
+    ag_service_type_unref (service_type);
+
+    return g_variant_dict_end (&dict);
 }
 
 AgServiceType *
@@ -332,6 +423,16 @@ GList *ag_service_type_get_tags (AgServiceType *service_type)
     return g_hash_table_get_keys (service_type->tags);
 }
 
+/* Returns a new reference to the set of tags, or %NULL; the set must not be
+ * modified, since it's shared with the services of this type */
+GHashTable *
+_ag_service_type_get_tags_table (AgServiceType *service_type)
+{
+    g_return_val_if_fail (service_type != NULL, NULL);
+    if (service_type->tags == NULL) return NULL;
+    return g_hash_table_ref (service_type->tags);
+}
+
 /**
  * ag_service_type_get_file_contents:
  * @service_type: the #AgServiceType.
@@ -348,12 +449,48 @@ ag_service_type_get_file_contents (AgServiceType *service_type,
                                    const gchar **contents,
                                    gsize *len)
 {
+    GBytes *file_contents;
+
     g_return_if_fail (service_type != NULL);
     g_return_if_fail (contents != NULL);
 
-    *contents = service_type->file_data;
-    if (len)
-        *len = service_type->file_data_len;
+    /* The contents are only loaded when requested, and are shared with the
+     * compiled catalog or the page cache */
+    file_contents = g_atomic_pointer_get (&service_type->file_contents);
+    if (file_contents == NULL)
+    {
+        file_contents =
+            _ag_get_libaccounts_file_contents (service_type->name,
+                                               ".service-type",
+                                               "AG_SERVICE_TYPES",
+                                               SERVICE_TYPE_FILES_DIR);
+        if (G_UNLIKELY (file_contents == NULL))
+        {
+            g_warning ("Loading service type %s file failed",
+                       service_type->name);
+        }
+        else if (!g_atomic_pointer_compare_and_exchange
+                 (&service_type->file_contents, NULL, file_contents))
+        {
+            /* another thread has loaded them in the meantime */
+            g_bytes_unref (file_contents);
+            file_contents =
+                g_atomic_pointer_get (&service_type->file_contents);
+        }
+    }
+
+    if (file_contents != NULL)
+    {
+        *contents = g_bytes_get_data (file_contents, NULL);
+        if (len)
+            *len = g_bytes_get_size (file_contents);
+    }
+    else
+    {
+        *contents = NULL;
+        if (len)
+            *len = 0;
+    }
 }
 
 /**
@@ -397,7 +534,7 @@ ag_service_type_unref (AgServiceType *service_type)
         g_clear_pointer (&service_type->display_name, g_free);
         g_clear_pointer (&service_type->description, g_free);
         g_clear_pointer (&service_type->icon_name, g_free);
-        g_clear_pointer (&service_type->file_data, g_free);
+        g_clear_pointer (&service_type->file_contents, g_bytes_unref);
         g_clear_pointer (&service_type->tags, g_hash_table_unref);
         g_slice_free (AgServiceType, service_type);
     }
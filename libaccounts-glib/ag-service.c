@@ -41,6 +41,7 @@
 #include "ag-service.h"
 
 #include "ag-service-type.h"
+#include "ag-catalog.h"
 #include "ag-internals.h"
 #include "ag-util.h"
 #include <libxml/xmlreader.h>
@@ -50,14 +51,67 @@ G_DEFINE_BOXED_TYPE (AgService, ag_service,
                      (GBoxedCopyFunc)ag_service_ref,
                      (GBoxedFreeFunc)ag_service_unref);
 
+/* The services cached by the AgManager are shared among threads: this
+ * serializes the loading of their contents */
+static GRecMutex load_lock;
+
+/* Returns the offset in @contents where the <type_data> element, on which
+ * @reader is positioned, begins */
+static gsize
+get_type_data_offset (xmlTextReaderPtr reader, const gchar *contents)
+{
+    static const gchar element[] = "<type_data";
+    glong offset;
+
+    offset = xmlTextReaderByteConsumed (reader);
+    while (offset > 0)
+    {
+        if (strncmp (contents + offset, element, sizeof (element) - 1) == 0)
+            return offset;
+        offset--;
+    }
+    return 0;
+}
+
+/* Returns the offset of the <type_data> element in the service file
+ * @contents, or 0 if there is none */
+static gsize
+find_type_data_offset (GBytes *contents)
+{
+    xmlTextReaderPtr reader;
+    const gchar *data;
+    gsize len, offset = 0;
+    int ret;
+
+    data = g_bytes_get_data (contents, &len);
+    reader = xmlReaderForMemory (data, len, NULL, NULL, 0);
+    if (G_UNLIKELY (reader == NULL))
+        return 0;
+
+    ret = xmlTextReaderRead (reader);
+    while (ret == 1)
+    {
+        if (xmlTextReaderNodeType (reader) == XML_READER_TYPE_ELEMENT &&
+            xmlTextReaderDepth (reader) == 1 &&
+            g_strcmp0 ((const gchar *)xmlTextReaderConstName (reader),
+                       "type_data") == 0)
+        {
+            offset = get_type_data_offset (reader, data);
+            break;
+        }
+        ret = xmlTextReaderRead (reader);
+    }
+
+    xmlFreeTextReader (reader);
+    return offset;
+}
+
 static gboolean
 parse_template (xmlTextReaderPtr reader, AgService *service)
 {
     GHashTable *settings;
     gboolean ok;
 
-    g_return_val_if_fail (service->default_settings == NULL, FALSE);
-
     settings =
         g_hash_table_new_full (g_str_hash, g_str_equal,
                                g_free, (GDestroyNotify)g_variant_unref);
@@ -69,6 +123,14 @@ parse_template (xmlTextReaderPtr reader, AgService *service)
         return FALSE;
     }
 
+    /* The defaults might have been already restored from the DB, and be in
+     * use: keep them */
+    if (service->default_settings != NULL)
+    {
+        g_hash_table_unref (settings);
+        return TRUE;
+    }
+
     service->default_settings = settings;
     return TRUE;
 }
@@ -82,7 +144,8 @@ parse_preview (G_GNUC_UNUSED xmlTextReaderPtr reader,
 }
 
 static gboolean
-parse_service (xmlTextReaderPtr reader, AgService *service)
+parse_service (xmlTextReaderPtr reader, AgService *service,
+               const gchar *contents)
 {
     const gchar *name;
     int ret, type;
@@ -145,21 +208,8 @@ parse_service (xmlTextReaderPtr reader, AgService *service)
             }
             else if (strcmp (name, "type_data") == 0)
             {
-                static const gchar element[] = "<type_data";
-                gsize offset;
-
-                /* find the offset in the file where this element begins */
-                offset = xmlTextReaderByteConsumed(reader);
-                while (offset > 0)
-                {
-                    if (strncmp (service->file_data + offset, element,
-                                 sizeof (element)) == 0)
-                    {
-                        service->type_data_offset = offset;
-                        break;
-                    }
-                    offset--;
-                }
+                service->type_data_offset =
+                    get_type_data_offset (reader, contents);
 
                 /* this element is placed after all the elements we are
                  * interested in: we can stop the parsing now */
@@ -182,7 +232,8 @@ parse_service (xmlTextReaderPtr reader, AgService *service)
 }
 
 static gboolean
-read_service_file (xmlTextReaderPtr reader, AgService *service)
+read_service_file (xmlTextReaderPtr reader, AgService *service,
+                   const gchar *contents)
 {
     const xmlChar *name;
     int ret;
@@ -194,7 +245,7 @@ read_service_file (xmlTextReaderPtr reader, AgService *service)
         if (G_LIKELY (name &&
                       strcmp ((const gchar *)name, "service") == 0))
         {
-            return parse_service (reader, service);
+            return parse_service (reader, service, contents);
         }
 
         ret = xmlTextReaderNext (reader);
@@ -202,23 +253,101 @@ read_service_file (xmlTextReaderPtr reader, AgService *service)
     return FALSE;
 }
 
+/* Parse only the elements which identify the service, that is the ones
+ * stored in the DB: the rest of the file is parsed when needed. */
+static gboolean
+read_service_header (xmlTextReaderPtr reader, AgService *service)
+{
+    const gchar *name;
+    int ret, type;
+
+    ret = xmlTextReaderRead (reader);
+    while (ret == 1)
+    {
+        name = (const gchar *)xmlTextReaderConstName (reader);
+        if (G_LIKELY (name && strcmp (name, "service") == 0))
+            break;
+
+        ret = xmlTextReaderNext (reader);
+    }
+    if (G_UNLIKELY (ret != 1)) return FALSE;
+
+    ret = xmlTextReaderRead (reader);
+    while (ret == 1 &&
+           !(service->type && service->display_name && service->provider))
+    {
+        name = (const gchar *)xmlTextReaderConstName (reader);
+        if (G_UNLIKELY (!name)) return FALSE;
+
+        type = xmlTextReaderNodeType (reader);
+        if (type == XML_READER_TYPE_END_ELEMENT &&
+            strcmp (name, "service") == 0)
+            break;
+
+        if (type == XML_READER_TYPE_ELEMENT)
+        {
+            gboolean ok;
+
+            if (strcmp (name, "type") == 0 && !service->type)
+            {
+                ok = _ag_xml_dup_element_data (reader, &service->type);
+            }
+            else if (strcmp (name, "name") == 0 && !service->display_name)
+            {
+                ok = _ag_xml_dup_element_data (reader, &service->display_name);
+            }
+            else if (strcmp (name, "provider") == 0 && !service->provider)
+            {
+                ok = _ag_xml_dup_element_data (reader, &service->provider);
+            }
+            else if (strcmp (name, "template") == 0 ||
+                     strcmp (name, "type_data") == 0)
+            {
+                /* the header elements are not expected past this point */
+                break;
+            }
+            else
+                ok = TRUE;
+
+            if (G_UNLIKELY (!ok)) return FALSE;
+        }
+
+        ret = xmlTextReaderNext (reader);
+    }
+    return TRUE;
+}
+
 static void
 copy_tags_from_type (AgService *service)
 {
-    AgServiceType *type;
-    GList *type_tags, *tag_list;
+    AgServiceType *type = NULL;
+    AgManager *manager;
 
-    service->tags = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                           g_free, NULL);
-    type = _ag_service_type_new_from_file (service->type);
-    if (G_UNLIKELY (type == NULL)) return;
+    if (G_LIKELY (service->type != NULL))
+    {
+        /* Use the service type cached by the manager, if we still have one:
+         * this way the file is parsed only once for all the services */
+        manager = g_weak_ref_get (&service->manager);
+        if (manager != NULL)
+        {
+            type = _ag_manager_get_service_type (manager, service->type);
+            g_object_unref (manager);
+        }
+        else
+        {
+            type = _ag_service_type_new_from_file (service->type);
+        }
+    }
 
-    type_tags = ag_service_type_get_tags (type);
-    for (tag_list = type_tags; tag_list != NULL; tag_list = tag_list->next)
-        g_hash_table_insert (service->tags,
-                             g_strdup (tag_list->data), NULL);
-    g_list_free (type_tags);
-    ag_service_type_unref (type);
+    if (type != NULL)
+    {
+        /* The set of tags is immutable, so it can be shared */
+        service->tags = _ag_service_type_get_tags_table (type);
+        ag_service_type_unref (type);
+    }
+
+    if (service->tags == NULL)
+        service->tags = g_hash_table_new (g_str_hash, g_str_equal);
 }
 
 AgService *
@@ -233,46 +362,170 @@ _ag_service_new (void)
 }
 
 static gboolean
-_ag_service_load_from_file (AgService *service)
+parse_service_contents (AgService *service, GBytes *contents,
+                        const gchar *filepath)
 {
     xmlTextReaderPtr reader;
-    gchar *filepath;
-    gboolean ret;
-    GError *error = NULL;
+    const gchar *data;
     gsize len;
+    gboolean ret;
 
-    g_return_val_if_fail (service->name != NULL, FALSE);
+    data = g_bytes_get_data (contents, &len);
+
+    /* TODO: cache the xmlReader */
+    reader = xmlReaderForMemory (data, len, filepath, NULL, 0);
+    if (G_UNLIKELY (reader == NULL))
+        return FALSE;
+
+    ret = read_service_file (reader, service, data);
+
+    xmlFreeTextReader (reader);
+    return ret;
+}
+
+static gboolean
+_ag_service_load_from_path (AgService *service, const gchar *filepath)
+{
+    GBytes *contents;
+    gboolean ret;
+
+    /* The contents are not kept: they are loaded again if
+     * ag_service_get_file_contents() is called */
+    contents = _ag_map_file (filepath);
+    if (G_UNLIKELY (contents == NULL))
+        return FALSE;
+
+    ret = parse_service_contents (service, contents, filepath);
+    g_bytes_unref (contents);
+
+    if (ret)
+        service->loaded = TRUE;
+    return ret;
+}
+
+static gboolean
+_ag_service_load_from_catalog (AgService *service, GVariant *entry)
+{
+    guint64 type_data_offset;
+
+    if (!_ag_catalog_entry_is_valid (entry))
+        return FALSE;
+
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_TYPE,
+                                  &service->type);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_DISPLAY_NAME,
+                                  &service->display_name);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_PROVIDER,
+                                  &service->provider);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_DESCRIPTION,
+                                  &service->description);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_ICON,
+                                  &service->icon_name);
+    _ag_catalog_entry_dup_string (entry, AG_CATALOG_KEY_I18N_DOMAIN,
+                                  &service->i18n_domain);
+    if (g_variant_lookup (entry, AG_CATALOG_KEY_TYPE_DATA_OFFSET, "t",
+                          &type_data_offset))
+        service->type_data_offset = type_data_offset;
+
+    if (!service->default_settings)
+        service->default_settings = _ag_catalog_entry_get_settings (entry);
+    if (!service->tags)
+        service->tags = _ag_catalog_entry_get_tags (entry);
+
+    service->loaded = TRUE;
+    return TRUE;
+}
+
+static gboolean
+load_from_file (AgService *service)
+{
+    GVariant *entry;
+    gchar *filepath;
+    gboolean ret;
 
     DEBUG_REFS ("Loading service %s", service->name);
     filepath = _ag_find_libaccounts_file (service->name,
                                           ".service",
                                           "AG_SERVICES",
-                                          SERVICE_FILES_DIR);
+                                          SERVICE_FILES_DIR,
+                                          &entry);
     if (G_UNLIKELY (!filepath)) return FALSE;
 
-    g_file_get_contents (filepath, &service->file_data,
-                         &len, &error);
-    if (G_UNLIKELY (error))
+    if (entry != NULL)
     {
-        g_warning ("Error reading %s: %s", filepath, error->message);
-        g_error_free (error);
-        g_free (filepath);
-        return FALSE;
+        ret = _ag_service_load_from_catalog (service, entry);
+        g_variant_unref (entry);
+    }
+    else
+    {
+        ret = _ag_service_load_from_path (service, filepath);
     }
 
-    /* TODO: cache the xmlReader */
-    reader = xmlReaderForMemory (service->file_data, len,
-                                 filepath, NULL, 0);
     g_free (filepath);
-    if (G_UNLIKELY (reader == NULL))
-        return FALSE;
+    return ret;
+}
 
-    ret = read_service_file (reader, service);
+static gboolean
+_ag_service_load_from_file (AgService *service)
+{
+    gboolean ret;
+
+    g_return_val_if_fail (service->name != NULL, FALSE);
+
+    g_rec_mutex_lock (&load_lock);
+    /* Another thread might have loaded it while we were waiting */
+    ret = service->loaded || load_from_file (service);
+    g_rec_mutex_unlock (&load_lock);
 
-    xmlFreeTextReader (reader);
     return ret;
 }
 
+GVariant *
+_ag_service_compile_catalog_entry (const gchar *service_name,
+                                   const gchar *filepath)
+{
+    GVariantDict dict;
+    AgService *service;
+    GBytes *contents;
+
+    contents = _ag_map_file (filepath);
+    if (G_UNLIKELY (contents == NULL))
+        return NULL;
+
+    service = _ag_service_new ();
+    service->name = g_strdup (service_name);
+    if (!parse_service_contents (service, contents, filepath))
+    {
+        ag_service_unref (service);
+        g_bytes_unref (contents);
+        return NULL;
+    }
+
+    g_variant_dict_init (&dict, NULL);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_NAME, service->name);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_TYPE, service->type);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_DISPLAY_NAME,
+                                 service->display_name);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_DESCRIPTION,
+                                 service->description);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_PROVIDER,
+                                 service->provider);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_ICON,
+                                 service->icon_name);
+    _ag_catalog_dict_add_string (&dict, AG_CATALOG_KEY_I18N_DOMAIN,
+                                 service->i18n_domain);
+    g_variant_dict_insert (&dict, AG_CATALOG_KEY_TYPE_DATA_OFFSET, "t",
+                           (guint64)service->type_data_offset);
+    _ag_catalog_dict_add_settings (&dict, service->default_settings);
+    _ag_catalog_dict_add_tags (&dict, service->tags);
+    _ag_catalog_dict_add_contents (&dict, g_bytes_get_data (contents, NULL),
+                                   g_bytes_get_size (contents));
+    g_bytes_unref (contents);
+    ag_service_unref (service);
+
+    return g_variant_dict_end (&dict);
+}
+
 AgService *
 _ag_service_new_from_file (const gchar *service_name)
 {
@@ -289,6 +542,67 @@ _ag_service_new_from_file (const gchar *service_name)
     return service;
 }
 
+/**
+ * _ag_service_new_from_header:
+ * @service_name: the name of the service.
+ *
+ * Create an #AgService having only its name, display name, type and provider
+ * loaded. The service file is read just up to the point where these are
+ * found, and it will be fully parsed only once any other information is
+ * requested.
+ *
+ * Returns: the new #AgService, or %NULL if the service file is not found or
+ * cannot be parsed.
+ */
+AgService *
+_ag_service_new_from_header (const gchar *service_name)
+{
+    xmlTextReaderPtr reader;
+    AgService *service;
+    GVariant *entry;
+    gchar *filepath;
+    gboolean ok = FALSE;
+
+    g_return_val_if_fail (service_name != NULL, NULL);
+
+    service = _ag_service_new ();
+    service->name = g_strdup (service_name);
+
+    DEBUG_REFS ("Loading header of service %s", service->name);
+    filepath = _ag_find_libaccounts_file (service->name,
+                                          ".service",
+                                          "AG_SERVICES",
+                                          SERVICE_FILES_DIR,
+                                          &entry);
+    if (G_UNLIKELY (!filepath)) goto finish;
+
+    if (entry != NULL)
+    {
+        /* the catalog has everything already parsed */
+        ok = _ag_service_load_from_catalog (service, entry);
+        g_variant_unref (entry);
+    }
+    else
+    {
+        /* the file is read incrementally, so only its first part is loaded */
+        reader = xmlReaderForFile (filepath, NULL, 0);
+        if (G_LIKELY (reader != NULL))
+        {
+            ok = read_service_header (reader, service);
+            xmlFreeTextReader (reader);
+        }
+    }
+
+    g_free (filepath);
+finish:
+    if (!ok)
+    {
+        ag_service_unref (service);
+        service = NULL;
+    }
+    return service;
+}
+
 AgService *
 _ag_service_new_from_memory (const gchar *service_name, const gchar *service_type,
                              const gint service_id)
@@ -303,27 +617,91 @@ _ag_service_new_from_memory (const gchar *service_name, const gchar *service_typ
     return service;
 }
 
-GHashTable *
-_ag_service_load_default_settings (AgService *service)
+static gint64
+get_service_file_mtime (AgService *service)
 {
-    g_return_val_if_fail (service != NULL, NULL);
+    gchar *filepath;
+    gint64 mtime;
 
-    if (!service->default_settings)
+    filepath = _ag_find_libaccounts_file (service->name,
+                                          ".service",
+                                          "AG_SERVICES",
+                                          SERVICE_FILES_DIR,
+                                          NULL);
+    if (G_UNLIKELY (!filepath)) return 0;
+
+    mtime = _ag_get_file_mtime (filepath);
+    g_free (filepath);
+    return mtime;
+}
+
+static void
+store_default_settings (AgService *service, gint64 mtime)
+{
+    AgManager *manager;
+
+    manager = g_weak_ref_get (&service->manager);
+    if (manager == NULL) return;
+
+    _ag_manager_store_service_defaults (manager, service, mtime);
+    g_object_unref (manager);
+}
+
+/* Loads the default settings; if they were read from the service file,
+ * @stale_mtime is set to the modification time of the file. */
+static GHashTable *
+load_default_settings (AgService *service, gint64 *stale_mtime)
+{
+    gint64 mtime;
+
+    if (service->loaded || service->default_settings != NULL)
+        return service->default_settings;
+
+    /* This can happen if the service was created by the AccountManager by
+     * loading the record from the DB. If the DB has the default settings,
+     * and the service file has not changed since they were stored, use
+     * them; otherwise, we must reload the service from its XML file.
+     */
+    mtime = get_service_file_mtime (service);
+    if (service->stored_defaults != NULL &&
+        service->stored_defaults_mtime == mtime && mtime != 0)
     {
-        /* This can happen if the service was created by the AccountManager by
-         * loading the record from the DB.
-         * Now we must reload the service from its XML file.
-         */
-        if (!_ag_service_load_from_file (service))
-        {
-            g_warning ("Loading service %s file failed", service->name);
-            return NULL;
-        }
+        service->default_settings =
+            _ag_settings_from_variant (service->stored_defaults);
+        return service->default_settings;
+    }
+
+    if (!_ag_service_load_from_file (service))
+    {
+        g_warning ("Loading service %s file failed", service->name);
+        return NULL;
     }
 
+    *stale_mtime = mtime;
     return service->default_settings;
 }
 
+GHashTable *
+_ag_service_load_default_settings (AgService *service)
+{
+    GHashTable *settings;
+    gint64 mtime = 0;
+
+    g_return_val_if_fail (service != NULL, NULL);
+
+    g_rec_mutex_lock (&load_lock);
+    settings = load_default_settings (service, &mtime);
+    g_rec_mutex_unlock (&load_lock);
+
+    /* Store the defaults, so that next time the file won't be parsed; the
+     * lock is not held, because the manager might be waiting for it while
+     * holding the DB */
+    if (mtime != 0)
+        store_default_settings (service, mtime);
+
+    return settings;
+}
+
 GVariant *
 _ag_service_get_default_setting (AgService *service, const gchar *key)
 {
@@ -365,7 +743,7 @@ const gchar *
 ag_service_get_display_name (AgService *service)
 {
     g_return_val_if_fail (service != NULL, NULL);
-    if (service->display_name == NULL && !service->file_data)
+    if (service->display_name == NULL && !service->loaded)
         _ag_service_load_from_file (service);
     return service->display_name;
 }
@@ -384,7 +762,7 @@ const gchar *
 ag_service_get_description (AgService *service)
 {
     g_return_val_if_fail (service != NULL, NULL);
-    if (service->description == NULL && !service->file_data)
+    if (service->description == NULL && !service->loaded)
         _ag_service_load_from_file (service);
     return service->description;
 }
@@ -401,7 +779,7 @@ const gchar *
 ag_service_get_service_type (AgService *service)
 {
     g_return_val_if_fail (service != NULL, NULL);
-    if (service->type == NULL && !service->file_data)
+    if (service->type == NULL && !service->loaded)
         _ag_service_load_from_file (service);
     return service->type;
 }
@@ -418,7 +796,7 @@ const gchar *
 ag_service_get_provider (AgService *service)
 {
     g_return_val_if_fail (service != NULL, NULL);
-    if (service->provider == NULL && !service->file_data)
+    if (service->provider == NULL && !service->loaded)
         _ag_service_load_from_file (service);
     return service->provider;
 }
@@ -436,7 +814,7 @@ ag_service_get_icon_name (AgService *service)
 {
     g_return_val_if_fail (service != NULL, NULL);
 
-    if (!service->file_data)
+    if (!service->loaded)
         _ag_service_load_from_file (service);
 
     return service->icon_name;
@@ -455,7 +833,7 @@ ag_service_get_i18n_domain (AgService *service)
 {
     g_return_val_if_fail (service != NULL, NULL);
 
-    if (!service->file_data)
+    if (!service->loaded)
         _ag_service_load_from_file (service);
 
     return service->i18n_domain;
@@ -474,7 +852,7 @@ gboolean ag_service_has_tag (AgService *service, const gchar *tag)
 {
     g_return_val_if_fail (service != NULL, FALSE);
 
-    if (!service->file_data)
+    if (!service->loaded)
         _ag_service_load_from_file (service);
 
     if (service->tags == NULL)
@@ -498,7 +876,7 @@ GList *ag_service_get_tags (AgService *service)
 {
     g_return_val_if_fail (service != NULL, NULL);
 
-    if (!service->file_data)
+    if (!service->loaded)
         _ag_service_load_from_file (service);
 
     if (service->tags == NULL)
@@ -516,8 +894,11 @@ GList *ag_service_get_tags (AgService *service)
  * Gets the contents of the XML service file.  The buffer returned in @contents
  * should not be modified or freed, and is guaranteed to be valid as long as
  * @service is referenced. If @data_offset is not %NULL, it is set to the
- * offset where the &lt;type_data&gt; element can be found.
+ * offset where the &lt;type_data&gt; element can be found in @contents.
  * If some error occurs, @contents is set to %NULL.
+ *
+ * The contents of large files are memory-mapped: the files must be replaced,
+ * not modified in place, while they are in use.
  */
 void
 ag_service_get_file_contents (AgService *service,
@@ -527,7 +908,7 @@ ag_service_get_file_contents (AgService *service,
     g_return_if_fail (service != NULL);
     g_return_if_fail (contents != NULL);
 
-    if (service->file_data == NULL)
+    if (!service->loaded)
     {
         /* This can happen if the service was created by the AccountManager by
          * loading the record from the DB.
@@ -537,10 +918,27 @@ ag_service_get_file_contents (AgService *service,
             g_warning ("Loading service %s file failed", service->name);
     }
 
-    *contents = service->file_data;
+    /* The contents are only loaded when requested, and are shared with the
+     * compiled catalog or the page cache. The file might have changed since
+     * the service was parsed: the offset is taken from these contents. */
+    g_rec_mutex_lock (&load_lock);
+    if (service->file_contents == NULL)
+    {
+        service->file_contents =
+            _ag_get_libaccounts_file_contents (service->name, ".service",
+                                               "AG_SERVICES",
+                                               SERVICE_FILES_DIR);
+        if (service->file_contents != NULL)
+            service->file_type_data_offset =
+                find_type_data_offset (service->file_contents);
+    }
+
+    *contents = service->file_contents != NULL ?
+        g_bytes_get_data (service->file_contents, NULL) : NULL;
 
     if (data_offset)
-        *data_offset = service->type_data_offset;
+        *data_offset = service->file_type_data_offset;
+    g_rec_mutex_unlock (&load_lock);
 }
 
 /**
@@ -586,9 +984,11 @@ ag_service_unref (AgService *service)
         g_clear_pointer (&service->i18n_domain, g_free);
         g_clear_pointer (&service->type, g_free);
         g_clear_pointer (&service->provider, g_free);
-        g_clear_pointer (&service->file_data, g_free);
+        g_clear_pointer (&service->file_contents, g_bytes_unref);
         g_clear_pointer (&service->default_settings, g_hash_table_unref);
+        g_clear_pointer (&service->stored_defaults, g_variant_unref);
         g_clear_pointer (&service->tags, g_hash_table_unref);
+        g_weak_ref_clear (&service->manager);
         g_slice_free (AgService, service);
     }
 }
@@ -26,6 +26,7 @@
  */
 
 #include "ag-util.h"
+#include "ag-catalog.h"
 #include "ag-debug.h"
 #include "ag-errors.h"
 
@@ -34,6 +35,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Smaller files are copied rather than mapped: a mapped file which is
+ * truncated by another process raises SIGBUS when accessed */
+#define MIN_MAPPED_FILE_SIZE (64 * 1024)
 
 GString *
 _ag_string_append_printf (GString *string, const gchar *format, ...)
@@ -106,12 +113,6 @@ _ag_value_to_variant (const GValue *in_value)
     return g_dbus_gvalue_to_gvariant (value, type);
 }
 
-gchar *
-_ag_value_to_db (GVariant *value, gboolean type_annotate)
-{
-    return g_variant_print (value, type_annotate);
-}
-
 const GVariantType *
 _ag_type_from_g_type (GType type)
 {
@@ -179,6 +180,29 @@ _ag_value_from_string (const gchar *type, const gchar *string)
     return variant;
 }
 
+static GVariant *
+_ag_value_from_data (const gchar *type, gconstpointer data, gsize size)
+{
+    GBytes *bytes;
+    GVariant *variant;
+
+    if (G_UNLIKELY (type == NULL || !g_variant_type_string_is_valid (type) ||
+                    !g_variant_type_is_definite ((GVariantType *)type)))
+    {
+        g_warning ("%s: invalid type \"%s\"", G_STRFUNC, type);
+        return NULL;
+    }
+
+    /* the data returned by SQLite is only valid until the next step */
+    bytes = g_bytes_new (data, size);
+    variant = g_variant_new_from_bytes ((GVariantType *)type, bytes, FALSE);
+    g_bytes_unref (bytes);
+
+    return g_variant_ref_sink (variant);
+}
+
+/* Values are stored either as blobs holding their serialized data (since
+ * version 3 of the DB schema), or as strings in the GVariant text format */
 GVariant *
 _ag_value_from_db (sqlite3_stmt *stmt, gint col_type, gint col_value)
 {
@@ -186,6 +210,13 @@ _ag_value_from_db (sqlite3_stmt *stmt, gint col_type, gint col_value)
     gchar *type;
 
     type = (gchar *)sqlite3_column_text (stmt, col_type);
+    if (sqlite3_column_type (stmt, col_value) == SQLITE_BLOB)
+    {
+        gconstpointer data = sqlite3_column_blob (stmt, col_value);
+        return _ag_value_from_data (type, data,
+                                    sqlite3_column_bytes (stmt, col_value));
+    }
+
     string_value = (gchar *)sqlite3_column_text (stmt, col_value);
 
     return _ag_value_from_string (type, string_value);
@@ -437,7 +468,9 @@ gboolean _ag_xml_parse_element_list (xmlTextReaderPtr reader, const gchar *match
     gchar *data;
     int res, etype;
 
-    *list = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    /* The elements are interned: they are usually tags, which come from a
+     * small vocabulary shared by many files */
+    *list = g_hash_table_new (g_str_hash, g_str_equal);
 
     res = xmlTextReaderRead (reader);
     while (res == 1)
@@ -455,7 +488,10 @@ gboolean _ag_xml_parse_element_list (xmlTextReaderPtr reader, const gchar *match
             {
                 if (_ag_xml_dup_element_data (reader, &data))
                 {
-                    g_hash_table_insert (*list, data, NULL);
+                    g_hash_table_insert (*list,
+                                         (gpointer)g_intern_string (data),
+                                         NULL);
+                    g_free (data);
                     ok = TRUE;
                 }
                 else return FALSE;
@@ -556,6 +592,64 @@ _ag_dbus_escape_as_identifier (const gchar *name)
     return g_string_free (op, FALSE);
 }
 
+/**
+ * _ag_get_data_dirs:
+ * @env_var: name of the environment variable which could specify an override
+ * path.
+ * @subdir: the subdirectory of $XDG_DATA_DIRS holding the files.
+ *
+ * Build the list of directories where the libaccounts data files of a given
+ * kind are searched, in descending order of priority: if @env_var is set,
+ * that is the only directory; otherwise the user data directory comes first,
+ * followed by the system data directories, each one preceded by its desktop
+ * specific override directory.
+ *
+ * Returns: (transfer full): a %NULL-terminated array of directory paths, to
+ * be freed with g_strfreev().
+ */
+gchar **
+_ag_get_data_dirs (const gchar *env_var, const gchar *subdir)
+{
+    const gchar * const *dirs;
+    const gchar *env_dirname, *datadir;
+    gchar *desktop_override = NULL;
+    GPtrArray *paths;
+
+    paths = g_ptr_array_new ();
+
+    env_dirname = g_getenv (env_var);
+    if (env_dirname)
+    {
+        /* If the environment variable is set, don't look in other places */
+        g_ptr_array_add (paths, g_strdup (env_dirname));
+        goto finish;
+    }
+
+    datadir = g_get_user_data_dir ();
+    if (G_LIKELY (datadir))
+        g_ptr_array_add (paths, g_build_filename (datadir, subdir, NULL));
+
+    /* Check what desktop is this running on */
+    env_dirname = g_getenv ("XDG_CURRENT_DESKTOP");
+    if (env_dirname)
+        desktop_override = g_ascii_strdown (env_dirname, -1);
+
+    dirs = g_get_system_data_dirs ();
+    for (datadir = *dirs; datadir != NULL; dirs++, datadir = *dirs)
+    {
+        /* Desktop override files have precedence over the generic ones */
+        if (desktop_override)
+            g_ptr_array_add (paths, g_build_filename (datadir, subdir,
+                                                      desktop_override, NULL));
+        g_ptr_array_add (paths, g_build_filename (datadir, subdir, NULL));
+    }
+
+    g_free (desktop_override);
+finish:
+    g_ptr_array_add (paths, NULL);
+    return (gchar **)g_ptr_array_free (paths, FALSE);
+}
+
 /**
  * _ag_find_libaccounts_file:
  * @file_id: the base name of the file, without suffix.
@@ -563,8 +657,13 @@ _ag_dbus_escape_as_identifier (const gchar *name)
  * @env_var: name of the environment variable which could specify an override
  * path.
  * @subdir: file will be searched in $XDG_DATA_DIRS/<subdir>/
+ * @catalog_entry: (out) (allow-none): location to receive the entry
+ * describing the file, if it was found in a compiled catalog.
  *
- * Search for the libaccounts file @file_id.
+ * Search for the libaccounts file @file_id. The directories are looked up in
+ * the per-process directory index, without touching the file system. If the
+ * file was found in a compiled catalog, @catalog_entry is set to a new
+ * reference to the catalog entry, otherwise it is set to %NULL.
  *
  * Returns: the path of the file, if found, %NULL otherwise.
  */
@@ -572,58 +671,194 @@ gchar *
 _ag_find_libaccounts_file (const gchar *file_id,
                            const gchar *suffix,
                            const gchar *env_var,
-                           const gchar *subdir)
+                           const gchar *subdir,
+                           GVariant **catalog_entry)
 {
-    const gchar * const *dirs;
-    const gchar *dirname;
-    const gchar *env_dirname;
-    gchar *filename, *filepath, *desktop_override = NULL;
+    gchar **dirs, **dirname;
+    gchar *filename, *filepath = NULL;
+
+    if (catalog_entry)
+        *catalog_entry = NULL;
 
     filename = g_strconcat (file_id, suffix, NULL);
-    env_dirname = g_getenv (env_var);
-    if (env_dirname)
+    dirs = _ag_get_data_dirs (env_var, subdir);
+    for (dirname = dirs; *dirname != NULL; dirname++)
     {
-        filepath = g_build_filename (env_dirname, filename, NULL);
-        if (g_file_test (filepath, G_FILE_TEST_IS_REGULAR))
-            goto found;
-        g_free (filepath);
+        if (_ag_catalog_lookup (*dirname, filename, catalog_entry))
+        {
+            filepath = g_build_filename (*dirname, filename, NULL);
+            break;
+        }
     }
 
-    dirname = g_get_user_data_dir ();
-    if (G_LIKELY (dirname))
+    g_strfreev (dirs);
+    g_free (filename);
+    return filepath;
+}
+
+/**
+ * _ag_settings_to_variant:
+ * @settings: (allow-none): a #GHashTable of settings, mapping keys to
+ * #GVariant values.
+ *
+ * Serialize a table of settings, such as the default settings of a service.
+ *
+ * Returns: (transfer floating): a #GVariant of type a{sv}.
+ */
+GVariant *
+_ag_settings_to_variant (GHashTable *settings)
+{
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    const gchar *key;
+    GVariant *value;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    if (settings != NULL)
     {
-        filepath = g_build_filename (dirname, subdir, filename, NULL);
-        if (g_file_test (filepath, G_FILE_TEST_IS_REGULAR))
-            goto found;
-        g_free (filepath);
+        g_hash_table_iter_init (&iter, settings);
+        while (g_hash_table_iter_next (&iter,
+                                       (gpointer)&key, (gpointer)&value))
+            g_variant_builder_add (&builder, "{sv}", key, value);
     }
+    return g_variant_builder_end (&builder);
+}
 
-    /* Check what desktop is this running on */
-    env_dirname = g_getenv ("XDG_CURRENT_DESKTOP");
-    if (env_dirname)
-        desktop_override = g_ascii_strdown (env_dirname, -1);
+/**
+ * _ag_settings_from_variant:
+ * @variant: a #GVariant of type a{sv}.
+ *
+ * The inverse of _ag_settings_to_variant().
+ *
+ * Returns: a new #GHashTable of settings.
+ */
+GHashTable *
+_ag_settings_from_variant (GVariant *variant)
+{
+    GHashTable *settings;
+    GVariantIter iter;
+    gchar *key;
+    GVariant *value;
+
+    settings = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                      g_free, (GDestroyNotify)g_variant_unref);
+    g_variant_iter_init (&iter, variant);
+    while (g_variant_iter_next (&iter, "{sv}", &key, &value))
+        g_hash_table_insert (settings, key, value);
+
+    return settings;
+}
 
-    dirs = g_get_system_data_dirs ();
-    for (dirname = *dirs; dirname != NULL; dirs++, dirname = *dirs)
+/**
+ * _ag_get_file_mtime:
+ * @filepath: path of the file.
+ *
+ * Returns: the modification time of @filepath, in microseconds, or 0 if the
+ * file cannot be accessed.
+ */
+gint64
+_ag_get_file_mtime (const gchar *filepath)
+{
+    struct stat file_stat;
+
+    if (stat (filepath, &file_stat) != 0)
+        return 0;
+
+    return (gint64)file_stat.st_mtim.tv_sec * G_USEC_PER_SEC +
+        file_stat.st_mtim.tv_nsec / 1000;
+}
+
+/**
+ * _ag_map_file:
+ * @filepath: path of the file.
+ *
+ * Map the file @filepath in memory, read-only; files smaller than
+ * MIN_MAPPED_FILE_SIZE are read instead. The returned data is always
+ * followed by a NUL byte, which is not counted in the size of the #GBytes.
+ *
+ * Returns: a #GBytes with the file contents, or %NULL if the file cannot be
+ * read.
+ */
+GBytes *
+_ag_map_file (const gchar *filepath)
+{
+    GMappedFile *mapped_file = NULL;
+    struct stat file_stat;
+    GError *error = NULL;
+    GBytes *bytes;
+    gchar *contents;
+    gsize len;
+
+    if (stat (filepath, &file_stat) == 0 &&
+        file_stat.st_size >= MIN_MAPPED_FILE_SIZE)
+        mapped_file = g_mapped_file_new (filepath, FALSE, &error);
+    if (mapped_file != NULL)
     {
-        /* Check first if desktop override files exist and if yes, load them first */
-        if (desktop_override)
+        len = g_mapped_file_get_length (mapped_file);
+        /* The end of the last page of the mapping is filled with zeroes: the
+         * contents are NUL-terminated unless the file ends exactly on a page
+         * boundary */
+        if (len > 0 && len % sysconf (_SC_PAGESIZE) != 0)
         {
-            filepath = g_build_filename (dirname, subdir, desktop_override, filename, NULL);
-            if (g_file_test (filepath, G_FILE_TEST_IS_REGULAR))
-                goto found;
-            g_free (filepath);
+            bytes = g_mapped_file_get_bytes (mapped_file);
+            g_mapped_file_unref (mapped_file);
+            return bytes;
         }
-        filepath = g_build_filename (dirname, subdir, filename, NULL);
-        if (g_file_test (filepath, G_FILE_TEST_IS_REGULAR))
-            goto found;
-        g_free (filepath);
+        g_mapped_file_unref (mapped_file);
+    }
+    else
+    {
+        g_clear_error (&error);
     }
 
-    filepath = NULL;
-found:
-    g_free (desktop_override);
-    g_free (filename);
-    return filepath;
+    if (!g_file_get_contents (filepath, &contents, &len, &error))
+    {
+        g_warning ("Error reading %s: %s", filepath, error->message);
+        g_error_free (error);
+        return NULL;
+    }
+
+    return g_bytes_new_take (contents, len);
 }
 
+/**
+ * _ag_get_libaccounts_file_contents:
+ * @file_id: the base name of the file, without suffix.
+ * @suffix: the file suffix.
+ * @env_var: name of the environment variable which could specify an override
+ * path.
+ * @subdir: file will be searched in $XDG_DATA_DIRS/<subdir>/
+ *
+ * Get the contents of the libaccounts file @file_id, either from the
+ * compiled catalog or by mapping the file; in both cases the data is shared
+ * with the other users of the file, not copied. The data is NUL-terminated.
+ *
+ * Returns: a #GBytes with the file contents, or %NULL.
+ */
+GBytes *
+_ag_get_libaccounts_file_contents (const gchar *file_id,
+                                   const gchar *suffix,
+                                   const gchar *env_var,
+                                   const gchar *subdir)
+{
+    GVariant *entry;
+    GBytes *contents;
+    gchar *filepath;
+
+    filepath = _ag_find_libaccounts_file (file_id, suffix, env_var, subdir,
+                                          &entry);
+    if (G_UNLIKELY (filepath == NULL)) return NULL;
+
+    if (entry != NULL)
+    {
+        contents = _ag_catalog_entry_get_contents (entry);
+        g_variant_unref (entry);
+    }
+    else
+    {
+        contents = _ag_map_file (filepath);
+    }
+
+    g_free (filepath);
+    return contents;
+}
@@ -50,9 +50,6 @@ GVariant *_ag_value_to_variant (const GValue *value);
 G_GNUC_INTERNAL
 void _ag_value_from_variant (GValue *value, GVariant *variant);
 
-G_GNUC_INTERNAL
-gchar *_ag_value_to_db (GVariant *value, gboolean type_annotate);
-
 G_GNUC_INTERNAL
 GVariant *_ag_value_from_db (sqlite3_stmt *stmt, gint col_type, gint col_value);
 
@@ -80,11 +77,33 @@ gboolean _ag_xml_parse_element_list (xmlTextReaderPtr reader, const gchar *match
 G_GNUC_INTERNAL
 gchar *_ag_dbus_escape_as_identifier (const gchar *name);
 
+G_GNUC_INTERNAL
+gchar **_ag_get_data_dirs (const gchar *env_var, const gchar *subdir);
+
 G_GNUC_INTERNAL
 gchar *_ag_find_libaccounts_file (const gchar *file_id,
                                   const gchar *suffix,
                                   const gchar *env_var,
-                                  const gchar *subdir);
+                                  const gchar *subdir,
+                                  GVariant **catalog_entry);
+
+G_GNUC_INTERNAL
+GVariant *_ag_settings_to_variant (GHashTable *settings);
+
+G_GNUC_INTERNAL
+GHashTable *_ag_settings_from_variant (GVariant *variant);
+
+G_GNUC_INTERNAL
+gint64 _ag_get_file_mtime (const gchar *filepath);
+
+G_GNUC_INTERNAL
+GBytes *_ag_map_file (const gchar *filepath);
+
+G_GNUC_INTERNAL
+GBytes *_ag_get_libaccounts_file_contents (const gchar *file_id,
+                                           const gchar *suffix,
+                                           const gchar *env_var,
+                                           const gchar *subdir);
 
 G_END_DECLS
 
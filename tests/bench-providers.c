@@ -0,0 +1,169 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This file is part of libaccounts-glib
+ *
+ * Copyright (C) 2012-2016 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * Benchmark for ag_manager_find_providers_for_domain(): compares it with
+ * matching the domains regex of each installed provider, which is what
+ * clients had to do before.
+ */
+
+#include <libaccounts-glib.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_PROVIDERS 300
+#define N_LOOKUPS 1000
+
+static gchar *
+create_providers (void)
+{
+    GError *error = NULL;
+    gchar *dirname;
+    gint i;
+
+    dirname = g_dir_make_tmp ("ag-bench-XXXXXX", &error);
+    g_assert_no_error (error);
+
+    for (i = 0; i < N_PROVIDERS; i++)
+    {
+        gchar *filename, *contents;
+
+        filename = g_strdup_printf ("%s/provider%03d.provider", dirname, i);
+        contents = g_strdup_printf (
+            "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+            "<provider id=\"provider%03d\">\n"
+            "  <name>Provider %d</name>\n"
+            "  <domains>(.*\\.)?provider%03d\\.com|provider%03d\\.org$"
+            "</domains>\n"
+            "</provider>\n", i, i, i, i);
+        g_file_set_contents (filename, contents, -1, &error);
+        g_assert_no_error (error);
+        g_free (contents);
+        g_free (filename);
+    }
+
+    return dirname;
+}
+
+static void
+delete_dir (const gchar *dirname)
+{
+    const gchar *name;
+    GDir *dir;
+
+    dir = g_dir_open (dirname, 0, NULL);
+    while ((name = g_dir_read_name (dir)) != NULL)
+    {
+        gchar *filename = g_build_filename (dirname, name, NULL);
+        g_unlink (filename);
+        g_free (filename);
+    }
+    g_dir_close (dir);
+    g_rmdir (dirname);
+}
+
+static gchar *
+get_domain (gint i)
+{
+    /* one lookup out of four doesn't match any provider */
+    if (i % 4 == 3)
+        return g_strdup_printf ("www.unknown%03d.net", i % N_PROVIDERS);
+    return g_strdup_printf ("mail.provider%03d.com", i % N_PROVIDERS);
+}
+
+static gint
+find_by_regex (GList *providers, const gchar *domain)
+{
+    GList *list;
+    gint found = 0;
+
+    for (list = providers; list != NULL; list = list->next)
+    {
+        const gchar *regex = ag_provider_get_domains_regex (list->data);
+
+        if (regex != NULL && g_regex_match_simple (regex, domain, 0, 0))
+            found++;
+    }
+    return found;
+}
+
+int
+main (int argc, char **argv)
+{
+    AgManager *manager;
+    GList *providers, *found;
+    GTimer *timer;
+    gchar *dirname;
+    gdouble regex_time, matcher_time;
+    gint i, n_regex = 0, n_matcher = 0;
+
+    dirname = create_providers ();
+    g_setenv ("AG_PROVIDERS", dirname, TRUE);
+    g_setenv ("ACCOUNTS", dirname, TRUE);
+
+    manager = ag_manager_new ();
+    providers = ag_manager_list_providers (manager);
+    g_assert_cmpint (g_list_length (providers), ==, N_PROVIDERS);
+
+    timer = g_timer_new ();
+    for (i = 0; i < N_LOOKUPS; i++)
+    {
+        gchar *domain = get_domain (i);
+        n_regex += find_by_regex (providers, domain);
+        g_free (domain);
+    }
+    regex_time = g_timer_elapsed (timer, NULL);
+
+    g_timer_start (timer);
+    for (i = 0; i < N_LOOKUPS; i++)
+    {
+        gchar *domain = get_domain (i);
+        found = ag_manager_find_providers_for_domain (manager, domain);
+        n_matcher += g_list_length (found);
+        ag_provider_list_free (found);
+        g_free (domain);
+    }
+    matcher_time = g_timer_elapsed (timer, NULL);
+
+    /* both methods must give the same results */
+    g_assert_cmpint (n_regex, ==, n_matcher);
+    g_assert_cmpint (n_matcher, ==, N_LOOKUPS - N_LOOKUPS / 4);
+
+    g_print ("%d lookups over %d providers:\n", N_LOOKUPS, N_PROVIDERS);
+    g_print ("  g_regex_match_simple():                 %.3f ms\n",
+             regex_time * 1000);
+    g_print ("  ag_manager_find_providers_for_domain(): %.3f ms\n",
+             matcher_time * 1000);
+
+    g_timer_destroy (timer);
+    ag_provider_list_free (providers);
+    g_object_unref (manager);
+
+    delete_dir (dirname);
+    g_free (dirname);
+
+    return EXIT_SUCCESS;
+}
@@ -44,11 +44,13 @@
 #include <check.h>
 #include <sched.h>
 #include <sqlite3.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
 #define PROVIDER    "dummyprovider"
@@ -211,6 +213,99 @@ end_test ()
     data_stored = FALSE;
 }
 
+static void
+copy_test_file (const gchar *src_dir, const gchar *dest_dir,
+                const gchar *file_name)
+{
+    gchar *src, *dest, *contents;
+    gsize len;
+    gboolean ok;
+
+    src = g_build_filename (src_dir, file_name, NULL);
+    dest = g_build_filename (dest_dir, file_name, NULL);
+    ok = g_file_get_contents (src, &contents, &len, NULL);
+    ck_assert (ok);
+    ok = g_file_set_contents (dest, contents, len, NULL);
+    ck_assert (ok);
+    g_free (contents);
+    g_free (dest);
+    g_free (src);
+}
+
+/* A temporary data directory, which replaces the one in @env_var until
+ * tmp_data_dir_free() is called */
+typedef struct {
+    const gchar *env_var;
+    gchar *orig_dir;
+    gchar *path;
+} TmpDataDir;
+
+static TmpDataDir *
+tmp_data_dir_new (const gchar *env_var)
+{
+    TmpDataDir *dir;
+    GError *error = NULL;
+
+    dir = g_slice_new0 (TmpDataDir);
+    dir->env_var = env_var;
+    dir->orig_dir = g_strdup (g_getenv (env_var));
+    dir->path = g_dir_make_tmp ("ag-data-XXXXXX", &error);
+    ck_assert_msg (dir->path != NULL, "Cannot create the directory: %s",
+                   error ? error->message : "");
+    g_setenv (env_var, dir->path, TRUE);
+    return dir;
+}
+
+/* Copies @file_name from the original data directory */
+static void
+tmp_data_dir_copy (TmpDataDir *dir, const gchar *file_name)
+{
+    copy_test_file (dir->orig_dir, dir->path, file_name);
+}
+
+static void
+tmp_data_dir_write (TmpDataDir *dir, const gchar *file_name,
+                    const gchar *contents)
+{
+    gchar *filepath;
+
+    filepath = g_build_filename (dir->path, file_name, NULL);
+    ck_assert (g_file_set_contents (filepath, contents, -1, NULL));
+    g_free (filepath);
+}
+
+static void
+tmp_data_dir_remove (TmpDataDir *dir, const gchar *file_name)
+{
+    gchar *filepath;
+
+    filepath = g_build_filename (dir->path, file_name, NULL);
+    g_remove (filepath);
+    g_free (filepath);
+}
+
+/* Deletes the directory with all its files, and restores the original one */
+static void
+tmp_data_dir_free (TmpDataDir *dir)
+{
+    const gchar *file_name;
+    GDir *gdir;
+
+    gdir = g_dir_open (dir->path, 0, NULL);
+    if (gdir != NULL)
+    {
+        while ((file_name = g_dir_read_name (gdir)) != NULL)
+            tmp_data_dir_remove (dir, file_name);
+        g_dir_close (gdir);
+    }
+    g_rmdir (dir->path);
+    g_setenv (dir->env_var, dir->orig_dir, TRUE);
+
+    g_free (dir->orig_dir);
+    g_free (dir->path);
+    g_slice_free (TmpDataDir, dir);
+}
+
 START_TEST(test_init)
 {
     manager = ag_manager_new ();
@@ -421,6 +516,96 @@ START_TEST(test_provider_settings)
 }
 END_TEST
 
+START_TEST(test_find_providers_for_domain)
+{
+    GList *providers;
+
+    manager = ag_manager_new ();
+
+    providers = ag_manager_find_providers_for_domain (manager,
+                                                      "www.provider.com");
+    ck_assert_int_eq (g_list_length (providers), 1);
+    ck_assert_str_eq (ag_provider_get_name (providers->data), "MyProvider");
+    ag_provider_list_free (providers);
+
+    providers = ag_manager_find_providers_for_domain (manager,
+                                                      "mail.example.com");
+    ck_assert_int_eq (g_list_length (providers), 1);
+    ck_assert_str_eq (ag_provider_get_name (providers->data), "maemo");
+
+    /* The providers, and their compiled regexes, are reused */
+    ck_assert (ag_provider_match_domain (providers->data, "example.com"));
+    ck_assert (!ag_provider_match_domain (providers->data, "example.org"));
+    ag_provider_list_free (providers);
+
+    providers = ag_manager_find_providers_for_domain (manager, "example.org");
+    ck_assert (providers == NULL);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_match_domain_escapes)
+{
+    const gchar *contents =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+        "<provider id=\"escapes\">\n"
+        "  <domains>.*hex\\x2eexample\\.com|"
+        ".*octal\\056example\\.com$</domains>\n"
+        "</provider>\n";
+    TmpDataDir *providers_dir;
+    AgProvider *provider;
+
+    providers_dir = tmp_data_dir_new ("AG_PROVIDERS");
+    tmp_data_dir_write (providers_dir, "escapes.provider", contents);
+
+    manager = ag_manager_new ();
+    provider = ag_manager_get_provider (manager, "escapes");
+    ck_assert (provider != NULL);
+
+    /* The text following the escapes is not a literal to look for */
+    ck_assert (ag_provider_match_domain (provider, "www.hex.example.com"));
+    ck_assert (ag_provider_match_domain (provider, "www.octal.example.com"));
+    ck_assert (!ag_provider_match_domain (provider, "www.other.example.com"));
+    ag_provider_unref (provider);
+
+    tmp_data_dir_free (providers_dir);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_match_domain_posix_classes)
+{
+    const gchar *contents =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+        "<provider id=\"posix\">\n"
+        "  <domains>.*mail[[:digit:]]\\.example\\.com$|"
+        ".*web[^[:^alpha:][:space:]]\\.example\\.org$</domains>\n"
+        "</provider>\n";
+    TmpDataDir *providers_dir;
+    AgProvider *provider;
+
+    providers_dir = tmp_data_dir_new ("AG_PROVIDERS");
+    tmp_data_dir_write (providers_dir, "posix.provider", contents);
+
+    manager = ag_manager_new ();
+    provider = ag_manager_get_provider (manager, "posix");
+    ck_assert (provider != NULL);
+
+    /* The "]" closing a POSIX class doesn't end the bracket expression */
+    ck_assert (ag_provider_match_domain (provider, "www.mail1.example.com"));
+    ck_assert (ag_provider_match_domain (provider, "www.webx.example.org"));
+    ck_assert (!ag_provider_match_domain (provider, "www.mailx.example.com"));
+    ck_assert (!ag_provider_match_domain (provider, "www.web1.example.org"));
+    ag_provider_unref (provider);
+
+    tmp_data_dir_free (providers_dir);
+
+    end_test ();
+}
+END_TEST
+
 START_TEST(test_provider_directories)
 {
     AgProvider *provider;
@@ -518,6 +703,19 @@ void account_store_locked_cb (AgAccount *account, const GError *error,
     end_test ();
 }
 
+static gint
+get_db_int (sqlite3 *db, const gchar *sql)
+{
+    sqlite3_stmt *stmt;
+    gint result;
+
+    sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL);
+    ck_assert_int_eq (sqlite3_step (stmt), SQLITE_ROW);
+    result = sqlite3_column_int (stmt, 0);
+    sqlite3_finalize (stmt);
+    return result;
+}
+
 gboolean
 release_lock (sqlite3 *db)
 {
@@ -615,165 +813,1284 @@ START_TEST(test_store_locked_cancel)
 }
 END_TEST
 
-static gboolean
-test_store_read_only_handle_store_cb (TestManager *test_manager,
-                                      GDBusMethodInvocation *invocation,
-                                      guint account_id,
-                                      gboolean created,
-                                      gboolean deleted,
-                                      const gchar *provider,
-                                      GVariant *settings,
-                                      StoreCbData *store_data)
+static gpointer
+hold_lock_thread (gpointer user_data)
 {
-    g_debug ("%s called", G_STRFUNC);
-    guint result_id = store_data->account_id;
+    sqlite3 *db = user_data;
 
-    store_data->called = TRUE;
-    store_data->account_id = account_id;
-    store_data->created = created;
-    store_data->deleted = deleted;
-    store_data->provider = g_strdup (provider);
-    store_data->settings = g_variant_ref (settings);
-    test_manager_complete_store (test_manager, invocation, result_id);
-    return TRUE;
+    g_usleep (200 * 1000);
+    g_debug ("releasing lock");
+    sqlite3_exec (db, "COMMIT;", NULL, NULL, NULL);
+    return NULL;
 }
 
-static void
-test_store_read_only_store_cb (GObject *object, GAsyncResult *res,
-                               gpointer user_data)
+START_TEST(test_store_locked_blocking)
 {
-    GMainLoop *loop = user_data;
+    sqlite3 *db;
+    GThread *thread;
     GError *error = NULL;
+    gint64 start_time, elapsed;
+    gboolean ok;
 
-    g_debug ("%s called", G_STRFUNC);
+    manager = ag_manager_new ();
 
-    ag_account_store_finish (AG_ACCOUNT (object), res, &error);
+    account = ag_manager_create_account (manager, PROVIDER);
+
+    /* get an exclusive lock on the DB, and release it from another thread */
+    sqlite3_open (db_filename, &db);
+    sqlite3_exec (db, "BEGIN EXCLUSIVE", NULL, NULL, NULL);
+    thread = g_thread_new ("lock holder", hold_lock_thread, db);
+
+    start_time = g_get_monotonic_time ();
+    ok = ag_account_store_blocking (account, &error);
+    elapsed = g_get_monotonic_time () - start_time;
+    ck_assert_msg (ok, "Store failed: %s", error ? error->message : "");
     ck_assert (error == NULL);
-    g_main_loop_quit (loop);
+
+    /* The store must have waited for the lock, and completed soon after its
+     * release */
+    ck_assert_msg (elapsed >= 150 * 1000,
+                   "Store completed too early (%" G_GINT64_FORMAT " us)",
+                   elapsed);
+    ck_assert_msg (elapsed < 1000 * 1000,
+                   "Store completed too late (%" G_GINT64_FORMAT " us)",
+                   elapsed);
+
+    g_thread_join (thread);
+    sqlite3_close (db);
+    end_test ();
 }
+END_TEST
 
-START_TEST(test_store_read_only)
+typedef struct {
+    GList *stored;
+    gboolean ticked;
+} WriterTestData;
+
+static void
+writer_store_cb (GObject *object, GAsyncResult *res, gpointer user_data)
 {
-    TestManager *test_manager;
-    TestObjectSkeleton *test_object;
-    StoreCbData store_data = { 0 };
-    GDBusObjectManagerServer *object_manager;
-    GDBusConnection *conn;
-    const gchar *display_name = "My readonly account";
-    const AgAccountId expected_id = 4;
+    WriterTestData *data = user_data;
     GError *error = NULL;
-    guint reg_id;
-
-    set_read_only ();
 
-    main_loop = g_main_loop_new (NULL, FALSE);
-
-    /* Register the D-Bus account manager service */
-    conn = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+    ag_account_store_finish (AG_ACCOUNT (object), res, &error);
     ck_assert (error == NULL);
-    ck_assert (conn != NULL);
+    /* The main loop must have kept running while the DB was locked */
+    ck_assert (data->ticked);
+    ck_assert (lock_released);
 
-    reg_id = g_bus_own_name_on_connection (conn,
-                                           AG_MANAGER_SERVICE_NAME,
-                                           G_BUS_NAME_OWNER_FLAGS_REPLACE,
-                                           NULL, NULL, NULL, NULL);
+    data->stored = g_list_append (data->stored, object);
+    if (g_list_length (data->stored) == 2)
+        g_main_loop_quit (main_loop);
+}
 
-    test_manager = test_manager_skeleton_new ();
-    g_signal_connect (test_manager, "handle-store",
-                      G_CALLBACK (test_store_read_only_handle_store_cb),
-                      &store_data);
+static gboolean
+writer_tick (gpointer user_data)
+{
+    WriterTestData *data = user_data;
 
-    test_object = test_object_skeleton_new (AG_MANAGER_OBJECT_PATH);
-    test_object_skeleton_set_manager (test_object, test_manager);
+    data->ticked = TRUE;
+    return G_SOURCE_REMOVE;
+}
 
-    object_manager =
-        g_dbus_object_manager_server_new ("/com/google/code/AccountsSSO");
-    g_dbus_object_manager_server_export (object_manager,
-                                         G_DBUS_OBJECT_SKELETON (test_object));
-    g_dbus_object_manager_server_set_connection (object_manager, conn);
+START_TEST(test_store_async_writer)
+{
+    WriterTestData data = { NULL, FALSE };
+    AgAccount *account2;
+    sqlite3 *db;
 
     manager = ag_manager_new ();
-    ck_assert (manager != NULL);
+    account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_display_name (account, "First");
+    account2 = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_display_name (account2, "Second");
 
-    /* create an account, write its display name */
-    account = ag_manager_create_account (manager, "fakebook");
-    ck_assert_msg (AG_IS_ACCOUNT (account),
-                   "Failed to create the AgAccount.");
-    ag_account_set_display_name (account, display_name);
+    /* get an exclusive lock on the DB */
+    sqlite3_open (db_filename, &db);
+    sqlite3_exec (db, "BEGIN EXCLUSIVE", NULL, NULL, NULL);
+    lock_released = FALSE;
 
-    /* We want to verify that the local account will be updated with this
-     * ID */
-    store_data.account_id = expected_id;
-    ag_account_store_async (account, NULL,
-                            test_store_read_only_store_cb,
-                            main_loop);
+    main_loop = g_main_loop_new (NULL, FALSE);
+    ag_account_store_async (account, NULL, writer_store_cb, &data);
+    ag_account_store_async (account2, NULL, writer_store_cb, &data);
+    g_timeout_add (50, writer_tick, &data);
+    g_timeout_add (150, (GSourceFunc)release_lock, db);
     g_main_loop_run (main_loop);
 
-    ck_assert (store_data.called);
-    ck_assert (store_data.created);
-    ck_assert (!store_data.deleted);
-    ck_assert_uint_eq (store_data.account_id, 0);
-    ck_assert_str_eq (store_data.provider, "fakebook");
-    store_cb_data_unset (&store_data);
+    /* Both accounts have been stored, in order */
+    ck_assert_int_eq (g_list_length (data.stored), 2);
+    ck_assert (data.stored->data == account);
+    ck_assert (data.stored->next->data == account2);
+    ck_assert_uint_ne (account->id, 0);
+    ck_assert_uint_gt (account2->id, account->id);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Accounts "
+                                  "WHERE name IN ('First', 'Second')"), 2);
+    g_list_free (data.stored);
+    sqlite3_close (db);
+    g_object_unref (account2);
+    end_test ();
+}
+END_TEST
 
-    ck_assert_uint_eq (account->id, expected_id);
-    const char *name = ag_account_get_display_name (account);
-    ck_assert (name != NULL);
-    ck_assert_str_eq (name, display_name);
+typedef struct {
+    gint n_pending;
+    gboolean failed[3];
+} GroupCommitData;
 
-    /* cleaning up */
-    g_object_unref (object_manager);
-    g_object_unref (test_object);
-    g_object_unref (test_manager);
-    g_bus_unown_name (reg_id);
-    g_object_unref (conn);
+static void
+group_commit_store_cb (GObject *object, GAsyncResult *res,
+                       gpointer user_data)
+{
+    GroupCommitData *data = user_data;
+    GError *error = NULL;
+    gint index;
 
-    /* delete the DB */
-    g_object_unref (account);
-    account = NULL;
-    g_object_unref (manager);
-    manager = NULL;
+    index = GPOINTER_TO_INT (g_object_get_data (object, "index"));
+    if (!ag_account_store_finish (AG_ACCOUNT (object), res, &error))
+    {
+        ck_assert (error != NULL);
+        data->failed[index] = TRUE;
+        g_error_free (error);
+    }
 
-    delete_db ();
+    if (--data->n_pending == 0)
+        g_main_loop_quit (main_loop);
+}
+
+START_TEST(test_store_group_commit)
+{
+    const gchar *names[] = { "First", "Fail", "Third" };
+    GroupCommitData data = { 3, { FALSE, FALSE, FALSE } };
+    AgAccount *accounts[3];
+    sqlite3 *db;
+    gint i;
+
+    manager = ag_manager_new ();
 
+    /* Storing the account named "Fail" will fail */
+    sqlite3_open (db_filename, &db);
+    sqlite3_exec (db,
+                  "CREATE TRIGGER fail_store BEFORE INSERT ON Accounts "
+                  "WHEN NEW.name = 'Fail' "
+                  "BEGIN SELECT RAISE(ABORT, 'failing'); END;",
+                  NULL, NULL, NULL);
+
+    /* Lock the DB, so that the stores are queued and then executed in the
+     * same transaction */
+    sqlite3_exec (db, "BEGIN EXCLUSIVE", NULL, NULL, NULL);
+
+    main_loop = g_main_loop_new (NULL, FALSE);
+    for (i = 0; i < 3; i++)
+    {
+        accounts[i] = ag_manager_create_account (manager, PROVIDER);
+        ag_account_set_display_name (accounts[i], names[i]);
+        g_object_set_data ((GObject *)accounts[i], "index",
+                           GINT_TO_POINTER (i));
+        ag_account_store_async (accounts[i], NULL,
+                                group_commit_store_cb, &data);
+    }
+    g_timeout_add (100, (GSourceFunc)release_lock, db);
+    g_main_loop_run (main_loop);
+
+    /* The failure of a store doesn't affect the others */
+    ck_assert (!data.failed[0]);
+    ck_assert (data.failed[1]);
+    ck_assert (!data.failed[2]);
+    ck_assert_uint_ne (accounts[0]->id, 0);
+    ck_assert_uint_eq (accounts[1]->id, 0);
+    ck_assert_uint_ne (accounts[2]->id, 0);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Accounts "
+                                  "WHERE name IN ('First', 'Third')"), 2);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Accounts "
+                                  "WHERE name = 'Fail'"), 0);
+
+    sqlite3_exec (db, "DROP TRIGGER fail_store", NULL, NULL, NULL);
+    sqlite3_close (db);
+    for (i = 0; i < 3; i++)
+        g_object_unref (accounts[i]);
     end_test ();
 }
 END_TEST
 
-void account_store_now_cb (AgAccount *account, const GError *error,
-                           gpointer user_data)
+static gpointer
+cancel_store_thread (gpointer user_data)
 {
-    const gchar *string = user_data;
-
-    ck_assert_msg (AG_IS_ACCOUNT (account), "Account got disposed?");
-    if (error)
-        ck_abort_msg("Got error: %s", error->message);
-    ck_assert_msg (g_strcmp0 (string, TEST_STRING) == 0, "Got wrong string");
-
-    data_stored = TRUE;
+    g_usleep (100 * 1000);
+    g_cancellable_cancel (user_data);
+    return NULL;
 }
 
-START_TEST(test_account_service)
+START_TEST(test_store_group_commit_mixed)
 {
-    GValue value = { 0 };
-    const gchar *description = "This is really a beautiful account";
-    const gchar *display_name = "My test account";
-    AgSettingSource source;
-    AgAccountService *account_service;
+    const gchar *names[] = { "Async", "Cancelled", "Blocking" };
+    GroupCommitData data = { 2, { FALSE, FALSE, FALSE } };
+    AgAccount *accounts[3];
+    GCancellable *cancellable;
+    GThread *lock_thread, *cancel_thread;
+    GError *error = NULL;
+    gint data_version;
+    sqlite3 *db;
+    gint i;
 
     manager = ag_manager_new ();
-    account = ag_manager_create_account (manager, PROVIDER);
-
+    for (i = 0; i < 3; i++)
+    {
+        accounts[i] = ag_manager_create_account (manager, PROVIDER);
+        ag_account_set_display_name (accounts[i], names[i]);
+        g_object_set_data ((GObject *)accounts[i], "index",
+                           GINT_TO_POINTER (i));
+    }
+
+    /* Lock the DB, so that the asynchronous and the blocking stores end up
+     * in the same batch. The data version of our connection changes each
+     * time another connection commits a transaction. */
+    sqlite3_open (db_filename, &db);
+    data_version = get_db_int (db, "PRAGMA data_version");
+    sqlite3_exec (db, "BEGIN EXCLUSIVE", NULL, NULL, NULL);
+
+    main_loop = g_main_loop_new (NULL, FALSE);
+    cancellable = g_cancellable_new ();
+    ag_account_store_async (accounts[0], NULL, group_commit_store_cb, &data);
+    ag_account_store_async (accounts[1], cancellable,
+                            group_commit_store_cb, &data);
+
+    /* Cancelling one store, while the blocking one is waiting, must not
+     * affect the others */
+    cancel_thread = g_thread_new ("canceller", cancel_store_thread,
+                                  cancellable);
+    lock_thread = g_thread_new ("lock holder", hold_lock_thread, db);
+    ck_assert_msg (ag_account_store_blocking (accounts[2], &error),
+                   "Store failed: %s", error ? error->message : "");
+    g_thread_join (cancel_thread);
+    g_thread_join (lock_thread);
+
+    g_main_loop_run (main_loop);
+    ck_assert (!data.failed[0]);
+    ck_assert (data.failed[1]);
+    ck_assert_uint_ne (accounts[0]->id, 0);
+    ck_assert_uint_eq (accounts[1]->id, 0);
+    ck_assert_uint_ne (accounts[2]->id, 0);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Accounts "
+                                  "WHERE name IN ('Async', 'Blocking')"), 2);
+
+    /* Both stores were committed in a single transaction */
+    ck_assert_int_eq (get_db_int (db, "PRAGMA data_version"),
+                      data_version + 1);
+
+    sqlite3_close (db);
+    g_object_unref (cancellable);
+    for (i = 0; i < 3; i++)
+        g_object_unref (accounts[i]);
+    end_test ();
+}
+END_TEST
+
+static void
+store_accounts_cb (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+    GError **error = user_data;
+
+    ag_manager_store_accounts_finish (AG_MANAGER (object), res, error);
+    g_main_loop_quit (main_loop);
+}
+
+START_TEST(test_store_accounts)
+{
+    GList *accounts = NULL, *list;
+    GError *error = NULL;
+    sqlite3 *db;
+    gboolean ok;
+    gint i;
+
+    delete_db ();
+    manager = ag_manager_new ();
+
+    for (i = 0; i < 100; i++)
+    {
+        gchar *name = g_strdup_printf ("Bulk %d", i);
+        AgAccount *bulk = ag_manager_create_account (manager, PROVIDER);
+
+        ag_account_set_display_name (bulk, name);
+        accounts = g_list_prepend (accounts, bulk);
+        g_free (name);
+    }
+
+    ok = ag_manager_store_accounts_blocking (manager, accounts, &error);
+    ck_assert_msg (ok, "Got error: %s", error ? error->message : "");
+    for (list = accounts; list != NULL; list = list->next)
+    {
+        AgAccount *bulk = list->data;
+        AgAccount *loaded;
+
+        ck_assert_uint_ne (bulk->id, 0);
+        loaded = ag_manager_get_account (manager, bulk->id);
+        ck_assert (loaded == bulk);
+        g_object_unref (loaded);
+    }
+
+    sqlite3_open (db_filename, &db);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Accounts"), 100);
+
+    /* If one of the accounts cannot be stored, none is */
+    sqlite3_exec (db,
+                  "CREATE TRIGGER fail_store BEFORE UPDATE ON Accounts "
+                  "WHEN NEW.name = 'Fail' "
+                  "BEGIN SELECT RAISE(ABORT, 'failing'); END;",
+                  NULL, NULL, NULL);
+    for (list = accounts, i = 0; list != NULL; list = list->next, i++)
+        ag_account_set_display_name (list->data, i == 50 ? "Fail" : "Renamed");
+
+    main_loop = g_main_loop_new (NULL, FALSE);
+    ag_manager_store_accounts_async (manager, accounts, NULL,
+                                     store_accounts_cb, &error);
+    g_main_loop_run (main_loop);
+    ck_assert (error != NULL);
+    g_clear_error (&error);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Accounts "
+                                  "WHERE name = 'Renamed'"), 0);
+
+    /* Without the failing account, all of them are stored */
+    sqlite3_exec (db, "DROP TRIGGER fail_store", NULL, NULL, NULL);
+    for (list = accounts; list != NULL; list = list->next)
+        ag_account_set_display_name (list->data, "Renamed");
+    ag_manager_store_accounts_async (manager, accounts, NULL,
+                                     store_accounts_cb, &error);
+    g_main_loop_run (main_loop);
+    ck_assert (error == NULL);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Accounts "
+                                  "WHERE name = 'Renamed'"), 100);
+
+    sqlite3_close (db);
+    g_list_free_full (accounts, g_object_unref);
+    end_test ();
+}
+END_TEST
+
+static void
+count_criticals (const gchar *log_domain, GLogLevelFlags log_level,
+                 const gchar *message, gpointer user_data)
+{
+    guint *n_criticals = user_data;
+    (*n_criticals)++;
+}
+
+START_TEST(test_store_accounts_other_manager)
+{
+    AgManager *other_manager;
+    AgAccount *other_account;
+    GList *accounts = NULL;
+    guint n_criticals = 0;
+    guint handler_id;
+    sqlite3 *db;
+    gboolean ok;
+
+    delete_db ();
+    manager = ag_manager_new ();
+    other_manager = ag_manager_new ();
+
+    account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_display_name (account, "Mine");
+    other_account = ag_manager_create_account (other_manager, PROVIDER);
+    ag_account_set_display_name (other_account, "Other");
+    accounts = g_list_prepend (accounts, other_account);
+    accounts = g_list_prepend (accounts, account);
+
+    /* The accounts of another manager are rejected, and none is stored */
+    g_log_set_always_fatal (G_LOG_FATAL_MASK);
+    handler_id = g_log_set_handler ("accounts-glib", G_LOG_LEVEL_CRITICAL,
+                                    count_criticals, &n_criticals);
+    ok = ag_manager_store_accounts_blocking (manager, accounts, NULL);
+    ck_assert (!ok);
+    ag_manager_store_accounts_async (manager, accounts, NULL, NULL, NULL);
+    g_log_remove_handler ("accounts-glib", handler_id);
+    ck_assert_uint_eq (n_criticals, 2);
+
+    ck_assert_uint_eq (account->id, 0);
+    ck_assert_uint_eq (other_account->id, 0);
+    sqlite3_open (db_filename, &db);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Accounts"), 0);
+    sqlite3_close (db);
+
+    g_list_free (accounts);
+    g_object_unref (other_account);
+    g_object_unref (other_manager);
+    end_test ();
+}
+END_TEST
+
+static gboolean
+test_store_read_only_handle_store_cb (TestManager *test_manager,
+                                      GDBusMethodInvocation *invocation,
+                                      guint account_id,
+                                      gboolean created,
+                                      gboolean deleted,
+                                      const gchar *provider,
+                                      GVariant *settings,
+                                      StoreCbData *store_data)
+{
+    g_debug ("%s called", G_STRFUNC);
+    guint result_id = store_data->account_id;
+
+    store_data->called = TRUE;
+    store_data->account_id = account_id;
+    store_data->created = created;
+    store_data->deleted = deleted;
+    store_data->provider = g_strdup (provider);
+    store_data->settings = g_variant_ref (settings);
+    test_manager_complete_store (test_manager, invocation, result_id);
+    return TRUE;
+}
+
+static void
+test_store_read_only_store_cb (GObject *object, GAsyncResult *res,
+                               gpointer user_data)
+{
+    GMainLoop *loop = user_data;
+    GError *error = NULL;
+
+    g_debug ("%s called", G_STRFUNC);
+
+    ag_account_store_finish (AG_ACCOUNT (object), res, &error);
+    ck_assert (error == NULL);
+    g_main_loop_quit (loop);
+}
+
+START_TEST(test_store_read_only)
+{
+    TestManager *test_manager;
+    TestObjectSkeleton *test_object;
+    StoreCbData store_data = { 0 };
+    GDBusObjectManagerServer *object_manager;
+    GDBusConnection *conn;
+    const gchar *display_name = "My readonly account";
+    const AgAccountId expected_id = 4;
+    GError *error = NULL;
+    guint reg_id;
+
+    set_read_only ();
+
+    main_loop = g_main_loop_new (NULL, FALSE);
+
+    /* Register the D-Bus account manager service */
+    conn = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+    ck_assert (error == NULL);
+    ck_assert (conn != NULL);
+
+    reg_id = g_bus_own_name_on_connection (conn,
+                                           AG_MANAGER_SERVICE_NAME,
+                                           G_BUS_NAME_OWNER_FLAGS_REPLACE,
+                                           NULL, NULL, NULL, NULL);
+
+    test_manager = test_manager_skeleton_new ();
+    g_signal_connect (test_manager, "handle-store",
+                      G_CALLBACK (test_store_read_only_handle_store_cb),
+                      &store_data);
+
+    test_object = test_object_skeleton_new (AG_MANAGER_OBJECT_PATH);
+    test_object_skeleton_set_manager (test_object, test_manager);
+
+    object_manager =
+        g_dbus_object_manager_server_new ("/com/google/code/AccountsSSO");
+    g_dbus_object_manager_server_export (object_manager,
+                                         G_DBUS_OBJECT_SKELETON (test_object));
+    g_dbus_object_manager_server_set_connection (object_manager, conn);
+
+    manager = ag_manager_new ();
+    ck_assert (manager != NULL);
+
+    /* create an account, write its display name */
+    account = ag_manager_create_account (manager, "fakebook");
+    ck_assert_msg (AG_IS_ACCOUNT (account),
+                   "Failed to create the AgAccount.");
+    ag_account_set_display_name (account, display_name);
+
+    /* We want to verify that the local account will be updated with this
+     * ID */
+    store_data.account_id = expected_id;
+    ag_account_store_async (account, NULL,
+                            test_store_read_only_store_cb,
+                            main_loop);
+    g_main_loop_run (main_loop);
+
+    ck_assert (store_data.called);
+    ck_assert (store_data.created);
+    ck_assert (!store_data.deleted);
+    ck_assert_uint_eq (store_data.account_id, 0);
+    ck_assert_str_eq (store_data.provider, "fakebook");
+    store_cb_data_unset (&store_data);
+
+    ck_assert_uint_eq (account->id, expected_id);
+    const char *name = ag_account_get_display_name (account);
+    ck_assert (name != NULL);
+    ck_assert_str_eq (name, display_name);
+
+    /* cleaning up */
+    g_object_unref (object_manager);
+    g_object_unref (test_object);
+    g_object_unref (test_manager);
+    g_bus_unown_name (reg_id);
+    g_object_unref (conn);
+
+    /* delete the DB */
+    g_object_unref (account);
+    account = NULL;
+    g_object_unref (manager);
+    manager = NULL;
+
+    delete_db ();
+
+    end_test ();
+}
+END_TEST
+
+static GVariant *
+load_setting (AgAccountId account_id, const gchar *key)
+{
+    AgManager *manager2;
+    AgAccount *account2;
+    GVariant *value;
+
+    /* use a new manager, so that the account is read from the DB */
+    manager2 = ag_manager_new ();
+    account2 = ag_manager_load_account (manager2, account_id, NULL);
+    ck_assert (account2 != NULL);
+    value = ag_account_get_variant (account2, key, NULL);
+    if (value != NULL)
+        g_variant_ref (value);
+
+    g_object_unref (account2);
+    g_object_unref (manager2);
+    return value;
+}
+
+START_TEST(test_store_binary_values)
+{
+    const gchar *strv[] = { "one", "two", NULL };
+    const gchar *keys[] = { "string", "number", "list", "flag", "big" };
+    GVariant *values[G_N_ELEMENTS (keys)];
+    GVariant *value;
+    AgAccountId account_id;
+    GError *error = NULL;
+    sqlite3_stmt *stmt;
+    sqlite3 *db;
+    GList *list;
+    guint i;
+
+    delete_db ();
+
+    values[0] = g_variant_new_string ("it's a \"test\"");
+    values[1] = g_variant_new_int32 (-7);
+    values[2] = g_variant_new_strv (strv, -1);
+    values[3] = g_variant_new_boolean (TRUE);
+    values[4] = g_variant_new_uint64 (G_MAXUINT64);
+
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, "maemo");
+    ag_account_set_enabled (account, TRUE);
+    for (i = 0; i < G_N_ELEMENTS (keys); i++)
+    {
+        g_variant_ref_sink (values[i]);
+        ag_account_set_variant (account, keys[i], values[i]);
+    }
+    service = ag_manager_get_service (manager, "MyService");
+    ag_account_select_service (account, service);
+    ag_account_set_enabled (account, TRUE);
+    ck_assert (ag_account_store_blocking (account, &error));
+    ck_assert (error == NULL);
+    account_id = account->id;
+
+    sqlite3_open (db_filename, &db);
+    ck_assert_int_eq (get_db_int (db, "PRAGMA user_version"), 5);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Settings "
+                                  "WHERE typeof(value) != 'blob'"), 0);
+
+    for (i = 0; i < G_N_ELEMENTS (keys); i++)
+    {
+        value = load_setting (account_id, keys[i]);
+        ck_assert (value != NULL);
+        ck_assert (g_variant_equal (value, values[i]));
+        g_variant_unref (value);
+    }
+
+    /* The "enabled" setting can still be queried */
+    list = ag_manager_list_enabled_by_service_type (manager, "e-mail");
+    ck_assert_int_eq (g_list_length (list), 1);
+    ag_manager_list_free (list);
+
+    /* Values in the text format are converted when the DB is upgraded */
+    sqlite3_prepare_v2 (db, "UPDATE Settings SET value = ? "
+                        "WHERE key = 'string'", -1, &stmt, NULL);
+    sqlite3_bind_text (stmt, 1, "'old value'", -1, SQLITE_STATIC);
+    ck_assert_int_eq (sqlite3_step (stmt), SQLITE_DONE);
+    sqlite3_finalize (stmt);
+    sqlite3_exec (db, "PRAGMA user_version = 2", NULL, NULL, NULL);
+
+    value = load_setting (account_id, "string");
+    ck_assert (value != NULL);
+    ck_assert_str_eq (g_variant_get_string (value, NULL), "old value");
+    g_variant_unref (value);
+
+    ck_assert_int_eq (get_db_int (db, "PRAGMA user_version"), 5);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Settings "
+                                  "WHERE typeof(value) != 'blob'"), 0);
+    sqlite3_close (db);
+
+    for (i = 0; i < G_N_ELEMENTS (keys); i++)
+        g_variant_unref (values[i]);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_store_many_settings)
+{
+    const gchar *empty[] = { NULL };
+    AgAccountId account_id;
+    AgManager *manager2;
+    AgAccount *account2;
+    AgService *service2;
+    GError *error = NULL;
+    GVariant *value;
+    gchar key[32];
+    sqlite3 *db;
+    gint i;
+
+    delete_db ();
+
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, "maemo");
+    ag_account_set_display_name (account, "Many settings");
+    for (i = 0; i < 300; i++)
+    {
+        g_snprintf (key, sizeof (key), "key%d", i);
+        ag_account_set_variant (account, key, g_variant_new_int32 (i));
+    }
+    /* An empty value has no serialized data */
+    ag_account_set_variant (account, "empty", g_variant_new_strv (empty, 0));
+    service = ag_manager_get_service (manager, "MyService");
+    ag_account_select_service (account, service);
+    ag_account_set_variant (account, "key0", g_variant_new_string ("text"));
+    ck_assert (ag_account_store_blocking (account, &error));
+    ck_assert (error == NULL);
+    account_id = account->id;
+    ck_assert (account_id != 0);
+
+    sqlite3_open (db_filename, &db);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Settings "
+                                  "WHERE account = 0"), 0);
+
+    /* Change, delete and rename on an existing account */
+    ag_account_select_service (account, NULL);
+    for (i = 0; i < 300; i += 2)
+    {
+        g_snprintf (key, sizeof (key), "key%d", i);
+        ag_account_set_variant (account, key, g_variant_new_int32 (-i));
+    }
+    for (i = 1; i < 100; i += 2)
+    {
+        g_snprintf (key, sizeof (key), "key%d", i);
+        ag_account_set_variant (account, key, NULL);
+    }
+    ag_account_set_display_name (account, "Renamed");
+    ag_account_set_enabled (account, TRUE);
+    ck_assert (ag_account_store_blocking (account, &error));
+    ck_assert (error == NULL);
+
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Settings "
+                                  "WHERE service = 0 AND key LIKE 'key%'"),
+                      250);
+    sqlite3_close (db);
+
+    /* use a new manager, so that the account is read from the DB */
+    manager2 = ag_manager_new ();
+    account2 = ag_manager_load_account (manager2, account_id, &error);
+    ck_assert (account2 != NULL);
+    ck_assert_str_eq (ag_account_get_display_name (account2), "Renamed");
+    ck_assert (ag_account_get_enabled (account2));
+
+    value = ag_account_get_variant (account2, "key10", NULL);
+    ck_assert (value != NULL);
+    ck_assert_int_eq (g_variant_get_int32 (value), -10);
+    ck_assert (ag_account_get_variant (account2, "key11", NULL) == NULL);
+    value = ag_account_get_variant (account2, "key101", NULL);
+    ck_assert (value != NULL);
+    ck_assert_int_eq (g_variant_get_int32 (value), 101);
+    value = ag_account_get_variant (account2, "empty", NULL);
+    ck_assert (value != NULL);
+    ck_assert_int_eq (g_variant_n_children (value), 0);
+
+    service2 = ag_manager_get_service (manager2, "MyService");
+    ag_account_select_service (account2, service2);
+    value = ag_account_get_variant (account2, "key0", NULL);
+    ck_assert (value != NULL);
+    ck_assert_str_eq (g_variant_get_string (value, NULL), "text");
+
+    ag_service_unref (service2);
+    g_object_unref (account2);
+    g_object_unref (manager2);
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_service_ids)
+{
+    AgManager *manager2;
+    AgService *service2;
+    AgAccount *account2;
+    GError *error = NULL;
+    sqlite3 *db;
+
+    delete_db ();
+
+    manager = ag_manager_new ();
+    service = ag_manager_get_service (manager, "MyService");
+    ck_assert (service != NULL);
+
+    /* The IDs of the services in the DB are known when the manager is
+     * created; the others when they are added */
+    manager2 = ag_manager_new ();
+    service2 = ag_manager_get_service (manager2, "MyService2");
+    ck_assert (service2 != NULL);
+
+    account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_select_service (account, service);
+    ag_account_set_enabled (account, TRUE);
+    ck_assert (ag_account_store_blocking (account, &error));
+
+    account2 = ag_manager_create_account (manager2, PROVIDER);
+    ag_account_select_service (account2, service2);
+    ag_account_set_enabled (account2, TRUE);
+    ag_service_unref (service2);
+    service2 = ag_manager_get_service (manager2, "MyService");
+    ag_account_select_service (account2, service2);
+    ag_account_set_enabled (account2, TRUE);
+    ck_assert (ag_account_store_blocking (account2, &error));
+
+    sqlite3_open (db_filename, &db);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Services"), 2);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Settings "
+                                  "JOIN Services "
+                                  "ON Services.id = Settings.service "
+                                  "WHERE key = 'enabled' "
+                                  "AND name = 'MyService'"), 2);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Settings "
+                                  "JOIN Services "
+                                  "ON Services.id = Settings.service "
+                                  "WHERE key = 'enabled' "
+                                  "AND name = 'MyService2'"), 1);
+    sqlite3_close (db);
+
+    g_object_unref (account2);
+    ag_service_unref (service2);
+    g_object_unref (manager2);
+    end_test ();
+}
+END_TEST
+
+static void
+create_old_db (gint version)
+{
+    sqlite3 *db;
+    gchar *sql;
+    gint ret;
+
+    delete_db ();
+    sqlite3_open (db_filename, &db);
+
+    /* The schema of version 1 of the DB, with one account */
+    ret = sqlite3_exec (db,
+        "CREATE TABLE Accounts (id INTEGER PRIMARY KEY AUTOINCREMENT,"
+            "name TEXT, provider TEXT, enabled INTEGER);"
+        "CREATE TABLE Services (id INTEGER PRIMARY KEY AUTOINCREMENT,"
+            "name TEXT NOT NULL UNIQUE, display TEXT NOT NULL,"
+            "provider TEXT, type TEXT);"
+        "CREATE INDEX idx_service ON Services(name);"
+        "CREATE TABLE Settings (account INTEGER NOT NULL, service INTEGER,"
+            "key TEXT NOT NULL, type TEXT NOT NULL, value BLOB);"
+        "CREATE UNIQUE INDEX idx_setting ON Settings (account, service, key);"
+        "CREATE TRIGGER tg_delete_account "
+            "BEFORE DELETE ON Accounts FOR EACH ROW BEGIN "
+                "DELETE FROM Settings WHERE account = OLD.id; "
+            "END;"
+        "CREATE TABLE Signatures (account INTEGER NOT NULL, service INTEGER,"
+            "key TEXT NOT NULL, signature TEXT NOT NULL,"
+            "token TEXT NOT NULL);"
+        "CREATE UNIQUE INDEX idx_signatures ON Signatures "
+           "(account, service, key);"
+        "INSERT INTO Accounts (name, provider, enabled) "
+            "VALUES ('Old account', 'maemo', 1);"
+        "INSERT INTO Services (name, display, provider, type) "
+            "VALUES ('MyService', 'My Service', 'maemo', 'e-mail');",
+        NULL, NULL, NULL);
+    ck_assert_int_eq (ret, SQLITE_OK);
+
+    /* Since version 3, values are stored in binary form */
+    ret = sqlite3_exec (db, version < 3 ?
+        "INSERT INTO Settings (account, service, key, type, value) VALUES "
+            "(1, 0, 'username', 's', '''old user'''),"
+            "(1, 0, 'port', 'i', '993'),"
+            "(1, 1, 'enabled', 'b', 'true');" :
+        "INSERT INTO Settings (account, service, key, type, value) VALUES "
+            "(1, 0, 'username', 's', X'6f6c64207573657200'),"
+            "(1, 0, 'port', 'i', X'e1030000'),"
+            "(1, 1, 'enabled', 'b', X'01');",
+        NULL, NULL, NULL);
+    ck_assert_int_eq (ret, SQLITE_OK);
+
+    if (version >= 2)
+    {
+        ret = sqlite3_exec (db,
+            "ALTER TABLE Services ADD COLUMN defaults BLOB;"
+            "ALTER TABLE Services ADD COLUMN mtime INTEGER;",
+            NULL, NULL, NULL);
+        ck_assert_int_eq (ret, SQLITE_OK);
+    }
+
+    if (version >= 4)
+    {
+        ret = sqlite3_exec (db,
+            "CREATE TABLE AccountServices (account INTEGER NOT NULL,"
+                "service INTEGER NOT NULL, enabled INTEGER NOT NULL,"
+                "PRIMARY KEY (account, service)) WITHOUT ROWID;"
+            "INSERT INTO AccountServices VALUES (1, 1, 1);",
+            NULL, NULL, NULL);
+        ck_assert_int_eq (ret, SQLITE_OK);
+    }
+
+    sql = g_strdup_printf ("PRAGMA user_version = %d", version);
+    sqlite3_exec (db, sql, NULL, NULL, NULL);
+    g_free (sql);
+    sqlite3_close (db);
+}
+
+START_TEST(test_db_migrations)
+{
+    const gint latest_version = 5;
+    GVariant *value;
+    sqlite3 *db;
+    GList *list;
+    gint version;
+
+    /* Upgrade the DB from each of the previous versions */
+    for (version = 1; version < latest_version; version++)
+    {
+        create_old_db (version);
+
+        manager = ag_manager_new ();
+        ck_assert (manager != NULL);
+
+        list = ag_manager_list_enabled (manager);
+        ck_assert_int_eq (g_list_length (list), 1);
+        ag_manager_list_free (list);
+
+        list = ag_manager_list_enabled_by_service_type (manager, "e-mail");
+        ck_assert_int_eq (g_list_length (list), 1);
+        ag_manager_list_free (list);
+
+        account = ag_manager_get_account (manager, 1);
+        ck_assert (account != NULL);
+        ck_assert_str_eq (ag_account_get_display_name (account),
+                          "Old account");
+        value = ag_account_get_variant (account, "username", NULL);
+        ck_assert_str_eq (g_variant_get_string (value, NULL), "old user");
+        value = ag_account_get_variant (account, "port", NULL);
+        ck_assert_int_eq (g_variant_get_int32 (value), 993);
+
+        /* the service defaults can be stored */
+        service = ag_manager_get_service (manager, "MyService");
+        ck_assert (service != NULL);
+        ag_account_select_service (account, service);
+        value = ag_account_get_variant (account, "parameters/port", NULL);
+        ck_assert_int_eq (g_variant_get_int32 (value), 5223);
+
+        sqlite3_open (db_filename, &db);
+        ck_assert_int_eq (get_db_int (db, "PRAGMA user_version"),
+                          latest_version);
+        ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Settings "
+                                      "WHERE typeof(value) != 'blob'"), 0);
+        ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Services "
+                                      "WHERE name = 'MyService' "
+                                      "AND mtime IS NOT NULL"), 1);
+        sqlite3_close (db);
+
+        end_test ();
+    }
+
+    /* A new DB goes through all the versions */
+    delete_db ();
+    manager = ag_manager_new ();
+    ck_assert (manager != NULL);
+    sqlite3_open (db_filename, &db);
+    ck_assert_int_eq (get_db_int (db, "PRAGMA user_version"), latest_version);
+    sqlite3_close (db);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_account_services_table)
+{
+    const gchar *enabled_sql =
+        "SELECT COUNT(*) FROM AccountServices WHERE enabled = 1";
+    const gchar *count_sql = "SELECT COUNT(*) FROM AccountServices";
+    GError *error = NULL;
+    sqlite3 *db;
+    GList *list;
+
+    delete_db ();
+
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, "maemo");
+    ag_account_set_enabled (account, TRUE);
+    service = ag_manager_get_service (manager, "MyService");
+    ag_account_select_service (account, service);
+    ag_account_set_enabled (account, TRUE);
+    ck_assert (ag_account_store_blocking (account, &error));
+
+    sqlite3_open (db_filename, &db);
+    ck_assert_int_eq (get_db_int (db, enabled_sql), 1);
+
+    list = ag_account_list_enabled_services (account);
+    ck_assert_int_eq (g_list_length (list), 1);
+    ag_service_list_free (list);
+    list = ag_manager_list_enabled_by_service_type (manager, "e-mail");
+    ck_assert_int_eq (g_list_length (list), 1);
+    ag_manager_list_free (list);
+
+    /* The table follows the changes of the "enabled" setting */
+    ag_account_set_enabled (account, FALSE);
+    ck_assert (ag_account_store_blocking (account, &error));
+    ck_assert_int_eq (get_db_int (db, enabled_sql), 0);
+    ck_assert_int_eq (get_db_int (db, count_sql), 1);
+
+    list = ag_account_list_enabled_services (account);
+    ck_assert (list == NULL);
+    list = ag_manager_list_enabled_by_service_type (manager, "e-mail");
+    ck_assert (list == NULL);
+
+    ag_account_set_enabled (account, TRUE);
+    ck_assert (ag_account_store_blocking (account, &error));
+    ck_assert_int_eq (get_db_int (db, enabled_sql), 1);
+
+    /* and of the deletion of the account */
+    ag_account_delete (account);
+    ck_assert (ag_account_store_blocking (account, &error));
+    ck_assert (error == NULL);
+    ck_assert_int_eq (get_db_int (db, count_sql), 0);
+    sqlite3_close (db);
+
+    end_test ();
+}
+END_TEST
+
+void account_store_now_cb (AgAccount *account, const GError *error,
+                           gpointer user_data)
+{
+    const gchar *string = user_data;
+
+    ck_assert_msg (AG_IS_ACCOUNT (account), "Account got disposed?");
+    if (error)
+        ck_abort_msg("Got error: %s", error->message);
+    ck_assert_msg (g_strcmp0 (string, TEST_STRING) == 0, "Got wrong string");
+
+    data_stored = TRUE;
+}
+
+/* Stores the account, and waits for the writer thread to complete the
+ * operation */
+static void
+store_now (AgAccount *account)
+{
+    data_stored = FALSE;
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    while (!data_stored)
+        g_main_context_iteration (NULL, TRUE);
+}
+
+START_TEST(test_account_preload)
+{
+    AgService *service2;
+    AgAccountId account_id;
+    AgSettingSource source;
+    GVariant *variant;
+    GError *error = NULL;
+    sqlite3 *db;
+
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_variant (account, "description",
+                            g_variant_new_string ("Preloaded"));
+    service = ag_manager_get_service (manager, "MyService");
+    ag_account_select_service (account, service);
+    ag_account_set_variant (account, "username", g_variant_new_string ("me"));
+    service2 = ag_manager_get_service (manager, "MyService2");
+    ag_account_select_service (account, service2);
+    ag_account_set_variant (account, "port", g_variant_new_int32 (8080));
+    store_now (account);
+    account_id = account->id;
+
+    g_object_unref (account);
+    account = NULL;
+    ag_service_unref (service2);
+    ag_service_unref (service);
+    service = NULL;
+    g_object_unref (manager);
+
+    manager = ag_manager_new ();
+    account = ag_manager_load_account_full (manager, account_id,
+                                            AG_ACCOUNT_LOAD_SETTINGS, &error);
+    ck_assert_msg (account != NULL, "Got error %s",
+                   error ? error->message : "No error set");
+
+    /* Drop the settings from the DB: the preloaded ones must be used */
+    sqlite3_open (db_filename, &db);
+    ck_assert_int_eq (sqlite3_exec (db, "DELETE FROM Settings", NULL, NULL,
+                                    NULL), SQLITE_OK);
+    sqlite3_close (db);
+
+    variant = ag_account_get_variant (account, "description", &source);
+    ck_assert_int_eq (source, AG_SETTING_SOURCE_ACCOUNT);
+    ck_assert_str_eq (g_variant_get_string (variant, NULL), "Preloaded");
+
+    service = ag_manager_get_service (manager, "MyService");
+    ag_account_select_service (account, service);
+    variant = ag_account_get_variant (account, "username", &source);
+    ck_assert_int_eq (source, AG_SETTING_SOURCE_ACCOUNT);
+    ck_assert_str_eq (g_variant_get_string (variant, NULL), "me");
+
+    service2 = ag_manager_get_service (manager, "MyService2");
+    ag_account_select_service (account, service2);
+    variant = ag_account_get_variant (account, "port", &source);
+    ck_assert_int_eq (source, AG_SETTING_SOURCE_ACCOUNT);
+    ck_assert_int_eq (g_variant_get_int32 (variant), 8080);
+    ag_service_unref (service2);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_load_accounts)
+{
+    AgAccountId ids[3], request[5];
+    AgAccount *cached;
+    AgSettingSource source;
+    GVariant *variant;
+    GList *list, *l;
+    GError *error = NULL;
+    sqlite3 *db;
+    gint i;
+
+    manager = ag_manager_new ();
+    service = ag_manager_get_service (manager, "MyService");
+    for (i = 0; i < 3; i++)
+    {
+        gchar *name = g_strdup_printf ("Account %d", i);
+
+        account = ag_manager_create_account (manager, PROVIDER);
+        ag_account_set_display_name (account, name);
+        ag_account_select_service (account, service);
+        ag_account_set_variant (account, "username",
+                                g_variant_new_string (name));
+        g_free (name);
+        store_now (account);
+        ids[i] = account->id;
+        g_clear_object (&account);
+    }
+    ag_service_unref (service);
+    service = NULL;
+    g_object_unref (manager);
+
+    manager = ag_manager_new ();
+    cached = ag_manager_get_account (manager, ids[1]);
+    ck_assert (cached != NULL);
+
+    /* Unknown and repeated IDs are allowed */
+    request[0] = ids[2];
+    request[1] = ids[0];
+    request[2] = ids[2] + 1000;
+    request[3] = ids[1];
+    request[4] = ids[0];
+    list = ag_manager_load_accounts (manager, request, G_N_ELEMENTS (request),
+                                     AG_ACCOUNT_LOAD_SETTINGS, &error);
+    ck_assert_msg (error == NULL, "Got error %s",
+                   error ? error->message : "");
+    ck_assert_int_eq (g_list_length (list), 4);
+    ck_assert_int_eq (AG_ACCOUNT (g_list_nth_data (list, 0))->id, ids[2]);
+    ck_assert_int_eq (AG_ACCOUNT (g_list_nth_data (list, 1))->id, ids[0]);
+    ck_assert (g_list_nth_data (list, 2) == cached);
+    ck_assert (g_list_nth_data (list, 3) == g_list_nth_data (list, 1));
+
+    /* The accounts are cached */
+    account = ag_manager_get_account (manager, ids[2]);
+    ck_assert (account == g_list_nth_data (list, 0));
+    g_clear_object (&account);
+
+    /* Drop the settings from the DB: the loaded ones must be used */
+    sqlite3_open (db_filename, &db);
+    ck_assert_int_eq (sqlite3_exec (db, "DELETE FROM Settings", NULL, NULL,
+                                    NULL), SQLITE_OK);
+    sqlite3_close (db);
+
+    service = ag_manager_get_service (manager, "MyService");
+    for (l = list; l != NULL; l = l->next)
+    {
+        AgAccount *loaded = l->data;
+        gchar *name;
+
+        i = (loaded->id == ids[0]) ? 0 : (loaded->id == ids[1]) ? 1 : 2;
+        name = g_strdup_printf ("Account %d", i);
+        ck_assert_str_eq (ag_account_get_display_name (loaded), name);
+        ck_assert_str_eq (ag_account_get_provider_name (loaded), PROVIDER);
+
+        ag_account_select_service (loaded, service);
+        variant = ag_account_get_variant (loaded, "username", &source);
+        ck_assert_int_eq (source, AG_SETTING_SOURCE_ACCOUNT);
+        ck_assert_str_eq (g_variant_get_string (variant, NULL), name);
+        g_free (name);
+    }
+
+    g_list_free_full (list, g_object_unref);
+    g_object_unref (cached);
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_load_accounts_sparse)
+{
+    AgAccountId ids[2];
+    GVariant *variant;
+    GList *list, *l;
+    GError *error = NULL;
+    sqlite3 *db;
+    gint i;
+
+    manager = ag_manager_new ();
+    sqlite3_open (db_filename, &db);
+    for (i = 0; i < 2; i++)
+    {
+        account = ag_manager_create_account (manager, PROVIDER);
+        ag_account_set_variant (account, "index", g_variant_new_int32 (i));
+        store_now (account);
+        ids[i] = account->id;
+        g_clear_object (&account);
+
+        /* Leave a wide gap between the IDs */
+        sqlite3_exec (db, "UPDATE sqlite_sequence SET seq = seq + 100000 "
+                      "WHERE name = 'Accounts'", NULL, NULL, NULL);
+    }
+    sqlite3_close (db);
+    ck_assert_uint_gt (ids[1] - ids[0], 100000);
+    g_object_unref (manager);
+
+    /* The accounts at both ends of the gap are found */
+    manager = ag_manager_new ();
+    list = ag_manager_load_accounts (manager, ids, G_N_ELEMENTS (ids),
+                                     AG_ACCOUNT_LOAD_SETTINGS, &error);
+    ck_assert_msg (error == NULL, "Got error %s",
+                   error ? error->message : "");
+    ck_assert_int_eq (g_list_length (list), 2);
+    for (l = list, i = 0; l != NULL; l = l->next, i++)
+    {
+        AgAccount *loaded = l->data;
+
+        ck_assert_uint_eq (loaded->id, ids[i]);
+        variant = ag_account_get_variant (loaded, "index", NULL);
+        ck_assert (variant != NULL);
+        ck_assert_int_eq (g_variant_get_int32 (variant), i);
+    }
+
+    g_list_free_full (list, g_object_unref);
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_load_accounts_duplicates)
+{
+    AgAccountLoadFlags flags[] = {
+        AG_ACCOUNT_LOAD_NONE,
+        AG_ACCOUNT_LOAD_SETTINGS,
+    };
+    AgAccountId ids[2], request[6];
+    AgAccount *cached;
+    GList *list;
+    GError *error = NULL;
+    guint f;
+    gint i, j;
+
+    manager = ag_manager_new ();
+    for (i = 0; i < 2; i++)
+    {
+        account = ag_manager_create_account (manager, PROVIDER);
+        store_now (account);
+        ids[i] = account->id;
+        g_clear_object (&account);
+    }
+    g_object_unref (manager);
+
+    for (f = 0; f < G_N_ELEMENTS (flags); f++)
+    {
+        /* ids[0] is already cached, ids[1] is not */
+        manager = ag_manager_new ();
+        cached = ag_manager_get_account (manager, ids[0]);
+        ck_assert (cached != NULL);
+
+        request[0] = ids[1];
+        request[1] = ids[0];
+        request[2] = ids[1];
+        request[3] = ids[0];
+        request[4] = ids[0];
+        request[5] = ids[1];
+        list = ag_manager_load_accounts (manager, request,
+                                         G_N_ELEMENTS (request), flags[f],
+                                         &error);
+        ck_assert_msg (error == NULL, "Got error %s",
+                       error ? error->message : "");
+        ck_assert_int_eq (g_list_length (list), G_N_ELEMENTS (request));
+
+        /* Every occurrence of an ID resolves to the cached account */
+        for (i = 0; i < (gint)G_N_ELEMENTS (request); i++)
+        {
+            AgAccount *loaded = g_list_nth_data (list, i);
+
+            ck_assert_uint_eq (loaded->id, request[i]);
+            if (request[i] == ids[0])
+                ck_assert (loaded == cached);
+            for (j = 0; j < i; j++)
+                if (request[j] == request[i])
+                    ck_assert (g_list_nth_data (list, j) == loaded);
+        }
+
+        account = ag_manager_get_account (manager, ids[1]);
+        ck_assert (account == g_list_nth_data (list, 0));
+        g_clear_object (&account);
+
+        g_list_free_full (list, g_object_unref);
+        g_object_unref (cached);
+        g_clear_object (&manager);
+    }
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_account_service)
+{
+    GValue value = { 0 };
+    const gchar *description = "This is really a beautiful account";
+    const gchar *display_name = "My test account";
+    AgSettingSource source;
+    AgAccountService *account_service;
+
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, PROVIDER);
+
     g_value_init (&value, G_TYPE_STRING);
     g_value_set_static_string (&value, description);
     ag_account_set_value (account, "description", &value);
     g_value_unset (&value);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
-
+    store_now (account);
+
     service = ag_manager_get_service (manager, "MyService");
     ck_assert (service != NULL);
 
@@ -862,10 +2179,7 @@ START_TEST(test_account_service_enabledness)
     ck_assert_msg (AG_IS_ACCOUNT_SERVICE (account_service),
                    "Failed to create AccountService");
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
     account_id = account->id;
 
     g_signal_connect (account_service, "enabled",
@@ -876,10 +2190,7 @@ START_TEST(test_account_service_enabledness)
     ag_account_select_service (account, service);
     ag_account_set_enabled (account, TRUE);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     /* Still disabled, because the account is disabled */
     ck_assert (enabled_signal.enabled == FALSE);
@@ -894,10 +2205,7 @@ START_TEST(test_account_service_enabledness)
     ag_account_select_service (account, service);
     ag_account_set_enabled (account, FALSE);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     /* Still disabled, because the account is disabled */
     ck_assert (enabled_signal.enabled == FALSE);
@@ -907,10 +2215,7 @@ START_TEST(test_account_service_enabledness)
     ag_account_select_service (account, service);
     ag_account_set_enabled (account, TRUE);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     ck_assert (enabled_signal.enabled == TRUE);
     ck_assert (enabled_signal.called_count == 1);
@@ -957,10 +2262,7 @@ START_TEST(test_account_service_enabledness)
     ag_account_select_service (account, service);
     ag_account_set_enabled (account, FALSE);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     ck_assert (enabled_signal.enabled == FALSE);
 
@@ -1035,10 +2337,7 @@ START_TEST(test_account_service_settings)
     ag_account_service_set_variant (account_service, "check_automatically",
                                     variant);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     /* The callback for the "changed" signal should have been emitted.
      * Let's check what changed fields were reported, and what their value
@@ -1071,10 +2370,7 @@ START_TEST(test_account_service_settings)
     ag_account_service_set_value (account_service, "ForReal", &value);
     g_value_unset (&value);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     /* The callback for the "changed" signal should have been emitted.
      * Let's check what changed fields were reported, and what their value
@@ -1194,10 +2490,7 @@ START_TEST(test_account_service_list)
         account = ag_manager_create_account (manager, "maemo");
         ag_account_set_enabled (account, TRUE);
         ag_account_set_display_name (account, display_name);
-        ag_account_store (account, account_store_now_cb, TEST_STRING);
-        run_main_loop_for_n_seconds(0);
-        ck_assert_msg (data_stored, "Callback not invoked immediately");
-        data_stored = FALSE;
+        store_now (account);
         account_id[i] = account->id;
         g_object_unref (account);
         account = NULL;
@@ -1231,10 +2524,7 @@ START_TEST(test_account_service_list)
     ag_account_set_enabled (account, TRUE);
     ag_account_select_service (account, my_service2);
     ag_account_set_enabled (account, FALSE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
     g_object_unref (account);
 
     account = ag_manager_get_account (manager, account_id[1]);
@@ -1244,10 +2534,7 @@ START_TEST(test_account_service_list)
     ag_account_set_enabled (account, TRUE);
     ag_account_select_service (account, my_service2);
     ag_account_set_enabled (account, FALSE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
     g_object_unref (account);
 
     account = ag_manager_get_account (manager, account_id[2]);
@@ -1256,10 +2543,7 @@ START_TEST(test_account_service_list)
     ag_account_set_enabled (account, FALSE);
     ag_account_select_service (account, my_service2);
     ag_account_set_enabled (account, TRUE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     g_object_unref (manager);
 
@@ -1416,10 +2700,7 @@ START_TEST(test_auth_data)
     ag_account_set_value (account, "auth/mechanism", &value);
     g_value_unset (&value);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
     account_id = account->id;
     g_object_unref (account);
     account = NULL;
@@ -1878,10 +3159,7 @@ START_TEST(test_service)
     ag_account_set_value (account, "ForReal", &value);
     g_value_unset (&value);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     g_debug ("Account id: %d", account->id);
     account_id = account->id;
@@ -1972,10 +3250,7 @@ START_TEST(test_service)
     ag_account_select_service (account, NULL);
     ag_account_set_enabled (account, TRUE);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     ck_assert_msg (ag_account_get_enabled (account) == TRUE,
                    "Account still disabled!");
@@ -2070,9 +3345,7 @@ START_TEST(test_signals)
     ag_account_set_display_name (account, display_name);
 
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
+    store_now (account);
 
     ck_assert_msg (enabled_called, "Enabled signal not emitted!");
     ck_assert_msg (display_name_called, "DisplayName signal not emitted!");
@@ -2086,6 +3359,72 @@ START_TEST(test_signals)
 }
 END_TEST
 
+static void
+unchanged_store_cb (AgAccount *account, GAsyncResult *res, gboolean *stored)
+{
+    ck_assert (ag_account_store_finish (account, res, NULL));
+    *stored = TRUE;
+}
+
+START_TEST(test_store_unchanged)
+{
+    gboolean display_name_called = FALSE;
+    gboolean enabled_called = FALSE;
+    gboolean stored = FALSE;
+    GVariant *variant;
+
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_display_name (account, "Unchanged");
+    ag_account_set_enabled (account, TRUE);
+    ag_account_set_variant (account, "description",
+                            g_variant_new_string ("A description"));
+    store_now (account);
+
+    g_signal_connect_swapped (account, "display-name-changed",
+                              G_CALLBACK (set_boolean_variable),
+                              &display_name_called);
+    g_signal_connect_swapped (account, "enabled",
+                              G_CALLBACK (set_boolean_variable),
+                              &enabled_called);
+
+    /* Setting the stored values again records no changes */
+    ag_account_set_display_name (account, "Unchanged");
+    ag_account_set_enabled (account, TRUE);
+    ag_account_set_variant (account, "description",
+                            g_variant_new_string ("A description"));
+    ag_account_set_variant (account, "not-there", NULL);
+    store_now (account);
+    ck_assert (!display_name_called);
+    ck_assert (!enabled_called);
+
+    /* Reverting a change drops it */
+    ag_account_set_enabled (account, FALSE);
+    ag_account_set_enabled (account, TRUE);
+    store_now (account);
+    ck_assert (!enabled_called);
+
+    /* The values being stored are not mistaken for the stored ones */
+    ag_account_set_variant (account, "description",
+                            g_variant_new_string ("Other"));
+    ag_account_store_async (account, NULL,
+                            (GAsyncReadyCallback)unchanged_store_cb,
+                            &stored);
+    ag_account_set_variant (account, "description",
+                            g_variant_new_string ("A description"));
+    while (!stored)
+        g_main_context_iteration (NULL, TRUE);
+    store_now (account);
+
+    variant = load_setting (account->id, "description");
+    ck_assert (variant != NULL);
+    ck_assert_str_eq (g_variant_get_string (variant, NULL), "A description");
+    g_variant_unref (variant);
+
+    end_test ();
+}
+END_TEST
+
 START_TEST(test_signals_other_manager)
 {
     AgAccountId account_id;
@@ -2102,10 +3441,7 @@ START_TEST(test_signals_other_manager)
 
     ag_account_set_enabled (account, FALSE);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
     account_id = account->id;
 
     manager2 = ag_manager_new ();
@@ -2125,10 +3461,7 @@ START_TEST(test_signals_other_manager)
     ag_account_select_service (account, service);
     ag_account_set_enabled (account, TRUE);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     main_loop = g_main_loop_new (NULL, FALSE);
     g_timeout_add_seconds (2, quit_loop, main_loop);
@@ -2166,10 +3499,7 @@ START_TEST(test_list)
     ag_account_set_enabled (account, TRUE);
     ag_account_set_display_name (account, display_name);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     ck_assert_msg (account->id != 0, "Account ID is still 0!");
 
@@ -2225,6 +3555,84 @@ START_TEST(test_list)
 }
 END_TEST
 
+START_TEST(test_list_by_service_type_unloaded)
+{
+    AgManager *manager2;
+    AgAccount *account2;
+    GList *list;
+    gint uninstalled_id;
+    sqlite3 *db;
+
+    delete_db ();
+
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, "other_provider");
+    store_now (account);
+    account2 = ag_manager_create_account (manager, "maemo");
+    ck_assert (ag_account_store_blocking (account2, NULL));
+    service = ag_manager_get_service (manager, "MyService");
+
+    sqlite3_open (db_filename, &db);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Services "
+                                  "WHERE name = 'OtherService'"), 0);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM sqlite_master "
+                                  "WHERE name IN ('idx_account_provider', "
+                                  "'idx_service_type_provider')"), 2);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM sqlite_master "
+                                  "WHERE name = 'idx_service_type'"), 0);
+
+    /* Rows left by an older version of a service file, and by a service
+     * which is not installed anymore */
+    ck_assert_int_eq (sqlite3_exec (db,
+        "UPDATE Services SET type = 'sharing' WHERE name = 'MyService';"
+        "INSERT INTO Services (name, display, provider, type) "
+            "VALUES ('Uninstalled', 'Gone', 'maemo', 'sharing');",
+        NULL, NULL, NULL), SQLITE_OK);
+    uninstalled_id = get_db_int (db, "SELECT id FROM Services "
+                                 "WHERE name = 'Uninstalled'");
+
+    /* Listing the services doesn't rewrite the table */
+    manager2 = ag_manager_new ();
+    list = ag_manager_list_services (manager2);
+    ag_service_list_free (list);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Services "
+                                  "WHERE name = 'MyService' "
+                                  "AND type = 'sharing'"), 1);
+
+    /* The service of this type has never been loaded, but the query must
+     * find it anyway, and not the stale rows */
+    list = ag_manager_list_by_service_type (manager2, "sharing");
+    ck_assert_int_eq (g_list_length (list), 1);
+    ck_assert_uint_eq (GPOINTER_TO_UINT (list->data), account->id);
+    ag_manager_list_free (list);
+
+    list = ag_manager_list_by_service_type (manager2, "e-mail");
+    ck_assert_int_eq (g_list_length (list), 1);
+    ck_assert_uint_eq (GPOINTER_TO_UINT (list->data), account2->id);
+    ag_manager_list_free (list);
+
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Services "
+                                  "WHERE name = 'OtherService' "
+                                  "AND type = 'sharing' "
+                                  "AND provider = 'other_provider'"), 1);
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Services "
+                                  "WHERE name = 'MyService' "
+                                  "AND type = 'e-mail'"), 1);
+    /* The row of the uninstalled service is kept, with the same ID */
+    ck_assert_int_eq (get_db_int (db, "SELECT COUNT(*) FROM Services "
+                                  "WHERE name = 'Uninstalled' "
+                                  "AND installed = 0"), 1);
+    ck_assert_int_eq (get_db_int (db, "SELECT id FROM Services "
+                                  "WHERE name = 'Uninstalled'"),
+                      uninstalled_id);
+    sqlite3_close (db);
+
+    g_object_unref (account2);
+    g_object_unref (manager2);
+    end_test ();
+}
+END_TEST
+
 START_TEST(test_settings_iter_gvalue)
 {
     const gchar *keys[] = {
@@ -2265,10 +3673,7 @@ START_TEST(test_settings_iter_gvalue)
     }
     n_values = i;
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     ck_assert_msg (account->id != 0, "Account ID is still 0!");
 
@@ -2361,10 +3766,7 @@ START_TEST(test_settings_iter_gvalue)
     g_value_unset (&value);
 
     /* save */
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     /* enumerate the parameters */
     n_read = 0;
@@ -2432,10 +3834,7 @@ START_TEST(test_settings_iter)
     }
     n_values = i;
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     ck_assert_msg (account->id != 0, "Account ID is still 0!");
 
@@ -2525,10 +3924,7 @@ START_TEST(test_settings_iter)
                             g_variant_new_string ("How's life?"));
 
     /* save */
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     /* enumerate the parameters */
     n_read = 0;
@@ -2605,6 +4001,165 @@ START_TEST(test_list_services)
 }
 END_TEST
 
+START_TEST(test_list_services_deferred)
+{
+    GList *services, *list;
+    const gchar *contents;
+    GVariant *value;
+
+    /* start with an empty DB, so that services are loaded from the files */
+    g_unlink (db_filename);
+    manager = ag_manager_new ();
+
+    services = ag_manager_list_services (manager);
+    for (list = services; list != NULL; list = list->next)
+    {
+        if (g_strcmp0 (ag_service_get_name (list->data), "MyService") == 0)
+            service = ag_service_ref (list->data);
+    }
+    ag_service_list_free (services);
+    ck_assert (service != NULL);
+    ck_assert_str_eq (ag_service_get_service_type (service), "e-mail");
+
+    /* the data used for listing is available... */
+    ck_assert_str_eq (ag_service_get_display_name (service), "My Service");
+    ck_assert_str_eq (ag_service_get_provider (service), "maemo");
+
+    /* ...and so is everything else */
+    ck_assert_str_eq (ag_service_get_description (service),
+                      "My Service Description");
+    ck_assert_str_eq (ag_service_get_icon_name (service),
+                      "general_myservice");
+    ck_assert_str_eq (ag_service_get_i18n_domain (service), "myservice_i18n");
+    ag_service_get_file_contents (service, &contents, NULL);
+    ck_assert (contents != NULL);
+
+    account = ag_manager_create_account (manager, "maemo");
+    ag_account_select_service (account, service);
+    value = ag_account_get_variant (account, "parameters/port", NULL);
+    ck_assert (value != NULL);
+    ck_assert_int_eq (g_variant_get_int32 (value), 5223);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_list_services_indexed)
+{
+    GList *services, *again, *applications;
+
+    manager = ag_manager_new ();
+
+    services = ag_manager_list_services_by_type (manager, "e-mail");
+    ck_assert_int_eq (g_list_length (services), 1);
+    service = ag_service_ref (services->data);
+    ck_assert_str_eq (ag_service_get_name (service), "MyService");
+
+    /* the same objects are returned, without reloading them */
+    again = ag_manager_list_services_by_type (manager, "e-mail");
+    ck_assert_int_eq (g_list_length (again), 1);
+    ck_assert (again->data == services->data);
+    ag_service_list_free (again);
+    ag_service_list_free (services);
+
+    services = ag_manager_list_services_by_type (manager, "no-such-type");
+    ck_assert (services == NULL);
+
+    account = ag_manager_create_account (manager, "maemo");
+    services = ag_account_list_services (account);
+    ck_assert_int_eq (g_list_length (services), 2);
+    ag_service_list_free (services);
+
+    services = ag_account_list_services_by_type (account, "calendar");
+    ck_assert_int_eq (g_list_length (services), 1);
+    ck_assert_str_eq (ag_service_get_name (services->data), "MyService2");
+    ag_service_list_free (services);
+
+    services = ag_account_list_services_by_type (account, "sharing");
+    ck_assert (services == NULL);
+
+    applications = ag_manager_list_applications_by_service (manager, service);
+    ck_assert_int_eq (g_list_length (applications), 1);
+    ck_assert_str_eq (ag_application_get_name (applications->data),
+                      "Mailer");
+    g_list_free_full (applications, (GDestroyNotify)ag_application_unref);
+
+    end_test ();
+}
+END_TEST
+
+typedef const gchar *(*GetNameFunc) (gpointer item);
+
+static gchar *
+join_names (GList *list, GetNameFunc get_name)
+{
+    GString *names = g_string_new ("");
+
+    for (; list != NULL; list = list->next)
+    {
+        g_string_append (names, get_name (list->data));
+        g_string_append_c (names, ';');
+    }
+    return g_string_free (names, FALSE);
+}
+
+START_TEST(test_parallel_loading)
+{
+    GList *services, *providers;
+    gchar *service_names, *service_types, *provider_names;
+    gchar *names;
+    guint n_providers;
+
+    /* Build the reference with sequential loading first, starting with an
+     * empty DB so that services are loaded from the files */
+    delete_db ();
+    manager = ag_manager_new ();
+    services = ag_manager_list_services (manager);
+    providers = ag_manager_list_providers (manager);
+    ck_assert_int_eq (g_list_length (services), 3);
+    service_names = join_names (services, (GetNameFunc)ag_service_get_name);
+    service_types = join_names (services,
+                                (GetNameFunc)ag_service_get_service_type);
+    provider_names = join_names (providers,
+                                 (GetNameFunc)ag_provider_get_name);
+    n_providers = g_list_length (providers);
+    ag_service_list_free (services);
+    ag_provider_list_free (providers);
+    g_clear_object (&manager);
+
+    /* The parallel manager gets its own, empty DB too */
+    delete_db ();
+    manager = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                              "parallel-loading", TRUE,
+                              NULL);
+    ck_assert (manager != NULL);
+    services = ag_manager_list_services (manager);
+    providers = ag_manager_list_providers (manager);
+
+    /* the results are the same, in the same order */
+    names = join_names (services, (GetNameFunc)ag_service_get_name);
+    ck_assert_str_eq (names, service_names);
+    g_free (names);
+
+    names = join_names (services, (GetNameFunc)ag_service_get_service_type);
+    ck_assert_str_eq (names, service_types);
+    g_free (names);
+
+    ck_assert_uint_eq (g_list_length (providers), n_providers);
+    names = join_names (providers, (GetNameFunc)ag_provider_get_name);
+    ck_assert_str_eq (names, provider_names);
+    g_free (names);
+
+    ag_service_list_free (services);
+    ag_provider_list_free (providers);
+    g_free (service_names);
+    g_free (service_types);
+    g_free (provider_names);
+
+    end_test ();
+}
+END_TEST
+
 START_TEST(test_list_service_types)
 {
     GList *service_types, *list, *tags, *tag_list;
@@ -2660,10 +4215,7 @@ START_TEST(test_delete)
     /* create an account */
     account = ag_manager_create_account (manager, PROVIDER);
     ag_account_set_enabled (account, TRUE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     ck_assert_msg (account->id != 0, "Account ID is still 0!");
     id = account->id;
@@ -2686,10 +4238,7 @@ START_TEST(test_delete)
     ck_assert_msg (deleted_called == FALSE, "Accound deleted too early!");
 
     /* really delete the account */
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     /* check that the signals are emitted */
     ck_assert_msg (enabled_called, "Accound enabled signal not emitted");
@@ -2768,10 +4317,7 @@ START_TEST(test_watches)
     ag_account_set_value (account, "parameters/port", &value);
     g_value_unset (&value);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     /* if we didn't change the server, make sure the callback is not
      * invoked */
@@ -2801,10 +4347,7 @@ START_TEST(test_watches)
     server_changed = FALSE;
     port_changed = FALSE;
     dir_changed = FALSE;
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     /* make sure the callback for the server is invoked */
     ck_assert_msg (server_changed == TRUE, "Callback for 'server' not invoked");
@@ -2842,9 +4385,7 @@ START_TEST(test_no_dbus)
     /* Test creating an account */
     account = ag_manager_create_account (manager, PROVIDER);
     ag_account_set_enabled (account, TRUE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
+    store_now (account);
     ck_assert_msg (account->id != 0, "Account ID is still 0!");
 
     /* Restore the initial value */
@@ -3151,10 +4692,7 @@ START_TEST(test_service_regression)
     ag_account_set_value (account, "interval", &value);
     g_value_unset (&value);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     g_debug ("Account id: %d", account->id);
     account_id = account->id;
@@ -3282,6 +4820,156 @@ START_TEST(test_blocking)
 }
 END_TEST
 
+#define N_READER_THREADS 4
+#define N_READ_ACCOUNTS 3
+
+static gpointer
+read_accounts_thread (gpointer user_data)
+{
+    const AgAccountId *ids = user_data;
+    gboolean ok = TRUE;
+    gint i, j;
+
+    for (i = 0; i < 50 && ok; i++)
+    {
+        GList *list;
+        AgService *my_service;
+
+        list = ag_manager_list (manager);
+        for (j = 0; j < N_READ_ACCOUNTS; j++)
+            ok = ok && g_list_find (list, GUINT_TO_POINTER (ids[j])) != NULL;
+        ag_manager_list_free (list);
+
+        for (j = 0; j < N_READ_ACCOUNTS && ok; j++)
+        {
+            AgAccount *read_account;
+            gchar *expected;
+
+            read_account = ag_manager_get_account (manager, ids[j]);
+            expected = g_strdup_printf ("Account %d", j);
+            ok = read_account != NULL && read_account->id == ids[j] &&
+                g_strcmp0 (ag_account_get_display_name (read_account),
+                           expected) == 0;
+            g_free (expected);
+            g_clear_object (&read_account);
+        }
+
+        my_service = ag_manager_get_service (manager, "MyService");
+        ok = ok && my_service != NULL &&
+            g_strcmp0 (ag_service_get_name (my_service), "MyService") == 0;
+        if (my_service != NULL)
+            ag_service_unref (my_service);
+    }
+
+    return GINT_TO_POINTER (ok);
+}
+
+START_TEST(test_threaded_reads)
+{
+    GThread *threads[N_READER_THREADS];
+    AgAccountId ids[N_READ_ACCOUNTS];
+    GError *error = NULL;
+    gboolean ok;
+    gint i;
+
+    delete_db ();
+
+    manager = ag_manager_new ();
+    for (i = 0; i < N_READ_ACCOUNTS; i++)
+    {
+        gchar *name = g_strdup_printf ("Account %d", i);
+
+        account = ag_manager_create_account (manager, PROVIDER);
+        ag_account_set_display_name (account, name);
+        g_free (name);
+        ok = ag_account_store_blocking (account, &error);
+        ck_assert_msg (ok, "Got error %s",
+                       error ? error->message : "No error set");
+        ids[i] = account->id;
+        g_clear_object (&account);
+    }
+
+    /* Read the same accounts and service from several threads at once */
+    for (i = 0; i < N_READER_THREADS; i++)
+        threads[i] = g_thread_new ("reader", read_accounts_thread, ids);
+
+    for (i = 0; i < N_READER_THREADS; i++)
+    {
+        ok = GPOINTER_TO_INT (g_thread_join (threads[i]));
+        ck_assert_msg (ok, "Thread %d read wrong data", i);
+    }
+
+    end_test ();
+}
+END_TEST
+
+static gpointer
+read_data_files_thread (gpointer user_data)
+{
+    guint n_services = GPOINTER_TO_UINT (user_data);
+    gboolean ok = TRUE;
+    gint i;
+
+    for (i = 0; i < 50 && ok; i++)
+    {
+        GList *list;
+        AgServiceType *service_type;
+
+        list = ag_manager_list_services (manager);
+        ok = g_list_length (list) == n_services;
+        ag_service_list_free (list);
+
+        list = ag_manager_list_services_by_type (manager, "e-mail");
+        ok = ok && list != NULL;
+        ag_service_list_free (list);
+
+        list = ag_manager_list_providers (manager);
+        ok = ok && list != NULL;
+        ag_provider_list_free (list);
+
+        service_type = ag_manager_load_service_type (manager, "e-mail");
+        ok = ok && service_type != NULL &&
+            g_strcmp0 (ag_service_type_get_name (service_type),
+                       "e-mail") == 0;
+        if (service_type != NULL)
+            ag_service_type_unref (service_type);
+    }
+
+    return GINT_TO_POINTER (ok);
+}
+
+START_TEST(test_threaded_data_file_reads)
+{
+    GThread *threads[N_READER_THREADS];
+    GList *services;
+    guint n_services;
+    gboolean ok;
+    gint i;
+
+    manager = ag_manager_new ();
+    services = ag_manager_list_services (manager);
+    n_services = g_list_length (services);
+    ag_service_list_free (services);
+    ck_assert_uint_gt (n_services, 0);
+
+    /* Drop the cached data, so that the threads rebuild it concurrently */
+    g_clear_object (&manager);
+    manager = ag_manager_new ();
+
+    for (i = 0; i < N_READER_THREADS; i++)
+        threads[i] = g_thread_new ("reader", read_data_files_thread,
+                                   GUINT_TO_POINTER (n_services));
+
+    for (i = 0; i < N_READER_THREADS; i++)
+    {
+        ok = GPOINTER_TO_INT (g_thread_join (threads[i]));
+        ck_assert_msg (ok, "Thread %d read wrong data", i);
+    }
+
+    end_test ();
+}
+END_TEST
+
 START_TEST(test_cache_regression)
 {
     AgAccountId account_id;
@@ -3305,10 +4993,7 @@ START_TEST(test_cache_regression)
 
     ag_account_set_display_name (account, display_name1);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     account_id = account->id;
 
@@ -3316,10 +5001,7 @@ START_TEST(test_cache_regression)
     ag_account_delete (account);
     deleted_account = account;
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     /* after deleting the account, we shouldn't get it anymore, even if we
      * didn't release our reference */
@@ -3332,11 +5014,8 @@ START_TEST(test_cache_regression)
 
     ag_account_set_display_name (account, display_name2);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
-
+    store_now (account);
+
     /* check that the values are the correct ones */
     ck_assert (g_strcmp0 (ag_account_get_display_name (account),
                           display_name2) == 0);
@@ -3384,15 +5063,9 @@ START_TEST(test_serviceid_regression)
     ag_account_select_service (account2, service2);
     ag_account_set_enabled (account2, FALSE);
 
-    ag_account_store (account1, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account1);
 
-    ag_account_store (account2, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account2);
 
     ck_assert (account1->id != 0);
     ck_assert (account2->id != 0);
@@ -3424,7 +5097,7 @@ START_TEST(test_enabled_regression)
 
     memset (&ecd, 0, sizeof (ecd));
     ag_account_set_enabled (account, TRUE);
-    ag_account_store (account, NULL, TEST_STRING);
+    store_now (account);
 
     ck_assert (ecd.called == TRUE);
     ck_assert (ecd.service == NULL);
@@ -3432,7 +5105,7 @@ START_TEST(test_enabled_regression)
 
     memset (&ecd, 0, sizeof (ecd));
     ag_account_set_enabled (account, FALSE);
-    ag_account_store (account, NULL, TEST_STRING);
+    store_now (account);
 
     ck_assert (ecd.called == TRUE);
     ck_assert (ecd.service == NULL);
@@ -3458,10 +5131,7 @@ START_TEST(test_delete_regression)
     ag_account_select_service (account, service);
     ag_account_set_enabled (account, TRUE);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     ck_assert_msg (account->id != 0, "Account ID is still 0!");
 
@@ -3485,10 +5155,7 @@ START_TEST(test_delete_regression)
     ck_assert_msg (deleted_called == FALSE, "Accound deleted too early!");
 
     /* really delete the account */
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     /* check that the signals are emitted */
     ck_assert_msg (enabled_called, "Accound enabled signal not emitted");
@@ -3580,14 +5247,8 @@ START_TEST(test_manager_new_for_service_type)
     ag_account_select_service (account2, service2);
     ag_account_set_enabled (account2, FALSE);
 
-    ag_account_store (account1, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
-    ag_account_store (account2, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account1);
+    store_now (account2);
 
     ck_assert (account1->id != 0);
     ck_assert (account2->id != 0);
@@ -3660,10 +5321,7 @@ START_TEST(test_manager_enabled_event)
     ck_assert (account != NULL);
 
     ag_account_set_enabled (account, TRUE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    store_now (account);
 
     main_loop = g_main_loop_new (NULL, FALSE);
 
@@ -3718,14 +5376,14 @@ START_TEST(test_list_enabled_account)
                    "Failed to create the AgAccount.");
     ag_account_set_display_name (account1, "EnabledAccount");
     ag_account_set_enabled (account1, TRUE);
-    ag_account_store (account1, account_store_now_cb, TEST_STRING);
+    store_now (account1);
 
     account2 = ag_manager_create_account (manager, "MyProvider");
     ck_assert_msg (AG_IS_ACCOUNT (account2),
                    "Failed to create the AgAccount.");
     ag_account_set_display_name (account2, "DisabledAccount");
     ag_account_set_enabled (account2, FALSE);
-    ag_account_store (account2, account_store_now_cb, TEST_STRING);
+    store_now (account2);
 
 
     list = ag_manager_list_enabled (manager);
@@ -3810,11 +5468,11 @@ START_TEST(test_account_list_enabled_services)
     /* 2 services, 1 enabled  */
     ag_account_select_service (account, service1);
     ag_account_set_enabled (account, TRUE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    store_now (account);
 
     ag_account_select_service (account, service2);
     ag_account_set_enabled (account, FALSE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    store_now (account);
 
     services = ag_account_list_enabled_services (account);
     n_services = g_list_length (services);
@@ -3824,7 +5482,7 @@ START_TEST(test_account_list_enabled_services)
     /* 2 services, 2 enabled  */
     ag_account_select_service (account, service2);
     ag_account_set_enabled (account, TRUE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    store_now (account);
 
     services = ag_account_list_enabled_services (account);
 
@@ -3860,11 +5518,11 @@ START_TEST(test_account_list_enabled_services)
     ag_account_select_service (account, service2);
     ag_account_set_enabled (account, FALSE);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    store_now (account);
 
     ag_account_select_service (account4, service2);
     ag_account_set_enabled (account4, TRUE);
-    ag_account_store (account4, account_store_now_cb, TEST_STRING);
+    store_now (account4);
 
     services = ag_account_list_enabled_services (account);
 
@@ -3925,6 +5583,213 @@ START_TEST(test_service_type)
 }
 END_TEST
 
+START_TEST(test_file_contents)
+{
+    const gchar *contents;
+    AgServiceType *service_type;
+    AgProvider *provider;
+    AgService *service;
+    gsize len = 0;
+
+    manager = ag_manager_new ();
+
+    /* The file contents are not kept in memory after parsing, and are loaded
+     * again on request */
+    service = ag_manager_get_service (manager, "MyService");
+    ck_assert (service != NULL);
+    ck_assert_str_eq (ag_service_get_display_name (service), "My Service");
+    ag_service_get_file_contents (service, &contents, NULL);
+    ck_assert (contents != NULL);
+    ck_assert (strstr (contents, "<service id=\"MyService\">") != NULL);
+    ag_service_unref (service);
+
+    provider = ag_manager_get_provider (manager, "maemo");
+    ck_assert (provider != NULL);
+    ag_provider_get_file_contents (provider, &contents);
+    ck_assert (contents != NULL);
+    ck_assert (strstr (contents, "<provider id=\"maemo\">") != NULL);
+    ag_provider_unref (provider);
+
+    service_type = ag_manager_load_service_type (manager, "e-mail");
+    ck_assert (service_type != NULL);
+    ag_service_type_get_file_contents (service_type, &contents, &len);
+    ck_assert (contents != NULL);
+    ck_assert_int_eq (len, strlen (contents));
+    ck_assert (strstr (contents, "<service-type") != NULL);
+    ag_service_type_unref (service_type);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_service_type_cache)
+{
+    AgServiceType *service_type, *again;
+    AgService *service;
+    GList *tags, *list;
+
+    manager = ag_manager_new ();
+
+    service_type = ag_manager_load_service_type (manager, "e-mail");
+    ck_assert (service_type != NULL);
+    again = ag_manager_load_service_type (manager, "e-mail");
+    ck_assert (again == service_type);
+    ag_service_type_unref (again);
+
+    /* MyService has no tags of its own, and gets those of its type */
+    service = ag_manager_get_service (manager, "MyService");
+    ck_assert (service != NULL);
+    ck_assert (ag_service_has_tag (service, "messaging"));
+    ck_assert (!ag_service_has_tag (service, "sharing"));
+
+    /* Tags are interned */
+    tags = ag_service_get_tags (service);
+    ck_assert_int_eq (g_list_length (tags), 2);
+    for (list = tags; list != NULL; list = list->next)
+        ck_assert (list->data == g_intern_string (list->data));
+    g_list_free (tags);
+
+    ag_service_unref (service);
+    ag_service_type_unref (service_type);
+
+    end_test ();
+}
+END_TEST
+
+static gint
+get_port_default (void)
+{
+    GVariant *value;
+    gint port;
+
+    manager = ag_manager_new ();
+    service = ag_manager_get_service (manager, "MyService");
+    ck_assert (service != NULL);
+    account = ag_manager_create_account (manager, "maemo");
+    ag_account_select_service (account, service);
+    value = ag_account_get_variant (account, "parameters/port", NULL);
+    ck_assert (value != NULL);
+    port = g_variant_get_int32 (value);
+
+    end_test ();
+    return port;
+}
+
+START_TEST(test_service_defaults_stored)
+{
+    GVariant *defaults;
+    sqlite3_stmt *stmt;
+    sqlite3 *db;
+    gint64 mtime;
+
+    delete_db ();
+
+    /* The first time, the service is loaded from its file and added to the
+     * DB; then, the defaults of the service are stored in the DB */
+    ck_assert_int_eq (get_port_default (), 5223);
+    ck_assert_int_eq (get_port_default (), 5223);
+
+    sqlite3_open (db_filename, &db);
+    sqlite3_prepare_v2 (db, "SELECT mtime FROM Services WHERE "
+                        "name = 'MyService' AND defaults IS NOT NULL",
+                        -1, &stmt, NULL);
+    ck_assert_int_eq (sqlite3_step (stmt), SQLITE_ROW);
+    mtime = sqlite3_column_int64 (stmt, 0);
+    ck_assert (mtime != 0);
+    sqlite3_finalize (stmt);
+
+    /* Make sure that the stored defaults are used */
+    defaults =
+        g_variant_ref_sink (g_variant_new_parsed ("{'parameters/port': <1234>}"));
+    sqlite3_prepare_v2 (db, "UPDATE Services SET defaults = ? "
+                        "WHERE name = 'MyService'", -1, &stmt, NULL);
+    sqlite3_bind_blob (stmt, 1, g_variant_get_data (defaults),
+                       g_variant_get_size (defaults), SQLITE_TRANSIENT);
+    ck_assert_int_eq (sqlite3_step (stmt), SQLITE_DONE);
+    sqlite3_finalize (stmt);
+    g_variant_unref (defaults);
+
+    ck_assert_int_eq (get_port_default (), 1234);
+
+    /* Unless the file has changed */
+    sqlite3_exec (db, "UPDATE Services SET mtime = 1 "
+                  "WHERE name = 'MyService'", NULL, NULL, NULL);
+
+    ck_assert_int_eq (get_port_default (), 5223);
+
+    sqlite3_prepare_v2 (db, "SELECT mtime FROM Services WHERE "
+                        "name = 'MyService'", -1, &stmt, NULL);
+    ck_assert_int_eq (sqlite3_step (stmt), SQLITE_ROW);
+    ck_assert (sqlite3_column_int64 (stmt, 0) == mtime);
+    sqlite3_finalize (stmt);
+    sqlite3_close (db);
+}
+END_TEST
+
+START_TEST(test_prepared_statements)
+{
+    AgAccountId account_id;
+    AgManager *manager2;
+    AgService *service2;
+    AgAccount *account2;
+    GVariant *value;
+    GList *list;
+    gint i;
+
+    delete_db ();
+
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, "maemo");
+    service = ag_manager_get_service (manager, "MyService");
+    ck_assert (service != NULL);
+    ag_account_set_enabled (account, TRUE);
+    ag_account_select_service (account, service);
+    ag_account_set_enabled (account, TRUE);
+    ag_account_set_variant (account, "username",
+                            g_variant_new_string ("it's me"));
+    store_now (account);
+    account_id = account->id;
+
+    manager2 = ag_manager_new ();
+    service2 = ag_manager_get_service (manager2, "MyService");
+
+    /* The same statements are reused on each run, and must give the same
+     * results */
+    for (i = 0; i < 3; i++)
+    {
+        list = ag_manager_list_by_service_type (manager, "e-mail");
+        ck_assert_int_eq (g_list_length (list), 1);
+        ck_assert_uint_eq (GPOINTER_TO_UINT (list->data), account_id);
+        ag_manager_list_free (list);
+
+        list = ag_manager_list_enabled_by_service_type (manager, "e-mail");
+        ck_assert_int_eq (g_list_length (list), 1);
+        ag_manager_list_free (list);
+
+        list = ag_manager_list_by_service_type (manager, "no-such-type");
+        ck_assert (list == NULL);
+
+        list = ag_account_list_enabled_services (account);
+        ck_assert_int_eq (g_list_length (list), 1);
+        ag_service_list_free (list);
+
+        /* the account is not cached, so it's loaded from the DB */
+        account2 = ag_manager_load_account (manager2, account_id, NULL);
+        ck_assert (account2 != NULL);
+        ck_assert_str_eq (ag_account_get_provider_name (account2), "maemo");
+        ag_account_select_service (account2, service2);
+        value = ag_account_get_variant (account2, "username", NULL);
+        ck_assert (value != NULL);
+        ck_assert_str_eq (g_variant_get_string (value, NULL), "it's me");
+        g_object_unref (account2);
+    }
+
+    ag_service_unref (service2);
+    g_object_unref (manager2);
+    end_test ();
+}
+END_TEST
+
 static void
 on_account_created_with_db_locked (AgManager *manager, AgAccountId account_id)
 {
@@ -3953,6 +5818,330 @@ on_account_created_with_db_locked (AgManager *manager, AgAccountId account_id)
     g_main_loop_quit (main_loop);
 }
 
+START_TEST(test_catalog)
+{
+    struct timespec times[2];
+    TmpDataDir *services_dir;
+    gchar *filepath;
+    const gchar *contents;
+    GList *services;
+    GError *error = NULL;
+    gboolean ok;
+    gint64 end_time;
+    guint n_services;
+    FILE *file;
+
+    services_dir = tmp_data_dir_new ("AG_SERVICES");
+    tmp_data_dir_copy (services_dir, "MyService.service");
+    tmp_data_dir_copy (services_dir, "OtherService.service");
+
+    manager = ag_manager_new ();
+    ok = ag_manager_compile_catalog (manager, "/nonexistent-dir", &error);
+    ck_assert (!ok);
+    ck_assert (error != NULL);
+    g_clear_error (&error);
+
+    ok = ag_manager_compile_catalog (manager, services_dir->path, &error);
+    ck_assert (ok);
+    ck_assert (error == NULL);
+    g_object_unref (manager);
+
+    /* Overwrite a file in place: the directory time doesn't change, so the
+     * catalog is still used and the file is not read */
+    filepath = g_build_filename (services_dir->path, "MyService.service",
+                                 NULL);
+    file = fopen (filepath, "w");
+    ck_assert (file != NULL);
+    fputs ("not XML", file);
+    fclose (file);
+    g_free (filepath);
+
+    manager = ag_manager_new ();
+    service = ag_manager_get_service (manager, "MyService");
+    ck_assert (service != NULL);
+    ck_assert_str_eq (ag_service_get_description (service),
+                      "My Service Description");
+    ag_service_get_file_contents (service, &contents, NULL);
+    ck_assert (contents != NULL);
+    ck_assert (strstr (contents, "<service") != NULL);
+    ag_service_unref (service);
+    service = NULL;
+
+    services = ag_manager_list_services (manager);
+    ck_assert_int_eq (g_list_length (services), 2);
+    ag_service_list_free (services);
+    g_object_unref (manager);
+
+    /* Adding a file makes the catalog stale; force a different directory
+     * time, in case the file system has a coarse timestamp resolution */
+    tmp_data_dir_copy (services_dir, "MyService2.service");
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = time (NULL) + 10;
+    times[1].tv_nsec = 0;
+    ck_assert_int_eq (utimensat (AT_FDCWD, services_dir->path, times, 0), 0);
+
+    manager = ag_manager_new ();
+    end_time = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+    do
+    {
+        /* let the directory monitor deliver its events */
+        while (g_main_context_iteration (NULL, FALSE));
+        services = ag_manager_list_services (manager);
+        n_services = g_list_length (services);
+        ag_service_list_free (services);
+    }
+    while (n_services != 3 && g_get_monotonic_time () < end_time);
+    ck_assert_int_eq (n_services, 3);
+
+    service = ag_manager_get_service (manager, "MyService2");
+    ck_assert (service != NULL);
+    ag_service_unref (service);
+
+    service = ag_manager_get_service (manager, "MyService");
+    if (service != NULL)
+    {
+        /* the record might come from the DB, but not the file contents */
+        ag_service_get_file_contents (service, &contents, NULL);
+        ck_assert (contents == NULL || strstr (contents, "<service") == NULL);
+        ag_service_unref (service);
+        service = NULL;
+    }
+
+    tmp_data_dir_free (services_dir);
+
+    end_test ();
+}
+END_TEST
+
+static AgProvider *
+wait_for_provider (const gchar *provider_name, gboolean present)
+{
+    AgProvider *provider;
+    gint64 end_time;
+
+    end_time = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+    for (;;)
+    {
+        provider = ag_manager_get_provider (manager, provider_name);
+        if ((provider != NULL) == present ||
+            g_get_monotonic_time () >= end_time)
+            return provider;
+
+        if (provider != NULL)
+            ag_provider_unref (provider);
+        /* let the directory monitor deliver its events */
+        while (g_main_context_iteration (NULL, FALSE));
+        g_usleep (10000);
+    }
+}
+
+START_TEST(test_service_type_data_offset)
+{
+    const gchar *format =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+        "<service id=\"Typed\">\n"
+        "  <type>e-mail</type>\n"
+        "  <name>Typed</name>\n"
+        "  <description>%s</description>\n"
+        "  <provider>maemo</provider>\n"
+        "  <type_data><custom>data</custom></type_data>\n"
+        "</service>\n";
+    TmpDataDir *services_dir;
+    const gchar *contents;
+    gchar *file_contents;
+    gsize offset = 0;
+
+    services_dir = tmp_data_dir_new ("AG_SERVICES");
+    file_contents = g_strdup_printf (format, "Short");
+    tmp_data_dir_write (services_dir, "Typed.service", file_contents);
+    g_free (file_contents);
+
+    manager = ag_manager_new ();
+    service = ag_manager_get_service (manager, "Typed");
+    ck_assert (service != NULL);
+    ck_assert_str_eq (ag_service_get_description (service), "Short");
+
+    /* The file changes after the service has been parsed: the offset must
+     * refer to the contents which are returned */
+    file_contents = g_strdup_printf (format, "A much longer description");
+    tmp_data_dir_write (services_dir, "Typed.service", file_contents);
+    g_free (file_contents);
+
+    ag_service_get_file_contents (service, &contents, &offset);
+    ck_assert (contents != NULL);
+    ck_assert (strstr (contents, "A much longer description") != NULL);
+    ck_assert (strncmp (contents + offset, "<type_data>", 11) == 0);
+
+    ag_service_unref (service);
+    service = NULL;
+    tmp_data_dir_free (services_dir);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_data_dir_index)
+{
+    TmpDataDir *providers_dir;
+    AgProvider *provider;
+
+    providers_dir = tmp_data_dir_new ("AG_PROVIDERS");
+
+    manager = ag_manager_new ();
+    provider = ag_manager_get_provider (manager, "MyProvider");
+    ck_assert (provider == NULL);
+
+    /* The index of the directory is refreshed when a file is added... */
+    tmp_data_dir_copy (providers_dir, "MyProvider.provider");
+    provider = wait_for_provider ("MyProvider", TRUE);
+    ck_assert (provider != NULL);
+    ck_assert_str_eq (ag_provider_get_display_name (provider), "My Provider");
+    ag_provider_unref (provider);
+
+    /* ... and when it's removed */
+    tmp_data_dir_remove (providers_dir, "MyProvider.provider");
+    provider = wait_for_provider ("MyProvider", FALSE);
+    ck_assert (provider == NULL);
+
+    tmp_data_dir_free (providers_dir);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_data_dir_unmonitored)
+{
+    TmpDataDir *providers_dir;
+    GMainContext *context;
+    AgProvider *provider;
+
+    providers_dir = tmp_data_dir_new ("AG_PROVIDERS");
+
+    /* The directory is first looked up with a thread-default context which
+     * is never run, so the events of its monitor are never delivered */
+    context = g_main_context_new ();
+    g_main_context_push_thread_default (context);
+    manager = ag_manager_new ();
+    provider = ag_manager_get_provider (manager, "MyProvider");
+    ck_assert (provider == NULL);
+    g_main_context_pop_thread_default (context);
+
+    /* The changes are seen anyway, when the modification time of the
+     * directory is checked again */
+    tmp_data_dir_copy (providers_dir, "MyProvider.provider");
+    provider = wait_for_provider ("MyProvider", TRUE);
+    ck_assert (provider != NULL);
+    ag_provider_unref (provider);
+
+    tmp_data_dir_remove (providers_dir, "MyProvider.provider");
+    provider = wait_for_provider ("MyProvider", FALSE);
+    ck_assert (provider == NULL);
+
+    g_main_context_unref (context);
+    tmp_data_dir_free (providers_dir);
+
+    end_test ();
+}
+END_TEST
+
+typedef struct {
+    gchar *added;
+    gchar *removed;
+    gchar *provider;
+} DataFileChanges;
+
+static void
+on_service_added (AgManager *manager, AgService *service,
+                  DataFileChanges *changes)
+{
+    g_free (changes->added);
+    changes->added = g_strdup (ag_service_get_name (service));
+}
+
+static void
+on_service_removed (AgManager *manager, AgService *service,
+                    DataFileChanges *changes)
+{
+    g_free (changes->removed);
+    changes->removed = g_strdup (ag_service_get_name (service));
+}
+
+static void
+on_provider_changed (AgManager *manager, const gchar *provider_name,
+                     DataFileChanges *changes)
+{
+    g_free (changes->provider);
+    changes->provider = g_strdup (provider_name);
+}
+
+static void
+wait_for_change (gchar **change)
+{
+    gint64 end_time;
+
+    end_time = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+    while (*change == NULL && g_get_monotonic_time () < end_time)
+    {
+        while (g_main_context_iteration (NULL, FALSE));
+        g_usleep (10000);
+    }
+}
+
+START_TEST(test_data_file_signals)
+{
+    TmpDataDir *services_dir, *providers_dir;
+    DataFileChanges changes = { NULL, NULL, NULL };
+    GList *list;
+
+    services_dir = tmp_data_dir_new ("AG_SERVICES");
+    providers_dir = tmp_data_dir_new ("AG_PROVIDERS");
+
+    manager = ag_manager_new ();
+    g_signal_connect (manager, "service-added",
+                      G_CALLBACK (on_service_added), &changes);
+    g_signal_connect (manager, "service-removed",
+                      G_CALLBACK (on_service_removed), &changes);
+    g_signal_connect (manager, "provider-changed",
+                      G_CALLBACK (on_provider_changed), &changes);
+
+    list = ag_manager_list_services (manager);
+    ck_assert (list == NULL);
+
+    tmp_data_dir_copy (services_dir, "MyService.service");
+    wait_for_change (&changes.added);
+    ck_assert_str_eq (changes.added, "MyService");
+
+    /* the catalog has been updated */
+    list = ag_manager_list_services_by_type (manager, "e-mail");
+    ck_assert_int_eq (g_list_length (list), 1);
+    ck_assert_str_eq (ag_service_get_name (list->data), "MyService");
+    ag_service_list_free (list);
+
+    tmp_data_dir_remove (services_dir, "MyService.service");
+    wait_for_change (&changes.removed);
+    ck_assert_str_eq (changes.removed, "MyService");
+
+    list = ag_manager_list_services (manager);
+    ck_assert (list == NULL);
+
+    tmp_data_dir_copy (providers_dir, "MyProvider.provider");
+    wait_for_change (&changes.provider);
+    ck_assert_str_eq (changes.provider, "MyProvider");
+
+    g_object_unref (manager);
+    manager = NULL;
+
+    tmp_data_dir_free (services_dir);
+    tmp_data_dir_free (providers_dir);
+    g_free (changes.added);
+    g_free (changes.removed);
+    g_free (changes.provider);
+
+    end_test ();
+}
+END_TEST
+
 START_TEST(test_db_access)
 {
     const gchar *lock_filename;
@@ -4041,6 +6230,12 @@ ag_suite(const char *test_case)
     tcase_add_test (tc, test_provider);
     tcase_add_test (tc, test_provider_settings);
     tcase_add_test (tc, test_provider_directories);
+    tcase_add_test (tc, test_find_providers_for_domain);
+    tcase_add_test (tc, test_match_domain_escapes);
+    tcase_add_test (tc, test_match_domain_posix_classes);
+    tcase_add_test (tc, test_service_type_data_offset);
+    tcase_add_test (tc, test_data_dir_index);
+    tcase_add_test (tc, test_data_dir_unmonitored);
     IF_TEST_CASE_ENABLED("Provider")
         suite_add_tcase (s, tc);
 
@@ -4048,7 +6243,22 @@ ag_suite(const char *test_case)
     tcase_add_test (tc, test_store);
     tcase_add_test (tc, test_store_locked);
     tcase_add_test (tc, test_store_locked_cancel);
+    tcase_add_test (tc, test_store_locked_blocking);
+    tcase_add_test (tc, test_store_async_writer);
+    tcase_add_test (tc, test_store_group_commit);
+    tcase_add_test (tc, test_store_group_commit_mixed);
+    tcase_add_test (tc, test_store_accounts);
+    tcase_add_test (tc, test_store_accounts_other_manager);
     tcase_add_test (tc, test_store_read_only);
+    tcase_add_test (tc, test_store_binary_values);
+    tcase_add_test (tc, test_store_many_settings);
+    tcase_add_test (tc, test_service_ids);
+    tcase_add_test (tc, test_db_migrations);
+    tcase_add_test (tc, test_account_services_table);
+    tcase_add_test (tc, test_account_preload);
+    tcase_add_test (tc, test_load_accounts);
+    tcase_add_test (tc, test_load_accounts_sparse);
+    tcase_add_test (tc, test_load_accounts_duplicates);
     IF_TEST_CASE_ENABLED("Store")
         suite_add_tcase (s, tc);
 
@@ -4058,6 +6268,11 @@ ag_suite(const char *test_case)
     tcase_add_test (tc, test_settings_iter_gvalue);
     tcase_add_test (tc, test_settings_iter);
     tcase_add_test (tc, test_service_type);
+    tcase_add_test (tc, test_file_contents);
+    tcase_add_test (tc, test_service_type_cache);
+    tcase_add_test (tc, test_service_defaults_stored);
+    tcase_add_test (tc, test_prepared_statements);
+    tcase_add_test (tc, test_catalog);
     IF_TEST_CASE_ENABLED("Service")
         suite_add_tcase (s, tc);
 
@@ -4084,8 +6299,12 @@ ag_suite(const char *test_case)
 
     tc = tcase_create("List");
     tcase_add_test (tc, test_list);
+    tcase_add_test (tc, test_list_by_service_type_unloaded);
     tcase_add_test (tc, test_list_enabled_account);
     tcase_add_test (tc, test_list_services);
+    tcase_add_test (tc, test_list_services_deferred);
+    tcase_add_test (tc, test_list_services_indexed);
+    tcase_add_test (tc, test_parallel_loading);
     tcase_add_test (tc, test_account_list_enabled_services);
     tcase_add_test (tc, test_list_service_types);
     IF_TEST_CASE_ENABLED("List")
@@ -4093,9 +6312,11 @@ ag_suite(const char *test_case)
 
     tc = tcase_create("Signalling");
     tcase_add_test (tc, test_signals);
+    tcase_add_test (tc, test_store_unchanged);
     tcase_add_test (tc, test_signals_other_manager);
     tcase_add_test (tc, test_delete);
     tcase_add_test (tc, test_watches);
+    tcase_add_test (tc, test_data_file_signals);
     IF_TEST_CASE_ENABLED("Signalling")
         suite_add_tcase (s, tc);
 
@@ -4103,6 +6324,8 @@ ag_suite(const char *test_case)
     tcase_add_test (tc, test_no_dbus);
     tcase_add_test (tc, test_concurrency);
     tcase_add_test (tc, test_blocking);
+    tcase_add_test (tc, test_threaded_reads);
+    tcase_add_test (tc, test_threaded_data_file_reads);
     tcase_add_test (tc, test_manager_new_for_service_type);
     tcase_add_test (tc, test_manager_enabled_event);
     /* Tests for ensuring that opening and reading from a locked DB was
@@ -100,7 +100,10 @@ show_help ()
             "     If account ID is specified lists services enabled on the given account\n"
             "   %1$s list-enabled [<account id>]\n\n"
             "   * Lists settings associated with account\n"
-            "   %1$s list-settings <account id>\n", gl_app_name);
+            "   %1$s list-settings <account id>\n\n"
+            "   * Compiles the data files of the given directories, or of all the\n"
+            "     directories in the search path, into a binary catalog\n"
+            "   %1$s compile-catalog [<directory>...]\n", gl_app_name);
 
     printf ("\nParameters in square braces '[param]' are optional\n");
 }
@@ -270,6 +273,9 @@ list_service_settings (AgAccount *account)
         return;
     }
 
+    /* Load the settings of all the services at once */
+    ag_account_preload (account);
+
     for (tmp = list; tmp != NULL; tmp = g_list_next (tmp))
     {
         printf ("\t\t%s\n", ag_service_get_name (tmp->data));
@@ -1173,6 +1179,40 @@ list_enabled (gchar **argv)
     g_object_unref (manager);
 }
 
+static void
+compile_catalog (gchar **argv)
+{
+    AgManager *manager = NULL;
+    GError *error = NULL;
+    gchar **dir;
+
+    manager = ag_manager_new ();
+    if (manager == NULL)
+    {
+        show_error (ERROR_GENERIC);
+        return;
+    }
+
+    if (argv[2] == NULL)
+    {
+        ag_manager_compile_catalog (manager, NULL, &error);
+    }
+    else
+    {
+        for (dir = argv + 2; *dir != NULL && error == NULL; dir++)
+            ag_manager_compile_catalog (manager, *dir, &error);
+    }
+
+    if (error != NULL)
+    {
+        printf ("\n%s\n", error->message);
+        show_error (ERROR_GENERIC);
+        g_error_free (error);
+    }
+
+    g_object_unref (manager);
+}
+
 static int
 parse (int argc, char **argv)
 {
@@ -1251,6 +1291,11 @@ parse (int argc, char **argv)
         list_settings (argv);
         return 0;
     }
+    else if (strcmp (argv[1], "compile-catalog") == 0)
+    {
+        compile_catalog (argv);
+        return 0;
+    }
 
     return -1;
 }